@@ -24,6 +24,9 @@
 
 #include "dictionary.h"
 
+/** Number of word index slots: a power of two over twice MAX_ENTRIES */
+#define INDEX_SLOTS 16384
+
 /** Dictionary entry with word and definition */
 struct DictionaryEntry {
 	/** word string */
@@ -35,7 +38,17 @@ struct DictionaryEntry {
 	/** length of definition */
 	size_t length;
 
+	/** next entry with the same word, or -1 if none */
+	int next;
+};
+
+/** Word index slot for a word and its entries */
+struct IndexSlot {
+	/** first entry with the word plus one, or 0 if slot is empty */
+	int first;
 
+	/** last entry with the word */
+	int last;
 };
 
 /** Dictionary array of entries */
@@ -48,11 +61,49 @@ struct Dictionary {
 
 	/** Dictionary file */
 	FILE* dFile;
+
+	/**
+	 * Word index with open addressing. Each word has one slot
+	 * that chains its entries in insertion order through their
+	 * next fields, so an exact match does not scan the entries.
+	 */
+	struct IndexSlot index[INDEX_SLOTS];
 };
 
 /** The dictionary */
 static struct Dictionary dictionary;
 
+/**
+ * Compute the hash of a word (FNV-1a).
+ *
+ * @param word the word
+ * @return the hash of the word
+ */
+static unsigned hashWord(const char word[]) {
+	unsigned hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char*)word; *p != '\0'; p++) {
+		hash = (hash ^ *p) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Find the index slot for a word. Probes from the slot for the
+ * word's hash to the slot holding the word, or to an empty slot
+ * where the word would be added.
+ *
+ * @param word the word
+ * @return the slot for the word
+ */
+static struct IndexSlot* findIndexSlot(const char word[]) {
+	unsigned slot = hashWord(word) & (INDEX_SLOTS-1);
+	while (dictionary.index[slot].first != 0
+		   && strcmp(word, dictionary.entries[dictionary.index[slot].first-1].word) != 0) {
+		slot = (slot+1) & (INDEX_SLOTS-1);  // linear probe
+	}
+	return &dictionary.index[slot];
+}
+
 /**
  * Return the number of entries in the dictionary.
  * @return the number of dictionary entries
@@ -105,14 +156,18 @@ bool getDictionaryDefinition(int entry, char def[]) {
 int getDictionaryEntry(const char word[], int start_entry) {
 	int wordlen = strlen(word);
 	if (wordlen > 0 && start_entry >= 0) {
-		for (int entry = start_entry; entry < dictionary.n_entries; entry++) {
-			if (word[wordlen-1] == '*') {  // wildcard match
+		if (word[wordlen-1] == '*') {  // wildcard match
+			for (int entry = start_entry; entry < dictionary.n_entries; entry++) {
 				if (strncmp(word, dictionary.entries[entry].word, wordlen-1) == 0) {
 					return entry;
 				}
-			} else if (strcmp(word, dictionary.entries[entry].word) == 0) {
-				return entry;
 			}
+		} else {  // exact match: follow word's entries to start entry
+			int entry = findIndexSlot(word)->first - 1;
+			while (entry >= 0 && entry < start_entry) {
+				entry = dictionary.entries[entry].next;
+			}
+			return entry;
 		}
 	}
 	return -1;
@@ -144,5 +199,16 @@ int putDictionaryEntry(const char word[], const char def[]) {
 	dictionary.entries[dictionary.n_entries].length = tDefLen;
 	fwrite(def, sizeof(char), tDefLen, dictionary.dFile);
 
+	// add entry to the end of the word's entries in the index
+	int entry = dictionary.n_entries;
+	struct IndexSlot *slot = findIndexSlot(word);
+	if (slot->first == 0) {
+		slot->first = entry+1;
+	} else {
+		dictionary.entries[slot->last].next = entry;
+	}
+	slot->last = entry;
+	dictionary.entries[entry].next = -1;
+
 	return dictionary.n_entries++;
 }
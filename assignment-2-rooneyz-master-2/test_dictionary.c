@@ -91,6 +91,34 @@ static void testDictionaryEntries(void) {
 	}
 }
 
+/**
+ * Test exact and wildcard lookups among words that share
+ * a prefix, with a duplicate word added after another word.
+ */
+static void testDictionaryLookup(void) {
+	int first = getDictionarySize();
+	CU_ASSERT_EQUAL_FATAL(putDictionaryEntry("SAKE", "SAKE, definition 1"), first);
+	CU_ASSERT_EQUAL_FATAL(putDictionaryEntry("SAKES", "SAKES, definition"), first+1);
+	CU_ASSERT_EQUAL_FATAL(putDictionaryEntry("SAKE", "SAKE, definition 2"), first+2);
+
+	// look up each occurrence of word from before and after the last one
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKE", 0), first);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKE", first+1), first+2);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKE", first+2), first+2);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKE", first+3), -1);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKES", 0), first+1);
+
+	// a prefix or an extension of a word is not an exact match
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAK", 0), -1);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKESS", 0), -1);
+
+	// wildcard matches words with prefix in entry order
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAK*", 0), first);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAK*", first+1), first+1);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKES*", 0), first+1);
+	CU_ASSERT_EQUAL(getDictionaryEntry("SAKE*", first+3), -1);
+}
+
 /**
  * Test full dictionary.
  */
@@ -129,5 +157,6 @@ void test_dictionary(void) {
 	// add the tests to the suite
 	CU_add_test(pSuite, "testDictionaryEmpty", testDictionaryEmpty);
 	CU_add_test(pSuite, "testDictionaryEntries", testDictionaryEntries);
+	CU_add_test(pSuite, "testDictionaryLookup", testDictionaryLookup);
 	CU_add_test(pSuite, "testDictionaryCapacity", testDictionaryCapacity);
 }
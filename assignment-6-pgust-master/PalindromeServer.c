@@ -1,133 +1,778 @@
 /*
  * PalindromeServer.c
  *
+ * Palindrome server reads lines from clients and answers each
+ * line with the palindrome made by adding the reverse of the line
+ * to its end, followed by a newline. A client may send any number
+ * of lines on one connection, and lines of any length.
+ *
+ * Connections are served concurrently by an epoll event loop on
+ * non-blocking sockets. Input is read in blocks, and all of the
+ * lines in a block are answered into an output buffer that is
+ * written with one call, so many short lines cost few system calls.
+ * Memory per connection is bounded: the start of a line is kept in
+ * memory and the rest spilled to an unlinked temporary file, the
+ * reverse half is produced a block at a time as output buffer space
+ * frees, and input is not read while output is waiting to be sent.
+ * The line is reversed by UTF-8 code point with a vectorized kernel,
+ * so multibyte characters come back intact.
+ *
+ * Clients that connect to the optional frame port send strings as
+ * frames instead of lines, so a string may hold newlines or binary
+ * data: a 4-byte big-endian length and then that many bytes. Each
+ * frame is answered with a frame holding the string followed by its
+ * reverse, byte by byte. A client may send a batch of frames in one
+ * write. The server reads all the frames that have arrived with one
+ * readv() into a ring buffer, and answers them with one writev()
+ * that sends each string from the ring buffer in place, so a batch
+ * costs two system calls however many frames it holds.
+ *
+ * Listener sockets come from the network_util library shared with
+ * the lecture 7 HTTP server.
+ *
+ * Build:
+ *   gcc -std=gnu11 -O2 -I../lecture-7-examples-master-2 -o PalindromeServer \
+ *       PalindromeServer.c reverse_utf8.c ../lecture-7-examples-master-2/network_util.c
+ *
  * @since 2019-06-10
  * @author philip gust
  */
-
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "network_util.h"
+#include "reverse_utf8.h"
+
+/** size of connection input buffer */
+#define INPUT_BUF 16384
+
+/** size of connection output buffer */
+#define OUTPUT_BUF 16384
+
+/** bytes of a line kept in memory before the rest is spilled to a file */
+#define LINE_MEMORY 8192
+
+/** most events handled per wait */
+#define MAX_EVENTS 64
+
+/** size of frame connection input ring and answer buffers; a power of 2 */
+#define FRAME_BUF 65536
+
+/** bytes in frame length header */
+#define FRAME_HEADER 4
 
-#define MAXBUF 128
+/** largest frame string; a whole frame must fit in the input ring */
+#define FRAME_MAX_STRING (FRAME_BUF - FRAME_HEADER)
+
+/** most iovecs sent with one writev(), which is IOV_MAX on Linux */
+#define FRAME_IOVS 1024
+
+/** Kind of socket watched by the event loop */
+typedef enum {
+	LINE_LISTENER,				// accepts line connections
+	FRAME_LISTENER,				// accepts frame connections
+	LINE_CONNECTION,			// client sends lines
+	FRAME_CONNECTION			// client sends frames
+} socket_kind;
+
+/** Listener socket */
+typedef struct {
+	socket_kind kind;			// LINE_LISTENER or FRAME_LISTENER
+	int sock_fd;				// listener socket
+} listener;
+
+/** State of one client connection that sends lines */
+typedef struct {
+	socket_kind kind;			// LINE_CONNECTION
+	int sock_fd;				// client socket
+	bool writing;				// waiting for socket to become writable
+	bool at_eof;				// client has finished sending
+	char in[INPUT_BUF];			// input read from socket
+	size_t in_pos;				// offset of next unprocessed input byte
+	size_t in_len;				// bytes of input in buffer
+	char out[OUTPUT_BUF];		// output waiting to be sent
+	size_t out_len;				// bytes of output in buffer
+	char line[LINE_MEMORY];		// start of current line
+	size_t line_len;			// bytes of line in memory
+	int spill_fd;				// file holding rest of line, or -1 if none
+	off_t spill_len;			// bytes of line in spill file
+	bool emitting;				// line is complete and its palindrome being sent
+	off_t emit_pos;				// offset in palindrome of next byte to send
+} connection;
+
+/** State of one client connection that sends frames */
+typedef struct {
+	socket_kind kind;			// FRAME_CONNECTION
+	int sock_fd;				// client socket
+	bool writing;				// waiting for socket to become writable
+	bool at_eof;				// client has finished sending
+	char in[FRAME_BUF];			// ring of input read from socket
+	size_t in_pos;				// ring offset of first unanswered input byte
+	size_t in_len;				// bytes of input in ring
+	size_t batch_len;			// bytes of input answered by the batch being sent
+	char out[FRAME_BUF];		// answer headers and reversed strings
+	struct iovec iov[FRAME_IOVS];	// answers to batch from ring and out
+	int iov_pos;				// index of next iovec to send
+	int iov_count;				// number of iovecs in batch
+} frame_connection;
 
 /**
- * Get listener socket
+ * Add bytes to the current line, spilling them to a temporary
+ * file once the line no longer fits in memory.
  *
- * @param port the port number
- * @return listener socket or -1 if unavailable
+ * @param conn the connection
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return true if the bytes were added
  */
-int get_listener_socket(int port) {
-    // Creating internet socket stream file descriptor
-    int listen_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_sock_fd < 0) {
-        return -1;
-    }
+static bool append_line(connection *conn, const char data[], size_t len) {
+	if (conn->spill_len == 0) {
+		size_t n = sizeof conn->line - conn->line_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(conn->line + conn->line_len, data, n);
+		conn->line_len += n;
+		data += n;
+		len -= n;
+	}
+	if (len == 0) {
+		return true;
+	}
 
-    // SO_REUSEADDR prevents the "address already in use" errors
-    // that commonly come up when testing servers.
-    int optval = 1;
-    if (setsockopt(listen_sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval , sizeof(int)) < 0) {
-    	close(listen_sock_fd);
-    	return -1;
-    }
+	if (conn->spill_fd < 0) {
+		char path[] = "/tmp/palindrome-XXXXXX";
+		conn->spill_fd = mkstemp(path);
+		if (conn->spill_fd < 0) {
+			return false;
+		}
+		unlink(path);  // removed when closed
+	}
+	while (len > 0) {
+		ssize_t n = pwrite(conn->spill_fd, data, len, conn->spill_len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+		conn->spill_len += n;
+	}
+	return true;
+}
+
+/**
+ * Copy bytes of the current line from memory or the spill file.
+ *
+ * @param conn the connection
+ * @param offset the offset of the first byte in the line
+ * @param buf the buffer for the bytes
+ * @param len the number of bytes
+ * @return true if the bytes were copied
+ */
+static bool copy_line(connection *conn, off_t offset, char buf[], size_t len) {
+	if (offset < (off_t)conn->line_len) {
+		size_t n = conn->line_len - offset;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(buf, conn->line + offset, n);
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	while (len > 0) {
+		ssize_t n = pread(conn->spill_fd, buf, len, offset - conn->line_len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/**
+ * Add as much of the palindrome of the current line to the output
+ * buffer as fits: the line, then its reverse, then a newline.
+ *
+ * @param conn the connection
+ * @return true if successful, false if the line could not be read
+ */
+static bool emit_palindrome(connection *conn) {
+	off_t len = conn->line_len + conn->spill_len;
+	off_t total = 2 * len + 1;
+	while (conn->emit_pos < total && conn->out_len < sizeof conn->out) {
+		char *dst = conn->out + conn->out_len;
+		off_t room = sizeof conn->out - conn->out_len;
+		off_t pos = conn->emit_pos;
+		off_t n;
+		if (pos < len) {
+			// line forward
+			n = (len - pos < room) ? len - pos : room;
+			if (!copy_line(conn, pos, dst, n)) {
+				return false;
+			}
+		} else if (pos < 2 * len) {
+			// line backward: copy the block forward, then reverse it
+			// by code point; a block cut from the middle of the line
+			// leaves the start of a split code point to the next block
+			n = (2 * len - pos < room) ? 2 * len - pos : room;
+			off_t last = 2 * len - 1 - pos;
+			if (!copy_line(conn, last - n + 1, dst, n)) {
+				return false;
+			}
+			if (n < 2 * len - pos) {
+				off_t skip = utf8_unit_offset(dst, n);
+				if (skip == n) {
+					break;  // wait for room for the whole code point
+				}
+				memmove(dst, dst + skip, n - skip);
+				n -= skip;
+			}
+			reverse_utf8(dst, n);
+		} else {
+			*dst = '\n';
+			n = 1;
+		}
+		conn->out_len += n;
+		conn->emit_pos += n;
+	}
 
-    // host address and port
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-    memset(&address, 0, addrlen);
-    address.sin_family = AF_INET;  // address from internet
-    address.sin_port = htons(port);   // port in network byte order
-    address.sin_addr.s_addr = INADDR_ANY;  // bind to any address
-
-    // bind host address to port
-    if (bind(listen_sock_fd, (struct sockaddr *)&address, addrlen) < 0) {
-    	close(listen_sock_fd);
+	if (conn->emit_pos == total) {
+		// ready for next line
+		if (conn->spill_len > 0) {
+			ftruncate(conn->spill_fd, 0);
+		}
+		conn->line_len = 0;
+		conn->spill_len = 0;
+		conn->emitting = false;
+	}
+	return true;
+}
+
+/**
+ * Add input bytes to the current line up to the end of the line.
+ *
+ * @param conn the connection
+ * @return 1 if the line is complete, 0 if more input is needed,
+ *   or -1 if the line could not be stored
+ */
+static int take_input(connection *conn) {
+	char *start = conn->in + conn->in_pos;
+	size_t avail = conn->in_len - conn->in_pos;
+	char *newline = memchr(start, '\n', avail);
+	size_t n = (newline != NULL) ? (size_t)(newline - start) : avail;
+	if (!append_line(conn, start, n)) {
 		return -1;
-    }
+	}
+	conn->in_pos += (newline != NULL) ? n + 1 : n;  // newline is not part of line
+	return newline != NULL;
+}
 
-    // set up queue for clients connections up to default
-    // maximum pending socket connections (usually 128)
-    if (listen(listen_sock_fd, SOMAXCONN) < 0) {
-    	close(listen_sock_fd);
-    	return -1;
-    }
+/**
+ * Write as much of the output buffer as the socket accepts.
+ *
+ * @param conn the connection
+ * @return 1 if all output was written, 0 if the socket would
+ *   block, or -1 on error
+ */
+static int flush_output(connection *conn) {
+	size_t pos = 0;
+	while (pos < conn->out_len) {
+		ssize_t n = write(conn->sock_fd, conn->out + pos, conn->out_len - pos);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+			break;
+		}
+		pos += n;
+	}
+	conn->out_len -= pos;
+	memmove(conn->out, conn->out + pos, conn->out_len);
+	return conn->out_len == 0;
+}
+
+/**
+ * Watch a connection for input, or for output space while
+ * output is waiting to be sent.
+ *
+ * @param epoll_fd the epoll descriptor
+ * @param watched the connection
+ * @param sock_fd the connection socket
+ * @param writing whether now waiting until the socket is writable
+ * @param writable true to wait until the socket is writable
+ */
+static void watch_connection(int epoll_fd, void *watched, int sock_fd, bool *writing, bool writable) {
+	if (*writing != writable) {
+		struct epoll_event ev = { .events = writable ? EPOLLOUT : EPOLLIN, .data.ptr = watched };
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock_fd, &ev);
+		*writing = writable;
+	}
+}
+
+/**
+ * Answer the lines that have arrived on a connection until
+ * it must wait for input or output space.
+ *
+ * @param epoll_fd the epoll descriptor
+ * @param conn the connection
+ * @return true if the connection should remain open
+ */
+static bool service_connection(int epoll_fd, connection *conn) {
+	while (true) {
+		if (conn->emitting) {
+			if (!emit_palindrome(conn)) {
+				return false;
+			}
+		} else if (conn->in_pos < conn->in_len) {
+			int status = take_input(conn);
+			if (status < 0) {
+				return false;
+			}
+			conn->emitting = (status > 0);
+			conn->emit_pos = 0;
+		} else if (!conn->at_eof) {
+			ssize_t n = read(conn->sock_fd, conn->in, sizeof conn->in);
+			if (n > 0) {
+				conn->in_pos = 0;
+				conn->in_len = n;
+			} else if (n == 0) {
+				// last line may have no newline
+				conn->at_eof = true;
+				conn->emitting = (conn->line_len > 0 || conn->spill_len > 0);
+				conn->emit_pos = 0;
+			} else if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// all input answered: send output before waiting for more
+				int status = flush_output(conn);
+				watch_connection(epoll_fd, conn, conn->sock_fd, &conn->writing, status == 0);
+				return status >= 0;
+			} else {
+				return false;
+			}
+		} else {
+			// client finished: close once output is sent
+			int status = flush_output(conn);
+			watch_connection(epoll_fd, conn, conn->sock_fd, &conn->writing, status == 0);
+			return status == 0;
+		}
+
+		if (sizeof conn->out - conn->out_len < UTF8_MAX_UNIT) {
+			// no room left for a whole code point
+			int status = flush_output(conn);
+			if (status <= 0) {
+				watch_connection(epoll_fd, conn, conn->sock_fd, &conn->writing, true);
+				return status == 0;
+			}
+		}
+	}
+}
+
+/**
+ * Copy bytes of input from the ring of a frame connection.
+ *
+ * @param fc the frame connection
+ * @param offset the offset of the first byte after the first unanswered byte
+ * @param buf the buffer for the bytes
+ * @param len the number of bytes
+ */
+static void copy_ring(frame_connection *fc, size_t offset, char buf[], size_t len) {
+	size_t start = (fc->in_pos + offset) & (FRAME_BUF - 1);
+	size_t n = (len < FRAME_BUF - start) ? len : FRAME_BUF - start;
+	memcpy(buf, fc->in + start, n);
+	memcpy(buf + n, fc->in, len - n);  // part that wraps to start of ring
+}
+
+/**
+ * Add bytes to the batch being sent on a frame connection.
+ *
+ * @param fc the frame connection
+ * @param data the bytes
+ * @param len the number of bytes
+ */
+static void add_iov(frame_connection *fc, char *data, size_t len) {
+	if (len > 0) {
+		fc->iov[fc->iov_count].iov_base = data;
+		fc->iov[fc->iov_count].iov_len = len;
+		fc->iov_count++;
+	}
+}
+
+/**
+ * Answer the whole frames in the input ring of a frame connection
+ * with a batch of iovecs to send. Each answer is its header and
+ * reversed string in the out buffer, around its string sent from
+ * the ring in place, so the out buffer holds a header, a reversed
+ * string and the next header, and so on, each run sent with one
+ * iovec.
+ *
+ * @param fc the frame connection
+ * @return the number of frames answered, or -1 if a frame is too long
+ */
+static int answer_frames(frame_connection *fc) {
+	size_t offset = 0;		// offset in ring of next frame
+	size_t out_len = 0;		// bytes in out buffer
+	size_t run = 0;			// offset in out buffer of run not yet in batch
+	int nframes = 0;
+	fc->iov_pos = fc->iov_count = 0;
+
+	// room for an out buffer run, a string that wraps, and the last run
+	while (fc->iov_count + 4 <= FRAME_IOVS && fc->in_len - offset >= FRAME_HEADER) {
+		unsigned char header[FRAME_HEADER];
+		copy_ring(fc, offset, (char *)header, FRAME_HEADER);
+		uint32_t len = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16
+					 | (uint32_t)header[2] << 8 | header[3];
+		if (len > FRAME_MAX_STRING) {
+			return -1;
+		}
+		if (fc->in_len - offset - FRAME_HEADER < len) {
+			break;  // wait for rest of frame
+		}
+
+		// header of answer, then string from ring in place
+		uint32_t answer_len = 2 * len;
+		char *dst = fc->out + out_len;
+		dst[0] = (char)(answer_len >> 24);
+		dst[1] = (char)(answer_len >> 16);
+		dst[2] = (char)(answer_len >> 8);
+		dst[3] = (char)answer_len;
+		out_len += FRAME_HEADER;
+		add_iov(fc, fc->out + run, out_len - run);
+		size_t start = (fc->in_pos + offset + FRAME_HEADER) & (FRAME_BUF - 1);
+		size_t n = (len < FRAME_BUF - start) ? len : FRAME_BUF - start;
+		add_iov(fc, fc->in + start, n);
+		add_iov(fc, fc->in, len - n);
 
-	return listen_sock_fd;
+		// reversed string starts the next run
+		copy_ring(fc, offset + FRAME_HEADER, fc->out + out_len, len);
+		reverse_binary(fc->out + out_len, len);
+		run = out_len;
+		out_len += len;
+		offset += FRAME_HEADER + len;
+		nframes++;
+	}
+	add_iov(fc, fc->out + run, out_len - run);
+	fc->batch_len = offset;
+	return nframes;
 }
 
 /**
- * Palindrome server listens for connections, reads input strings
- * from socket, and writes palindromes of the string to the socket.
+ * Send as much of the batch of answers as the socket accepts,
+ * and drop the input it answers once it has all been sent.
+ *
+ * @param fc the frame connection
+ * @return 1 if the batch was sent, 0 if the socket would
+ *   block, or -1 on error
+ */
+static int send_frames(frame_connection *fc) {
+	while (fc->iov_pos < fc->iov_count) {
+		ssize_t n = writev(fc->sock_fd, fc->iov + fc->iov_pos, fc->iov_count - fc->iov_pos);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+
+		// skip iovecs that were sent, and the sent part of the next one
+		while (fc->iov_pos < fc->iov_count && (size_t)n >= fc->iov[fc->iov_pos].iov_len) {
+			n -= fc->iov[fc->iov_pos].iov_len;
+			fc->iov_pos++;
+		}
+		if (n > 0) {
+			fc->iov[fc->iov_pos].iov_base = (char *)fc->iov[fc->iov_pos].iov_base + n;
+			fc->iov[fc->iov_pos].iov_len -= n;
+		}
+	}
+
+	fc->in_pos = (fc->in_pos + fc->batch_len) & (FRAME_BUF - 1);
+	fc->in_len -= fc->batch_len;
+	fc->batch_len = 0;
+	fc->iov_pos = fc->iov_count = 0;
+	return 1;
+}
+
+/**
+ * Read as much input as fits in the ring of a frame connection,
+ * filling the free space at the end and start of the ring with
+ * one readv().
+ *
+ * @param fc the frame connection
+ * @return the number of bytes read, 0 at end of input, or -1 on error
+ */
+static ssize_t read_frames(frame_connection *fc) {
+	size_t end = (fc->in_pos + fc->in_len) & (FRAME_BUF - 1);
+	size_t room = FRAME_BUF - fc->in_len;
+	size_t n = (room < FRAME_BUF - end) ? room : FRAME_BUF - end;
+	struct iovec iov[2] = {
+		{ .iov_base = fc->in + end, .iov_len = n },
+		{ .iov_base = fc->in, .iov_len = room - n }
+	};
+	ssize_t len = readv(fc->sock_fd, iov, (room > n) ? 2 : 1);
+	if (len > 0) {
+		fc->in_len += len;
+	}
+	return len;
+}
+
+/**
+ * Answer the frames that have arrived on a frame connection
+ * until it must wait for input or output space. Input is not
+ * read while a batch of answers is waiting to be sent.
+ *
+ * @param epoll_fd the epoll descriptor
+ * @param fc the frame connection
+ * @return true if the connection should remain open
+ */
+static bool service_frames(int epoll_fd, frame_connection *fc) {
+	while (true) {
+		if (fc->iov_pos < fc->iov_count) {
+			int status = send_frames(fc);
+			if (status <= 0) {
+				watch_connection(epoll_fd, fc, fc->sock_fd, &fc->writing, true);
+				return status == 0;
+			}
+		}
+
+		int nframes = answer_frames(fc);
+		if (nframes < 0) {
+			return false;
+		} else if (nframes > 0) {
+			continue;
+		} else if (fc->at_eof) {
+			return false;  // all frames answered; drops partial frame
+		}
+
+		ssize_t n = read_frames(fc);
+		if (n == 0) {
+			fc->at_eof = true;
+		} else if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return false;
+			}
+			watch_connection(epoll_fd, fc, fc->sock_fd, &fc->writing, false);
+			return true;
+		}
+	}
+}
+
+/**
+ * Close a connection and free its resources.
+ *
+ * @param watched the line or frame connection
+ */
+static void close_connection(socket_kind *watched) {
+	if (*watched == LINE_CONNECTION) {
+		connection *conn = (connection *)watched;
+		close(conn->sock_fd);  // also removes it from epoll set
+		if (conn->spill_fd >= 0) {
+			close(conn->spill_fd);
+		}
+	} else {
+		close(((frame_connection *)watched)->sock_fd);
+	}
+	free(watched);
+}
+
+/**
+ * Create the state of a connection that sends lines.
+ *
+ * @param sock_fd the client socket
+ * @return the connection, or NULL if out of memory
+ */
+static connection *new_connection(int sock_fd) {
+	connection *conn = malloc(sizeof(connection));
+	if (conn != NULL) {
+		conn->kind = LINE_CONNECTION;
+		conn->sock_fd = sock_fd;
+		conn->writing = false;
+		conn->at_eof = false;
+		conn->in_pos = conn->in_len = 0;
+		conn->out_len = 0;
+		conn->line_len = 0;
+		conn->spill_fd = -1;
+		conn->spill_len = 0;
+		conn->emitting = false;
+		conn->emit_pos = 0;
+	}
+	return conn;
+}
+
+/**
+ * Create the state of a connection that sends frames.
+ *
+ * @param sock_fd the client socket
+ * @return the connection, or NULL if out of memory
+ */
+static frame_connection *new_frame_connection(int sock_fd) {
+	frame_connection *fc = malloc(sizeof(frame_connection));
+	if (fc != NULL) {
+		fc->kind = FRAME_CONNECTION;
+		fc->sock_fd = sock_fd;
+		fc->writing = false;
+		fc->at_eof = false;
+		fc->in_pos = fc->in_len = 0;
+		fc->batch_len = 0;
+		fc->iov_pos = fc->iov_count = 0;
+	}
+	return fc;
+}
+
+/**
+ * Accept pending connections and watch them for input.
+ *
+ * @param epoll_fd the epoll descriptor
+ * @param lis the listener
+ */
+static void accept_connections(int epoll_fd, listener *lis) {
+	while (true) {
+		int sock_fd = accept_connection(lis->sock_fd, true, NULL);
+		if (sock_fd < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept");
+			}
+			return;
+		}
+		socket_kind *watched = (lis->kind == FRAME_LISTENER)
+				? (socket_kind *)new_frame_connection(sock_fd)
+				: (socket_kind *)new_connection(sock_fd);
+		if (watched == NULL) {
+			close(sock_fd);
+			continue;
+		}
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = watched };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) < 0) {
+			perror("epoll_ctl");
+			close_connection(watched);
+		}
+	}
+}
+
+/**
+ * Listen for connections on a port.
+ *
+ * @param epoll_fd the epoll descriptor
+ * @param lis the listener
+ * @param port the port number
+ * @return true if listening
+ */
+static bool start_listener(int epoll_fd, listener *lis, int port) {
+	listener_options options;
+	init_listener_options(&options, port);
+	options.nonblocking = true;
+	lis->sock_fd = open_listener_socket(&options);
+	if (lis->sock_fd < 0) {
+		return false;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = lis };
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lis->sock_fd, &ev) == 0;
+}
+
+/**
+ * Palindrome server listens for connections, reads input lines
+ * from sockets, and writes palindromes of the lines to the sockets.
+ * Clients that connect to the optional frame port send strings
+ * as length-prefixed frames instead of lines.
  *
  * @param argc
  * @param argv
  * @return
  */
 int main(int argc, char* argv[]) {
-	char buf[2*MAXBUF];
-    struct sockaddr_in address; // connector's address information
-    socklen_t addrlen = sizeof address;
     int port;
+    int frame_port = 0;
 
     // ensure port specified
-    if (argc < 2) {
-    	fprintf(stderr, "usage: %s port", argv[0]);
+    if (argc < 2 || argc > 3) {
+    	fprintf(stderr, "usage: %s port [frame-port]\n", argv[0]);
     	return EXIT_FAILURE;
     }
 
-    // decode and validate port
+    // decode and validate ports
     if ((sscanf(argv[1], "%d", &port) != 1) || (port <= 0)) {
 		fprintf(stderr, "Invalid port %s\n", argv[1]);
 		return EXIT_FAILURE;
 	}
+    if (argc == 3 && ((sscanf(argv[2], "%d", &frame_port) != 1) || (frame_port <= 0))) {
+		fprintf(stderr, "Invalid frame port %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	// a client closing before it reads its answer must not kill
+	// the whole server; the write fails with EPIPE and only that
+	// connection is closed
+	signal(SIGPIPE, SIG_IGN);
 
-    // get listener socket on the port
-	int listen_sock_fd = get_listener_socket(port);
-	if (listen_sock_fd < 0) {
+	// listeners are watched with connections, marked by their kind
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll");
+		return EXIT_FAILURE;
+	}
+	static listener line_listener = { .kind = LINE_LISTENER };
+	static listener frame_listener = { .kind = FRAME_LISTENER };
+	if (!start_listener(epoll_fd, &line_listener, port)) {
 		perror("listen_sock_fd");
 		return EXIT_FAILURE;
 	}
+	if (frame_port > 0 && !start_listener(epoll_fd, &frame_listener, frame_port)) {
+		perror("frame listen_sock_fd");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "waiting for connections on port %d...\n", port);
+	if (frame_port > 0) {
+		fprintf(stderr, "waiting for frame connections on port %d...\n", frame_port);
+	}
 
-	// Since loops forever, relies on OS to flush and close all
-	// stdio streams, including listener socket, on system exit.
+	// Since loops forever, relies on OS to close all
+	// sockets, including listener socket, on system exit.
     while (true) {
-        // accept client connection
-    	fprintf(stderr, "waiting for connection...\n");
-		int sock_fd = accept(listen_sock_fd, (struct sockaddr *)&address, &addrlen);
-		if (sock_fd < 0) {
-			perror("accept");
-			continue;
+		struct epoll_event events[MAX_EVENTS];
+		int nevents = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (nevents < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			return EXIT_FAILURE;
 		}
-
-		// process input line
-		FILE* sock_file = fdopen(sock_fd, "r+");
-		if ((sock_file != NULL) && (fgets(buf, MAXBUF, sock_file) != NULL)) {
-			// bkw_idx selects characters backward from end of input
-			// string and fwd_idx adds characters to end of the string
-			size_t bkw_idx = strlen(buf);
-			if (bkw_idx > 0) {
-				if (buf[bkw_idx-1] == '\n') {
-					bkw_idx--;  // step over newline
-				}
-				int fwd_idx = bkw_idx;
-				while (bkw_idx > 0) {
-					buf[fwd_idx++] = buf[--bkw_idx] ;
-				}
-				buf[fwd_idx] = '\0';  // terminate string
-
-				// write time to socket
-				if (fputs(buf , sock_file) < 0) {
-					perror("send");
-				}
+		for (int i = 0; i < nevents; i++) {
+			socket_kind *watched = events[i].data.ptr;
+			bool open = true;
+			switch (*watched) {
+			case LINE_LISTENER:
+			case FRAME_LISTENER:
+				accept_connections(epoll_fd, (listener *)watched);
+				break;
+			case LINE_CONNECTION:
+				open = service_connection(epoll_fd, (connection *)watched);
+				break;
+			case FRAME_CONNECTION:
+				open = service_frames(epoll_fd, (frame_connection *)watched);
+				break;
+			}
+			if (!open) {
+				close_connection(watched);
 			}
 		}
-
-		// close socket to complete write operation
-		fclose(sock_file);
     }
 }
-
@@ -0,0 +1,219 @@
+/*
+ * bench_reverse.c
+ *
+ * Benchmark that compares the cost of reversing a line with the
+ * original byte-at-a-time swap loop, which splits multibyte code
+ * points, and with each of the code point reverse kernels, for
+ * lines of ASCII and of mixed UTF-8 text from 8 bytes to 1 MB.
+ * Each kernel's result is first checked against a reference
+ * reverse.
+ *
+ * Build and run:
+ *   gcc -std=gnu11 -O2 -o bench_reverse bench_reverse.c reverse_utf8.c
+ *   ./bench_reverse
+ *
+ * @since 2019-06-10
+ * @author philip gust
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reverse_utf8.h"
+
+/** bytes reversed per measurement */
+#define BENCH_BYTES (256UL * 1024 * 1024)
+
+/** longest line measured */
+#define MAX_LINE (1024 * 1024)
+
+/** line lengths measured */
+static const size_t lengths[] = { 8, 64, 512, 4096, 65536, MAX_LINE };
+
+/** number of line lengths */
+#define NLENGTHS (sizeof lengths / sizeof lengths[0])
+
+/** text that lines are made from */
+static const struct {
+	const char *name;
+	const char *text;
+} texts[] = {
+	{ "ascii", "A man, a plan, a canal: Panama! " },
+	{ "utf-8", "Ésope reste ici — 回文 😀 et se repose. " },
+};
+
+/** number of texts */
+#define NTEXTS (sizeof texts / sizeof texts[0])
+
+/** Reverse kernel to measure */
+typedef struct {
+	const char *name;
+	reverse_kernel reverse;
+	bool by_unit;			// reverses by code point
+} kernel;
+
+/**
+ * Original reverse that swaps one byte at a time.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+static void reverse_swap(char buf[], size_t len) {
+	for (size_t i = 0, j = len - 1; len > 0 && i < j; i++, j--) {
+		char c = buf[i];
+		buf[i] = buf[j];
+		buf[j] = c;
+	}
+}
+
+/**
+ * Get current monotonic time in seconds.
+ *
+ * @return the time in seconds
+ */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill a line with whole code points of a text, padding
+ * the end with spaces.
+ *
+ * @param line the line
+ * @param len the number of bytes
+ * @param text the text
+ */
+static void make_line(char line[], size_t len, const char text[]) {
+	size_t text_len = strlen(text);
+	size_t n = 0;
+	for (size_t t = 0; ; t = (t + 1) % text_len) {
+		size_t unit = 1;
+		while (t + unit < text_len && (text[t + unit] & 0xC0) == 0x80) {
+			unit++;
+		}
+		if (n + unit > len) {
+			break;
+		}
+		memcpy(line + n, text + t, unit);
+		n += unit;
+		t += unit - 1;
+	}
+	memset(line + n, ' ', len - n);
+}
+
+/**
+ * Reverse a line by code point into another buffer, one code
+ * point at a time, as the reference result.
+ *
+ * @param dst the reversed line
+ * @param src the line
+ * @param len the number of bytes
+ */
+static void reverse_reference(char dst[], const char src[], size_t len) {
+	size_t end = len;
+	while (end > 0) {
+		size_t start = end - 1;
+		while (start > 0 && end - start < UTF8_MAX_UNIT && (src[start] & 0xC0) == 0x80) {
+			start--;
+		}
+		memcpy(dst + len - end, src + start, end - start);
+		end = start;
+	}
+}
+
+/**
+ * Time reversing a line repeatedly.
+ *
+ * @param reverse the kernel
+ * @param line the line
+ * @param len the number of bytes
+ * @return nanoseconds per reverse
+ */
+static double bench(reverse_kernel reverse, char line[], size_t len) {
+	unsigned long rounds = BENCH_BYTES / len;
+	double start = now();
+	for (unsigned long n = 0; n < rounds; n++) {
+		reverse(line, len);
+		__asm__ volatile("" : : "r"(line) : "memory");  // keep each reverse
+	}
+	return (now() - start) * 1e9 / rounds;
+}
+
+/**
+ * Main program checks each kernel against the reference reverse,
+ * then reports the time per line and throughput of each kernel
+ * for each text and line length.
+ */
+int main(void) {
+	kernel kernels[] = {
+		{ "swap", reverse_swap, false },
+		{ "scalar", reverse_utf8_scalar, true },
+#ifdef REVERSE_UTF8_X86
+		{ "sse2", reverse_utf8_sse2, true },
+		{ "avx2", reverse_utf8_avx2, true },
+#endif
+	};
+	size_t nkernels = sizeof kernels / sizeof kernels[0];
+#ifdef REVERSE_UTF8_X86
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2")) {
+		nkernels--;
+	}
+#endif
+
+	char *line = malloc(MAX_LINE);
+	char *expect = malloc(MAX_LINE);
+	char *got = malloc(MAX_LINE);
+	if (line == NULL || expect == NULL || got == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	// check every length up to 300 bytes and the measured lengths
+	for (size_t t = 0; t < NTEXTS; t++) {
+		for (size_t len = 0; len <= MAX_LINE; len = (len < 300) ? len + 1 : len * 2) {
+			make_line(line, len, texts[t].text);
+			reverse_reference(expect, line, len);
+			for (size_t k = 0; k < nkernels; k++) {
+				if (!kernels[k].by_unit) {
+					continue;
+				}
+				memcpy(got, line, len);
+				kernels[k].reverse(got, len);
+				if (memcmp(got, expect, len) != 0) {
+					fprintf(stderr, "%s: wrong reverse of %zu byte %s line\n",
+							kernels[k].name, len, texts[t].name);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	printf("%-6s %8s", "text", "length");
+	for (size_t k = 0; k < nkernels; k++) {
+		printf(" %19s", kernels[k].name);
+	}
+	printf("\n");
+	for (size_t t = 0; t < NTEXTS; t++) {
+		for (size_t l = 0; l < NLENGTHS; l++) {
+			size_t len = lengths[l];
+			make_line(line, len, texts[t].text);
+			printf("%-6s %8zu", texts[t].name, len);
+			for (size_t k = 0; k < nkernels; k++) {
+				double ns = bench(kernels[k].reverse, line, len);
+				printf(" %9.1f ns %4.1f GB/s", ns, len / ns);
+			}
+			printf("\n");
+		}
+	}
+
+	free(line);
+	free(expect);
+	free(got);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,402 @@
+/*
+ * reverse_utf8.c
+ *
+ * Reverse a buffer of UTF-8 text in place by code point. The
+ * bytes are first reversed a register at a time from both ends,
+ * which leaves the bytes of each multibyte code point backward:
+ * its continuation bytes followed by its lead byte. If any byte
+ * is not ASCII, a second pass finds the lead bytes a word at a
+ * time and puts the bytes of their code points back in order.
+ *
+ * @since 2019-06-10
+ * @author philip gust
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "reverse_utf8.h"
+
+#ifdef REVERSE_UTF8_X86
+#include <immintrin.h>
+#endif
+
+/** high bit of each byte of a word; set only in non-ASCII bytes */
+#define HIGH_BITS 0x8080808080808080ULL
+
+/**
+ * Reverse the bytes between two offsets of a buffer.
+ *
+ * @param buf the buffer
+ * @param i offset of the first byte
+ * @param j offset after the last byte
+ * @return true if any byte is not ASCII
+ */
+typedef bool (*range_reverse)(char buf[], size_t i, size_t j);
+
+/**
+ * Test whether a byte continues a multibyte code point.
+ *
+ * @param c the byte
+ * @return true for 10xxxxxx
+ */
+static inline bool is_continuation(unsigned char c) {
+	return (c & 0xC0) == 0x80;
+}
+
+/**
+ * Get the number of bytes in a code point from its lead byte.
+ *
+ * @param c the lead byte
+ * @return 2 to 4, or 0 if c does not lead a multibyte code point
+ */
+static inline size_t unit_length(unsigned char c) {
+	if (c >= 0xC0 && c < 0xE0) return 2;
+	if (c >= 0xE0 && c < 0xF0) return 3;
+	if (c >= 0xF0 && c < 0xF8) return 4;
+	return 0;
+}
+
+/** bytes in front of a code point of each length that stay put in its window */
+static const uint32_t window_keep[UTF8_MAX_UNIT + 1] = {
+	0x00FFFFFF, 0x00FFFFFF, 0x0000FFFF, 0x000000FF, 0x00000000
+};
+
+/** top two bits of the continuation bytes of a code point of each length */
+static const uint32_t window_continuations[UTF8_MAX_UNIT + 1] = {
+	0x00000000, 0x00000000, 0x00C00000, 0x00C0C000, 0x00C0C0C0
+};
+
+/**
+ * Move a lead byte in front of the continuation bytes before it
+ * in a reversed buffer. The lead byte and the three bytes before
+ * it are handled as one word, first byte lowest, so code points
+ * of every length are restored the same way.
+ *
+ * @param s the reversed buffer
+ * @param lead the offset of the lead byte; at least 3
+ */
+static inline void restore_unit(unsigned char s[], size_t lead) {
+	unsigned char *p = s + lead - 3;
+	uint32_t w = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+	size_t n = unit_length(p[3]);
+	if (n > 0 && ((w ^ 0x80808080) & window_continuations[n]) == 0) {
+		w = (w & window_keep[n]) | (__builtin_bswap32(w) << (8 * (UTF8_MAX_UNIT - n)));
+		p[0] = (unsigned char)w;
+		p[1] = (unsigned char)(w >> 8);
+		p[2] = (unsigned char)(w >> 16);
+		p[3] = (unsigned char)(w >> 24);
+	}
+}
+
+/**
+ * Move a lead byte in front of the continuation bytes before it
+ * in a reversed buffer, one byte at a time, for a lead byte too
+ * near the start of the buffer for restore_unit().
+ *
+ * @param s the reversed buffer
+ * @param lead the offset of the lead byte
+ */
+static void restore_unit_bytes(unsigned char s[], size_t lead) {
+	size_t n = unit_length(s[lead]);
+	if (n == 0 || lead < n - 1) {
+		return;
+	}
+	size_t first = lead - (n - 1);
+	for (size_t k = first; k < lead; k++) {
+		if (!is_continuation(s[k])) {
+			return;
+		}
+	}
+	for (size_t lo = first, hi = lead; lo < hi; lo++, hi--) {
+		unsigned char c = s[lo];
+		s[lo] = s[hi];
+		s[hi] = c;
+	}
+}
+
+/**
+ * Get the offset of the first byte of a word that is marked
+ * by its high bit.
+ *
+ * @param marks the high bits of the marked bytes; not 0
+ * @return the offset of the first marked byte in memory order
+ */
+static inline size_t first_marked(uint64_t marks) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_ctzll(marks) / 8;
+#else
+	return __builtin_clzll(marks) / 8;
+#endif
+}
+
+/**
+ * Clear the mark of the first marked byte of a word.
+ *
+ * @param marks the high bits of the marked bytes; not 0
+ * @return the marks without the first one
+ */
+static inline uint64_t clear_first_marked(uint64_t marks) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return marks & (marks - 1);
+#else
+	return marks & ~(1ULL << (63 - __builtin_clzll(marks)));
+#endif
+}
+
+/**
+ * Put the bytes of each multibyte code point in a reversed
+ * buffer back in order. A code point reversed with the buffer
+ * appears as its continuation bytes followed by its lead byte,
+ * so the buffer is searched a word at a time for lead bytes
+ * (11xxxxxx) and each is moved back in front of its continuation
+ * bytes. Bytes that do not form a valid sequence stay where they
+ * are.
+ *
+ * @param buf the reversed buffer
+ * @param len the number of bytes
+ */
+static void restore_units(char buf[], size_t len) {
+	unsigned char *s = (unsigned char *)buf;
+	size_t i = 0;
+	for (; i < len && i < UTF8_MAX_UNIT - 1; i++) {
+		restore_unit_bytes(s, i);
+	}
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		// a lead byte has both of its top bits set
+		uint64_t word;
+		memcpy(&word, s + i, sizeof word);
+		uint64_t leads = word & (word << 1) & HIGH_BITS;
+		while (leads != 0) {
+			restore_unit(s, i + first_marked(leads));
+			leads = clear_first_marked(leads);
+		}
+	}
+	for (; i < len; i++) {
+		restore_unit(s, i);
+	}
+}
+
+/**
+ * Reverse the bytes between two offsets one at a time.
+ *
+ * @param buf the buffer
+ * @param i offset of the first byte
+ * @param j offset after the last byte
+ * @return the bytes or-ed together, to test for non-ASCII bytes
+ */
+static unsigned char reverse_bytes(char buf[], size_t i, size_t j) {
+	unsigned char high = 0;
+	while (j > i + 1) {
+		char c = buf[i];
+		buf[i++] = buf[--j];
+		buf[j] = c;
+		high |= (unsigned char)c | (unsigned char)buf[i - 1];
+	}
+	if (j > i) {
+		high |= (unsigned char)buf[i];  // middle byte stays
+	}
+	return high;
+}
+
+/**
+ * Reverse the bytes between two offsets eight at a time.
+ *
+ * @param buf the buffer
+ * @param i offset of the first byte
+ * @param j offset after the last byte
+ * @return true if any byte is not ASCII
+ */
+static bool reverse_words(char buf[], size_t i, size_t j) {
+	uint64_t high = 0;
+	while (j - i >= 2 * sizeof high) {
+		uint64_t a, b;
+		memcpy(&a, buf + i, sizeof a);
+		memcpy(&b, buf + j - sizeof b, sizeof b);
+		high |= a | b;
+		a = __builtin_bswap64(a);
+		b = __builtin_bswap64(b);
+		memcpy(buf + i, &b, sizeof b);
+		memcpy(buf + j - sizeof a, &a, sizeof a);
+		i += sizeof a;
+		j -= sizeof b;
+	}
+	unsigned char middle = reverse_bytes(buf, i, j);
+	return (high & HIGH_BITS) != 0 || (middle & 0x80) != 0;
+}
+
+/**
+ * Reverse a buffer by code point eight bytes at a time
+ * with general-purpose registers.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8_scalar(char buf[], size_t len) {
+	if (reverse_words(buf, 0, len)) {
+		restore_units(buf, len);
+	}
+}
+
+#ifdef REVERSE_UTF8_X86
+/**
+ * Reverse the bytes of an SSE2 register. SSE2 has no byte
+ * shuffle, so the doublewords are reversed, then the words in
+ * each doubleword, then the bytes in each word.
+ *
+ * @param v the register
+ * @return the register with its bytes reversed
+ */
+static inline __m128i reverse_m128(__m128i v) {
+	v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/**
+ * Reverse the bytes between two offsets sixteen at a time.
+ *
+ * @param buf the buffer
+ * @param i offset of the first byte
+ * @param j offset after the last byte
+ * @return true if any byte is not ASCII
+ */
+static bool reverse_m128s(char buf[], size_t i, size_t j) {
+	__m128i high = _mm_setzero_si128();
+	while (j - i >= 2 * sizeof high) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(buf + j - sizeof b));
+		high = _mm_or_si128(high, _mm_or_si128(a, b));
+		_mm_storeu_si128((__m128i *)(buf + i), reverse_m128(b));
+		_mm_storeu_si128((__m128i *)(buf + j - sizeof a), reverse_m128(a));
+		i += sizeof a;
+		j -= sizeof b;
+	}
+	bool middle = reverse_words(buf, i, j);
+	return _mm_movemask_epi8(high) != 0 || middle;
+}
+
+/**
+ * Reverse a buffer by code point sixteen bytes at a time with SSE2.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8_sse2(char buf[], size_t len) {
+	if (reverse_m128s(buf, 0, len)) {
+		restore_units(buf, len);
+	}
+}
+
+/**
+ * Reverse the bytes between two offsets thirty-two at a time with
+ * AVX2. The byte shuffle reverses each 128-bit lane, then the
+ * lanes are swapped.
+ *
+ * @param buf the buffer
+ * @param i offset of the first byte
+ * @param j offset after the last byte
+ * @return true if any byte is not ASCII
+ */
+__attribute__((target("avx2")))
+static bool reverse_m256s(char buf[], size_t i, size_t j) {
+	const __m256i reverse_lane = _mm256_setr_epi8(
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i high = _mm256_setzero_si256();
+	while (j - i >= 2 * sizeof high) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(buf + j - sizeof b));
+		high = _mm256_or_si256(high, _mm256_or_si256(a, b));
+		a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, reverse_lane), 0x4E);
+		b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, reverse_lane), 0x4E);
+		_mm256_storeu_si256((__m256i *)(buf + i), b);
+		_mm256_storeu_si256((__m256i *)(buf + j - sizeof a), a);
+		i += sizeof a;
+		j -= sizeof b;
+	}
+
+	// clear upper halves before SSE2 code to avoid transition stalls
+	bool non_ascii = _mm256_movemask_epi8(high) != 0;
+	_mm256_zeroupper();
+	bool middle = reverse_m128s(buf, i, j);
+	return non_ascii || middle;
+}
+
+/**
+ * Reverse a buffer by code point thirty-two bytes at a time with
+ * AVX2. Only call if the processor supports AVX2.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8_avx2(char buf[], size_t len) {
+	if (reverse_m256s(buf, 0, len)) {
+		restore_units(buf, len);
+	}
+}
+#endif
+
+/**
+ * Get the fastest byte reverse the processor supports.
+ *
+ * @return the byte reverse
+ */
+static range_reverse reverse_range(void) {
+	static range_reverse range = NULL;
+	if (range == NULL) {
+#ifdef REVERSE_UTF8_X86
+		__builtin_cpu_init();
+		range = __builtin_cpu_supports("avx2") ? reverse_m256s : reverse_m128s;
+#else
+		range = reverse_words;
+#endif
+	}
+	return range;
+}
+
+/**
+ * Reverse a buffer by code point with the fastest kernel
+ * the processor supports.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8(char buf[], size_t len) {
+	if (reverse_range()(buf, 0, len)) {
+		restore_units(buf, len);
+	}
+}
+
+/**
+ * Reverse a buffer byte by byte, for binary data, with the
+ * fastest kernel the processor supports.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_binary(char buf[], size_t len) {
+	reverse_range()(buf, 0, len);
+}
+
+/**
+ * Find where the first whole code point of a buffer starts, so
+ * a buffer cut from the middle of a line can be reversed without
+ * splitting a code point.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ * @return the number of continuation bytes at the start of buf
+ *   that belong to the code point before it, which is len if buf
+ *   has only those; 0 if there are none or more than a code point
+ *   can have
+ */
+size_t utf8_unit_offset(const char buf[], size_t len) {
+	size_t n = 0;
+	while (n < len && n < UTF8_MAX_UNIT && is_continuation(buf[n])) {
+		n++;
+	}
+	return (n < UTF8_MAX_UNIT) ? n : 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * reverse_utf8.h
+ *
+ * Reverse a buffer of UTF-8 text in place by code point, so a
+ * multibyte character keeps its bytes in order rather than being
+ * turned into invalid bytes. Bytes that are not part of a valid
+ * sequence are reversed individually. Binary data can be reversed
+ * byte by byte with the same kernels.
+ *
+ * @since 2019-06-10
+ * @author philip gust
+ */
+
+#ifndef REVERSE_UTF8_H_
+#define REVERSE_UTF8_H_
+
+#include <stddef.h>
+
+/** most bytes in one UTF-8 code point */
+#define UTF8_MAX_UNIT 4
+
+#ifdef __x86_64__
+/** SSE2 and AVX2 kernels are available */
+#define REVERSE_UTF8_X86 1
+#endif
+
+/**
+ * Reverse a buffer by code point.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+typedef void (*reverse_kernel)(char buf[], size_t len);
+
+/**
+ * Reverse a buffer by code point with the fastest kernel
+ * the processor supports.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8(char buf[], size_t len);
+
+/**
+ * Reverse a buffer byte by byte, for binary data, with the
+ * fastest kernel the processor supports.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_binary(char buf[], size_t len);
+
+/**
+ * Reverse a buffer by code point eight bytes at a time
+ * with general-purpose registers.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8_scalar(char buf[], size_t len);
+
+#ifdef REVERSE_UTF8_X86
+/**
+ * Reverse a buffer by code point sixteen bytes at a time with SSE2.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8_sse2(char buf[], size_t len);
+
+/**
+ * Reverse a buffer by code point thirty-two bytes at a time with
+ * AVX2. Only call if the processor supports AVX2.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+void reverse_utf8_avx2(char buf[], size_t len);
+#endif
+
+/**
+ * Find where the first whole code point of a buffer starts, so
+ * a buffer cut from the middle of a line can be reversed without
+ * splitting a code point.
+ *
+ * @param buf the buffer
+ * @param len the number of bytes
+ * @return the number of continuation bytes at the start of buf
+ *   that belong to the code point before it, which is len if buf
+ *   has only those; 0 if there are none or more than a code point
+ *   can have
+ */
+size_t utf8_unit_offset(const char buf[], size_t len);
+
+#endif /* REVERSE_UTF8_H_ */
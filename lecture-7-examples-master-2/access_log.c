@@ -0,0 +1,293 @@
+/*
+ * access_log.c
+ *
+ * Access log that records one JSON line per response. The ring
+ * buffer is a bounded multi-producer queue: each slot carries a
+ * sequence number that tells a producer whether the slot is free
+ * and tells the writer whether it has been filled, so producers
+ * only compete for the enqueue position with compare-and-swap.
+ * The single writer thread drains the ring, formats the entries,
+ * and writes each batch with one write() call.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+/** size of the batch of formatted entries written at once */
+#define ACCESS_LOG_BATCH 65536
+
+/** A ring buffer slot */
+typedef struct {
+	atomic_size_t sequence;		// position this slot is ready for
+	access_entry entry;
+} log_slot;
+
+/** ring buffer of entries waiting to be written */
+static log_slot ring[ACCESS_LOG_ENTRIES];
+
+/** position of next entry to add; shared by request threads */
+static atomic_size_t enqueue_pos;
+
+/** position of next entry to write; used only by the writer */
+static size_t dequeue_pos;
+
+/** number of entries dropped because the ring was full */
+static atomic_ulong dropped;
+
+/** true if the access log is running */
+static atomic_bool logging;
+
+/** true when the writer should write what remains and exit */
+static atomic_bool closing;
+
+/** writer thread */
+static pthread_t writer;
+
+/** access log file descriptor */
+static int log_fd = -1;
+
+/**
+ * Add an entry to the ring buffer without waiting.
+ *
+ * @param entry the entry
+ * @return false if the ring is full
+ */
+static bool pushEntry(const access_entry *entry) {
+	size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	log_slot *slot;
+	while (true) {
+		slot = &ring[pos & (ACCESS_LOG_ENTRIES - 1)];
+		size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			// slot is free: claim it by advancing the enqueue position
+			if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false;  // writer has not emptied slot yet
+		} else {
+			pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+		}
+	}
+	slot->entry = *entry;
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * Remove the oldest entry from the ring buffer.
+ * Must only be called by the writer thread.
+ *
+ * @param entry set to the entry
+ * @return false if the ring is empty
+ */
+static bool popEntry(access_entry *entry) {
+	log_slot *slot = &ring[dequeue_pos & (ACCESS_LOG_ENTRIES - 1)];
+	size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+	if (seq != dequeue_pos + 1) {
+		return false;
+	}
+	*entry = slot->entry;
+	atomic_store_explicit(&slot->sequence, dequeue_pos + ACCESS_LOG_ENTRIES, memory_order_release);
+	dequeue_pos++;
+	return true;
+}
+
+/**
+ * Append a string to a batch as a JSON string value.
+ *
+ * @param buf the batch buffer
+ * @param len the length of the batch
+ * @param str the string
+ * @return the new length of the batch
+ */
+static size_t appendJsonString(char buf[], size_t len, const char str[]) {
+	buf[len++] = '"';
+	for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = *p;
+		} else if (*p < 0x20 || *p == 0x7f) {
+			len += sprintf(buf + len, "\\u%04x", *p);
+		} else {
+			buf[len++] = *p;
+		}
+	}
+	buf[len++] = '"';
+	return len;
+}
+
+/**
+ * Append an entry to a batch as a JSON line.
+ *
+ * @param buf the batch buffer
+ * @param len the length of the batch
+ * @param entry the entry
+ * @return the new length of the batch
+ */
+static size_t formatEntry(char buf[], size_t len, const access_entry *entry) {
+	struct tm tm;
+	gmtime_r(&entry->time.tv_sec, &tm);
+	len += strftime(buf + len, 32, "{\"time\":\"%Y-%m-%dT%H:%M:%S", &tm);
+	len += sprintf(buf + len, ".%03ldZ\",\"method\":", entry->time.tv_nsec / 1000000);
+	len = appendJsonString(buf, len, entry->method);
+	len += sprintf(buf + len, ",\"uri\":");
+	len = appendJsonString(buf, len, entry->uri);
+	len += sprintf(buf + len, ",\"status\":%d,\"bytes\":%lu,\"latency_us\":%ld}\n",
+				   entry->status, entry->bytes, entry->latency_us);
+	return len;
+}
+
+/**
+ * Write a batch to the access log file.
+ *
+ * @param buf the batch buffer
+ * @param len the length of the batch
+ */
+static void writeBatch(const char buf[], size_t len) {
+	while (len > 0) {
+		ssize_t n = write(log_fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("access log");
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+ * Writer thread function drains the ring buffer and writes
+ * the entries in batches, waiting briefly when it is empty,
+ * until the access log is stopped.
+ *
+ * @param arg unused
+ * @return NULL (unused)
+ */
+static void *accessLogWriter(void *arg) {
+	(void)arg;
+	static char batch[ACCESS_LOG_BATCH];
+	const struct timespec pause = { 0, ACCESS_LOG_FLUSH_MS * 1000000L };
+	unsigned long reported = 0;
+
+	while (true) {
+		size_t len = 0;
+		access_entry entry;
+		while (popEntry(&entry)) {
+			len = formatEntry(batch, len, &entry);
+			if (len > sizeof batch - 8 * MAXBUF) {  // room for another entry
+				writeBatch(batch, len);
+				len = 0;
+			}
+		}
+
+		// note entries lost since last batch
+		unsigned long lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+		if (lost != reported) {
+			len += sprintf(batch + len, "{\"dropped\":%lu}\n", lost - reported);
+			reported = lost;
+		}
+		if (len > 0) {
+			writeBatch(batch, len);
+		}
+		if (atomic_load(&closing)) {
+			break;
+		}
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Open the access log file for appending and start the
+ * thread that writes it.
+ *
+ * @param path the access log file
+ * @return true if the access log is running
+ */
+bool startAccessLog(const char path[]) {
+	for (size_t i = 0; i < ACCESS_LOG_ENTRIES; i++) {
+		atomic_init(&ring[i].sequence, i);
+	}
+
+	log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (log_fd < 0) {
+		return false;
+	}
+	if (pthread_create(&writer, NULL, accessLogWriter, NULL) != 0) {
+		close(log_fd);
+		log_fd = -1;
+		return false;
+	}
+	atomic_store(&logging, true);
+	return true;
+}
+
+/**
+ * Stop adding entries, wait for the writer to write the
+ * entries already in the ring buffer, and close the file.
+ * Entries completed after this call are not logged.
+ */
+void stopAccessLog(void) {
+	if (!atomic_exchange(&logging, false)) {
+		return;
+	}
+	atomic_store(&closing, true);
+	pthread_join(writer, NULL);
+	close(log_fd);
+	log_fd = -1;
+}
+
+/**
+ * Begin an access log entry when a request is received.
+ *
+ * @param entry the entry
+ * @param method the request method
+ * @param uri the request URI
+ */
+void beginAccess(access_entry *entry, const char method[], const char uri[]) {
+	if (!atomic_load_explicit(&logging, memory_order_relaxed)) {
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &entry->time);
+	clock_gettime(CLOCK_MONOTONIC, &entry->started);
+	snprintf(entry->method, sizeof entry->method, "%s", method);
+	snprintf(entry->uri, sizeof entry->uri, "%s", uri);
+}
+
+/**
+ * Complete an access log entry when the response is sent
+ * and add it to the log. Never waits for the writer.
+ *
+ * @param entry the entry
+ * @param status the response status
+ * @param bytes the response bytes sent
+ */
+void endAccess(access_entry *entry, int status, unsigned long bytes) {
+	if (!atomic_load_explicit(&logging, memory_order_relaxed)) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	entry->status = status;
+	entry->bytes = bytes;
+	entry->latency_us = (now.tv_sec - entry->started.tv_sec) * 1000000L
+					  + (now.tv_nsec - entry->started.tv_nsec) / 1000;
+	if (!pushEntry(entry)) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+	}
+}
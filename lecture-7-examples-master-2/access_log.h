@@ -0,0 +1,76 @@
+/*
+ * access_log.h
+ *
+ * Access log that records one JSON line per response. Request
+ * threads add entries to a lock-free ring buffer and never wait;
+ * a background thread writes the entries to the log file in
+ * batches. Entries are dropped and counted if the ring is full.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "http_server.h"
+
+/** number of entries in the ring buffer; must be a power of 2 */
+#define ACCESS_LOG_ENTRIES 4096
+
+/** milliseconds the writer waits when the ring buffer is empty */
+#define ACCESS_LOG_FLUSH_MS 100
+
+/** maximum length of a logged method */
+#define ACCESS_LOG_METHOD 16
+
+/** Access log entry for one request */
+typedef struct {
+	struct timespec time;		// wall clock time request started
+	struct timespec started;	// monotonic time request started
+	char method[ACCESS_LOG_METHOD];	// request method
+	char uri[MAXBUF];			// request URI
+	int status;					// response status
+	unsigned long bytes;		// response bytes sent
+	long latency_us;			// microseconds to send response
+} access_entry;
+
+/**
+ * Open the access log file for appending and start the
+ * thread that writes it.
+ *
+ * @param path the access log file
+ * @return true if the access log is running
+ */
+bool startAccessLog(const char path[]);
+
+/**
+ * Stop adding entries, wait for the writer to write the
+ * entries already in the ring buffer, and close the file.
+ * Entries completed after this call are not logged.
+ */
+void stopAccessLog(void);
+
+/**
+ * Begin an access log entry when a request is received.
+ *
+ * @param entry the entry
+ * @param method the request method
+ * @param uri the request URI
+ */
+void beginAccess(access_entry *entry, const char method[], const char uri[]);
+
+/**
+ * Complete an access log entry when the response is sent
+ * and add it to the log. Never waits for the writer.
+ *
+ * @param entry the entry
+ * @param status the response status
+ * @param bytes the response bytes sent
+ */
+void endAccess(access_entry *entry, int status, unsigned long bytes);
+
+#endif /* ACCESS_LOG_H_ */
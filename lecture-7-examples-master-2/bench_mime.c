@@ -0,0 +1,119 @@
+/*
+ * bench_mime.c
+ *
+ * Benchmark that compares the cost of finding the content type of
+ * a file path with the original linear strcasestr() scan and with
+ * the perfect hash lookup (lookupContentType), first with only the
+ * built-in types and then with a mime.types file loaded.
+ *
+ * Build and run:
+ *   gcc -std=gnu11 -O2 -o bench_mime bench_mime.c mime_types.c -lpthread
+ *   ./bench_mime [mime.types file (default: /etc/mime.types)]
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mime_types.h"
+
+/** number of lookups per measurement */
+#define BENCH_LOOKUPS 10000000UL
+
+/** sample request paths */
+static const char *paths[] = {
+	"content/index.html", "content/favicon.ico", "content/northeastern.png",
+	"content/css/site.css", "content/js/app.min.js", "content/img/photo.JPG",
+	"content/docs/report.pdf", "content/fonts/body.woff2", "content/data.json",
+	"content/notes.html.txt", "content/archive.tar.gz", "content/README",
+	"content/video/intro.mp4", "content/images/logo.svg", "content/feed.xml",
+	"content/download/setup.exe",
+};
+
+/** number of sample request paths */
+#define NPATHS (sizeof paths / sizeof paths[0])
+
+/**
+ * Original content type lookup that scans a table for
+ * the first suffix found anywhere in the path.
+ *
+ * @param filePath the file path
+ * @return the content type
+ */
+static const char *scanContentType(const char filePath[]) {
+	static const char* contentTypes[][2] = {
+		{".html", "text/html"},
+		{".txt", "text/plain"},
+		{".css", "text/css"},
+		{".gif", "impage/gif"},
+		{".jpg", "image.jpg"},
+		{".png", "image.png"},
+		{".ico", "image/ico"},
+		{ NULL, "application/octet-stream"}  // default
+	};
+	int i;
+	for (i = 0; contentTypes[i][0] != NULL; i++) {
+		if (strcasestr(filePath, contentTypes[i][0]) != NULL) break;
+	}
+	return contentTypes[i][1];
+}
+
+/**
+ * Get current monotonic time in seconds.
+ *
+ * @return the time in seconds
+ */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Time lookups of the sample paths.
+ *
+ * @param lookup the lookup function
+ * @return nanoseconds per lookup
+ */
+static double bench(const char *(*lookup)(const char[])) {
+	size_t total = 0;  // keeps lookups from being optimized away
+	double start = now();
+	for (unsigned long n = 0; n < BENCH_LOOKUPS; n++) {
+		total += strlen(lookup(paths[n % NPATHS]));
+	}
+	double elapsed = now() - start;
+	if (total == 0) {
+		printf("no lookups\n");
+	}
+	return elapsed * 1e9 / BENCH_LOOKUPS;
+}
+
+/**
+ * Main program reports the content type found for each sample
+ * path and the time per lookup for each lookup method.
+ *
+ * @param argv[1]: optional mime.types file (default: /etc/mime.types)
+ */
+int main(int argc, char* argv[argc]) {
+	const char *mimeTypes = (argc == 2) ? argv[1] : "/etc/mime.types";
+
+	printf("%-28s %-26s %s\n", "path", "scan", "hash");
+	for (size_t i = 0; i < NPATHS; i++) {
+		printf("%-28s %-26s %s\n", paths[i], scanContentType(paths[i]), lookupContentType(paths[i]));
+	}
+	printf("\n");
+
+	printf("%-28s %8.1f ns\n", "scan", bench(scanContentType));
+	printf("%-28s %8.1f ns\n", "hash (built-in)", bench(lookupContentType));
+	if (loadMimeTypes(mimeTypes)) {
+		printf("%-28s %8.1f ns\n", "hash (with mime.types)", bench(lookupContentType));
+	} else {
+		perror(mimeTypes);
+	}
+	return EXIT_SUCCESS;
+}
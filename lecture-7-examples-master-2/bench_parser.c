@@ -0,0 +1,200 @@
+/*
+ * bench_parser.c
+ *
+ * Benchmark that compares the throughput of parsing a typical
+ * browser request header with the original stream reader, which
+ * reads lines with fgets(), splits the request line with sscanf(),
+ * and copies each field with parseHeader(), and with the
+ * incremental parser, both with the whole header available at
+ * once and with the header arriving in 64-byte pieces. These
+ * results include copying the fields to request headers the way
+ * the server does; a last measurement is of the parser alone.
+ *
+ * Build and run:
+ *   gcc -std=gnu11 -O2 -o bench_parser bench_parser.c http_parser.c \
+ *       http_headers.c
+ *   ./bench_parser
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_headers.h"
+#include "http_parser.h"
+#include "http_server.h"
+
+/** number of requests parsed per measurement */
+#define BENCH_REQUESTS 1000000UL
+
+/** typical browser request header */
+static const char request[] =
+	"GET /images/northeastern.png?size=large HTTP/1.1\r\n"
+	"Host: localhost:1500\r\n"
+	"Connection: keep-alive\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/74.0 Safari/537.36\r\n"
+	"Accept: image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+	"Referer: http://localhost:1500/index.html\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"If-None-Match: \"2a1b3c-4d5e-6f70\"\r\n"
+	"If-Modified-Since: Sat, 13 Apr 2019 19:03:32 GMT\r\n"
+	"Cookie: session=0123456789abcdef; theme=dark\r\n"
+	"\r\n";
+
+/** length of the request header */
+#define REQUEST_LEN (sizeof request - 1)
+
+/**
+ * Parse the request with the original stream reader.
+ *
+ * @param headers the request headers
+ * @return true if parsed
+ */
+static bool parseWithStream(http_headers *headers) {
+	char buf[MAXBUF];
+	char method[MAXBUF];
+	char uri[MAXBUF];
+	char version[MAXBUF];
+
+	FILE *istream = fmemopen((void *)request, REQUEST_LEN, "r");
+	if (fgets(buf, MAXBUF, istream) == NULL) {
+		fclose(istream);
+		return false;
+	}
+	bool parsed = (sscanf(buf, "%s %s %s", method, uri, version) == 3);
+	while (fgets(buf, MAXBUF, istream) != NULL) {
+		buf[strcspn(buf, CRLF)] = '\0';
+		if (strlen(buf) == 0) {
+			break;
+		}
+		parseHeader(buf, headers);
+	}
+	fclose(istream);
+	return parsed;
+}
+
+/**
+ * Parse the request with the incremental parser.
+ *
+ * @param headers the request headers
+ * @param step the number of bytes that arrive at a time
+ * @return true if parsed
+ */
+static bool parseIncrementally(http_headers *headers, size_t step) {
+	static char buf[REQUEST_BUFFER];
+	memcpy(buf, request, REQUEST_LEN);
+
+	http_parser parser;
+	initParser(&parser, NULL);
+	parse_status status = PARSE_INCOMPLETE;
+	for (size_t n = 0; n < REQUEST_LEN && status == PARSE_INCOMPLETE; ) {
+		n = (REQUEST_LEN - n < step) ? REQUEST_LEN : n + step;
+		status = parseRequest(&parser, buf, n);
+	}
+	if (status != PARSE_COMPLETE) {
+		return false;
+	}
+	getRequestHeaders(&parser, headers);
+	return true;
+}
+
+/**
+ * Parse the request with the incremental parser all at once.
+ *
+ * @param headers the request headers
+ * @return true if parsed
+ */
+static bool parseWhole(http_headers *headers) {
+	return parseIncrementally(headers, REQUEST_LEN);
+}
+
+/**
+ * Parse the request with the incremental parser in 64-byte pieces.
+ *
+ * @param headers the request headers
+ * @return true if parsed
+ */
+static bool parsePieces(http_headers *headers) {
+	return parseIncrementally(headers, 64);
+}
+
+/**
+ * Measure the time to parse the request.
+ *
+ * @param parse the parse function
+ * @return the average time in nanoseconds
+ */
+static double bench(bool (*parse)(http_headers *headers)) {
+	struct timespec start, end;
+	unsigned long failed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < BENCH_REQUESTS; i++) {
+		http_headers headers;
+		initHeaders(&headers);
+		if (!parse(&headers) || getHeader(&headers, "Cookie") == NULL) {
+			failed++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (failed > 0) {
+		fprintf(stderr, "%lu requests not parsed\n", failed);
+	}
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	return ns / BENCH_REQUESTS;
+}
+
+/**
+ * Measure the time for the incremental parser alone to parse
+ * the whole request, without copying fields to request headers.
+ *
+ * @return the average time in nanoseconds
+ */
+static double benchParseOnly(void) {
+	static char buf[REQUEST_BUFFER];
+	struct timespec start, end;
+	unsigned long failed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < BENCH_REQUESTS; i++) {
+		memcpy(buf, request, REQUEST_LEN);
+		http_parser parser;
+		initParser(&parser, NULL);
+		if (parseRequest(&parser, buf, REQUEST_LEN) != PARSE_COMPLETE || parser.nfields != 10) {
+			failed++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (failed > 0) {
+		fprintf(stderr, "%lu requests not parsed\n", failed);
+	}
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	return ns / BENCH_REQUESTS;
+}
+
+/**
+ * Print a measurement.
+ *
+ * @param name the name of the measurement
+ * @param ns the average time in nanoseconds
+ */
+static void report(const char *name, double ns) {
+	printf("%-28s %8.1f ns %10.0f req/s %8.1f MB/s\n", name, ns, 1e9 / ns, REQUEST_LEN * 1e3 / ns);
+}
+
+/**
+ * Main program runs the benchmark.
+ */
+int main(void) {
+	printf("request header of %zu bytes\n", REQUEST_LEN);
+	report("stream (fgets/sscanf)", bench(parseWithStream));
+	report("incremental (whole)", bench(parseWhole));
+	report("incremental (64-byte)", bench(parsePieces));
+	report("incremental (parse only)", benchParseOnly());
+	return EXIT_SUCCESS;
+}
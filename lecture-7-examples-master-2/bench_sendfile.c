@@ -0,0 +1,156 @@
+/*
+ * bench_sendfile.c
+ *
+ * Benchmark that compares the throughput of sending file content
+ * to a socket byte by byte through stdio (the original response
+ * body path), in large blocks through stdio (sendResponseBytes),
+ * and with the zero-copy path (sendResponseFile) for 1 KB, 1 MB,
+ * and 100 MB files. A reader thread drains the other end of a
+ * socket pair so only the sending side is measured.
+ *
+ * Build and run:
+ *   gcc -std=gnu11 -O2 -o bench_sendfile bench_sendfile.c \
+ *       http_util.c http_headers.c mime_types.c -lpthread
+ *   ./bench_sendfile [directory for temporary files]
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "http_server.h"
+#include "http_util.h"
+
+/** debug flag */
+const bool debug = false;
+
+/** subdirectory of application home directory for web content */
+const char *CONTENT_BASE = "content";
+
+/** minimum bytes to send per measurement */
+#define MIN_BENCH_BYTES (64UL * 1024 * 1024)
+
+/**
+ * Reader thread function drains bytes from a socket until
+ * the other end is closed.
+ *
+ * @param arg pointer-encoded socket descriptor
+ * @return NULL (unused)
+ */
+static void *drain(void *arg) {
+	int fd = (int)((char*)arg - (char*)0);
+	char buf[COPY_BLOCK_SIZE];
+	while (read(fd, buf, sizeof buf) > 0) {
+		continue;
+	}
+	return NULL;
+}
+
+/**
+ * Get current monotonic time in seconds.
+ *
+ * @return the time in seconds
+ */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Send a file repeatedly using one body path.
+ *
+ * @param method 0: byte copy, 1: block copy, 2: zero copy
+ * @param path the content file
+ * @param size the size of the content file
+ * @return throughput in MB/s
+ */
+static double bench(int method, const char *path, unsigned long size) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	pthread_t reader;
+	pthread_create(&reader, NULL, drain, (char*)0 + sv[1]);
+
+	FILE *ostream = fdopen(sv[0], "wb");
+	FILE *contentStream = fopen(path, "rb");
+	int content_fd = fileno(contentStream);
+	unsigned long reps = (MIN_BENCH_BYTES + size - 1) / size;
+
+	double start = now();
+	for (unsigned long r = 0; r < reps; r++) {
+		switch (method) {
+		case 0:
+			rewind(contentStream);
+			for (unsigned long n = size; n > 0; n--) {
+				fputc(fgetc(contentStream), ostream);
+			}
+			break;
+		case 1:
+			rewind(contentStream);
+			sendResponseBytes(contentStream, ostream, size);
+			break;
+		case 2:
+			fflush(ostream);
+			sendResponseFile(content_fd, sv[0], 0, size);
+			break;
+		}
+	}
+	fflush(ostream);
+	double elapsed = now() - start;
+
+	fclose(ostream);
+	pthread_join(reader, NULL);
+	close(sv[1]);
+	fclose(contentStream);
+
+	return (double)reps * size / (1024 * 1024) / elapsed;
+}
+
+/**
+ * Main program creates the content files and reports
+ * throughput for each body path and file size.
+ *
+ * @param argv[1]: optional directory for temporary files (default: /tmp)
+ */
+int main(int argc, char* argv[argc]) {
+	const char *dir = (argc == 2) ? argv[1] : "/tmp";
+	const unsigned long sizes[] = { 1024UL, 1024UL * 1024, 100UL * 1024 * 1024 };
+	const char *labels[] = { "1 KB", "1 MB", "100 MB" };
+
+	printf("%-8s %14s %14s %14s\n", "size", "byte MB/s", "block MB/s", "zerocopy MB/s");
+	for (int i = 0; i < 3; i++) {
+		char path[MAXBUF];
+		snprintf(path, sizeof path, "%s/bench_sendfile_%d.dat", dir, i);
+		FILE *f = fopen(path, "wb");
+		if (f == NULL) {
+			perror(path);
+			return EXIT_FAILURE;
+		}
+		char block[COPY_BLOCK_SIZE];
+		memset(block, 'x', sizeof block);
+		for (unsigned long n = sizes[i]; n > 0; ) {
+			size_t len = (n < sizeof block) ? n : sizeof block;
+			fwrite(block, 1, len, f);
+			n -= len;
+		}
+		fclose(f);
+
+		double byte = bench(0, path, sizes[i]);
+		double blocks = bench(1, path, sizes[i]);
+		double zerocopy = bench(2, path, sizes[i]);
+		printf("%-8s %14.1f %14.1f %14.1f\n", labels[i], byte, blocks, zerocopy);
+		unlink(path);
+	}
+	return EXIT_SUCCESS;
+}
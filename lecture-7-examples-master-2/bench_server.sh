@@ -0,0 +1,176 @@
+#!/usr/bin/env bash
+#
+# bench_server.sh
+#
+# Benchmark suite for the Tiny Http Server. Builds the server and
+# the load generator, generates a content directory of small (1 KB),
+# medium (64 KB), and large (4 MB) files, and runs loadgen against
+# the thread pool and the reactor with each file size and a mix of
+# sizes, on keep-alive and on new connections. Uploads of medium and
+# large bodies are measured alongside the downloads of the same size.
+# The listeners suite instead runs small files through the reactor
+# with each listener socket option: IPv4, IPv6, a Unix domain socket,
+# TCP_NODELAY, TCP_DEFER_ACCEPT, TCP Fast Open, and a short backlog.
+#
+# Usage:
+#   ./bench_server.sh [suite ...]    suites: pool reactor listeners (default: pool reactor)
+#
+# Environment:
+#   DURATION     seconds per run (default: 10)
+#   CONNECTIONS  concurrent connections (default: 64)
+#   THREADS      loadgen threads (default: 4)
+#   POOL_THREADS server worker threads (default: 8)
+#   PORT         server port (default: 1599)
+#
+#  @since 2019-04-10
+#  @author: Philip Gust
+
+set -euo pipefail
+
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-4}
+POOL_THREADS=${POOL_THREADS:-8}
+PORT=${PORT:-1599}
+if [ $# -gt 0 ]; then
+	ENGINES=("$@")
+else
+	ENGINES=(pool reactor)
+fi
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+SERVER_PID=
+
+# stop the server and remove the work directory on exit
+cleanup() {
+	if [ -n "$SERVER_PID" ]; then
+		kill "$SERVER_PID" 2>/dev/null || true
+		wait "$SERVER_PID" 2>/dev/null || true
+	fi
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# build server and load generator
+build() {
+	local sources
+	sources=$(cd "$SRC" && ls *.c | grep -v '^bench_\|^fuzz_\|^loadgen')
+	(cd "$SRC" && gcc -std=gnu11 -O2 -o "$WORK/http_server" $sources -lpthread -lz)
+	gcc -std=gnu11 -O2 -o "$WORK/loadgen" "$SRC/loadgen.c" -lpthread
+}
+
+# make count files of a size in a content subdirectory and list their URIs
+make_files() {
+	local dir=$1 size=$2 count=$3
+	mkdir -p "$WORK/content/$dir"
+	for i in $(seq 1 "$count"); do
+		head -c "$size" /dev/urandom > "$WORK/content/$dir/$i.bin"
+		echo "/$dir/$i.bin"
+	done > "$WORK/$dir.uris"
+}
+
+# generate content and URI mixes
+make_content() {
+	make_files small 1024 100
+	make_files medium 65536 20
+	make_files large 4194304 4
+
+	# mix of mostly small requests, like a page with its resources
+	{
+		cat "$WORK/small.uris" "$WORK/small.uris" "$WORK/small.uris"
+		cat "$WORK/medium.uris"
+		head -n 1 "$WORK/large.uris"
+	} > "$WORK/mix.uris"
+
+	# upload targets, replaced by each PUT
+	mkdir -p "$WORK/uploads"
+	seq -f "/%g.bin" 1 16 > "$WORK/upload.uris"
+}
+
+# start the server with an engine and listener flags, and wait until
+# it accepts connections from loadgen with its connection flags
+start_server() {
+	local engine=$1 listener_flags=${2:-} client_flags=${3:-}
+	local flags=(-t "$POOL_THREADS" -u uploads)
+	if [ "$engine" = reactor ]; then
+		flags=(-e -u uploads)
+	fi
+	# shellcheck disable=SC2086
+	(cd "$WORK" && exec ./http_server "${flags[@]}" $listener_flags "$PORT") 2>"$WORK/server.log" &
+	SERVER_PID=$!
+	for _ in $(seq 1 50); do
+		# shellcheck disable=SC2086
+		if "$WORK/loadgen" -n 1 -c 1 $client_flags "$PORT" /small/1.bin >/dev/null 2>&1; then
+			return
+		fi
+		sleep 0.1
+	done
+	echo "server did not start" >&2
+	cat "$WORK/server.log" >&2
+	exit 1
+}
+
+# stop the server
+stop_server() {
+	kill "$SERVER_PID"
+	wait "$SERVER_PID" 2>/dev/null || true
+	SERVER_PID=
+}
+
+# run loadgen with a URI mix
+run() {
+	local title=$1 mix=$2
+	shift 2
+	echo "== $title"
+	"$WORK/loadgen" -c "$CONNECTIONS" -t "$THREADS" -d "$DURATION" "$@" \
+		-f "$WORK/$mix.uris" "$PORT"
+	echo
+}
+
+build
+make_content
+echo "duration ${DURATION}s, ${CONNECTIONS} connections, ${THREADS} loadgen threads"
+echo
+
+# listener options: name, server flags, loadgen flags
+LISTENERS=(
+	"ipv4|-a 0.0.0.0|"
+	"ipv6 dual-stack||-h ::1"
+	"unix socket|-U $WORK/http.sock|-U $WORK/http.sock"
+	"tcp_nodelay|-n|"
+	"defer accept|-d 1|"
+	"fast open|-f 256|-F"
+	"backlog 16|-b 16|"
+)
+
+# run small files with each listener option
+run_listeners() {
+	local entry name listener_flags client_flags
+	for entry in "${LISTENERS[@]}"; do
+		IFS='|' read -r name listener_flags client_flags <<< "$entry"
+		start_server reactor "$listener_flags" "$client_flags"
+		# shellcheck disable=SC2086
+		run "listener $name: small files, keep-alive" small -k $client_flags
+		# shellcheck disable=SC2086
+		run "listener $name: small files, new connections" small $client_flags
+		stop_server
+	done
+}
+
+for engine in "${ENGINES[@]}"; do
+	case "$engine" in
+	pool|reactor) ;;
+	listeners) run_listeners; continue ;;
+	*) echo "unknown suite $engine" >&2; exit 1 ;;
+	esac
+	start_server "$engine"
+	run "$engine: small files, keep-alive" small -k
+	run "$engine: small files, new connections" small
+	run "$engine: medium files, keep-alive" medium -k
+	run "$engine: medium uploads, keep-alive" upload -k -P 65536
+	run "$engine: large files, keep-alive" large -k
+	run "$engine: large uploads, keep-alive" upload -k -P 4194304
+	run "$engine: mix, keep-alive" mix -k
+	stop_server
+done
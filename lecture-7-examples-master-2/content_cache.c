@@ -0,0 +1,366 @@
+/*
+ * content_cache.c
+ *
+ * Bounded in-memory cache of static content keyed by resolved
+ * file path and content coding. Entries are found through a hash
+ * table and kept on a recency list so the least recently used
+ * entries can be evicted. An entry is reference counted so it
+ * can be evicted or replaced while a request is still sending it.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "content_cache.h"
+#include "http_util.h"
+
+/** monitor for cache state */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** hash buckets of cached entries */
+static content_entry *buckets[CACHE_BUCKETS];
+
+/** recency list, most recently used first */
+static content_entry *lru_head = NULL, *lru_tail = NULL;
+
+/** cache counters */
+static content_cache_stats stats = { .capacity = (size_t)DEFAULT_CACHE_MB * 1024 * 1024 };
+
+/**
+ * Compute bucket for a file path using FNV-1a hash.
+ *
+ * @param path the file path
+ * @return the bucket index
+ */
+static unsigned bucketOf(const char path[]) {
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)path; *p != '\0'; p++) {
+		hash = (hash ^ *p) * 16777619u;
+	}
+	return hash % CACHE_BUCKETS;
+}
+
+/**
+ * Determine whether entry still matches its file.
+ *
+ * @param entry the entry
+ * @param sb the current file status
+ * @return true if entry is current
+ */
+static bool isCurrent(const content_entry *entry, const struct stat *sb) {
+	return entry->sb.st_mtime == sb->st_mtime
+#ifdef __linux__
+		&& entry->sb.st_mtim.tv_nsec == sb->st_mtim.tv_nsec  // changes within a second
+#endif
+		&& entry->sb.st_size == sb->st_size
+		&& entry->sb.st_ino == sb->st_ino
+		&& entry->sb.st_dev == sb->st_dev;
+}
+
+/**
+ * Free an entry.
+ *
+ * @param entry the entry
+ */
+static void freeEntry(content_entry *entry) {
+	free(entry->header);
+	free(entry->body);
+	free(entry);
+}
+
+/**
+ * Remove entry from the recency list.
+ * Must be called with cache lock held.
+ *
+ * @param entry the entry
+ */
+static void unlinkRecent(content_entry *entry) {
+	if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next; else lru_head = entry->lru_next;
+	if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev; else lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * Add entry to the front of the recency list.
+ * Must be called with cache lock held.
+ *
+ * @param entry the entry
+ */
+static void linkRecent(content_entry *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+	if (lru_head != NULL) lru_head->lru_prev = entry; else lru_tail = entry;
+	lru_head = entry;
+}
+
+/**
+ * Remove entry from the cache and drop the cache's reference.
+ * Must be called with cache lock held.
+ *
+ * @param entry the entry
+ */
+static void removeEntry(content_entry *entry) {
+	content_entry **pp = &buckets[bucketOf(entry->path)];
+	while (*pp != entry) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = entry->hash_next;
+	unlinkRecent(entry);
+
+	stats.entries--;
+	stats.bytes -= entry->size;
+	if (--entry->refcount == 0) {
+		freeEntry(entry);
+	}
+}
+
+/**
+ * Find cached entry for a file path and content coding.
+ * Must be called with cache lock held.
+ *
+ * @param path the file path
+ * @param encoding the content coding, or "" if none
+ * @return the entry or NULL if not cached
+ */
+static content_entry *findEntry(const char path[], const char encoding[]) {
+	for (content_entry *entry = buckets[bucketOf(path)]; entry != NULL; entry = entry->hash_next) {
+		if (strcmp(entry->path, path) == 0 && strcmp(entry->encoding, encoding) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Evict least recently used entries until cache is within capacity.
+ * Must be called with cache lock held.
+ */
+static void evictEntries(void) {
+	while (stats.bytes > stats.capacity && lru_tail != NULL) {
+		removeEntry(lru_tail);
+		stats.evictions++;
+	}
+}
+
+/**
+ * Set capacity of the content cache. A capacity of 0
+ * disables the cache.
+ *
+ * @param capacity the maximum number of bytes to cache
+ */
+void setContentCacheCapacity(size_t capacity) {
+	pthread_mutex_lock(&cache_lock);  // lock cache monitor
+		stats.capacity = capacity;
+		evictEntries();
+	pthread_mutex_unlock(&cache_lock);  // unlock cache monitor
+}
+
+/**
+ * Look up current content for a file path. The file is checked
+ * with stat() and a stale entry is discarded.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding, or NULL for the file content
+ * @return the entry, which must be released, or NULL if not cached
+ */
+content_entry *getCachedContent(const char path[], const char encoding[]) {
+	struct stat sb;
+	bool exists = statContent(path, &sb);
+
+	content_entry *entry;
+	pthread_mutex_lock(&cache_lock);  // lock cache monitor
+		entry = findEntry(path, (encoding != NULL) ? encoding : "");
+		if (entry != NULL && (!exists || !isCurrent(entry, &sb))) {
+			removeEntry(entry);  // file changed or removed
+			entry = NULL;
+		}
+		if (entry != NULL) {
+			entry->refcount++;
+			unlinkRecent(entry);
+			linkRecent(entry);
+			stats.hits++;
+		} else {
+			stats.misses++;
+		}
+	pthread_mutex_unlock(&cache_lock);  // unlock cache monitor
+
+	return entry;
+}
+
+/**
+ * Test whether content for a file path is in the cache, without
+ * checking the file or counting a lookup. The entry may be stale
+ * or be evicted before it is looked up.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding, or NULL for the file content
+ * @param size set to the number of content bytes if cached
+ * @return true if the content is cached
+ */
+bool isContentCached(const char path[], const char encoding[], size_t *size) {
+	pthread_mutex_lock(&cache_lock);  // lock cache monitor
+		content_entry *entry = findEntry(path, (encoding != NULL) ? encoding : "");
+		if (entry != NULL) {
+			*size = entry->size;
+		}
+	pthread_mutex_unlock(&cache_lock);  // unlock cache monitor
+	return entry != NULL;
+}
+
+/**
+ * Allocate an entry for content of a file.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding, or NULL if none
+ * @param sb the status of the file
+ * @param size the number of content bytes
+ * @param header the pre-rendered content response properties
+ * @return the entry without content bytes, or NULL if not cacheable
+ */
+static content_entry *newEntry(const char path[], const char encoding[],
+							   const struct stat *sb, size_t size, const char header[]) {
+	if (encoding == NULL) {
+		encoding = "";
+	}
+	if (!(S_ISREG(sb->st_mode) || S_ISDIR(sb->st_mode)) || size > CACHE_MAX_ENTRY || size > stats.capacity
+			|| strlen(path) >= MAXBUF || strlen(encoding) >= MAX_ENCODING) {
+		return NULL;
+	}
+
+	content_entry *entry = calloc(1, sizeof(content_entry));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->header = strdup(header);
+	if (entry->header == NULL) {
+		freeEntry(entry);
+		return NULL;
+	}
+	strcpy(entry->path, path);
+	strcpy(entry->encoding, encoding);
+	entry->size = size;
+	entry->sb = *sb;
+	entry->refcount = 2;  // one for cache, one for caller
+	return entry;
+}
+
+/**
+ * Add entry to the cache, replacing any entry for the same
+ * file path and content coding.
+ *
+ * @param entry the entry
+ * @return the entry
+ */
+static content_entry *addEntry(content_entry *entry) {
+	pthread_mutex_lock(&cache_lock);  // lock cache monitor
+		content_entry *old = findEntry(entry->path, entry->encoding);
+		if (old != NULL) {
+			removeEntry(old);  // replaced by newer load
+		}
+		unsigned bucket = bucketOf(entry->path);
+		entry->hash_next = buckets[bucket];
+		buckets[bucket] = entry;
+		linkRecent(entry);
+		stats.entries++;
+		stats.bytes += entry->size;
+		evictEntries();
+	pthread_mutex_unlock(&cache_lock);  // unlock cache monitor
+
+	return entry;
+}
+
+/**
+ * Load content of an open file into the cache.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding of the file, or NULL if none
+ * @param fd the open content file
+ * @param sb the status of the content file
+ * @param header the pre-rendered content response properties
+ * @return the entry, which must be released, or NULL if not cacheable
+ */
+content_entry *putCachedContent(const char path[], const char encoding[], int fd,
+								const struct stat *sb, const char header[]) {
+	size_t size = (size_t)sb->st_size;
+	content_entry *entry = newEntry(path, encoding, sb, size, header);
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->body = malloc(size > 0 ? size : 1);
+	if (entry->body == NULL) {
+		freeEntry(entry);
+		return NULL;
+	}
+
+	// read content outside the lock
+	for (size_t nread = 0; nread < size; ) {
+		ssize_t n = pread(fd, entry->body + nread, size - nread, nread);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			freeEntry(entry);
+			return NULL;
+		}
+		nread += n;
+	}
+	return addEntry(entry);
+}
+
+/**
+ * Add encoded content of a file to the cache. The cache takes
+ * ownership of the encoded bytes, which are freed if not cached.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding
+ * @param sb the status of the file that was encoded
+ * @param body the malloc'd encoded bytes
+ * @param size the number of encoded bytes
+ * @param header the pre-rendered content response properties
+ * @return the entry, which must be released, or NULL if not cacheable
+ */
+content_entry *putEncodedContent(const char path[], const char encoding[],
+								 const struct stat *sb, char *body, size_t size,
+								 const char header[]) {
+	content_entry *entry = newEntry(path, encoding, sb, size, header);
+	if (entry == NULL) {
+		free(body);
+		return NULL;
+	}
+	entry->body = body;
+	return addEntry(entry);
+}
+
+/**
+ * Release a reference to a cache entry.
+ *
+ * @param entry the entry
+ */
+void releaseCachedContent(content_entry *entry) {
+	bool unused;
+	pthread_mutex_lock(&cache_lock);  // lock cache monitor
+		unused = (--entry->refcount == 0);
+	pthread_mutex_unlock(&cache_lock);  // unlock cache monitor
+
+	if (unused) {
+		freeEntry(entry);
+	}
+}
+
+/**
+ * Get current cache counters.
+ *
+ * @param current the counters
+ */
+void getContentCacheStats(content_cache_stats *current) {
+	pthread_mutex_lock(&cache_lock);  // lock cache monitor
+		*current = stats;
+	pthread_mutex_unlock(&cache_lock);  // unlock cache monitor
+}
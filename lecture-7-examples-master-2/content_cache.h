@@ -0,0 +1,137 @@
+/*
+ * content_cache.h
+ *
+ * Bounded in-memory cache of static content keyed by resolved
+ * file path and content coding. Each entry holds the pre-rendered
+ * content response properties, the content bytes, and the file
+ * status. Entries are revalidated against the file with stat()
+ * on every lookup and the least recently used entries are evicted
+ * when the cache is full. Rendered directory listings are cached
+ * the same way, keyed by directory path with the listing format
+ * and page in place of the content coding, and revalidated
+ * against the directory.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef CONTENT_CACHE_H_
+#define CONTENT_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "http_server.h"
+
+/** default cache capacity in megabytes */
+#define DEFAULT_CACHE_MB 64
+
+/** largest file that is cached */
+#define CACHE_MAX_ENTRY (1024 * 1024)
+
+/** number of hash buckets */
+#define CACHE_BUCKETS 4096
+
+/** maximum length of a content coding name */
+#define MAX_ENCODING 16
+
+/** A cached content file */
+typedef struct content_entry {
+	char path[MAXBUF];		// resolved file path
+	char encoding[MAX_ENCODING];	// content coding of body, or "" if none
+	char *header;			// pre-rendered content response properties
+	char *body;				// content bytes
+	size_t size;			// number of content bytes
+	struct stat sb;			// file status when loaded
+	int refcount;			// references held by cache and requests
+	struct content_entry *lru_prev, *lru_next;	// recency list, newest first
+	struct content_entry *hash_next;	// next entry in bucket
+} content_entry;
+
+/** Cache counters */
+typedef struct {
+	unsigned long hits;			// lookups served from cache
+	unsigned long misses;		// lookups not in cache or stale
+	unsigned long evictions;	// entries evicted to make room
+	unsigned long entries;		// entries currently cached
+	size_t bytes;				// bytes currently cached
+	size_t capacity;			// maximum bytes cached
+} content_cache_stats;
+
+/**
+ * Set capacity of the content cache. A capacity of 0
+ * disables the cache.
+ *
+ * @param capacity the maximum number of bytes to cache
+ */
+void setContentCacheCapacity(size_t capacity);
+
+/**
+ * Look up current content for a file path. The file is checked
+ * with stat() and a stale entry is discarded.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding, or NULL for the file content
+ * @return the entry, which must be released, or NULL if not cached
+ */
+content_entry *getCachedContent(const char path[], const char encoding[]);
+
+/**
+ * Test whether content for a file path is in the cache, without
+ * checking the file or counting a lookup. The entry may be stale
+ * or be evicted before it is looked up.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding, or NULL for the file content
+ * @param size set to the number of content bytes if cached
+ * @return true if the content is cached
+ */
+bool isContentCached(const char path[], const char encoding[], size_t *size);
+
+/**
+ * Load content of an open file into the cache.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding of the file, or NULL if none
+ * @param fd the open content file
+ * @param sb the status of the content file
+ * @param header the pre-rendered content response properties
+ * @return the entry, which must be released, or NULL if not cacheable
+ */
+content_entry *putCachedContent(const char path[], const char encoding[], int fd,
+								const struct stat *sb, const char header[]);
+
+/**
+ * Add encoded content of a file to the cache. The cache takes
+ * ownership of the encoded bytes, which are freed if not cached.
+ *
+ * @param path the file path relative to the content root
+ * @param encoding the content coding
+ * @param sb the status of the file that was encoded
+ * @param body the malloc'd encoded bytes
+ * @param size the number of encoded bytes
+ * @param header the pre-rendered content response properties
+ * @return the entry, which must be released, or NULL if not cacheable
+ */
+content_entry *putEncodedContent(const char path[], const char encoding[],
+								 const struct stat *sb, char *body, size_t size,
+								 const char header[]);
+
+/**
+ * Release a reference to a cache entry.
+ *
+ * @param entry the entry
+ */
+void releaseCachedContent(content_entry *entry);
+
+/**
+ * Get current cache counters.
+ *
+ * @param current the counters
+ */
+void getContentCacheStats(content_cache_stats *current);
+
+#endif /* CONTENT_CACHE_H_ */
@@ -0,0 +1,413 @@
+/*
+ * dir_index.c
+ *
+ * Directory listings rendered as HTML or JSON. Entries are read
+ * with getdents64() into a fixed buffer, one chunk at a time, and
+ * only the entries on the requested page are looked up with
+ * fstatat() and rendered, so the cost of a page does not grow with
+ * the size of the directory beyond skipping the earlier entries.
+ * A listing is written one entry at a time, so it can be sent as
+ * it is rendered.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+#define _GNU_SOURCE  // for open_memstream()
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "dir_index.h"
+
+#ifdef __linux__
+/** Directory entry returned by getdents64() */
+struct linux_dirent64 {
+	ino_t d_ino;				// inode number
+	off_t d_off;				// offset of next entry
+	unsigned short d_reclen;	// length of this entry
+	unsigned char d_type;		// file type
+	char d_name[];				// NUL-terminated name
+};
+#endif
+
+/** Reader of directory entries */
+typedef struct {
+#ifdef __linux__
+	int fd;						// the directory
+	size_t len;					// bytes of entries in buffer
+	size_t pos;					// offset of next entry in buffer
+	char buf[INDEX_READ_BUFFER] __attribute__((aligned(8)));	// entries read
+#else
+	DIR *dir;					// the directory stream
+#endif
+} dir_reader;
+
+/**
+ * Start reading entries of a directory.
+ *
+ * @param reader the reader
+ * @param dir_fd the open directory
+ * @return true if the directory can be read
+ */
+static bool openReader(dir_reader *reader, int dir_fd) {
+#ifdef __linux__
+	reader->fd = dir_fd;
+	reader->len = reader->pos = 0;
+	return true;
+#else
+	int fd = dup(dir_fd);
+	reader->dir = (fd >= 0) ? fdopendir(fd) : NULL;
+	if (reader->dir == NULL && fd >= 0) {
+		close(fd);
+	}
+	return reader->dir != NULL;
+#endif
+}
+
+/**
+ * Stop reading entries of a directory.
+ *
+ * @param reader the reader
+ */
+static void closeReader(dir_reader *reader) {
+#ifndef __linux__
+	closedir(reader->dir);
+#else
+	(void)reader;
+#endif
+}
+
+/**
+ * Get the next entry of a directory other than "." and "..".
+ *
+ * @param reader the reader
+ * @return the entry name, or NULL at the end of the directory or on error
+ */
+static const char *nextEntry(dir_reader *reader) {
+	while (true) {
+#ifdef __linux__
+		if (reader->pos >= reader->len) {
+			long n = syscall(SYS_getdents64, reader->fd, reader->buf, sizeof reader->buf);
+			if (n <= 0) {
+				return NULL;
+			}
+			reader->len = (size_t)n;
+			reader->pos = 0;
+		}
+		struct linux_dirent64 *d = (struct linux_dirent64 *)(reader->buf + reader->pos);
+		reader->pos += d->d_reclen;
+		const char *name = d->d_name;
+#else
+		struct dirent *d = readdir(reader->dir);
+		if (d == NULL) {
+			return NULL;
+		}
+		const char *name = d->d_name;
+#endif
+		if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+			return name;
+		}
+	}
+}
+
+/**
+ * Write text escaped for HTML.
+ *
+ * @param out the output stream
+ * @param text the text
+ */
+static void writeHtml(FILE *out, const char text[]) {
+	for (const char *p = text; *p != '\0'; p++) {
+		switch (*p) {
+		case '&': fputs("&amp;", out); break;
+		case '<': fputs("&lt;", out); break;
+		case '>': fputs("&gt;", out); break;
+		case '"': fputs("&quot;", out); break;
+		case '\'': fputs("&#39;", out); break;
+		default: fputc(*p, out);
+		}
+	}
+}
+
+/**
+ * Write a file name percent-encoded for use as a URI path segment.
+ *
+ * @param out the output stream
+ * @param name the file name
+ */
+static void writeUriSegment(FILE *out, const char name[]) {
+	for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+		if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')
+				|| *p == '-' || *p == '.' || *p == '_' || *p == '~') {
+			fputc(*p, out);
+		} else {
+			fprintf(out, "%%%02X", *p);
+		}
+	}
+}
+
+/**
+ * Write text as a JSON string.
+ *
+ * @param out the output stream
+ * @param text the text
+ */
+static void writeJson(FILE *out, const char text[]) {
+	fputc('"', out);
+	for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			fprintf(out, "\\%c", *p);
+		} else if (*p < ' ') {
+			fprintf(out, "\\u%04x", *p);
+		} else {
+			fputc(*p, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/**
+ * Get the name of the type of a file.
+ *
+ * @param mode the file mode
+ * @return "file", "dir", "link", or "other"
+ */
+static const char *typeName(mode_t mode) {
+	if (S_ISREG(mode)) return "file";
+	if (S_ISDIR(mode)) return "dir";
+	if (S_ISLNK(mode)) return "link";
+	return "other";
+}
+
+/**
+ * Write one entry of an HTML listing.
+ *
+ * @param out the output stream
+ * @param name the entry name
+ * @param sb the entry status, or NULL if not available
+ */
+static void writeHtmlEntry(FILE *out, const char name[], const struct stat *sb) {
+	const char *slash = (sb != NULL && S_ISDIR(sb->st_mode)) ? "/" : "";
+	fputs("<tr><td><a href=\"", out);
+	writeUriSegment(out, name);
+	fprintf(out, "%s\">", slash);
+	writeHtml(out, name);
+	fprintf(out, "%s</a></td>", slash);
+	if (sb == NULL) {
+		fputs("<td></td><td></td></tr>\n", out);
+		return;
+	}
+	if (S_ISREG(sb->st_mode)) {
+		fprintf(out, "<td>%lld</td>", (long long)sb->st_size);
+	} else {
+		fputs("<td>-</td>", out);
+	}
+	char modified[64];
+	struct tm tm;
+	strftime(modified, sizeof modified, "%Y-%m-%d %H:%M", gmtime_r(&sb->st_mtime, &tm));
+	fprintf(out, "<td>%s</td></tr>\n", modified);
+}
+
+/**
+ * Write one entry of a JSON listing.
+ *
+ * @param out the output stream
+ * @param name the entry name
+ * @param sb the entry status, or NULL if not available
+ * @param first true for the first entry on the page
+ */
+static void writeJsonEntry(FILE *out, const char name[], const struct stat *sb, bool first) {
+	fputs(first ? "\n{\"name\":" : ",\n{\"name\":", out);
+	writeJson(out, name);
+	if (sb != NULL) {
+		fprintf(out, ",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld", typeName(sb->st_mode),
+				(long long)sb->st_size, (long long)sb->st_mtime);
+	}
+	fputc('}', out);
+}
+
+/** Parts of a listing written in order */
+enum {
+	LISTING_HEAD,		// title and table header
+	LISTING_ENTRIES,	// entries on the page
+	LISTING_FOOT,		// links to other pages
+	LISTING_DONE
+};
+
+/** Listing being written a part at a time */
+struct dir_listing {
+	int dir_fd;				// the directory
+	char path[PATH_MAX];	// URI path of the directory
+	int page;				// page number
+	bool json;				// render JSON instead of HTML
+	int part;				// next part to write
+	int count;				// entries written
+	const char *name;		// next entry, or NULL at end of directory
+	dir_reader reader;		// reader of directory entries
+};
+
+/**
+ * Start a listing of one page of a directory. Entries are listed
+ * in the order the file system returns them, which is stable while
+ * the directory is unchanged, so pages can be rendered separately.
+ *
+ * @param dir_fd the open directory, read from its current offset;
+ *   closed when the listing is closed
+ * @param path the URI path of the directory, ending in "/"
+ * @param page the page number, starting at 1
+ * @param json true to render JSON, false to render HTML
+ * @return the listing, or NULL on error, when dir_fd is closed
+ */
+dir_listing *openDirectoryListing(int dir_fd, const char path[], int page, bool json) {
+	dir_listing *listing = malloc(sizeof(dir_listing));
+	if (listing == NULL || !openReader(&listing->reader, dir_fd)) {
+		free(listing);
+		close(dir_fd);
+		return NULL;
+	}
+	listing->dir_fd = dir_fd;
+	snprintf(listing->path, sizeof listing->path, "%s", path);
+	listing->page = page;
+	listing->json = json;
+	listing->part = LISTING_HEAD;
+	listing->count = 0;
+	listing->name = NULL;
+	return listing;
+}
+
+/**
+ * Write the next part of a listing: the head, one entry, or the
+ * foot. Each entry is looked up with fstatat() only as it is
+ * written.
+ *
+ * @param listing the listing
+ * @param out the output stream
+ * @return 1 if more parts follow, 0 after the last part
+ */
+int writeDirectoryListing(dir_listing *listing, FILE *out) {
+	switch (listing->part) {
+	case LISTING_HEAD: {
+		const char *path = listing->path;
+		if (listing->json) {
+			fputs("{\"path\":", out);
+			writeJson(out, path);
+			fprintf(out, ",\"page\":%d,\"entries\":[", listing->page);
+		} else {
+			fputs("<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ", out);
+			writeHtml(out, path);
+			fputs("</title></head>\n<body><h1>Index of ", out);
+			writeHtml(out, path);
+			fputs("</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Last modified (GMT)</th></tr>\n", out);
+			if (strcmp(path, "/") != 0) {
+				fputs("<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n", out);
+			}
+		}
+
+		// skip entries on earlier pages without looking them up
+		unsigned long skip = (unsigned long)(listing->page - 1) * INDEX_PAGE_ENTRIES;
+		for (unsigned long n = 0; n <= skip && (listing->name = nextEntry(&listing->reader)) != NULL; n++) {
+			continue;
+		}
+		listing->part = LISTING_ENTRIES;
+		return 1;
+	}
+	case LISTING_ENTRIES:
+		if (listing->name != NULL && listing->count < INDEX_PAGE_ENTRIES) {
+			const char *name = listing->name;
+			struct stat sb;
+			bool found = (fstatat(listing->dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0);
+			if (listing->json) {
+				writeJsonEntry(out, name, found ? &sb : NULL, listing->count == 0);
+			} else {
+				writeHtmlEntry(out, name, found ? &sb : NULL);
+			}
+			listing->count++;
+			listing->name = nextEntry(&listing->reader);
+			return 1;
+		}
+		listing->part = LISTING_FOOT;
+		// fall through
+	case LISTING_FOOT: {
+		bool more = (listing->name != NULL);  // an entry remains for the next page
+		int page = listing->page;
+		if (listing->json) {
+			fputs("\n],\"next\":", out);
+			if (more) {
+				fprintf(out, "%d}\n", page + 1);
+			} else {
+				fputs("null}\n", out);
+			}
+		} else {
+			fputs("</table>\n<p>", out);
+			if (page > 1) {
+				fprintf(out, "<a href=\"?page=%d\">Previous</a> ", page - 1);
+			}
+			if (more) {
+				fprintf(out, "<a href=\"?page=%d\">Next</a>", page + 1);
+			}
+			fputs("</p>\n</body></html>\n", out);
+		}
+		listing->part = LISTING_DONE;
+		return 0;
+	}
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Close a listing and its directory.
+ *
+ * @param listing the listing, or NULL
+ */
+void closeDirectoryListing(dir_listing *listing) {
+	if (listing == NULL) {
+		return;
+	}
+	closeReader(&listing->reader);
+	close(listing->dir_fd);
+	free(listing);
+}
+
+/**
+ * Render one page of a directory listing in full.
+ *
+ * @param dir_fd the open directory, read from its current offset;
+ *   closed when the listing is rendered
+ * @param path the URI path of the directory, ending in "/"
+ * @param page the page number, starting at 1
+ * @param json true to render JSON, false to render HTML
+ * @param len set to the length of the listing
+ * @return the malloc'd listing, or NULL on error
+ */
+char *renderDirectoryIndex(int dir_fd, const char path[], int page, bool json, size_t *len) {
+	dir_listing *listing = openDirectoryListing(dir_fd, path, page, json);
+	if (listing == NULL) {
+		return NULL;
+	}
+	char *rendered = NULL;
+	FILE *out = open_memstream(&rendered, len);
+	if (out == NULL) {
+		closeDirectoryListing(listing);
+		return NULL;
+	}
+	while (writeDirectoryListing(listing, out) > 0) {
+		continue;
+	}
+	closeDirectoryListing(listing);
+	if (fclose(out) != 0) {
+		free(rendered);
+		return NULL;
+	}
+	return rendered;
+}
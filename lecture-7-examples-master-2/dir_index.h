@@ -0,0 +1,73 @@
+/*
+ * dir_index.h
+ *
+ * Directory listings rendered as HTML or JSON. A listing is
+ * divided into pages so that a directory with tens of thousands
+ * of entries is read in chunks and never held in memory whole.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef DIR_INDEX_H_
+#define DIR_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/** number of entries on a page of a directory listing */
+#define INDEX_PAGE_ENTRIES 1000
+
+/** size of buffer for reading directory entries */
+#define INDEX_READ_BUFFER 32768
+
+/** Listing of one page of a directory, written a part at a time */
+typedef struct dir_listing dir_listing;
+
+/**
+ * Start a listing of one page of a directory. Entries are listed
+ * in the order the file system returns them, which is stable while
+ * the directory is unchanged, so pages can be rendered separately.
+ *
+ * @param dir_fd the open directory, read from its current offset;
+ *   closed when the listing is closed
+ * @param path the URI path of the directory, ending in "/"
+ * @param page the page number, starting at 1
+ * @param json true to render JSON, false to render HTML
+ * @return the listing, or NULL on error, when dir_fd is closed
+ */
+dir_listing *openDirectoryListing(int dir_fd, const char path[], int page, bool json);
+
+/**
+ * Write the next part of a listing: the head, one entry, or the
+ * foot. Each entry is looked up with fstatat() only as it is
+ * written.
+ *
+ * @param listing the listing
+ * @param out the output stream
+ * @return 1 if more parts follow, 0 after the last part
+ */
+int writeDirectoryListing(dir_listing *listing, FILE *out);
+
+/**
+ * Close a listing and its directory.
+ *
+ * @param listing the listing, or NULL
+ */
+void closeDirectoryListing(dir_listing *listing);
+
+/**
+ * Render one page of a directory listing in full.
+ *
+ * @param dir_fd the open directory, read from its current offset;
+ *   closed when the listing is rendered
+ * @param path the URI path of the directory, ending in "/"
+ * @param page the page number, starting at 1
+ * @param json true to render JSON, false to render HTML
+ * @param len set to the length of the listing
+ * @return the malloc'd listing, or NULL on error
+ */
+char *renderDirectoryIndex(int dir_fd, const char path[], int page, bool json, size_t *len);
+
+#endif /* DIR_INDEX_H_ */
@@ -0,0 +1,262 @@
+/*
+ * fuzz_parser.c
+ *
+ * Fuzz harness for the request header parser. Each input is parsed
+ * whole and again in pieces of varying size, and the harness aborts
+ * if the results differ, if a span lies outside the header, if a
+ * complete header does not end in a blank line, or if a size limit
+ * is exceeded without an error.
+ *
+ * With libFuzzer (clang):
+ *   clang -std=gnu11 -g -O1 -fsanitize=fuzzer,address,undefined -DUSE_LIBFUZZER \
+ *       -o fuzz_parser fuzz_parser.c http_parser.c http_headers.c
+ *   ./fuzz_parser [corpus directory]
+ *
+ * Standalone, mutating built-in sample requests at random:
+ *   gcc -std=gnu11 -g -O1 -fsanitize=address,undefined \
+ *       -o fuzz_parser fuzz_parser.c http_parser.c http_headers.c
+ *   ./fuzz_parser [iterations (default: 1000000)] [seed]
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_headers.h"
+#include "http_parser.h"
+
+/** small limits so inputs reach them often */
+static const http_limits fuzz_limits = {
+	.max_request_line = 96,
+	.max_header = 512,
+	.max_fields = 8
+};
+
+/** largest input parsed */
+#define MAX_INPUT 1024
+
+/**
+ * Abort with a message if a condition does not hold.
+ *
+ * @param cond the condition
+ * @param msg the message
+ */
+static void check(bool cond, const char *msg) {
+	if (!cond) {
+		fprintf(stderr, "fuzz_parser: %s\n", msg);
+		abort();
+	}
+}
+
+/**
+ * Check that a span lies within the parsed header.
+ *
+ * @param span the span
+ * @param buf the request buffer
+ * @param len the length of the header
+ */
+static void checkSpan(const http_span *span, const char buf[], size_t len) {
+	check(span->start >= buf && span->start + span->len < buf + len, "span outside header");
+	check(span->start[span->len] == '\0', "span not terminated");
+	check(memchr(span->start, '\0', span->len) == NULL, "NUL within span");
+}
+
+/**
+ * Parse an input in pieces.
+ *
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param len the input length
+ * @param step the number of bytes added per call, or 0 for all at once
+ * @return the parse status
+ */
+static parse_status parseInPieces(http_parser *parser, char buf[], size_t len, size_t step) {
+	initParser(parser, &fuzz_limits);
+	if (step == 0) {
+		return parseRequest(parser, buf, len);
+	}
+	parse_status status = PARSE_INCOMPLETE;
+	for (size_t n = 0; n < len && status == PARSE_INCOMPLETE; ) {
+		n = (len - n < step) ? len : n + step;
+		status = parseRequest(parser, buf, n);
+	}
+	return status;
+}
+
+/**
+ * Parse one input and check the results.
+ *
+ * @param data the input
+ * @param size the input length
+ * @return 0 (required by libFuzzer)
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (size > MAX_INPUT) {
+		size = MAX_INPUT;
+	}
+	static char whole[MAX_INPUT], pieces[MAX_INPUT];
+	memcpy(whole, data, size);
+	memcpy(pieces, data, size);
+
+	http_parser parser, pieceParser;
+	parse_status status = parseInPieces(&parser, whole, size, 0);
+	size_t step = (size > 0) ? 1 + data[0] % 7 : 1;
+	parse_status pieceStatus = parseInPieces(&pieceParser, pieces, size, step);
+	check(status == pieceStatus, "result depends on how input arrives");
+
+	switch (status) {
+	case PARSE_INCOMPLETE:
+		check(size < fuzz_limits.max_header, "header over limit not rejected");
+		break;
+
+	case PARSE_COMPLETE:
+		check(parser.length == pieceParser.length, "length depends on how input arrives");
+		check(parser.length <= size && parser.length <= fuzz_limits.max_header, "header too long");
+		check(whole[parser.length - 1] == '\n', "header does not end with newline");
+		check(parser.nfields <= fuzz_limits.max_fields, "too many fields");
+		check(parser.uri.start + parser.uri.len - parser.method.start
+			  < (ptrdiff_t)fuzz_limits.max_request_line, "request line over limit");
+		checkSpan(&parser.method, whole, parser.length);
+		checkSpan(&parser.uri, whole, parser.length);
+		checkSpan(&parser.version, whole, parser.length);
+		check(parser.method.len > 0 && parser.uri.len > 0, "empty method or URI");
+		for (int f = 0; f < parser.nfields; f++) {
+			checkSpan(&parser.fields[f].name, whole, parser.length);
+			checkSpan(&parser.fields[f].value, whole, parser.length);
+			check(parser.fields[f].name.len > 0, "empty field name");
+		}
+
+		http_headers headers;
+		initHeaders(&headers);
+		getRequestHeaders(&parser, &headers);
+		check(headers.count <= parser.nfields, "more headers than fields");
+		break;
+
+	case PARSE_BAD_REQUEST:
+	case PARSE_URI_TOO_LONG:
+	case PARSE_HEADER_TOO_LARGE:
+	case PARSE_BAD_VERSION:
+		break;
+
+	default:
+		check(false, "unknown status");
+	}
+	return 0;
+}
+
+#ifndef USE_LIBFUZZER
+
+/** sample requests to mutate */
+static const char *samples[] = {
+	"GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n",
+	"GET / HTTP/1.0\n\n",
+	"\r\nGET /a?b=c HTTP/1.1\r\nRange: bytes=0-9\r\nRange: bytes=20-\r\n\r\nGET / HTTP/1.1\r\n\r\n",
+	"GET /favicon.ico HTTP/1.1\r\nAccept-Encoding: gzip;q=1.0, deflate;q=0.5\r\nX-Empty:\r\n\r\n",
+	"POST /upload HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello",
+};
+
+/** number of sample requests */
+#define NSAMPLES (sizeof samples / sizeof samples[0])
+
+/** number of inputs made from a sample by repeated mutation */
+#define MUTATION_RUN 32
+
+/**
+ * Mutate an input by flipping, inserting, deleting, or
+ * duplicating bytes, or by splicing in a header token.
+ *
+ * @param buf the input
+ * @param len the input length
+ * @return the new input length
+ */
+static size_t mutate(uint8_t buf[], size_t len) {
+	static const char *tokens[] = { "\r\n", "\n", " ", ":", "\t", "HTTP/1.1", "HTTP/2.0", "\0", "\x7f" };
+	int nmutations = 1 + rand() % 4;
+	for (int m = 0; m < nmutations; m++) {
+		size_t pos = (len > 0) ? (size_t)rand() % len : 0;
+		switch (rand() % 5) {
+		case 0:  // flip a byte
+			if (len > 0) buf[pos] ^= 1 << (rand() % 8);
+			break;
+		case 1:  // insert a random byte
+			if (len < MAX_INPUT) {
+				memmove(buf + pos + 1, buf + pos, len - pos);
+				buf[pos] = rand();
+				len++;
+			}
+			break;
+		case 2:  // delete a run of bytes
+			if (len > 0) {
+				size_t n = 1 + rand() % (len - pos);
+				memmove(buf + pos, buf + pos + n, len - pos - n);
+				len -= n;
+			}
+			break;
+		case 3:  // repeat a run of bytes
+			if (len > 0) {
+				size_t n = 1 + rand() % (len - pos);
+				if (len + n <= MAX_INPUT) {
+					memmove(buf + pos + n, buf + pos, len - pos);
+					len += n;
+				}
+			}
+			break;
+		case 4: {  // splice in a token
+			const char *token = tokens[rand() % (sizeof tokens / sizeof tokens[0])];
+			size_t n = (*token == '\0') ? 1 : strlen(token);
+			if (len + n <= MAX_INPUT) {
+				memmove(buf + pos + n, buf + pos, len - pos);
+				memcpy(buf + pos, token, n);
+				len += n;
+			}
+			break;
+		}
+		}
+	}
+	return len;
+}
+
+/**
+ * Main program parses mutated sample requests.
+ * @param iterations: optional number of inputs (default: 1000000)
+ * @param seed: optional random seed (default: 1)
+ */
+int main(int argc, char* argv[argc]) {
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000UL;
+	unsigned seed = (argc > 2) ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+	srand(seed);
+
+	unsigned long counts[600] = { 0 };
+	uint8_t buf[MAX_INPUT];
+	size_t len = 0;
+	for (unsigned long i = 0; i < iterations; i++) {
+		// mutations accumulate until the next sample is taken
+		if (i % MUTATION_RUN == 0) {
+			const char *sample = samples[(i / MUTATION_RUN) % NSAMPLES];
+			len = strlen(sample);
+			memcpy(buf, sample, len);
+		} else {
+			len = mutate(buf, len);
+		}
+		LLVMFuzzerTestOneInput(buf, len);
+
+		http_parser parser;
+		char copy[MAX_INPUT];
+		memcpy(copy, buf, len);
+		initParser(&parser, &fuzz_limits);
+		counts[parseRequest(&parser, copy, len)]++;
+	}
+
+	printf("%lu inputs: incomplete %lu, complete %lu, 400 %lu, 414 %lu, 431 %lu, 505 %lu\n",
+		   iterations, counts[PARSE_INCOMPLETE], counts[PARSE_COMPLETE], counts[PARSE_BAD_REQUEST],
+		   counts[PARSE_URI_TOO_LONG], counts[PARSE_HEADER_TOO_LARGE], counts[PARSE_BAD_VERSION]);
+	return EXIT_SUCCESS;
+}
+
+#endif /* USE_LIBFUZZER */
@@ -0,0 +1,120 @@
+/*
+ * http_headers.c
+ *
+ * Collection of HTTP request or response header properties.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_headers.h"
+
+/**
+ * Initialize header properties to be empty.
+ *
+ * @param headers the header properties
+ */
+void initHeaders(http_headers *headers) {
+	headers->count = 0;
+}
+
+/**
+ * Find index of a header property.
+ *
+ * @param headers the header properties
+ * @param name the property name (case-insensitive)
+ * @return the index, or -1 if not present
+ */
+static int findHeader(const http_headers *headers, const char name[]) {
+	for (int i = 0; i < headers->count; i++) {
+		if (strcasecmp(headers->header[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Get value of a header property.
+ *
+ * @param headers the header properties
+ * @param name the property name (case-insensitive)
+ * @return the property value, or NULL if not present
+ */
+const char *getHeader(const http_headers *headers, const char name[]) {
+	int i = findHeader(headers, name);
+	return (i < 0) ? NULL : headers->header[i].value;
+}
+
+/**
+ * Set value of a header property, replacing any existing value.
+ *
+ * @param headers the header properties
+ * @param name the property name
+ * @param value the property value
+ * @return true if set, false if there is no room
+ */
+bool putHeader(http_headers *headers, const char name[], const char value[]) {
+	int i = findHeader(headers, name);
+	if (i < 0) {
+		if (headers->count == MAX_HEADERS) {
+			return false;
+		}
+		i = headers->count++;
+		snprintf(headers->header[i].name, MAX_HEADER_NAME, "%s", name);
+	}
+	snprintf(headers->header[i].value, MAXBUF, "%s", value);
+	return true;
+}
+
+/**
+ * Remove a header property.
+ *
+ * @param headers the header properties
+ * @param name the property name (case-insensitive)
+ */
+void removeHeader(http_headers *headers, const char name[]) {
+	int i = findHeader(headers, name);
+	if (i >= 0) {
+		headers->count--;
+		memmove(&headers->header[i], &headers->header[i+1],
+				(headers->count - i) * sizeof(http_header));
+	}
+}
+
+/**
+ * Parse a "name: value" request line and add it to the
+ * header properties. Leading and trailing whitespace is
+ * trimmed from the value.
+ *
+ * @param line the header line without CRLF
+ * @param headers the header properties
+ * @return true if parsed, false if the line is malformed
+ */
+bool parseHeader(const char line[], http_headers *headers) {
+	const char *colon = strchr(line, ':');
+	if (colon == NULL || colon == line || colon - line >= MAX_HEADER_NAME) {
+		return false;
+	}
+	char name[MAX_HEADER_NAME];
+	snprintf(name, sizeof name, "%.*s", (int)(colon - line), line);
+
+	// trim whitespace around value
+	const char *value = colon + 1;
+	while (isspace((unsigned char)*value)) {
+		value++;
+	}
+	int len = (int)strlen(value);
+	while (len > 0 && isspace((unsigned char)value[len-1])) {
+		len--;
+	}
+	char trimmed[MAXBUF];
+	snprintf(trimmed, sizeof trimmed, "%.*s", len, value);
+
+	return putHeader(headers, name, trimmed);
+}
@@ -0,0 +1,80 @@
+/*
+ * http_headers.h
+ *
+ * Collection of HTTP request or response header properties.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef HTTP_HEADERS_H_
+#define HTTP_HEADERS_H_
+
+#include <stdbool.h>
+
+#include "http_server.h"
+
+/** maximum number of header properties */
+#define MAX_HEADERS 64
+
+/** maximum length of a header property name */
+#define MAX_HEADER_NAME 64
+
+/** A header property */
+typedef struct {
+	char name[MAX_HEADER_NAME];
+	char value[MAXBUF];
+} http_header;
+
+/** Collection of header properties in the order added */
+typedef struct {
+	int count;
+	http_header header[MAX_HEADERS];
+} http_headers;
+
+/**
+ * Initialize header properties to be empty.
+ *
+ * @param headers the header properties
+ */
+void initHeaders(http_headers *headers);
+
+/**
+ * Get value of a header property.
+ *
+ * @param headers the header properties
+ * @param name the property name (case-insensitive)
+ * @return the property value, or NULL if not present
+ */
+const char *getHeader(const http_headers *headers, const char name[]);
+
+/**
+ * Set value of a header property, replacing any existing value.
+ *
+ * @param headers the header properties
+ * @param name the property name
+ * @param value the property value
+ * @return true if set, false if there is no room
+ */
+bool putHeader(http_headers *headers, const char name[], const char value[]);
+
+/**
+ * Remove a header property.
+ *
+ * @param headers the header properties
+ * @param name the property name (case-insensitive)
+ */
+void removeHeader(http_headers *headers, const char name[]);
+
+/**
+ * Parse a "name: value" request line and add it to the
+ * header properties. Leading and trailing whitespace is
+ * trimmed from the value.
+ *
+ * @param line the header line without CRLF
+ * @param headers the header properties
+ * @return true if parsed, false if the line is malformed
+ */
+bool parseHeader(const char line[], http_headers *headers);
+
+#endif /* HTTP_HEADERS_H_ */
@@ -1,63 +1,1130 @@
 /*
  * http_methods.c
  *
- * Functions that implement HTTP methods, including GET
+ * Functions that implement HTTP methods: GET, HEAD, OPTIONS,
+ * and the responses to PUT and POST uploads.
  *
  *  @since 2019-04-10
  *  @author: Philip Gust
  */
+#define _GNU_SOURCE  // for memmem()
 
-
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "content_cache.h"
+#include "dir_index.h"
 #include "http_methods.h"
 #include "http_server.h"
 #include "http_util.h"
+#include "mime_types.h"
+#include "server_stats.h"
+
+/** true to list directories that have no index.html */
+static bool autoindex = false;
 
 /**
- * Handle GET request.
+ * Add a segment to the response body.
+ *
+ * @param body the response body
+ * @param data the in-memory bytes, or NULL to send from content file
+ * @param offset the offset of the first byte in data or content file
+ * @param nbytes the number of bytes
+ */
+static void add_segment(response_body *body, const char *data, off_t offset,
+						unsigned long nbytes) {
+	body->segments[body->nsegments++] = (body_segment){ data, offset, nbytes };
+}
+
+/**
+ * Prepare a multipart/byteranges body for the requested ranges.
+ * Each range is preceded by a separator with its own properties,
+ * and the body ends with a closing separator.
+ *
+ * @param body the response body
+ * @param data the in-memory content, or NULL to send from content file
+ * @param size the size of the content
+ * @param contentType the content type of each part
+ * @param boundary the multipart boundary
+ * @param ranges the ranges
+ * @param nranges the number of ranges
+ * @return the total length of the body, or 0 if out of memory
+ */
+static unsigned long add_multipart_segments(response_body *body, const char *data, off_t size,
+		const char contentType[], const char boundary[], byte_range ranges[], int nranges) {
+	size_t partsLen = (nranges + 1) * 3 * MAXBUF;
+	body->parts = malloc(partsLen);
+	if (body->parts == NULL) {
+		return 0;
+	}
+
+	unsigned long total = 0;
+	size_t pos = 0;
+	for (int i = 0; i < nranges; i++) {
+		int len = snprintf(body->parts + pos, partsLen - pos,
+				"%s--%s%sContent-type: %s%sContent-Range: bytes %lld-%lld/%lld%s%s",
+				CRLF, boundary, CRLF, contentType, CRLF,
+				(long long)ranges[i].first, (long long)ranges[i].last, (long long)size,
+				CRLF, CRLF);
+		add_segment(body, body->parts, pos, len);
+		pos += len;
+
+		unsigned long nbytes = (unsigned long)(ranges[i].last - ranges[i].first + 1);
+		add_segment(body, data, ranges[i].first, nbytes);
+		total += len + nbytes;
+	}
+	int len = snprintf(body->parts + pos, partsLen - pos, "%s--%s--%s", CRLF, boundary, CRLF);
+	add_segment(body, body->parts, pos, len);
+	return total + len;
+}
+
+/**
+ * Open a content file and get its status.
+ *
+ * @param path the file path relative to the content root
+ * @param content_fd set to the open file, or -1 if not opened
+ * @param sb set to the status of the file
+ * @return true if the file is an open regular file
+ */
+static bool open_content(const char path[], int *content_fd, struct stat *sb) {
+	*content_fd = openContent(path);
+	if (*content_fd < 0) {
+		return false;
+	}
+	if (fstat(*content_fd, sb) < 0 || !S_ISREG(sb->st_mode)) {
+		close(*content_fd);
+		*content_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Render the content response properties for a file.
+ *
+ * @param header the rendered properties
+ * @param len the size of the header buffer
+ * @param contentType the content type
+ * @param encoding the content coding, or NULL if none
+ * @param sb the status of the file
+ * @param size the length of the content
+ */
+static void render_properties(char header[], size_t len, const char contentType[],
+							  const char encoding[], const struct stat *sb, size_t size) {
+	char etag[MAXBUF];
+	getEntityTag(sb, encoding, etag);
+	char lastModified[MAXBUF];
+	milliTimeToRFC_1123_Date_Time(sb->st_mtime, lastModified);
+
+	int n = snprintf(header, len, "Content-type: %s%s", contentType, CRLF);
+	if (encoding != NULL) {
+		n += snprintf(header + n, len - n, "Content-Encoding: %s%s", encoding, CRLF);
+	}
+	snprintf(header + n, len - n,
+			 "Content-Length: %lu%sLast-Modified: %s%sETag: %s%sAccept-Ranges: bytes%s",
+			 (unsigned long)size, CRLF, lastModified, CRLF, etag, CRLF, CRLF);
+}
+
+/**
+ * Compress content with zlib.
+ *
+ * @param data the content
+ * @param size the length of the content
+ * @param encoding "gzip" or "deflate"
+ * @param encodedSize set to the length of the compressed content
+ * @return the malloc'd compressed content, or NULL on error
+ */
+static char *compress_content(const char *data, size_t size, const char encoding[],
+							  size_t *encodedSize) {
+	// window bits select gzip or zlib wrapper around deflate stream
+	int windowBits = (strcmp(encoding, "gzip") == 0) ? MAX_WBITS + 16 : MAX_WBITS;
+	z_stream zs = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, windowBits, 8,
+					 Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+	uLong bound = deflateBound(&zs, size);
+	char *encoded = malloc(bound);
+	if (encoded == NULL) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = size;
+	zs.next_out = (Bytef *)encoded;
+	zs.avail_out = bound;
+	int status = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (status != Z_STREAM_END) {
+		free(encoded);
+		return NULL;
+	}
+	*encodedSize = zs.total_out;
+	char *shrunk = realloc(encoded, *encodedSize > 0 ? *encodedSize : 1);
+	return (shrunk != NULL) ? shrunk : encoded;
+}
+
+/**
+ * Get content of a file in a content coding. For gzip, a
+ * pre-compressed ".gz" sibling that is no older than the file is
+ * used. Otherwise the file content is compressed once and kept in
+ * the content cache, if its size is within the compression limits.
+ *
+ * @param filePath the file path relative to the content root
+ * @param encoding the content coding
+ * @param contentType the content type of the file
+ * @param content_fd set to the open sibling file if it is too large to cache, or -1
+ * @param sb set to the status of the open sibling file
+ * @return the cache entry, which must be released, or NULL if not cached
+ */
+static content_entry *get_encoded_content(const char filePath[], const char encoding[],
+										  const char contentType[], int *content_fd,
+										  struct stat *sb) {
+	*content_fd = -1;
+	struct stat fileSb;
+	if (!statContent(filePath, &fileSb) || !S_ISREG(fileSb.st_mode)) {
+		return NULL;
+	}
+
+	char header[4*MAXBUF];
+	char gzPath[PATH_MAX];
+	if (strcmp(encoding, "gzip") == 0
+			&& snprintf(gzPath, sizeof gzPath, "%s.gz", filePath) < (int)sizeof gzPath) {
+		content_entry *entry = getCachedContent(gzPath, encoding);
+		if (entry != NULL) {
+			if (entry->sb.st_mtime >= fileSb.st_mtime) {
+				return entry;
+			}
+			releaseCachedContent(entry);  // sibling is older than file
+		} else if (open_content(gzPath, content_fd, sb)) {
+			if (sb->st_mtime >= fileSb.st_mtime) {
+				render_properties(header, sizeof header, contentType, encoding, sb, sb->st_size);
+				entry = putCachedContent(gzPath, encoding, *content_fd, sb, header);
+				if (entry != NULL) {
+					close(*content_fd);
+					*content_fd = -1;
+				}
+				return entry;
+			}
+			close(*content_fd);  // sibling is older than file
+			*content_fd = -1;
+		}
+	}
+
+	// use content compressed earlier if file has not changed
+	content_entry *entry = getCachedContent(filePath, encoding);
+	if (entry != NULL || fileSb.st_size < COMPRESS_MIN_SIZE || fileSb.st_size > CACHE_MAX_ENTRY) {
+		return entry;
+	}
+
+	// compress content loaded through the cache
+	content_entry *source = getCachedContent(filePath, NULL);
+	int fd;
+	if (source == NULL && open_content(filePath, &fd, &fileSb)) {
+		render_properties(header, sizeof header, contentType, NULL, &fileSb, fileSb.st_size);
+		source = putCachedContent(filePath, NULL, fd, &fileSb, header);
+		close(fd);
+	}
+	if (source == NULL) {
+		return NULL;
+	}
+	size_t size;
+	char *encoded = compress_content(source->body, source->size, encoding, &size);
+	if (encoded != NULL && size < source->size) {
+		render_properties(header, sizeof header, contentType, encoding, &source->sb, size);
+		entry = putEncodedContent(filePath, encoding, &source->sb, encoded, size, header);
+	} else {
+		free(encoded);
+	}
+	releaseCachedContent(source);
+	return entry;
+}
+
+/**
+ * Redirect a URI that names a directory without a trailing "/"
+ * to the URI with one, so the directory's index page and its
+ * relative links resolve against the directory.
+ *
+ * @param response set to the response header
+ * @param uri the request URI
+ * @param filePath the file path relative to the content root
+ * @param responseHeaders the response headers
+ * @return true if the response is a redirect
+ */
+static bool redirect_directory(response_header *response, const char uri[],
+							   const char filePath[], http_headers *responseHeaders) {
+	struct stat sb;
+	if (!statContent(filePath, &sb) || !S_ISDIR(sb.st_mode)) {
+		return false;
+	}
+	// add "/" to path before any query
+	char location[MAXBUF];
+	int pathLen = (int)strcspn(uri, "?#");
+	const char *query = uri + pathLen;
+	if (query[0] == '#') {
+		query = "";
+	}
+	if (snprintf(location, sizeof location, "%.*s/%s", pathLen, uri, query) >= (int)sizeof location) {
+		return false;
+	}
+	putHeader(responseHeaders, "Location", location);
+	setErrorResponse(response, 301, "Moved Permanently", responseHeaders);
+	return true;
+}
+
+/**
+ * Get the value of a parameter in the query of a URI.
+ *
+ * @param uri the request URI
+ * @param name the parameter name
+ * @param value set to the parameter value
+ * @param size the size of the value buffer
+ * @return true if the parameter is present
+ */
+static bool get_query_param(const char uri[], const char name[], char value[], size_t size) {
+	const char *query = strchr(uri, '?');
+	size_t len = strlen(name);
+	while (query != NULL) {
+		query++;
+		if (strncmp(query, name, len) == 0 && query[len] == '=') {
+			const char *start = query + len + 1;
+			size_t n = strcspn(start, "&#");
+			snprintf(value, size, "%.*s", (int)n, start);
+			return true;
+		}
+		query = strchr(query, '&');
+	}
+	return false;
+}
+
+/** Directory listing streamed while a copy is kept for the cache */
+typedef struct {
+	dir_listing *listing;	// the listing
+	char root[PATH_MAX];	// cache path of the directory
+	char key[MAX_ENCODING];	// cache key of format and page
+	struct stat sb;			// status of the directory when listed
+	bool json;				// listing is JSON
+	FILE *copy;				// stream keeping the copy, or NULL if too large
+	char *copied;			// bytes of the copy
+	size_t copied_len;		// number of bytes of the copy
+} index_stream;
+
+/**
+ * Render the content response properties of a directory listing.
  *
- * @param the socket stream
+ * @param header the buffer for the properties
+ * @param len the size of the buffer
+ * @param json true if the listing is JSON
+ * @param sb the status of the directory
+ * @param key the cache key of format and page
+ * @param framing the Content-Length or Transfer-Encoding property
+ */
+static void render_index_properties(char header[], size_t len, bool json, const struct stat *sb,
+									const char key[], const char framing[]) {
+	char etag[MAXBUF];
+	getEntityTag(sb, key, etag);
+	char lastModified[MAXBUF];
+	milliTimeToRFC_1123_Date_Time(sb->st_mtime, lastModified);
+	snprintf(header, len, "Content-type: %s%s%s%sLast-Modified: %s%sETag: %s%s",
+			 json ? "application/json" : "text/html; charset=utf-8", CRLF, framing, CRLF,
+			 lastModified, CRLF, etag, CRLF);
+}
+
+/**
+ * Write the next part of a streamed listing, keeping a copy that
+ * is cached once the listing is complete unless it grows too
+ * large to cache.
+ *
+ * @param state the index stream
+ * @param out the output stream
+ * @return 1 if more parts follow, 0 after the last part, -1 on error
+ */
+static int produce_index(void *state, FILE *out) {
+	index_stream *index = state;
+	if (index->copy == NULL) {
+		return writeDirectoryListing(index->listing, out);
+	}
+
+	size_t from = index->copied_len;
+	int more = writeDirectoryListing(index->listing, index->copy);
+	if (fflush(index->copy) != 0) {
+		return -1;
+	}
+	fwrite(index->copied + from, 1, index->copied_len - from, out);
+
+	if (index->copied_len > CACHE_MAX_ENTRY) {
+		// too large to cache: stop keeping copy
+		fclose(index->copy);
+		free(index->copied);
+		index->copy = NULL;
+		index->copied = NULL;
+	} else if (more == 0) {
+		fclose(index->copy);
+		index->copy = NULL;
+		char framing[MAXBUF];
+		snprintf(framing, sizeof framing, "Content-Length: %zu", index->copied_len);
+		char header[4*MAXBUF];
+		render_index_properties(header, sizeof header, index->json, &index->sb, index->key, framing);
+		content_entry *entry = putEncodedContent(index->root, index->key, &index->sb,
+												 index->copied, index->copied_len, header);
+		index->copied = NULL;  // owned by cache
+		if (entry != NULL) {
+			releaseCachedContent(entry);
+		}
+	}
+	return more;
+}
+
+/**
+ * Release a streamed listing.
+ *
+ * @param state the index stream
+ */
+static void release_index(void *state) {
+	index_stream *index = state;
+	closeDirectoryListing(index->listing);
+	if (index->copy != NULL) {
+		fclose(index->copy);
+	}
+	free(index->copied);
+	free(index);
+}
+
+/**
+ * Create a stream that sends a directory listing as it is rendered.
+ *
+ * @param dir_fd the open directory, closed by the stream
+ * @param path the URI path of the directory
+ * @param root the cache path of the directory
+ * @param key the cache key of format and page
+ * @param sb the status of the directory
+ * @param page the page number
+ * @param json true to render JSON
+ * @return the stream, or NULL on error
+ */
+static response_stream *stream_index(int dir_fd, const char path[], const char root[],
+									 const char key[], const struct stat *sb, int page, bool json) {
+	index_stream *index = calloc(1, sizeof(index_stream));
+	if (index == NULL) {
+		close(dir_fd);
+		return NULL;
+	}
+	index->listing = openDirectoryListing(dir_fd, path, page, json);
+	if (index->listing == NULL) {
+		free(index);
+		return NULL;
+	}
+	snprintf(index->root, sizeof index->root, "%s", root);
+	snprintf(index->key, sizeof index->key, "%s", key);
+	index->sb = *sb;
+	index->json = json;
+	index->copy = open_memstream(&index->copied, &index->copied_len);
+	return newResponseStream(produce_index, release_index, index);
+}
+
+/**
+ * Prepare a directory listing response for a URI that names a
+ * directory without an index.html. The listing is HTML, or JSON if
+ * the query has "format=json" or the client accepts JSON, and
+ * shows the page of entries selected by "page=n". Rendered pages
+ * are cached until the directory changes. A page not in the cache
+ * is streamed to HTTP/1.1 clients as it is rendered.
+ *
+ * @param response set to the response header
  * @param uri the request URI
+ * @param dirPath the directory path relative to the content root
+ * @param chunked true if the client accepts chunked transfer coding
  * @param requestHeaders the request headers
  * @param responseHeaders the response headers
+ * @param body set to the response body, which must be released
+ * @return true if the body should be sent, false if the response has no body
+ */
+static bool start_index(response_header *response, const char uri[], const char dirPath[],
+						bool chunked, http_headers *requestHeaders,
+						http_headers *responseHeaders, response_body *body) {
+	char value[MAXBUF];
+	const char *accept = getHeader(requestHeaders, "Accept");
+	bool json = get_query_param(uri, "format", value, sizeof value)
+			? (strcmp(value, "json") == 0)
+			: (accept != NULL && strstr(accept, "application/json") != NULL);
+	int page = 1;
+	if (get_query_param(uri, "page", value, sizeof value)
+			&& (sscanf(value, "%d", &page) != 1 || page < 1 || page > MAX_INDEX_PAGE)) {
+		setErrorResponse(response, 400, "Bad Request", responseHeaders);
+		return false;
+	}
+	putHeader(responseHeaders, "Vary", "Accept");
+
+	// listing of each format and page is cached separately
+	char key[MAX_ENCODING];
+	snprintf(key, sizeof key, "%s/%d", json ? "json" : "html", page);
+	const char *root = (dirPath[0] == '\0') ? "." : dirPath;
+	content_entry *entry = getCachedContent(root, key);
+	struct stat sb;
+	int dir_fd = -1;
+	if (entry != NULL) {
+		sb = entry->sb;
+	} else {
+		dir_fd = openContent(root);
+		if (dir_fd < 0 || fstat(dir_fd, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+			if (dir_fd >= 0) {
+				close(dir_fd);
+			}
+			setErrorResponse(response, 404, "Not Found", responseHeaders);
+			return false;
+		}
+	}
+
+	char etag[MAXBUF];
+	getEntityTag(&sb, key, etag);
+	if (isNotModified(requestHeaders, etag, sb.st_mtime)) {
+		if (entry != NULL) {
+			releaseCachedContent(entry);
+		} else {
+			close(dir_fd);
+		}
+		char lastModified[MAXBUF];
+		milliTimeToRFC_1123_Date_Time(sb.st_mtime, lastModified);
+		beginResponse(response, 304, "Not Modified");
+		putHeader(responseHeaders, "ETag", etag);
+		putHeader(responseHeaders, "Last-Modified", lastModified);
+		endResponseProperties(response, responseHeaders);   // end of response properties
+		return false;
+	}
+
+	if (entry != NULL) {
+		body->entry = entry;
+		beginResponse(response, 200, "OK");
+		addRenderedProperties(response, entry->header);
+		endResponseProperties(response, responseHeaders);   // end of response properties
+		add_segment(body, entry->body, 0, entry->size);
+		return true;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, "/%s", dirPath);
+	char header[4*MAXBUF];
+	if (chunked) {
+		// send listing as it is rendered
+		body->stream = stream_index(dir_fd, path, root, key, &sb, page, json);
+		if (body->stream == NULL) {
+			setErrorResponse(response, 500, "Internal Server Error", responseHeaders);
+			return false;
+		}
+		render_index_properties(header, sizeof header, json, &sb, key, "Transfer-Encoding: chunked");
+	} else {
+		size_t size;
+		body->parts = renderDirectoryIndex(dir_fd, path, page, json, &size);
+		if (body->parts == NULL) {
+			setErrorResponse(response, 500, "Internal Server Error", responseHeaders);
+			return false;
+		}
+		char framing[MAXBUF];
+		snprintf(framing, sizeof framing, "Content-Length: %zu", size);
+		render_index_properties(header, sizeof header, json, &sb, key, framing);
+		add_segment(body, body->parts, 0, size);
+	}
+	beginResponse(response, 200, "OK");
+	addRenderedProperties(response, header);
+	endResponseProperties(response, responseHeaders);   // end of response properties
+	return true;
+}
+
+/**
+ * Prepare the statistics report response.
+ *
+ * @param response set to the response header
+ * @param responseHeaders the response headers
+ * @param body set to the response body, which must be released
+ * @return true if the body should be sent, false if the response has no body
+ */
+static bool start_stats(response_header *response, http_headers *responseHeaders,
+						response_body *body) {
+	size_t len;
+	body->parts = renderServerStats(&len);
+	if (body->parts == NULL) {
+		setErrorResponse(response, 500, "Internal Server Error", responseHeaders);
+		return false;
+	}
+	add_segment(body, body->parts, 0, len);
+
+	char value[MAXBUF];
+	sprintf(value, "%zu", len);
+	putHeader(responseHeaders, "Content-type", "application/json");
+	putHeader(responseHeaders, "Content-Length", value);
+	putHeader(responseHeaders, "Cache-Control", "no-store");
+	beginResponse(response, 200, "OK");
+	endResponseProperties(response, responseHeaders);   // end of response properties
+	return true;
+}
+
+/**
+ * Set whether directories that have no index.html are listed.
+ *
+ * @param enabled true to list directories
  */
-void do_get(FILE *ostream, const char uri[]) {
-	// resolve uri to system file path
-	char filePath[MAXBUF];
-	resolveUri(uri, filePath);
+void setAutoindex(bool enabled) {
+	autoindex = enabled;
+}
 
-	// open file to read
-	FILE *contentStream = fopen(filePath, "rb");
-	if (contentStream == NULL) {
-		sendErrorResponse(ostream, 404, "Not Found");
-		return;
+/**
+ * Resolve uri to content, prepare the GET response header, and
+ * prepare the response body from the content cache or the
+ * content file. Textual content is compressed for clients that
+ * accept gzip or deflate. Requested byte ranges are sent as 206
+ * Partial Content, using multipart/byteranges for more than one
+ * range. Sends 304 Not Modified instead if the client's copy is
+ * current, a redirect if the URI names a directory without a
+ * trailing "/", a directory listing if enabled and the directory
+ * has no index.html, or an error response if the content is not
+ * available. The statistics report URI is answered by the server
+ * itself. Generated bodies are streamed with chunked transfer
+ * coding to HTTP/1.1 clients.
+ *
+ * @param response set to the response header
+ * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param body set to the response body, which must be released
+ * @return true if the body should be sent, false if the response has no body
+ */
+bool start_get(response_header *response, const char uri[], const char version[],
+			   http_headers *requestHeaders, http_headers *responseHeaders, response_body *body) {
+	*body = (response_body){ .fd = -1 };
+	if (strcmp(uri, STATS_URI) == 0) {
+		return start_stats(response, responseHeaders, body);
 	}
 
-	// get size and other file info file
+	// resolve uri to file path relative to content root
+	char filePath[PATH_MAX];
+	int status = resolveUri(uri, filePath, sizeof filePath);
+	if (status != 0) {
+		setErrorResponse(response, status, (status == 414) ? "URI Too Long" : "Bad Request",
+						 responseHeaders);
+		return false;
+	}
+	const char *contentType = lookupContentType(filePath);
+
+	// compress textual content unless client requests byte ranges
+	const char *encoding = NULL;
+	if (isCompressible(contentType)) {
+		putHeader(responseHeaders, "Vary", "Accept-Encoding");
+		if (getHeader(requestHeaders, "Range") == NULL) {
+			encoding = getAcceptedEncoding(requestHeaders);
+		}
+	}
+
+	struct timespec opening;
+	startTimer(&opening);
+	content_entry *entry = NULL;
+	int content_fd = -1;
 	struct stat sb;
-	fstat(fileno(contentStream), &sb);  // fileno() gets fd from FILE*
-	unsigned long nbytes = (unsigned long)sb.st_size;
+	if (encoding != NULL) {
+		entry = get_encoded_content(filePath, encoding, contentType, &content_fd, &sb);
+		if (entry == NULL && content_fd < 0) {
+			encoding = NULL;  // send content as is
+		}
+	}
+	if (encoding == NULL) {
+		// use cached content if file has not changed
+		entry = getCachedContent(filePath, NULL);
+		if (entry == NULL && !open_content(filePath, &content_fd, &sb)) {
+			recordLatency(LATENCY_OPEN, &opening);
+			size_t pathLen = strcspn(uri, "?#");
+			if (autoindex && pathLen > 0 && uri[pathLen - 1] == '/') {
+				// list directory that has no index.html
+				filePath[strlen(filePath) - strlen(DIRECTORY_INDEX)] = '\0';
+				bool chunked = (strcasecmp(version, "HTTP/1.1") == 0);
+				return start_index(response, uri, filePath, chunked, requestHeaders,
+								   responseHeaders, body);
+			}
+			if (!redirect_directory(response, uri, filePath, responseHeaders)) {
+				setErrorResponse(response, 404, "Not Found", responseHeaders);
+			}
+			return false;
+		}
+	}
+	if (entry != NULL) {
+		sb = entry->sb;
+	}
+	recordLatency(LATENCY_OPEN, &opening);
 
-	// output response header
-	sendResponseStatus(ostream, 200, "OK");
+	// validators for conditional requests
+	char etag[MAXBUF];
+	getEntityTag(&sb, encoding, etag);
+	char lastModified[MAXBUF];
+	milliTimeToRFC_1123_Date_Time(sb.st_mtime, lastModified);
 
-	char contentType[MAXBUF];
-	getContentType(filePath, contentType);
-	sendResponseProperty(ostream, "Content-type", contentType);
+	// client's copy is current: send header only
+	if (isNotModified(requestHeaders, etag, sb.st_mtime)) {
+		if (entry != NULL) {
+			releaseCachedContent(entry);
+		} else {
+			close(content_fd);
+		}
+		beginResponse(response, 304, "Not Modified");
+		putHeader(responseHeaders, "ETag", etag);
+		putHeader(responseHeaders, "Last-Modified", lastModified);
+		endResponseProperties(response, responseHeaders);   // end of response properties
+		return false;
+	}
 
-	char contentLength[MAXBUF];
-	sprintf(contentLength, "%lu", nbytes);
-	sendResponseProperty(ostream, "Content-Length", contentLength);
+	char header[4*MAXBUF];
+	if (entry == NULL) {
+		render_properties(header, sizeof header, contentType, encoding, &sb, sb.st_size);
 
-	endResponseProperties(ostream);   // end of response properties
+		// load content into cache, or send from file if not cacheable
+		if (encoding == NULL) {
+			entry = putCachedContent(filePath, NULL, content_fd, &sb, header);
+		}
+		if (entry != NULL) {
+			close(content_fd);
+			content_fd = -1;
+		}
+	}
+	body->entry = entry;
+	body->fd = content_fd;
+	const char *data = (entry != NULL) ? entry->body : NULL;
+	const char *properties = (entry != NULL) ? entry->header : header;
+	off_t size = (entry != NULL) ? (off_t)entry->size : sb.st_size;
 
+	// ranges requested for current content
+	byte_range ranges[MAX_RANGES];
+	int nranges = -1;
+	const char *range = getHeader(requestHeaders, "Range");
+	if (range != NULL && isRangeCurrent(requestHeaders, etag, sb.st_mtime)) {
+		nranges = parseByteRanges(range, size, ranges, MAX_RANGES);
+	}
+
+	if (nranges < 0) {
+		// output response header for full content
+		beginResponse(response, 200, "OK");
+		addRenderedProperties(response, properties);
+		endResponseProperties(response, responseHeaders);   // end of response properties
+		add_segment(body, data, 0, (unsigned long)size);
+		return true;
+	}
+
+	if (nranges == 0) {
+		// no requested range overlaps content
+		release_body(body);
+		char contentRange[MAXBUF];
+		sprintf(contentRange, "bytes */%lld", (long long)size);
+		putHeader(responseHeaders, "Content-Range", contentRange);
+		setErrorResponse(response, 416, "Range Not Satisfiable", responseHeaders);
+		return false;
+	}
+
+	// prepare partial content body and properties
+	char value[MAXBUF];
+	if (nranges == 1) {
+		unsigned long nbytes = (unsigned long)(ranges[0].last - ranges[0].first + 1);
+		putHeader(responseHeaders, "Content-type", contentType);
+		sprintf(value, "bytes %lld-%lld/%lld", (long long)ranges[0].first,
+				(long long)ranges[0].last, (long long)size);
+		putHeader(responseHeaders, "Content-Range", value);
+		sprintf(value, "%lu", nbytes);
+		putHeader(responseHeaders, "Content-Length", value);
+		add_segment(body, data, ranges[0].first, nbytes);
+	} else {
+		char boundary[64];
+		sprintf(boundary, "%lx%08lx", (unsigned long)sb.st_ino, (unsigned long)random());
+		unsigned long nbytes = add_multipart_segments(body, data, size, contentType,
+													  boundary, ranges, nranges);
+		if (nbytes == 0) {
+			release_body(body);
+			setErrorResponse(response, 500, "Internal Server Error", responseHeaders);
+			return false;
+		}
+		sprintf(value, "multipart/byteranges; boundary=%s", boundary);
+		putHeader(responseHeaders, "Content-type", value);
+		sprintf(value, "%lu", nbytes);
+		putHeader(responseHeaders, "Content-Length", value);
+	}
+	putHeader(responseHeaders, "Last-Modified", lastModified);
+	putHeader(responseHeaders, "ETag", etag);
 
-	// output response bytes
-	sendResponseBytes(contentStream, ostream, nbytes);
-	fclose(contentStream);
+	// output response header for partial content
+	beginResponse(response, 206, "Partial Content");
+	endResponseProperties(response, responseHeaders);   // end of response properties
+	return true;
+}
+
+/**
+ * Write all bytes described by an I/O vector.
+ *
+ * @param fd the socket descriptor
+ * @param iov the I/O vector, which is modified
+ * @param iovcnt the number of vector elements
+ * @param nsent incremented by the number of bytes written
+ * @return true if all bytes were written
+ */
+static bool write_vector(int fd, struct iovec iov[], int iovcnt, unsigned long *nsent) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		*nsent += n;
+		// skip elements written in full, then advance into partial one
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+/**
+ * Send a generated body a chunk at a time as it is produced.
+ *
+ * @param sock_fd the socket descriptor
+ * @param response the response header; counts the bytes sent
+ * @param stream the generated body
+ * @return true if the entire body was sent
+ */
+static bool send_stream(int sock_fd, response_header *response, response_stream *stream) {
+	int status;
+	while ((status = fillResponseStream(stream)) > 0) {
+		struct iovec iov = { stream->buf + stream->pos, stream->len - stream->pos };
+		if (!write_vector(sock_fd, &iov, 1, &response->nsent)) {
+			return false;
+		}
+		stream->pos = stream->len;
+	}
+	return status == 0;
+}
+
+/**
+ * Send response header and body segments.
+ *
+ * @param sock_fd the socket descriptor
+ * @param response the response header; counts the bytes sent
+ * @param body the response body, or NULL if none
+ * @return true if the entire response was sent
+ */
+static bool send_segments(int sock_fd, response_header *response, response_body *body) {
+	struct iovec iov[MAX_BODY_SEGMENTS + 1];
+	int iovcnt = 0;
+	iov[iovcnt++] = (struct iovec){ response->buf, response->len };
+	while (true) {
+		// gather in-memory segments up to next content file segment
+		while (body != NULL && body->segment < body->nsegments
+			   && body->segments[body->segment].data != NULL) {
+			body_segment *seg = &body->segments[body->segment++];
+			iov[iovcnt++] = (struct iovec){ (char *)seg->data + seg->offset, seg->nbytes };
+		}
+		if (iovcnt > 0 && !write_vector(sock_fd, iov, iovcnt, &response->nsent)) {
+			return false;
+		}
+		iovcnt = 0;
+		if (body == NULL || body->segment == body->nsegments) {
+			return (body == NULL || body->stream == NULL) || send_stream(sock_fd, response, body->stream);
+		}
+
+		body_segment *seg = &body->segments[body->segment++];
+		if (!sendResponseFile(body->fd, sock_fd, seg->offset, seg->nbytes)) {
+			return false;
+		}
+		response->nsent += seg->nbytes;
+	}
+}
+
+/**
+ * Send response header and body to the client socket. The header
+ * and any in-memory body segments that follow it are sent in one
+ * writev(); content file segments are sent with sendfile().
+ *
+ * @param sock_fd the socket descriptor
+ * @param response the response header; counts the bytes sent
+ * @param body the response body, or NULL if none
+ * @return true if the entire response was sent
+ */
+bool send_response(int sock_fd, response_header *response, response_body *body) {
+	if (response->overflow) {
+		setErrorResponse(response, 500, "Internal Server Error", NULL);
+		body = NULL;
+	}
+	if (debug) {
+		debugResponseHeader(response);
+	}
+	struct timespec sending;
+	startTimer(&sending);
+	bool sent = send_segments(sock_fd, response, body);
+	recordLatency(LATENCY_SEND, &sending);
+	return sent;
+}
+
+/**
+ * Release the content held by a response body.
+ *
+ * @param body the response body
+ */
+void release_body(response_body *body) {
+	if (body->entry != NULL) {
+		releaseCachedContent(body->entry);
+	}
+	if (body->fd >= 0) {
+		close(body->fd);
+	}
+	free(body->parts);
+	freeResponseStream(body->stream);
+	*body = (response_body){ .fd = -1 };
+}
+
+/**
+ * Handle GET request.
+ *
+ * @param sock_fd the socket descriptor
+ * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param response the response header
+ * @return true if the entire response was sent
+ */
+bool do_get(int sock_fd, const char uri[], const char version[], http_headers *requestHeaders,
+			http_headers *responseHeaders, response_header *response) {
+	// prepare response header and content
+	response_body body;
+	start_get(response, uri, version, requestHeaders, responseHeaders, &body);
+
+	// output response header and bytes
+	bool sent = send_response(sock_fd, response, &body);
+	release_body(&body);
+	return sent;
+}
+
+/**
+ * Get the methods the server accepts.
+ *
+ * @return the value of the Allow header
+ */
+static const char *allowed_methods(void) {
+	return isUploadEnabled() ? "GET, HEAD, OPTIONS, POST, PUT" : "GET, HEAD, OPTIONS";
+}
+
+/**
+ * Get the message of a response status the methods report.
+ *
+ * @param status the response status
+ * @return the status message
+ */
+static const char *status_message(int status) {
+	switch (status) {
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 408: return "Request Timeout";
+	case 409: return "Conflict";
+	case 411: return "Length Required";
+	case 413: return "Content Too Large";
+	case 414: return "URI Too Long";
+	case 501: return "Not Implemented";
+	case 507: return "Insufficient Storage";
+	default: return "Internal Server Error";
+	}
+}
+
+/**
+ * Prepare the HEAD response header: the header GET would send,
+ * without the body.
+ *
+ * @param response set to the response header
+ * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param body set to the empty response body
+ * @return false, since the response has no body
+ */
+static bool start_head(response_header *response, const char uri[], const char version[],
+					   http_headers *requestHeaders, http_headers *responseHeaders,
+					   response_body *body) {
+	start_get(response, uri, version, requestHeaders, responseHeaders, body);
+	release_body(body);
+
+	// drop error page that follows header
+	const char *end = memmem(response->buf, response->len, "\r\n\r\n", 4);
+	if (end != NULL) {
+		response->len = (size_t)(end + 4 - response->buf);
+	}
+	return false;
+}
+
+/**
+ * Prepare the OPTIONS response header listing the accepted methods.
+ *
+ * @param response set to the response header
+ * @param responseHeaders the response headers
+ * @return false, since the response has no body
+ */
+static bool start_options(response_header *response, http_headers *responseHeaders) {
+	putHeader(responseHeaders, "Allow", allowed_methods());
+	putHeader(responseHeaders, "Content-Length", "0");
+	beginResponse(response, 200, "OK");
+	endResponseProperties(response, responseHeaders);   // end of response properties
+	return false;
+}
+
+/**
+ * Test whether a method uploads its request body.
+ *
+ * @param method the request method
+ * @return true for PUT and POST
+ */
+bool is_upload_method(const char method[]) {
+	return strcasecmp(method, "PUT") == 0 || strcasecmp(method, "POST") == 0;
+}
+
+/**
+ * Test whether preparing the response to a request may block on
+ * opening or reading content, compressing it, or listing a
+ * directory. A GET or HEAD request may block unless the content
+ * it needs is already in the cache; other requests do not.
+ *
+ * @param method the request method
+ * @param uri the request URI
+ * @param requestHeaders the request headers
+ * @return true if the response may block
+ */
+bool may_block_method(const char method[], const char uri[], const http_headers *requestHeaders) {
+	if ((strcasecmp(method, "GET") != 0 && strcasecmp(method, "HEAD") != 0)
+			|| strcmp(uri, STATS_URI) == 0) {
+		return false;
+	}
+	char filePath[PATH_MAX];
+	if (resolveUri(uri, filePath, sizeof filePath) != 0) {
+		return false;  // answered with an error
+	}
+
+	// content compressed for the client, or small enough to send as is
+	size_t size;
+	const char *contentType = lookupContentType(filePath);
+	const char *encoding = NULL;
+	if (isCompressible(contentType) && getHeader(requestHeaders, "Range") == NULL) {
+		encoding = getAcceptedEncoding(requestHeaders);
+	}
+	if (encoding != NULL) {
+		char gzPath[PATH_MAX];
+		if (isContentCached(filePath, encoding, &size)
+				|| (strcmp(encoding, "gzip") == 0
+					&& snprintf(gzPath, sizeof gzPath, "%s.gz", filePath) < (int)sizeof gzPath
+					&& isContentCached(gzPath, encoding, &size))) {
+			return false;
+		}
+		return !isContentCached(filePath, NULL, &size) || size >= COMPRESS_MIN_SIZE;
+	}
+	return !isContentCached(filePath, NULL, &size);
+}
+
+/**
+ * Prepare the response to a request that has no body to read:
+ * GET, HEAD, and OPTIONS. Uploads are answered 405 Method Not
+ * Allowed if not enabled, and other methods 501 Not Implemented.
+ * A body sent with the request is not read here; the request
+ * engine reads past it or closes the connection.
+ *
+ * @param response set to the response header
+ * @param method the request method
+ * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param body set to the response body, which must be released
+ * @return true if the body should be sent, false if the response has no body
+ */
+bool start_method(response_header *response, const char method[], const char uri[],
+				  const char version[], http_headers *requestHeaders,
+				  http_headers *responseHeaders, response_body *body) {
+	*body = (response_body){ .fd = -1 };
+	if (strcasecmp(method, "GET") == 0) {
+		return start_get(response, uri, version, requestHeaders, responseHeaders, body);
+	}
+	if (strcasecmp(method, "HEAD") == 0) {
+		return start_head(response, uri, version, requestHeaders, responseHeaders, body);
+	}
+	if (strcasecmp(method, "OPTIONS") == 0) {
+		return start_options(response, responseHeaders);
+	}
+	if (is_upload_method(method)) {
+		putHeader(responseHeaders, "Allow", allowed_methods());
+		setErrorResponse(response, 405, status_message(405), responseHeaders);
+	} else {
+		setErrorResponse(response, 501, status_message(501), responseHeaders);
+	}
+	return false;
+}
+
+/**
+ * Prepare the interim response a client waits for before
+ * sending the request body, if it asked for one.
+ *
+ * @param response set to the interim response header
+ * @param requestHeaders the request headers
+ * @return true if the client expects 100 Continue
+ */
+bool start_continue(response_header *response, const http_headers *requestHeaders) {
+	const char *expect = getHeader(requestHeaders, "Expect");
+	if (expect == NULL || strcasecmp(expect, "100-continue") != 0) {
+		return false;
+	}
+	static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+	memcpy(response->buf, interim, sizeof interim - 1);
+	response->len = sizeof interim - 1;
+	response->status = 100;
+	response->nsent = 0;
+	response->overflow = false;
+	return true;
+}
+
+/**
+ * Prepare the response to an upload that has been stored
+ * or has failed.
+ *
+ * @param response set to the response header
+ * @param upload the upload
+ * @param status 201 if a file was created, 204 if one was
+ *   replaced, or the status of the error response
+ * @param responseHeaders the response headers
+ */
+void end_upload(response_header *response, const http_upload *upload, int status,
+				http_headers *responseHeaders) {
+	switch (status) {
+	case 201:
+		putHeader(responseHeaders, "Location", upload->location);
+		putHeader(responseHeaders, "Content-Length", "0");
+		beginResponse(response, 201, "Created");
+		endResponseProperties(response, responseHeaders);   // end of response properties
+		break;
+	case 204:
+		beginResponse(response, 204, "No Content");
+		endResponseProperties(response, responseHeaders);   // end of response properties
+		break;
+	case 405:
+		putHeader(responseHeaders, "Allow", allowed_methods());
+		setErrorResponse(response, status, status_message(status), responseHeaders);
+		break;
+	default:
+		setErrorResponse(response, status, status_message(status), responseHeaders);
+	}
 }
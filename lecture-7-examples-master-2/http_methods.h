@@ -1,7 +1,8 @@
 /*
  * http_methods.h
  *
- * Functions that implement HTTP methods, including GET.
+ * Functions that implement HTTP methods: GET, HEAD, OPTIONS,
+ * and the responses to PUT and POST uploads.
  *
  *  @since 2019-04-10
  *  @author: Philip Gust
@@ -10,14 +11,167 @@
 #ifndef HTTP_METHODS_H_
 #define HTTP_METHODS_H_
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
+
+#include "content_cache.h"
+#include "http_headers.h"
+#include "http_stream.h"
+#include "http_upload.h"
+#include "http_util.h"
+
+/** smallest content that is compressed on the fly */
+#define COMPRESS_MIN_SIZE 256
+
+/** highest page number of a directory listing */
+#define MAX_INDEX_PAGE 100000
+
+/** maximum number of body segments: a separator and data per range, and a trailer */
+#define MAX_BODY_SEGMENTS (2 * MAX_RANGES + 1)
+
+/** Segment of response body bytes from memory or the content file */
+typedef struct {
+	const char *data;		// in-memory bytes, or NULL to send from content file
+	off_t offset;			// offset of first byte in data or content file
+	unsigned long nbytes;	// number of bytes remaining
+} body_segment;
+
+/** Source of response body bytes */
+typedef struct {
+	int fd;					// content file, or -1 if none
+	content_entry *entry;	// cache entry holding content, or NULL if none
+	char *parts;			// rendered multipart separators, or NULL if none
+	response_stream *stream;	// body generated after the segments, or NULL if none
+	int nsegments;			// number of segments
+	int segment;			// index of next segment to send
+	body_segment segments[MAX_BODY_SEGMENTS];
+} response_body;
+
+/**
+ * Set whether directories that have no index.html are listed.
+ *
+ * @param enabled true to list directories
+ */
+void setAutoindex(bool enabled);
+
+/**
+ * Resolve uri to content, prepare the GET response header, and
+ * prepare the response body from the content cache or the
+ * content file. Requested byte ranges are sent as 206 Partial
+ * Content, using multipart/byteranges for more than one range.
+ * Sends 304 Not Modified instead if the client's copy is current,
+ * or an error response if the content is not available. Generated
+ * bodies are streamed with chunked transfer coding to HTTP/1.1
+ * clients.
+ *
+ * @param response set to the response header
+ * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param body set to the response body, which must be released
+ * @return true if the body should be sent, false if the response has no body
+ */
+bool start_get(response_header *response, const char uri[], const char version[],
+			   http_headers *requestHeaders, http_headers *responseHeaders, response_body *body);
+
+/**
+ * Send response header and body to the client socket. The header
+ * and any in-memory body segments that follow it are sent in one
+ * writev(); content file segments are sent with sendfile(), and
+ * a generated body is sent a chunk at a time as it is produced.
+ *
+ * @param sock_fd the socket descriptor
+ * @param response the response header; counts the bytes sent
+ * @param body the response body, or NULL if none
+ * @return true if the entire response was sent
+ */
+bool send_response(int sock_fd, response_header *response, response_body *body);
+
+/**
+ * Release the content held by a response body.
+ *
+ * @param body the response body
+ */
+void release_body(response_body *body);
 
 /**
  * Handle GET request.
  *
- * @param the socket stream
+ * @param sock_fd the socket descriptor
  * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param response the response header
+ * @return true if the entire response was sent
+ */
+bool do_get(int sock_fd, const char uri[], const char version[], http_headers *requestHeaders,
+			http_headers *responseHeaders, response_header *response);
+
+/**
+ * Test whether a method uploads its request body.
+ *
+ * @param method the request method
+ * @return true for PUT and POST
+ */
+bool is_upload_method(const char method[]);
+
+/**
+ * Test whether preparing the response to a request may block on
+ * opening or reading content, compressing it, or listing a
+ * directory. A GET or HEAD request may block unless the content
+ * it needs is already in the cache; other requests do not.
+ *
+ * @param method the request method
+ * @param uri the request URI
+ * @param requestHeaders the request headers
+ * @return true if the response may block
+ */
+bool may_block_method(const char method[], const char uri[], const http_headers *requestHeaders);
+
+/**
+ * Prepare the response to a request that has no body to read:
+ * GET, HEAD, and OPTIONS. Uploads are answered 405 Method Not
+ * Allowed if not enabled, and other methods 501 Not Implemented.
+ * A body sent with the request is not read here; the request
+ * engine reads past it or closes the connection.
+ *
+ * @param response set to the response header
+ * @param method the request method
+ * @param uri the request URI
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param body set to the response body, which must be released
+ * @return true if the body should be sent, false if the response has no body
+ */
+bool start_method(response_header *response, const char method[], const char uri[],
+				  const char version[], http_headers *requestHeaders, http_headers *responseHeaders,
+				  response_body *body);
+
+/**
+ * Prepare the interim response a client waits for before
+ * sending the request body, if it asked for one.
+ *
+ * @param response set to the interim response header
+ * @param requestHeaders the request headers
+ * @return true if the client expects 100 Continue
+ */
+bool start_continue(response_header *response, const http_headers *requestHeaders);
+
+/**
+ * Prepare the response to an upload that has been stored
+ * or has failed.
+ *
+ * @param response set to the response header
+ * @param upload the upload
+ * @param status 201 if a file was created, 204 if one was
+ *   replaced, or the status of the error response
+ * @param responseHeaders the response headers
  */
-void do_get(FILE *stream, const char uri[]);
+void end_upload(response_header *response, const http_upload *upload, int status,
+				http_headers *responseHeaders);
 
 #endif /* HTTP_METHODS_H_ */
@@ -0,0 +1,358 @@
+/*
+ * http_parser.c
+ *
+ * Incremental HTTP request header parser. The parser is a state
+ * machine that looks at each byte once, so a header that arrives
+ * in pieces costs no more to parse than one that arrives whole.
+ * Tokens are recorded as spans of the caller's buffer rather than
+ * copied, and the size limits are checked as bytes are parsed, so
+ * an oversized request is rejected without reading all of it.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "http_parser.h"
+
+/** Parser states */
+enum {
+	S_START,			// before request line; blank lines are skipped
+	S_METHOD,			// in method
+	S_URI_START,		// after method
+	S_URI,				// in request target
+	S_VERSION,			// in version
+	S_LINE_LF,			// after CR ending request line
+	S_FIELD_START,		// at start of a header line
+	S_NAME,				// in field name
+	S_VALUE_START,		// before field value
+	S_VALUE,			// in field value
+	S_FIELD_LF,			// after CR ending header line
+	S_END_LF,			// after CR ending header
+	S_DONE				// complete or failed
+};
+
+/** default request header limits */
+const http_limits default_limits = {
+	.max_request_line = DEFAULT_MAX_REQUEST_LINE,
+	.max_header = DEFAULT_MAX_REQUEST_HEADER,
+	.max_fields = MAX_REQUEST_FIELDS
+};
+
+/** true for characters allowed in a method or field name (RFC 7230 tchar) */
+static const bool isToken[256] = {
+	['0' ... '9'] = true, ['A' ... 'Z'] = true, ['a' ... 'z'] = true,
+	['!'] = true, ['#'] = true, ['$'] = true, ['%'] = true, ['&'] = true,
+	['\''] = true, ['*'] = true, ['+'] = true, ['-'] = true, ['.'] = true,
+	['^'] = true, ['_'] = true, ['`'] = true, ['|'] = true, ['~'] = true
+};
+
+/**
+ * Test whether a character is a control character other
+ * than horizontal tab, which may not appear in a header.
+ *
+ * @param ch the character
+ * @return true if a control character
+ */
+static inline bool isControl(unsigned char ch) {
+	return (ch < ' ' && ch != '\t') || ch == 0x7f;
+}
+
+/**
+ * Stop parsing with a result.
+ *
+ * @param parser the parser
+ * @param status the result
+ * @return the result
+ */
+static parse_status finish(http_parser *parser, parse_status status) {
+	parser->state = S_DONE;
+	parser->status = status;
+	return status;
+}
+
+/**
+ * Check that a version is "HTTP/" followed by a
+ * one-digit major and minor version.
+ *
+ * @param version the version
+ * @return PARSE_INCOMPLETE if HTTP/1.x, or the error status
+ */
+static parse_status checkVersion(const http_span *version) {
+	const char *v = version->start;
+	if (version->len != 8 || memcmp(v, "HTTP/", 5) != 0
+			|| v[5] < '0' || v[5] > '9' || v[6] != '.' || v[7] < '0' || v[7] > '9') {
+		return PARSE_BAD_REQUEST;
+	}
+	return (v[5] == '1') ? PARSE_INCOMPLETE : PARSE_BAD_VERSION;
+}
+
+/**
+ * Replace the delimiter following a span with a NUL.
+ *
+ * @param buf the request buffer
+ * @param span the span
+ */
+static inline void terminateSpan(char buf[], const http_span *span) {
+	buf[(span->start - buf) + span->len] = '\0';
+}
+
+/**
+ * Initialize parser to parse a request header from
+ * the beginning of a request buffer.
+ *
+ * @param parser the parser
+ * @param limits the size limits, or NULL for default_limits
+ */
+void initParser(http_parser *parser, const http_limits *limits) {
+	parser->limits = (limits != NULL) ? limits : &default_limits;
+	parser->state = S_START;
+	parser->status = PARSE_INCOMPLETE;
+	parser->pos = 0;
+	parser->line_start = 0;
+	parser->nfields = 0;
+	parser->length = 0;
+}
+
+/**
+ * Parse request header bytes that have arrived since the last call.
+ * The buffer must be the same on every call for one request header.
+ *
+ * When the header is complete, the request line and fields are
+ * spans of the buffer, and a NUL replaces the delimiter following
+ * each span, so the span data can also be used as strings.
+ *
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param len the number of bytes in the buffer
+ * @return PARSE_INCOMPLETE if more bytes are needed, PARSE_COMPLETE
+ *   once the header is complete, or the status of an error response
+ */
+parse_status parseRequest(http_parser *parser, char buf[], size_t len) {
+	if (parser->state == S_DONE) {
+		return parser->status;
+	}
+	const http_limits *limits = parser->limits;
+	int maxFields = (limits->max_fields < MAX_REQUEST_FIELDS) ? limits->max_fields : MAX_REQUEST_FIELDS;
+
+	// stop at header limit; going past it is an error
+	size_t end = (len < limits->max_header) ? len : limits->max_header;
+	int state = parser->state;
+	size_t i;
+	for (i = parser->pos; i < end; i++) {
+		unsigned char ch = buf[i];
+		switch (state) {
+		case S_START:
+			if (ch == '\r' || ch == '\n') {
+				parser->line_start = i + 1;
+				continue;
+			}
+			if (!isToken[ch]) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			parser->mark = i;
+			state = S_METHOD;
+			break;
+
+		case S_METHOD:
+			if (ch == ' ') {
+				parser->method = (http_span){ buf + parser->mark, i - parser->mark };
+				state = S_URI_START;
+			} else if (!isToken[ch]) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			break;
+
+		case S_URI_START:
+			if (ch <= ' ' || ch == 0x7f) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			parser->mark = i;
+			state = S_URI;
+			break;
+
+		case S_URI:
+			if (ch == ' ') {
+				parser->uri = (http_span){ buf + parser->mark, i - parser->mark };
+				parser->mark = i + 1;
+				state = S_VERSION;
+			} else if (ch < ' ' || ch == 0x7f) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			break;
+
+		case S_VERSION:
+			if (ch == '\r' || ch == '\n') {
+				parser->version = (http_span){ buf + parser->mark, i - parser->mark };
+				parse_status status = checkVersion(&parser->version);
+				if (status != PARSE_INCOMPLETE) {
+					return finish(parser, status);
+				}
+				state = (ch == '\r') ? S_LINE_LF : S_FIELD_START;
+			} else if (i - parser->mark >= 8) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			break;
+
+		case S_LINE_LF:
+		case S_FIELD_LF:
+			if (ch != '\n') {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			state = S_FIELD_START;
+			break;
+
+		case S_FIELD_START:
+			if (ch == '\r') {
+				state = S_END_LF;
+			} else if (ch == '\n') {
+				goto complete;
+			} else if (!isToken[ch]) {
+				// includes obsolete line folding, which may be rejected
+				return finish(parser, PARSE_BAD_REQUEST);
+			} else if (parser->nfields == maxFields) {
+				return finish(parser, PARSE_HEADER_TOO_LARGE);
+			} else {
+				parser->mark = i;
+				state = S_NAME;
+			}
+			break;
+
+		case S_NAME:
+			if (ch == ':') {
+				parser->fields[parser->nfields].name = (http_span){ buf + parser->mark, i - parser->mark };
+				state = S_VALUE_START;
+			} else if (!isToken[ch]) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			break;
+
+		case S_VALUE_START:
+			if (ch == ' ' || ch == '\t') {
+				break;
+			}
+			parser->mark = parser->value_end = i;
+			state = S_VALUE;
+			// fall through
+
+		case S_VALUE:
+			if (ch == '\r' || ch == '\n') {
+				parser->fields[parser->nfields++].value =
+						(http_span){ buf + parser->mark, parser->value_end - parser->mark };
+				state = (ch == '\r') ? S_FIELD_LF : S_FIELD_START;
+			} else if (isControl(ch)) {
+				return finish(parser, PARSE_BAD_REQUEST);
+			} else if (ch != ' ' && ch != '\t') {
+				parser->value_end = i + 1;
+			}
+			break;
+
+		case S_END_LF:
+			if (ch != '\n') {
+				return finish(parser, PARSE_BAD_REQUEST);
+			}
+			goto complete;
+		}
+
+		// request line limit applies until the version is reached
+		if (state > S_START && state < S_VERSION && i - parser->line_start >= limits->max_request_line) {
+			return finish(parser, (state >= S_URI_START) ? PARSE_URI_TOO_LONG : PARSE_BAD_REQUEST);
+		}
+	}
+
+	parser->state = state;
+	parser->pos = i;
+	if (i == limits->max_header) {
+		return finish(parser, (state < S_LINE_LF) ? PARSE_URI_TOO_LONG : PARSE_HEADER_TOO_LARGE);
+	}
+	return PARSE_INCOMPLETE;
+
+complete:
+	parser->length = i + 1;
+	terminateSpan(buf, &parser->method);
+	terminateSpan(buf, &parser->uri);
+	terminateSpan(buf, &parser->version);
+	for (int f = 0; f < parser->nfields; f++) {
+		terminateSpan(buf, &parser->fields[f].name);
+		terminateSpan(buf, &parser->fields[f].value);
+	}
+	return finish(parser, PARSE_COMPLETE);
+}
+
+/**
+ * Test whether any part of a request has been parsed,
+ * apart from blank lines before the request line.
+ *
+ * @param parser the parser
+ * @return true if a request has been started
+ */
+bool isRequestStarted(const http_parser *parser) {
+	return parser->state != S_START;
+}
+
+/**
+ * Get the request line, or as much of it as has been received,
+ * for logging a request that could not be parsed.
+ *
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param len the number of bytes in the buffer
+ * @param line the request line
+ * @param size the size of the line buffer
+ */
+void getRequestLine(const http_parser *parser, const char buf[], size_t len,
+					char line[], size_t size) {
+	size_t start = (parser->line_start < len) ? parser->line_start : len;
+	size_t n = 0;
+	while (start + n < len && n + 1 < size && buf[start + n] != '\r' && buf[start + n] != '\n') {
+		line[n] = buf[start + n];
+		n++;
+	}
+	line[n] = '\0';
+}
+
+/**
+ * Get the response message for an error parsing a request.
+ *
+ * @param status the parse status
+ * @return the response message
+ */
+const char *getParseErrorMessage(parse_status status) {
+	switch (status) {
+	case PARSE_URI_TOO_LONG:
+		return "URI Too Long";
+	case PARSE_HEADER_TOO_LARGE:
+		return "Request Header Fields Too Large";
+	case PARSE_BAD_VERSION:
+		return "HTTP Version Not Supported";
+	default:
+		return "Bad Request";
+	}
+}
+
+/**
+ * Add the header fields of a complete request header to request
+ * headers. Repeated fields are combined into one comma-separated
+ * value, and values longer than a header value are truncated.
+ *
+ * @param parser the parser
+ * @param headers the request headers
+ */
+void getRequestHeaders(const http_parser *parser, http_headers *headers) {
+	for (int f = 0; f < parser->nfields; f++) {
+		const http_field *field = &parser->fields[f];
+		if (field->name.len >= MAX_HEADER_NAME) {
+			continue;  // no field the server uses has so long a name
+		}
+		const char *earlier = getHeader(headers, field->name.start);
+		if (earlier == NULL) {
+			putHeader(headers, field->name.start, field->value.start);
+		} else {
+			char combined[MAXBUF];
+			snprintf(combined, sizeof combined, "%s, %s", earlier, field->value.start);
+			putHeader(headers, field->name.start, combined);
+		}
+	}
+}
@@ -0,0 +1,148 @@
+/*
+ * http_parser.h
+ *
+ * Incremental HTTP request header parser. The parser works over
+ * the caller's request buffer without copying or allocating, and
+ * can be resumed as more bytes arrive. Once the header is complete,
+ * the method, URI, version, and header fields are spans of the
+ * buffer.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef HTTP_PARSER_H_
+#define HTTP_PARSER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "http_headers.h"
+
+/** maximum number of header fields the parser can hold */
+#define MAX_REQUEST_FIELDS MAX_HEADERS
+
+/** default maximum length of the request line */
+#define DEFAULT_MAX_REQUEST_LINE 8192
+
+/** default maximum length of the request header, including the request line */
+#define DEFAULT_MAX_REQUEST_HEADER 16384
+
+/** size of a request buffer that holds the largest default request header */
+#define REQUEST_BUFFER DEFAULT_MAX_REQUEST_HEADER
+
+/** Result of parsing; errors are the status of the response to send */
+typedef enum {
+	PARSE_INCOMPLETE = 0,			// more bytes needed
+	PARSE_COMPLETE = 200,			// request header complete
+	PARSE_BAD_REQUEST = 400,		// malformed request
+	PARSE_URI_TOO_LONG = 414,		// request line over limit
+	PARSE_HEADER_TOO_LARGE = 431,	// request header or field count over limit
+	PARSE_BAD_VERSION = 505			// not an HTTP/1.x request
+} parse_status;
+
+/** Limits on the size of a request header */
+typedef struct {
+	size_t max_request_line;	// longest request line
+	size_t max_header;			// longest request header, including the request line
+	int max_fields;				// most header fields, up to MAX_REQUEST_FIELDS
+} http_limits;
+
+/** Part of the request buffer */
+typedef struct {
+	const char *start;		// first byte of the span
+	size_t len;				// length of the span
+} http_span;
+
+/** A header field */
+typedef struct {
+	http_span name;			// field name
+	http_span value;		// field value without surrounding whitespace
+} http_field;
+
+/** State of parsing one request header */
+typedef struct {
+	const http_limits *limits;	// size limits
+	int state;					// parser state
+	parse_status status;		// result once complete or failed
+	size_t pos;					// next byte to parse
+	size_t line_start;			// start of the request line
+	size_t mark;				// start of the token being parsed
+	size_t value_end;			// end of field value before trailing whitespace
+	http_span method;			// request method
+	http_span uri;				// request target
+	http_span version;			// protocol version, e.g. "HTTP/1.1"
+	http_field fields[MAX_REQUEST_FIELDS];	// header fields in order received
+	int nfields;				// number of header fields
+	size_t length;				// length of the complete request header
+} http_parser;
+
+/** default request header limits */
+extern const http_limits default_limits;
+
+/**
+ * Initialize parser to parse a request header from
+ * the beginning of a request buffer.
+ *
+ * @param parser the parser
+ * @param limits the size limits, or NULL for default_limits
+ */
+void initParser(http_parser *parser, const http_limits *limits);
+
+/**
+ * Parse request header bytes that have arrived since the last call.
+ * The buffer must be the same on every call for one request header.
+ *
+ * When the header is complete, the request line and fields are
+ * spans of the buffer, and a NUL replaces the delimiter following
+ * each span, so the span data can also be used as strings.
+ *
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param len the number of bytes in the buffer
+ * @return PARSE_INCOMPLETE if more bytes are needed, PARSE_COMPLETE
+ *   once the header is complete, or the status of an error response
+ */
+parse_status parseRequest(http_parser *parser, char buf[], size_t len);
+
+/**
+ * Test whether any part of a request has been parsed,
+ * apart from blank lines before the request line.
+ *
+ * @param parser the parser
+ * @return true if a request has been started
+ */
+bool isRequestStarted(const http_parser *parser);
+
+/**
+ * Get the request line, or as much of it as has been received,
+ * for logging a request that could not be parsed.
+ *
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param len the number of bytes in the buffer
+ * @param line the request line
+ * @param size the size of the line buffer
+ */
+void getRequestLine(const http_parser *parser, const char buf[], size_t len,
+					char line[], size_t size);
+
+/**
+ * Get the response message for an error parsing a request.
+ *
+ * @param status the parse status
+ * @return the response message
+ */
+const char *getParseErrorMessage(parse_status status);
+
+/**
+ * Add the header fields of a complete request header to request
+ * headers. Repeated fields are combined into one comma-separated
+ * value, and values longer than a header value are truncated.
+ *
+ * @param parser the parser
+ * @param headers the request headers
+ */
+void getRequestHeaders(const http_parser *parser, http_headers *headers);
+
+#endif /* HTTP_PARSER_H_ */
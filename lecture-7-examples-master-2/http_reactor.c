@@ -0,0 +1,1018 @@
+/*
+ * http_reactor.c
+ *
+ * Event-driven request engine that multiplexes non-blocking
+ * client sockets on a single thread using edge-triggered epoll.
+ *
+ * Each connection has a fixed request buffer that is filled as
+ * bytes arrive, and the request header is parsed incrementally
+ * as it is received. A complete request is answered by
+ * assembling the response header with the same functions the
+ * stream model uses into the connection's header buffer, then
+ * writing the header and in-memory content together and sending
+ * the content file as the socket accepts them. Requests already
+ * buffered behind the current one are answered in order once its
+ * response is sent. A generated body is produced a chunk at a
+ * time as the socket accepts it. A PUT or POST body is stored as
+ * it arrives, in whatever pieces the socket yields, before the
+ * response is prepared.
+ *
+ * A response that is not in the content cache may block on
+ * reading a file, compressing it, or listing a directory, so it
+ * is prepared on a helper thread rather than the event thread,
+ * and each chunk of a generated body such as a directory listing
+ * is produced on one too. The connection is not serviced until an
+ * eventfd wakes the event loop to send it. Cache hits are
+ * answered inline.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "access_log.h"
+#include "http_headers.h"
+#include "http_methods.h"
+#include "http_parser.h"
+#include "http_reactor.h"
+#include "http_server.h"
+#include "http_upload.h"
+#include "http_util.h"
+#include "network_util.h"
+#include "server_stats.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+
+/** State of one client connection */
+typedef struct connection {
+	int fd;					// client socket
+	char in[REQUEST_BUFFER];	// buffered request bytes
+	size_t in_len;			// number of buffered request bytes
+	http_parser parser;		// parser of request header in buffer
+	bool in_full;			// buffer filled before socket was drained
+	bool peer_closed;		// client closed its side or failed
+	response_header response;	// assembled response header
+	size_t out_pos;			// bytes of response header sent
+	response_body body;		// remaining response body
+	http_upload upload;		// upload receiving request body
+	bool receiving;			// request body is being received
+	bool preparing;			// response is being prepared by a helper thread
+	long long discarding;	// bytes of an unused request body left to read
+	access_entry access;	// access log entry for current request
+	struct timespec sending;	// time response became ready to send
+	bool keep_alive;		// keep connection open after response
+	int nrequests;			// number of requests received
+	time_t last_active;		// time of last socket activity
+	struct connection *prev, *next;	// activity list, oldest first
+} connection;
+
+/** Response to prepare, or chunk of a streamed body to fill, on a helper thread */
+typedef struct prepare_job {
+	connection *c;			// connection of the request
+	response_stream *stream;	// stream to fill, or NULL to prepare response
+	int fill_status;		// result of filling the stream
+	const char *method;		// request method in connection's buffer
+	const char *uri;		// request URI in connection's buffer
+	const char *version;	// request version in connection's buffer
+	http_headers requestHeaders;	// request headers
+	http_headers responseHeaders;	// response headers
+	long long discard;		// unused request body to read past
+	struct prepare_job *next;	// next job in queue
+} prepare_job;
+
+/** connections ordered from least to most recently active */
+static connection *active_head = NULL, *active_tail = NULL;
+
+/** epoll descriptor of the event loop */
+static int epoll_fd = -1;
+
+/** true when connections are to be closed after their current request */
+static bool draining = false;
+
+/** monitor for the queues of responses prepared by helper threads */
+static pthread_mutex_t prepare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** signals helper threads that a job is queued or they are to stop */
+static pthread_cond_t prepare_cond = PTHREAD_COND_INITIALIZER;
+
+/** jobs waiting for a helper thread, oldest first */
+static prepare_job *pending_head = NULL, *pending_tail = NULL;
+
+/** jobs whose responses are prepared, waiting for the event loop */
+static prepare_job *prepared = NULL;
+
+/** true when helper threads are to exit */
+static bool stopping_helpers = false;
+
+/** helper threads that prepare responses that may block */
+static pthread_t helpers[REACTOR_HELPER_THREADS];
+
+/** number of helper threads running */
+static int nhelpers = 0;
+
+/** eventfd that wakes the event loop when responses are prepared */
+static int prepared_fd = -1;
+
+/**
+ * Make a socket non-blocking.
+ *
+ * @param fd the socket descriptor
+ * @return 0 if successful, -1 on error
+ */
+static int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Remove connection from the activity list.
+ *
+ * @param c the connection
+ */
+static void unlink_connection(connection *c) {
+	if (c->prev != NULL) c->prev->next = c->next; else active_head = c->next;
+	if (c->next != NULL) c->next->prev = c->prev; else active_tail = c->prev;
+	c->prev = c->next = NULL;
+}
+
+/**
+ * Record activity on a connection by moving it to
+ * the end of the activity list.
+ *
+ * @param c the connection
+ */
+static void touch_connection(connection *c) {
+	if (active_head == c || c->prev != NULL) {  // new connection is not yet listed
+		unlink_connection(c);
+	}
+	c->last_active = time(NULL);
+	c->prev = active_tail;
+	if (active_tail != NULL) active_tail->next = c; else active_head = c;
+	active_tail = c;
+}
+
+/**
+ * Close connection and free its resources. Closing the
+ * socket also removes it from the epoll set.
+ *
+ * @param c the connection
+ */
+static void close_connection(connection *c) {
+	countConnection(-1);
+	unlink_connection(c);
+	release_body(&c->body);
+	if (c->receiving) {
+		abortUpload(&c->upload);
+	}
+	close(c->fd);
+	free(c);
+}
+
+/**
+ * Read available request bytes into the request buffer
+ * until the socket would block or the buffer is full.
+ *
+ * @param c the connection
+ */
+static void read_input(connection *c) {
+	c->in_full = false;
+	while (c->in_len < sizeof c->in) {
+		ssize_t n = read(c->fd, c->in + c->in_len, sizeof c->in - c->in_len);
+		if (n > 0) {
+			c->in_len += n;
+		} else if (n == 0) {
+			c->peer_closed = true;
+			return;
+		} else if (errno == EINTR) {
+			continue;
+		} else {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				c->peer_closed = true;
+			}
+			return;
+		}
+	}
+	c->in_full = true;  // more may be waiting; no new edge will say so
+}
+
+/**
+ * Remove the request from the front of the request buffer.
+ *
+ * @param c the connection
+ * @param discard the length of an unused request body behind it,
+ *   which is read before the response is sent, or -1 to drop
+ *   all input because the connection will close
+ */
+static void remove_request(connection *c, long long discard) {
+	c->in_len -= c->parser.length;
+	memmove(c->in, c->in + c->parser.length, c->in_len);
+	if (discard > 0) {
+		c->discarding = discard;
+	} else if (discard < 0) {
+		c->in_len = 0;
+	}
+}
+
+/**
+ * Make a rendered response ready to send, and reset the parser
+ * for the next request.
+ *
+ * @param c the connection
+ */
+static void finish_response(connection *c) {
+	if (c->response.overflow) {
+		release_body(&c->body);
+		setErrorResponse(&c->response, 500, "Internal Server Error", NULL);
+	}
+	if (debug) {
+		debugResponseHeader(&c->response);
+	}
+	c->out_pos = 0;
+	startTimer(&c->sending);
+	initParser(&c->parser, NULL);
+}
+
+/**
+ * Queue a job for the helper threads and stop servicing its
+ * connection until the job is done.
+ *
+ * @param job the job
+ */
+static void queue_job(prepare_job *job) {
+	job->next = NULL;
+	job->c->preparing = true;
+	pthread_mutex_lock(&prepare_lock);  // lock prepare monitor
+		if (pending_tail != NULL) pending_tail->next = job; else pending_head = job;
+		pending_tail = job;
+		pthread_cond_signal(&prepare_cond);
+	pthread_mutex_unlock(&prepare_lock);  // unlock prepare monitor
+}
+
+/**
+ * Queue the response to the request at the front of the request
+ * buffer to be prepared by a helper thread. The connection is not
+ * serviced until the response is ready.
+ *
+ * @param c the connection
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param discard the length of an unused request body to read past
+ * @return true if queued, false if the response must be prepared here
+ */
+static bool prepare_response(connection *c, const http_headers *requestHeaders,
+							 const http_headers *responseHeaders, long long discard) {
+	if (nhelpers == 0) {
+		return false;
+	}
+	prepare_job *job = malloc(sizeof(prepare_job));
+	if (job == NULL) {
+		return false;
+	}
+	job->c = c;
+	job->stream = NULL;
+	job->method = c->parser.method.start;
+	job->uri = c->parser.uri.start;
+	job->version = c->parser.version.start;
+	job->requestHeaders = *requestHeaders;
+	job->responseHeaders = *responseHeaders;
+	job->discard = discard;
+	queue_job(job);
+	return true;
+}
+
+/**
+ * Queue the next chunk of a streamed body to be produced by a
+ * helper thread once the current chunk has been sent, since a
+ * producer such as a directory listing may block. The connection
+ * is not serviced until the chunk is ready.
+ *
+ * @param c the connection
+ * @return true if queued, false if the chunk must be produced here
+ */
+static bool fill_stream(connection *c) {
+	response_stream *stream = c->body.stream;
+	if (nhelpers == 0 || stream->pos < stream->len || stream->done) {
+		return false;  // nothing to produce
+	}
+	prepare_job *job = malloc(sizeof(prepare_job));
+	if (job == NULL) {
+		return false;
+	}
+	job->c = c;
+	job->stream = stream;
+	job->discard = 0;
+	queue_job(job);
+	return true;
+}
+
+/**
+ * Helper thread function prepares queued responses and fills
+ * chunks of streamed bodies, which may block on content files,
+ * compression, or directory listings, and hands them back to the
+ * event loop, until helpers are stopped. Only the connection's
+ * response and body are written; the event loop leaves them
+ * alone while the job is queued.
+ *
+ * @param arg unused
+ * @return NULL (unused)
+ */
+static void *prepare_responses(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&prepare_lock);  // lock prepare monitor
+	while (true) {
+		while (pending_head == NULL && !stopping_helpers) {
+			pthread_cond_wait(&prepare_cond, &prepare_lock);
+		}
+		if (stopping_helpers) {
+			break;
+		}
+		prepare_job *job = pending_head;
+		pending_head = job->next;
+		if (pending_head == NULL) {
+			pending_tail = NULL;
+		}
+		pthread_mutex_unlock(&prepare_lock);  // unlock prepare monitor
+
+		connection *c = job->c;
+		if (job->stream != NULL) {
+			job->fill_status = fillResponseStream(job->stream);
+		} else {
+			start_method(&c->response, job->method, job->uri, job->version,
+						 &job->requestHeaders, &job->responseHeaders, &c->body);
+		}
+
+		pthread_mutex_lock(&prepare_lock);  // lock prepare monitor
+		job->next = prepared;
+		prepared = job;
+		uint64_t one = 1;
+		if (write(prepared_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+			perror("eventfd");
+		}
+	}
+	pthread_mutex_unlock(&prepare_lock);  // unlock prepare monitor
+	return NULL;
+}
+
+/**
+ * Start the helper threads and register the eventfd that they
+ * use to wake the event loop.
+ *
+ * @return true if the helpers are running
+ */
+static bool start_helpers(void) {
+	if (prepared_fd >= 0) {
+		return true;  // still running from an earlier loop
+	}
+	prepared_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (prepared_fd < 0) {
+		perror("eventfd");
+		return false;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &prepared_fd };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, prepared_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+	stopping_helpers = false;
+	for (nhelpers = 0; nhelpers < REACTOR_HELPER_THREADS; nhelpers++) {
+		if (pthread_create(&helpers[nhelpers], NULL, prepare_responses, NULL) != 0) {
+			break;  // prepare responses on fewer threads, or on the event loop
+		}
+	}
+	return true;
+}
+
+/**
+ * Stop the helper threads once they finish the responses they
+ * are preparing, and drop the jobs that remain. Connections of
+ * dropped jobs are left to be closed.
+ */
+static void stop_helpers(void) {
+	pthread_mutex_lock(&prepare_lock);  // lock prepare monitor
+		stopping_helpers = true;
+		pthread_cond_broadcast(&prepare_cond);
+	pthread_mutex_unlock(&prepare_lock);  // unlock prepare monitor
+	for (int i = 0; i < nhelpers; i++) {
+		pthread_join(helpers[i], NULL);
+	}
+	nhelpers = 0;
+
+	prepare_job *queues[] = { pending_head, prepared };
+	for (int q = 0; q < 2; q++) {
+		prepare_job *next;
+		for (prepare_job *job = queues[q]; job != NULL; job = next) {
+			next = job->next;
+			job->c->preparing = false;
+			free(job);
+		}
+	}
+	pending_head = pending_tail = prepared = NULL;
+	if (prepared_fd >= 0) {
+		close(prepared_fd);
+		prepared_fd = -1;
+	}
+}
+
+/**
+ * Render the response to the request header at the front of
+ * the request buffer, then remove the request from the buffer.
+ *
+ * @param c the connection
+ * @param status the result of parsing the request header
+ */
+static void start_response(connection *c, parse_status status) {
+	http_parser *parser = &c->parser;
+	struct timespec parsing;
+	startTimer(&parsing);
+
+	http_headers requestHeaders, responseHeaders;
+	initHeaders(&requestHeaders);
+	initHeaders(&responseHeaders);
+
+	if (status != PARSE_COMPLETE) {
+		char line[MAXBUF];
+		getRequestLine(parser, c->in, c->in_len, line, sizeof line);
+		if (debug) {
+			fprintf(stderr, "request header invalid (%d): %s\n", status, line);
+		}
+		beginAccess(&c->access, "-", line);
+		c->keep_alive = false;
+		c->in_len = 0;  // discard rest of input
+		putHeader(&responseHeaders, "Connection", "close");
+		setErrorResponse(&c->response, status, getParseErrorMessage(status), &responseHeaders);
+	} else {
+		const char *method = parser->method.start;
+		const char *uri = parser->uri.start;
+		const char *version = parser->version.start;
+		beginAccess(&c->access, method, uri);
+		getRequestHeaders(parser, &requestHeaders);
+		if (debug) {
+			fprintf(stderr, "> %s %s %s\n", method, uri, version);
+			for (int f = 0; f < parser->nfields; f++) {
+				fprintf(stderr, "> %s: %s\n", parser->fields[f].name.start, parser->fields[f].value.start);
+			}
+		}
+
+		// keep connection open if client wants it, request cap not
+		// reached, server is not draining, and a body the request
+		// does not use can be read past, so it is not taken for
+		// the next request
+		bool upload = is_upload_method(method) && isUploadEnabled();
+		long long discard = upload ? 0 : getDiscardLength(&requestHeaders);
+		c->keep_alive = !draining && (++c->nrequests < KEEPALIVE_MAX_REQUESTS)
+						&& isKeepAlive(version, &requestHeaders) && (discard >= 0);
+		putHeader(&responseHeaders, "Connection", c->keep_alive ? "keep-alive" : "close");
+		recordLatency(LATENCY_PARSE, &parsing);
+
+		// dispatch based on method; a response that may block is
+		// prepared on a helper thread, and the request stays in
+		// the buffer until it is ready
+		int upload_status = -1;
+		if (upload) {
+			upload_status = beginUpload(&c->upload, method, uri, &requestHeaders);
+		} else if (may_block_method(method, uri, &requestHeaders)
+				   && prepare_response(c, &requestHeaders, &responseHeaders, discard)) {
+			return;
+		} else {
+			start_method(&c->response, method, uri, version, &requestHeaders, &responseHeaders, &c->body);
+		}
+		remove_request(c, discard);
+
+		if (upload_status > 0) {
+			if (upload_status >= 400) {
+				// body is not read, so connection cannot be reused
+				c->keep_alive = false;
+				c->in_len = 0;
+				putHeader(&responseHeaders, "Connection", "close");
+			}
+			end_upload(&c->response, &c->upload, upload_status, &responseHeaders);
+		} else if (upload_status == 0) {
+			// receive body before responding
+			c->receiving = true;
+			if (c->in_len > 0 || !start_continue(&c->response, &requestHeaders)) {
+				c->response.len = 0;
+			}
+		}
+	}
+
+	finish_response(c);
+}
+
+/**
+ * Send as much of the pending response as the socket accepts.
+ *
+ * @param c the connection
+ * @return 1 if response sent, 0 if socket would block, -1 on error
+ */
+static int flush_output(connection *c) {
+	response_body *body = &c->body;
+	while (c->out_pos < c->response.len || body->segment < body->nsegments) {
+		// gather rest of header and in-memory segments up to next content file segment
+		struct iovec iov[MAX_BODY_SEGMENTS + 1];
+		int iovcnt = 0;
+		if (c->out_pos < c->response.len) {
+			iov[iovcnt++] = (struct iovec){ c->response.buf + c->out_pos, c->response.len - c->out_pos };
+		}
+		for (int s = body->segment; s < body->nsegments && body->segments[s].data != NULL; s++) {
+			body_segment *seg = &body->segments[s];
+			iov[iovcnt++] = (struct iovec){ (char *)seg->data + seg->offset, seg->nbytes };
+		}
+
+		body_segment *seg = &body->segments[body->segment];
+		ssize_t n;
+		if (iovcnt > 0) {
+			n = writev(c->fd, iov, iovcnt);
+		} else if (seg->nbytes == 0) {
+			body->segment++;
+			continue;
+		} else {
+			n = sendfile(c->fd, body->fd, &seg->offset, seg->nbytes);
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		c->response.nsent += n;
+		if (iovcnt == 0) {
+			if (n == 0) {  // file shrank: cannot honor Content-Length
+				c->keep_alive = false;
+				break;
+			}
+			seg->nbytes -= n;  // sendfile() advances file offset itself
+			continue;
+		}
+
+		// advance past bytes written
+		size_t nbytes = (size_t)n;
+		size_t nheader = c->response.len - c->out_pos;
+		if (nbytes < nheader) {
+			c->out_pos += nbytes;
+			continue;
+		}
+		c->out_pos = c->response.len;
+		nbytes -= nheader;
+		while (nbytes > 0 || (body->segment < body->nsegments
+							  && body->segments[body->segment].data != NULL
+							  && body->segments[body->segment].nbytes == 0)) {
+			seg = &body->segments[body->segment];
+			size_t len = (nbytes < seg->nbytes) ? nbytes : seg->nbytes;
+			seg->offset += len;
+			seg->nbytes -= len;
+			nbytes -= len;
+			if (seg->nbytes == 0) {
+				body->segment++;
+			}
+		}
+	}
+
+	// generated body follows segments, produced by a helper
+	// thread a chunk at a time as the socket takes it
+	while (body->stream != NULL) {
+		response_stream *stream = body->stream;
+		if (fill_stream(c)) {
+			return 0;  // wait for helper to produce chunk
+		}
+		int status = fillResponseStream(stream);
+		if (status <= 0) {
+			if (status < 0) {
+				return -1;  // body cut short
+			}
+			break;
+		}
+		ssize_t n = write(c->fd, stream->buf + stream->pos, stream->len - stream->pos);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		c->response.nsent += n;
+		stream->pos += n;
+	}
+	release_body(body);
+	if (c->response.status >= 200 && c->response.len > 0) {  // not an interim response
+		recordLatency(LATENCY_SEND, &c->sending);
+		endAccess(&c->access, c->response.status, c->response.nsent);
+		countResponse(c->response.status, c->response.nsent);
+	}
+	c->out_pos = c->response.len = 0;
+	return 1;
+}
+
+/**
+ * Prepare the response to a stored or failed upload.
+ *
+ * @param c the connection
+ * @param status the upload status
+ */
+static void finish_upload(connection *c, int status) {
+	c->receiving = false;
+	if (status >= 400) {
+		// rest of body unread after an error
+		c->keep_alive = false;
+		c->in_len = 0;
+	}
+	http_headers responseHeaders;
+	initHeaders(&responseHeaders);
+	putHeader(&responseHeaders, "Connection", c->keep_alive ? "keep-alive" : "close");
+	end_upload(&c->response, &c->upload, status, &responseHeaders);
+	if (debug) {
+		debugResponseHeader(&c->response);
+	}
+	c->out_pos = 0;
+	startTimer(&c->sending);
+}
+
+/**
+ * Store the request body bytes that have arrived, reading
+ * more while the socket has them. The rest of a body of known
+ * length is read straight into the file in large blocks; a
+ * chunked body is read through the request buffer so that bytes
+ * after its end are kept for the next request.
+ *
+ * @param c the connection
+ * @return true if the body is complete and its response ready,
+ *   false if more of the body is needed
+ */
+static bool receive_body(connection *c) {
+	static char block[COPY_BLOCK_SIZE];  // reactor runs on one thread
+	while (true) {
+		size_t used;
+		int status;
+		long long remaining = getUploadRemaining(&c->upload);
+		if (c->in_len > 0) {
+			status = receiveUpload(&c->upload, c->in, c->in_len, &used);
+			c->in_len -= used;
+			memmove(c->in, c->in + used, c->in_len);
+		} else if (remaining > 0) {
+			size_t len = (remaining < (long long)sizeof block) ? (size_t)remaining : sizeof block;
+			ssize_t n = read(c->fd, block, len);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) continue;
+				if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+					c->peer_closed = true;
+				}
+				c->in_full = false;
+				return false;  // wait for next edge
+			}
+			c->in_full = true;  // more may be waiting; no new edge will say so
+			status = receiveUpload(&c->upload, block, (size_t)n, &used);
+		} else if (c->in_full) {
+			read_input(c);
+			continue;
+		} else {
+			return false;  // wait for next edge
+		}
+		if (status != 0) {
+			finish_upload(c, status);
+			return true;
+		}
+	}
+}
+
+/**
+ * Read and discard the unused request body that has arrived,
+ * reading more while the socket has it. Bytes after the body
+ * are kept for the next request.
+ *
+ * @param c the connection
+ * @return true if the whole body was read, false if more is needed
+ */
+static bool discard_body(connection *c) {
+	static char block[COPY_BLOCK_SIZE];  // reactor runs on one thread
+	while (c->discarding > 0) {
+		if (c->in_len > 0) {
+			size_t used = (c->in_len < (unsigned long long)c->discarding) ? c->in_len : (size_t)c->discarding;
+			c->in_len -= used;
+			memmove(c->in, c->in + used, c->in_len);
+			c->discarding -= used;
+			continue;
+		}
+		size_t len = (c->discarding < (long long)sizeof block) ? (size_t)c->discarding : sizeof block;
+		ssize_t n = read(c->fd, block, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				c->peer_closed = true;
+			}
+			c->in_full = false;
+			return false;  // wait for next edge
+		}
+		c->in_full = true;  // more may be waiting; no new edge will say so
+		c->discarding -= n;
+	}
+	return true;
+}
+
+/**
+ * Send pending output and answer buffered requests in order
+ * until the socket would block or no complete request remains.
+ *
+ * @param c the connection
+ * @return true if the connection should remain open
+ */
+static bool service_connection(connection *c) {
+	while (true) {
+		if (c->preparing) {
+			return true;  // response is sent when helper prepares it
+		}
+		if (c->discarding > 0 && !discard_body(c)) {
+			return !c->peer_closed;  // response waits for rest of body
+		}
+		int status = flush_output(c);
+		if (status < 0) {
+			return false;
+		}
+		if (status == 0) {
+			return true;  // wait for socket to become writable
+		}
+		if (c->receiving) {
+			if (!receive_body(c)) {
+				return !c->peer_closed;  // closing aborts upload
+			}
+			continue;
+		}
+		if (!c->keep_alive) {
+			return false;
+		}
+
+		if (c->in_full) {
+			read_input(c);
+		}
+		parse_status parsed = parseRequest(&c->parser, c->in, c->in_len);
+		if (parsed == PARSE_INCOMPLETE) {
+			if (!c->peer_closed || !isRequestStarted(&c->parser)) {
+				return !c->peer_closed;
+			}
+			parsed = PARSE_BAD_REQUEST;  // request cut short
+		}
+		start_response(c, parsed);
+	}
+}
+
+/**
+ * Accept pending connections and add them to the epoll set.
+ *
+ * @param listen_sock_fd the listener socket
+ */
+static void accept_connections(int listen_sock_fd) {
+	while (true) {
+		char peer[PEER_ADDRESS_SIZE];
+		int sock_fd = accept_connection(listen_sock_fd, true, debug ? peer : NULL);
+		if (sock_fd < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept");
+			}
+			return;
+		}
+		if (debug) {
+			fprintf(stderr, "New connection accepted  %s\n", peer);
+		}
+
+		connection *c = calloc(1, sizeof(connection));
+		if (c == NULL) {
+			free(c);
+			close(sock_fd);
+			continue;
+		}
+		c->fd = sock_fd;
+		c->body.fd = -1;
+		initParser(&c->parser, NULL);
+		c->keep_alive = true;
+
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) < 0) {
+			perror("epoll_ctl");
+			free(c);
+			close(sock_fd);
+			continue;
+		}
+		countConnection(1);
+		touch_connection(c);
+	}
+}
+
+/**
+ * Close connections that have been idle longer than
+ * the keep-alive timeout. A connection whose response
+ * a helper thread is preparing is left open.
+ */
+static void close_idle_connections(void) {
+	time_t now = time(NULL);
+	connection *next;
+	for (connection *c = active_head; c != NULL && now - c->last_active > KEEPALIVE_TIMEOUT; c = next) {
+		next = c->next;
+		if (!c->preparing) {
+			close_connection(c);
+		}
+	}
+}
+
+/**
+ * Test whether a connection is waiting for another request
+ * with no part of one received. A new connection is not idle
+ * until its first request has been answered.
+ *
+ * @param c the connection
+ * @return true if the connection is idle
+ */
+static bool is_idle(connection *c) {
+	return c->nrequests > 0 && !c->preparing && c->response.len == 0 && c->in_len == 0
+		   && !c->receiving && c->discarding == 0;
+}
+
+/**
+ * Send the responses and streamed body chunks that helper threads
+ * have prepared, and answer the requests buffered behind them.
+ */
+static void finish_prepared_responses(void) {
+	uint64_t count;
+	if (read(prepared_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+		perror("eventfd");
+	}
+	pthread_mutex_lock(&prepare_lock);  // lock prepare monitor
+		prepare_job *job = prepared;
+		prepared = NULL;
+	pthread_mutex_unlock(&prepare_lock);  // unlock prepare monitor
+
+	prepare_job *next;
+	for ( ; job != NULL; job = next) {
+		next = job->next;
+		connection *c = job->c;
+		c->preparing = false;
+		bool failed = (job->stream != NULL && job->fill_status < 0);  // body cut short
+		if (job->stream == NULL) {
+			remove_request(c, job->discard);
+			finish_response(c);
+		}
+		free(job);
+		touch_connection(c);
+		if (failed || !service_connection(c) || (draining && is_idle(c))) {
+			close_connection(c);
+		}
+	}
+}
+
+/**
+ * Wait for and handle one round of events.
+ *
+ * @param listen_sock_fd the listener socket
+ * @return -1 if waiting failed, 0 otherwise
+ */
+static int handle_events(int listen_sock_fd) {
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int nevents = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, 1000);
+	if (nevents < 0) {
+		if (errno == EINTR) return 0;
+		perror("epoll_wait");
+		return -1;
+	}
+
+	bool prepared_ready = false;
+	for (int i = 0; i < nevents; i++) {
+		connection *c = events[i].data.ptr;
+		if (c == NULL) {
+			accept_connections(listen_sock_fd);
+			continue;
+		}
+		if (events[i].data.ptr == &prepared_fd) {
+			prepared_ready = true;  // after events that may name its connections
+			continue;
+		}
+		touch_connection(c);
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			read_input(c);
+		}
+		if (!service_connection(c) || (draining && is_idle(c))) {
+			close_connection(c);
+		}
+	}
+	if (prepared_ready) {
+		finish_prepared_responses();
+	}
+	close_idle_connections();
+	return 0;
+}
+
+/**
+ * Run the event loop, accepting connections on the listener
+ * socket and servicing requests until the server is asked to
+ * stop. Open connections are left for drain_reactor().
+ *
+ * @param listen_sock_fd the listener socket
+ * @return 0 if asked to stop, -1 if the reactor could not run or failed
+ */
+int run_reactor(int listen_sock_fd) {
+	if (set_nonblocking(listen_sock_fd) < 0) {
+		perror("fcntl");
+		return -1;
+	}
+
+	if (epoll_fd < 0 && (epoll_fd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	// responses that may block are prepared on helper threads
+	if (!start_helpers()) {
+		return -1;
+	}
+
+	// listener is level-triggered so a full descriptor table
+	// does not lose the notification for pending connections
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	int status = 0;
+	while (stop_signal == 0 && (status = handle_events(listen_sock_fd)) == 0) {
+		continue;
+	}
+
+	// stop accepting; a replacement server may still share the
+	// listener, so it must leave the epoll set explicitly
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_sock_fd, NULL);
+	return status;
+}
+
+/**
+ * Finish the requests of open connections, closing each one
+ * when its current response is sent, then close the event loop.
+ *
+ * @param timeout the maximum number of seconds to wait
+ * @return true if all connections finished, false on timeout
+ */
+bool drain_reactor(int timeout) {
+	time_t deadline = time(NULL) + timeout;
+	draining = true;
+
+	connection *next;
+	for (connection *c = active_head; c != NULL; c = next) {
+		next = c->next;
+		if (is_idle(c)) {
+			close_connection(c);
+		}
+	}
+	while (active_head != NULL && time(NULL) < deadline && handle_events(-1) == 0) {
+		continue;
+	}
+
+	bool drained = (active_head == NULL);
+	stop_helpers();
+	while (active_head != NULL) {
+		close_connection(active_head);
+	}
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+	return drained;
+}
+
+#else /* !__linux__ */
+
+/**
+ * Run the event loop, accepting connections on the listener
+ * socket and servicing requests until the server is asked to
+ * stop. Open connections are left for drain_reactor().
+ *
+ * @param listen_sock_fd the listener socket
+ * @return 0 if asked to stop, -1 if the reactor could not run or failed
+ */
+int run_reactor(int listen_sock_fd) {
+	fprintf(stderr, "epoll reactor is only available on Linux\n");
+	return -1;
+}
+
+/**
+ * Finish the requests of open connections, closing each one
+ * when its current response is sent, then close the event loop.
+ *
+ * @param timeout the maximum number of seconds to wait
+ * @return true if all connections finished, false on timeout
+ */
+bool drain_reactor(int timeout) {
+	return true;
+}
+
+#endif /* __linux__ */
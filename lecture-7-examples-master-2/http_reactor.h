@@ -0,0 +1,41 @@
+/*
+ * http_reactor.h
+ *
+ * Event-driven request engine that multiplexes non-blocking
+ * client sockets on a single thread using epoll.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef HTTP_REACTOR_H_
+#define HTTP_REACTOR_H_
+
+#include <stdbool.h>
+
+/** maximum number of events handled per wait */
+#define REACTOR_MAX_EVENTS 256
+
+/** number of threads that prepare responses that may block */
+#define REACTOR_HELPER_THREADS 4
+
+/**
+ * Run the event loop, accepting connections on the listener
+ * socket and servicing requests until the server is asked to
+ * stop. Open connections are left for drain_reactor().
+ *
+ * @param listen_sock_fd the listener socket
+ * @return 0 if asked to stop, -1 if the reactor could not run or failed
+ */
+int run_reactor(int listen_sock_fd);
+
+/**
+ * Finish the requests of open connections, closing each one
+ * when its current response is sent, then close the event loop.
+ *
+ * @param timeout the maximum number of seconds to wait
+ * @return true if all connections finished, false on timeout
+ */
+bool drain_reactor(int timeout);
+
+#endif /* HTTP_REACTOR_H_ */
@@ -6,72 +6,451 @@
  *  @since 2019-04-10
  *  @author: Philip Gust
  */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
+#include "access_log.h"
+#include "http_headers.h"
 #include "http_methods.h"
+#include "http_parser.h"
 #include "http_server.h"
+#include "http_upload.h"
 #include "http_util.h"
+#include "server_stats.h"
+#include "thread_pool.h"
 
+/** A connection being processed by a worker thread */
+typedef struct request_connection {
+	int sock_fd;		// client socket
+	bool idle;			// waiting for the next request
+	char in[REQUEST_BUFFER];	// buffered request bytes
+	size_t in_len;		// number of buffered request bytes
+	struct request_connection *prev, *next;	// list of open connections
+} request_connection;
+
+/** monitor for the list of open connections */
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** connections being processed by worker threads */
+static request_connection *connections = NULL;
+
+/** true when connections are to be closed after their current request */
+static bool draining = false;
 
 /**
- *  Process an http request.
+ *  Add a connection to the list of open connections.
  *
- *  @param sock_fd the socket descriptor
+ *  @param conn the connection
  */
-void process_request(int sock_fd) {
-	char buf[MAXBUF];
-	char method[MAXBUF];
-	char uri[MAXBUF];
-	char version[MAXBUF];
-
-	// open socket as a stream
-	FILE *stream = fdopen(sock_fd, "rb+");
-	if (stream == NULL) {
-		perror("fdopen");
-		return;
+static void add_connection(request_connection *conn) {
+	pthread_mutex_lock(&connections_lock);  // lock connections monitor
+		conn->prev = NULL;
+		conn->next = connections;
+		if (connections != NULL) {
+			connections->prev = conn;
+		}
+		connections = conn;
+	pthread_mutex_unlock(&connections_lock);  // unlock connections monitor
+}
+
+/**
+ *  Remove a connection from the list of open connections.
+ *
+ *  @param conn the connection
+ */
+static void remove_connection(request_connection *conn) {
+	pthread_mutex_lock(&connections_lock);  // lock connections monitor
+		if (conn->prev != NULL) conn->prev->next = conn->next; else connections = conn->next;
+		if (conn->next != NULL) conn->next->prev = conn->prev;
+	pthread_mutex_unlock(&connections_lock);  // unlock connections monitor
+}
+
+/**
+ *  Mark a connection idle while it waits for its next request.
+ *
+ *  @param conn the connection
+ *  @return false if the server is draining and the connection should close
+ */
+static bool await_request(request_connection *conn) {
+	bool waiting;
+	pthread_mutex_lock(&connections_lock);  // lock connections monitor
+		conn->idle = waiting = !draining;
+	pthread_mutex_unlock(&connections_lock);  // unlock connections monitor
+	return waiting;
+}
+
+/**
+ *  Mark a connection busy once a request has arrived.
+ *
+ *  @param conn the connection
+ *  @return false if the server is draining and the connection should
+ *    close after this request
+ */
+static bool begin_request(request_connection *conn) {
+	bool reusable;
+	pthread_mutex_lock(&connections_lock);  // lock connections monitor
+		conn->idle = false;
+		reusable = !draining;
+	pthread_mutex_unlock(&connections_lock);  // unlock connections monitor
+	return reusable;
+}
+
+/**
+ *  Wait for the next request to start arriving on a connection.
+ *  The wait ends early if other connections are queued for a
+ *  worker, so idle connections cannot hold every worker while
+ *  clients wait. Only a request that has started may take the
+ *  full socket timeout to arrive.
+ *
+ *  @param conn the connection
+ *  @return true if input or end of input is available, false if
+ *    the connection should close to free its worker or timed out
+ */
+static bool await_input(request_connection *conn) {
+	struct pollfd pfd = { .fd = conn->sock_fd, .events = POLLIN };
+	for (int waited = 0; waited < KEEPALIVE_TIMEOUT * 1000; waited += KEEPALIVE_YIELD_MS) {
+		int n = poll(&pfd, 1, KEEPALIVE_YIELD_MS);
+		if (n > 0 || (n < 0 && errno != EINTR)) {
+			return true;  // request reads the input or the error
+		}
+		if (thread_pool_has_waiting()) {
+			return false;
+		}
 	}
+	return false;
+}
 
-	// get request
-	if (readRequestLine(stream, buf, MAXBUF) == NULL) {
-		if (debug) {
-			fprintf(stderr, "request header empty\n");
+/**
+ *  Read from a connection until a complete request header has
+ *  arrived after any bytes of it already in the request buffer.
+ *
+ *  @param conn the connection
+ *  @param parser the request parser
+ *  @param started set to the time the first bytes of the request were available
+ *  @return the parse status, or PARSE_INCOMPLETE if the connection
+ *    closed or timed out first
+ */
+static parse_status read_request(request_connection *conn, http_parser *parser,
+								 struct timespec *started) {
+	initParser(parser, NULL);
+	if (conn->in_len > 0) {
+		startTimer(started);
+	}
+	parse_status status;
+	while ((status = parseRequest(parser, conn->in, conn->in_len)) == PARSE_INCOMPLETE) {
+		if (conn->in_len == sizeof conn->in) {
+			return PARSE_HEADER_TOO_LARGE;
+		}
+		ssize_t n = read(conn->sock_fd, conn->in + conn->in_len, sizeof conn->in - conn->in_len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		if (conn->in_len == 0) {
+			startTimer(started);
+		}
+		conn->in_len += n;
+		if (conn->idle) {
+			begin_request(conn);  // no longer safe to shut down
 		}
-		sendErrorResponse(stream, 400, "Bad Request");
-		return;
 	}
+	return status;
+}
 
-	// decode request fields
-	if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
-		if (debug) {
-			fprintf(stderr, "request header incomplete: %s\n", buf);
+/**
+ *  Store the body of a PUT or POST request and send the response.
+ *  Body bytes buffered behind the request header are stored first;
+ *  the rest of a body of known length is read straight into the
+ *  file in large blocks, while a chunked body is read through the
+ *  request buffer so that bytes after its end are kept for the
+ *  next request.
+ *
+ *  @param conn the connection
+ *  @param parser the parser of the request header
+ *  @param requestHeaders the request headers
+ *  @param responseHeaders the response headers
+ *  @param response the response header
+ *  @param keep_alive set to false if the body was not read in full
+ *  @return true if the entire response was sent
+ */
+static bool do_upload(request_connection *conn, http_parser *parser,
+					  http_headers *requestHeaders, http_headers *responseHeaders,
+					  response_header *response, bool *keep_alive) {
+	http_upload upload;
+	int status = beginUpload(&upload, parser->method.start, parser->uri.start, requestHeaders);
+
+	// remove request header from buffer; body follows it
+	conn->in_len -= parser->length;
+	memmove(conn->in, conn->in + parser->length, conn->in_len);
+
+	if (status == 0 && conn->in_len == 0 && start_continue(response, requestHeaders)) {
+		if (!send_response(conn->sock_fd, response, NULL)) {
+			abortUpload(&upload);
+			return false;
 		}
-		sendErrorResponse(stream, 400, "Bad Request");
-		return;
 	}
 
-	// skip request properties up to empty line
-	do {
+	char block[COPY_BLOCK_SIZE];
+	while (status == 0) {
+		size_t used;
+		if (conn->in_len > 0) {
+			status = receiveUpload(&upload, conn->in, conn->in_len, &used);
+			conn->in_len -= used;
+			memmove(conn->in, conn->in + used, conn->in_len);
+			continue;
+		}
+
+		long long remaining = getUploadRemaining(&upload);
+		ssize_t n;
+		if (remaining >= 0) {
+			size_t len = (remaining < (long long)sizeof block) ? (size_t)remaining : sizeof block;
+			n = read(conn->sock_fd, block, len);
+			if (n > 0) {
+				status = receiveUpload(&upload, block, (size_t)n, &used);
+			}
+		} else {
+			n = read(conn->sock_fd, conn->in, sizeof conn->in);
+			if (n > 0) {
+				conn->in_len = (size_t)n;
+			}
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			abortUpload(&upload);  // client gave up on request
+			*keep_alive = false;
+			response->status = 400;
+			response->nsent = 0;
+			return false;
+		}
+		if (n < 0) {
+			abortUpload(&upload);  // body timed out
+			status = 408;
+		}
+	}
+
+	// rest of body unread after an error
+	if (status >= 400) {
+		*keep_alive = false;
+		putHeader(responseHeaders, "Connection", "close");
+	}
+	end_upload(response, &upload, status, responseHeaders);
+	return send_response(conn->sock_fd, response, NULL);
+}
+
+/**
+ *  Read and discard a request body that is not used. Body bytes
+ *  buffered behind the request header are removed from the buffer,
+ *  leaving the header and any pipelined requests after the body.
+ *
+ *  @param conn the connection
+ *  @param header_len the length of the request header in the buffer
+ *  @param length the length of the body
+ *  @return true if the whole body was read
+ */
+static bool discard_body(request_connection *conn, size_t header_len, long long length) {
+	size_t buffered = conn->in_len - header_len;
+	size_t used = (buffered < (unsigned long long)length) ? buffered : (size_t)length;
+	memmove(conn->in + header_len, conn->in + header_len + used, buffered - used);
+	conn->in_len -= used;
+	length -= used;
+
+	char block[COPY_BLOCK_SIZE];
+	while (length > 0) {
+		size_t len = (length < (long long)sizeof block) ? (size_t)length : sizeof block;
+		ssize_t n = read(conn->sock_fd, block, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;  // closed or timed out
+		}
+		length -= n;
+	}
+	return true;
+}
+
+/**
+ *  Read, decode, and respond to one request on a connection.
+ *
+ *  @param conn the connection
+ *  @param nrequests the number of this request on the connection
+ *  @return true if the connection should remain open for another request
+ */
+static bool handle_request(request_connection *conn, int nrequests) {
+	int sock_fd = conn->sock_fd;
+
+	http_headers requestHeaders, responseHeaders;
+	initHeaders(&requestHeaders);
+	initHeaders(&responseHeaders);
+	response_header response;
+
+	// get request, ignoring blank lines between requests
+	http_parser parser;
+	struct timespec parsing;
+	parse_status status = read_request(conn, &parser, &parsing);
+	if (status == PARSE_INCOMPLETE && !isRequestStarted(&parser)) {
+		// closed or timed out before a request arrived; only
+		// an error if this was the first request on connection
+		if (nrequests == 1) {
+			if (debug) {
+				fprintf(stderr, "request header empty\n");
+			}
+			putHeader(&responseHeaders, "Connection", "close");
+			setErrorResponse(&response, 400, "Bad Request", &responseHeaders);
+			send_response(sock_fd, &response, NULL);
+		}
+		return false;
+	}
+	bool reusable = begin_request(conn);
+
+	access_entry access;
+	if (status != PARSE_COMPLETE) {
+		// request cut short is malformed
+		if (status == PARSE_INCOMPLETE) {
+			status = PARSE_BAD_REQUEST;
+		}
+		char line[MAXBUF];
+		getRequestLine(&parser, conn->in, conn->in_len, line, sizeof line);
 		if (debug) {
-			fprintf(stderr, "> %s\n", buf);
+			fprintf(stderr, "request header invalid (%d): %s\n", status, line);
 		}
-	} while ((readRequestLine(stream, buf, MAXBUF) != NULL) && (strlen(buf) > 0));
+		beginAccess(&access, "-", line);
+		putHeader(&responseHeaders, "Connection", "close");
+		setErrorResponse(&response, status, getParseErrorMessage(status), &responseHeaders);
+		send_response(sock_fd, &response, NULL);
+		endAccess(&access, response.status, response.nsent);
+		countResponse(response.status, response.nsent);
+		return false;
+	}
+
+	// decode request fields
+	const char *method = parser.method.start;
+	const char *uri = parser.uri.start;
+	const char *version = parser.version.start;
+	beginAccess(&access, method, uri);
+	getRequestHeaders(&parser, &requestHeaders);
 	if (debug) {
+		fprintf(stderr, "> %s %s %s\n", method, uri, version);
+		for (int f = 0; f < parser.nfields; f++) {
+			fprintf(stderr, "> %s: %s\n", parser.fields[f].name.start, parser.fields[f].value.start);
+		}
 		fprintf(stderr, "> \n");
 	}
+	recordLatency(LATENCY_PARSE, &parsing);
+
+	// read past a body the request does not use, so it is not
+	// taken for the next request
+	bool upload = is_upload_method(method) && isUploadEnabled();
+	long long discard = upload ? 0 : getDiscardLength(&requestHeaders);
+	if (discard > 0 && !discard_body(conn, parser.length, discard)) {
+		discard = -1;
+	}
+
+	// keep connection open if client wants it, request cap not
+	// reached, server is not draining, and no unused body is left
+	bool keep_alive = reusable && (nrequests < KEEPALIVE_MAX_REQUESTS)
+					  && isKeepAlive(version, &requestHeaders) && (discard >= 0);
+	putHeader(&responseHeaders, "Connection", keep_alive ? "keep-alive" : "close");
 
 	// dispatch based on method
-	if (strcasecmp(method, "GET") == 0) {
-		do_get(stream, uri);  // execute GET method
+	bool sent;
+	if (upload) {
+		sent = do_upload(conn, &parser, &requestHeaders, &responseHeaders, &response, &keep_alive);
 	} else {
-		sendErrorResponse(stream, 501, "Not Implemented");
+		response_body body;
+		start_method(&response, method, uri, version, &requestHeaders, &responseHeaders, &body);
+		sent = send_response(sock_fd, &response, &body);
+		release_body(&body);
+
+		// remove request from buffer, keeping pipelined requests behind it
+		conn->in_len -= parser.length;
+		memmove(conn->in, conn->in + parser.length, conn->in_len);
+	}
+	endAccess(&access, response.status, response.nsent);
+	countResponse(response.status, response.nsent);
+
+	// a response not sent in full leaves the client unable
+	// to find the next one, so the connection cannot be reused
+	return sent && keep_alive;
+}
+
+/**
+ *  Process http requests on a connection until the client closes
+ *  it, asks for it to be closed, or leaves it idle too long or
+ *  while other connections wait for a worker.
+ *
+ *  Requests are read into a buffer and parsed in place, so
+ *  pipelined requests that arrive behind the current one are
+ *  kept for the next call.
+ *
+ *  @param sock_fd the socket descriptor
+ */
+void process_request(int sock_fd) {
+	// timeout for the rest of a request that has started
+	struct timeval timeout = { .tv_sec = KEEPALIVE_TIMEOUT, .tv_usec = 0 };
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+	request_connection conn = { .sock_fd = sock_fd, .idle = false, .in_len = 0 };
+	add_connection(&conn);
+	countConnection(1);
+	for (int nrequests = 1; ; nrequests++) {
+		if (conn.in_len == 0 && !await_input(&conn)) {
+			break;  // idle too long or worker needed elsewhere
+		}
+		if (!handle_request(&conn, nrequests) || !await_request(&conn)) {
+			break;
+		}
 	}
+	countConnection(-1);
+	remove_connection(&conn);
 
-	// close socket stream
-	fflush(stream);
-	fclose(stream);
 	close(sock_fd);
 }
 
+/**
+ *  Reject a connection with an error response without
+ *  reading the request, then close the socket.
+ *
+ *  @param sock_fd the socket descriptor
+ *  @param status the response status
+ *  @param statusMsg the response message
+ */
+void reject_request(int sock_fd, int status, const char *statusMsg) {
+	http_headers responseHeaders;
+	initHeaders(&responseHeaders);
+	putHeader(&responseHeaders, "Connection", "close");
+
+	response_header response;
+	setErrorResponse(&response, status, statusMsg, &responseHeaders);
+	send_response(sock_fd, &response, NULL);
+
+	close(sock_fd);
+}
+
+/**
+ *  Close connections after their current request so the server
+ *  can stop. Connections waiting for their next request are shut
+ *  down for reading, which ends the wait at once.
+ */
+void drain_requests(void) {
+	pthread_mutex_lock(&connections_lock);  // lock connections monitor
+		draining = true;
+		for (request_connection *conn = connections; conn != NULL; conn = conn->next) {
+			if (conn->idle) {
+				shutdown(conn->sock_fd, SHUT_RD);
+			}
+		}
+	pthread_mutex_unlock(&connections_lock);  // unlock connections monitor
+}
@@ -17,5 +17,22 @@
  */
 void process_request(int sock_fd);
 
+/**
+ *  Reject a connection with an error response without
+ *  reading the request, then close the socket.
+ *
+ *  @param sock_fd the socket descriptor
+ *  @param status the response status
+ *  @param statusMsg the response message
+ */
+void reject_request(int sock_fd, int status, const char *statusMsg);
+
+/**
+ *  Close connections after their current request so the server
+ *  can stop. Connections waiting for their next request are shut
+ *  down for reading, which ends the wait at once.
+ */
+void drain_requests(void);
+
 
 #endif /* HTTP_REQUEST_H_ */
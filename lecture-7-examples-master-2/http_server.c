@@ -2,76 +2,437 @@
  * http_server.c
  *
  * The HTTP server main function sets up the listener socket
- * and dispatches client requests to request sockets.
+ * and dispatches client requests to a pool of worker threads,
+ * or to an event-driven reactor that services every connection
+ * on one thread and hands responses that miss the content cache
+ * to a few helper threads. With --workers, several processes
+ * each run their own server on the same port.
+ *
+ * SIGTERM or SIGINT stops the server: it closes the listener and
+ * lets active connections finish their current request. SIGHUP
+ * first starts the server's program again with the listener, so
+ * a new build takes over without refusing any connection.
  *
  *  @since 2019-04-10
  *  @author: Philip Gust
  */
+#include <errno.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
+#include <sys/time.h>
 
+#include "access_log.h"
+#include "content_cache.h"
+#include "http_methods.h"
+#include "http_reactor.h"
 #include "http_request.h"
 #include "http_server.h"
+#include "http_upload.h"
+#include "http_util.h"
+#include "mime_types.h"
 #include "network_util.h"
+#include "thread_pool.h"
+#include "worker_processes.h"
 
 
 #define DEFAULT_HTTP_PORT 1500
 #define MIN_PORT 1000
 
 /** debug flag */
-const bool debug = true;
+const bool debug = false;
 
 /** subdirectory of application home directory for web content */
 const char *CONTENT_BASE = "content";
 
+/** signal asking the server to stop or be replaced, or 0 while running */
+volatile sig_atomic_t stop_signal = 0;
+
+/** Server settings from the command line */
+typedef struct {
+	listener_options listen;	// listener socket settings
+	char where[MAXBUF];		// listener port or path, for messages
+	int nthreads;			// number of worker threads
+	int queue_depth;		// depth of pending connection queue
+	bool use_reactor;		// use event-driven reactor instead of threads
+	const char *access_log;	// access log file or NULL
+	int nworkers;			// number of worker processes, 0 for none
+	bool pin_workers;		// pin each worker process to its own CPU
+	char **argv;			// command line that starts a replacement server
+} server_options;
+
+/** long forms of command line options */
+static const struct option long_options[] = {
+	{ "workers", required_argument, NULL, 'w' },
+	{ "pin-cpus", no_argument, NULL, 'p' },
+	{ "autoindex", no_argument, NULL, 'i' },
+	{ "upload-root", required_argument, NULL, 'u' },
+	{ "bind", required_argument, NULL, 'a' },
+	{ "unix", required_argument, NULL, 'U' },
+	{ "backlog", required_argument, NULL, 'b' },
+	{ "ipv6-only", no_argument, NULL, '6' },
+	{ "nodelay", no_argument, NULL, 'n' },
+	{ "defer-accept", required_argument, NULL, 'd' },
+	{ "fastopen", required_argument, NULL, 'f' },
+	{ NULL, 0, NULL, 0 }
+};
+
 /**
- * Main program starts the server and processes requests
- * @param argv[1]: optional port number (default: 1500)
+ * Print command line usage.
+ *
+ * @param prog the program name
  */
-int main(int argc, char* argv[argc]) {
-	int port = DEFAULT_HTTP_PORT;
-    struct sockaddr_in address; // connector's address information
-    socklen_t addrlen = sizeof address;
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-e | -t threads -q queue_depth] [-c cache_mb] [-m mime.types] [-l access_log]"
+			" [-i] [-u upload_dir] [--workers n [--pin-cpus]] [-a address [-6] | -U unix_path] [-b backlog]"
+			" [-n] [-d defer_seconds] [-f fastopen_queue] [port]\n", prog);
+}
+
+/**
+ * Signal handler records a request to stop or replace the server.
+ *
+ * @param sig the signal
+ */
+static void request_stop(int sig) {
+	stop_signal = sig;
+}
+
+/**
+ * Handle the signals that stop or replace the server. They
+ * interrupt blocking calls rather than restart them, so the
+ * server notices the request promptly.
+ *
+ * @param replaceable true if SIGHUP replaces the server
+ */
+static void handle_stop_signals(bool replaceable) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = request_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	if (replaceable) {
+		sigaction(SIGHUP, &sa, NULL);
+	}
+}
+
+/**
+ * Decide whether to act on a request to stop. On SIGHUP, a
+ * replacement server is started with the listener socket first;
+ * if it cannot be started, this server keeps running.
+ *
+ * @param listen_sock_fd the listener socket
+ * @param options the server settings
+ * @return true if the server should drain and exit
+ */
+static bool should_stop(int listen_sock_fd, const server_options *options) {
+	if (stop_signal == SIGHUP) {
+		if (!start_replacement(options->argv, listen_sock_fd)) {
+			fprintf(stderr, "Cannot start replacement server\n");
+			stop_signal = 0;
+			return false;
+		}
+		fprintf(stderr, "Replacement server started\n");
+	}
+	return true;
+}
+
+/**
+ * Serve requests arriving on a listener socket until asked to stop,
+ * then close the listener and let active connections finish for up
+ * to DRAIN_TIMEOUT seconds. Starts the threads this process needs,
+ * so in worker mode it must be called after the fork.
+ *
+ * @param listen_sock_fd the listener socket, closed on return
+ * @param options the server settings
+ * @return EXIT_SUCCESS if the server stopped on request, EXIT_FAILURE on error
+ */
+static int serve(int listen_sock_fd, const server_options *options) {
+    char peer[PEER_ADDRESS_SIZE];  // connector's address
+
+	if (options->access_log != NULL && !startAccessLog(options->access_log)) {
+		perror(options->access_log);
+		close(listen_sock_fd);
+		return EXIT_FAILURE;
+	}
+
+    // keep the Date property current for all responses
+    if (!startDateClock()) {
+		fprintf(stderr, "Cannot start date clock\n");
+	}
+
+    // worker processes are replaced by their supervisor
+    handle_stop_signals(options->nworkers == 0);
+
+	bool drained;
+	if (options->use_reactor) {
+		fprintf(stderr, "Tiny Http Server running on %s (event-driven)\n", options->where);
+		do {
+			if (run_reactor(listen_sock_fd) < 0) {
+				close(listen_sock_fd);
+				stopAccessLog();
+				return EXIT_FAILURE;
+			}
+		} while (!should_stop(listen_sock_fd, options));
 
-    if (argc == 2) {
-		if ((sscanf(argv[1], "%d", &port) != 1) || (port < MIN_PORT)) {
-			fprintf(stderr, "Invalid port %s\n", argv[1]);
+		close(listen_sock_fd);
+		drained = drain_reactor(DRAIN_TIMEOUT);
+	} else {
+		// start worker threads that handle requests
+		thread_pool *pool = thread_pool_create(options->nthreads, options->queue_depth, process_request);
+		if (pool == NULL) {
+			fprintf(stderr, "Cannot create thread pool\n");
+			close(listen_sock_fd);
+			stopAccessLog();
 			return EXIT_FAILURE;
 		}
+
+		fprintf(stderr, "Tiny Http Server running on %s (%d threads, queue %d)\n",
+				options->where, options->nthreads, options->queue_depth);
+
+		// wake from accept() now and then in case a stop
+		// signal was delivered to a worker thread instead
+		struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+		setsockopt(listen_sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+		while (stop_signal == 0 || !should_stop(listen_sock_fd, options)) {
+			// accept client connection
+			int socket_fd = accept_connection(listen_sock_fd, false, debug ? peer : NULL);
+			if (socket_fd < 0) {
+				if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+					perror("accept");
+				}
+				continue;
+			}
+			if (debug) {
+				fprintf(stderr, "New connection accepted  %s\n", peer);
+			}
+
+			// hand request to a worker; if all workers are busy and
+			// the queue is full, reject now rather than let clients
+			// pile up in the listener backlog
+			if (!thread_pool_submit(pool, socket_fd)) {
+				if (debug) {
+					fprintf(stderr, "Server busy, rejecting %s\n", peer);
+				}
+				reject_request(socket_fd, 503, "Service Unavailable");
+			}
+		}
+
+		// stop accepting, then let workers finish queued and active connections
+		close(listen_sock_fd);
+		drain_requests();
+		drained = thread_pool_drain(pool, DRAIN_TIMEOUT);
+		if (drained) {
+			thread_pool_destroy(pool);
+		}
 	}
 
-    // get listener socket on the default port
-	int listen_sock_fd = get_listener_socket(port);
-	if (listen_sock_fd == 0) {
+	if (!drained) {
+		fprintf(stderr, "Closing connections still active after %d seconds\n", DRAIN_TIMEOUT);
+	}
+	stopAccessLog();
+	fprintf(stderr, "Tiny Http Server stopped\n");
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Worker process function opens its own listener on the shared
+ * port and serves requests from it.
+ *
+ * @param worker the worker number
+ * @param arg the server settings
+ * @return the exit status of the worker
+ */
+static int serve_worker(int worker, void *arg) {
+	const server_options *options = arg;
+	(void)worker;
+
+	listener_options listen = options->listen;
+	listen.reuse_port = true;
+	int listen_sock_fd = open_listener_socket(&listen);
+	if (listen_sock_fd < 0) {
 		perror("listen_sock_fd");
 		return EXIT_FAILURE;
 	}
+	return serve(listen_sock_fd, options);
+}
 
-	fprintf(stderr, "Tiny Http Server running on port %d\n", port);
+/**
+ * Main program starts the server and processes requests
+ * @param -e: optional use event-driven reactor instead of threads;
+ *   file reads, compression, and directory listings that miss the
+ *   content cache run on helper threads
+ * @param -t: optional number of worker threads (default: 8)
+ * @param -q: optional depth of pending connection queue (default: 64)
+ * @param -c: optional content cache size in MB, 0 to disable (default: 64)
+ * @param -m: optional mime.types file adding to the built-in content types
+ * @param -l: optional access log file of JSON lines
+ * @param -w, --workers: optional number of worker processes sharing the port (default: none)
+ * @param -p, --pin-cpus: optional pin each worker process to its own CPU
+ * @param -i, --autoindex: optional list directories that have no index.html
+ * @param -u, --upload-root: optional directory that stores PUT and POST uploads (default: none)
+ * @param -a, --bind: optional address to listen on (default: all IPv6 and IPv4 addresses)
+ * @param -U, --unix: optional Unix domain socket path to listen on instead of a port
+ * @param -b, --backlog: optional maximum pending connections (default: SOMAXCONN)
+ * @param -6, --ipv6-only: optional accept only IPv6 connections on an IPv6 address
+ * @param -n, --nodelay: optional send small writes at once (TCP_NODELAY)
+ * @param -d, --defer-accept: optional seconds to wait for request data before accepting
+ * @param -f, --fastopen: optional TCP Fast Open pending request limit (default: off)
+ * @param port: optional port number (default: 1500)
+ */
+int main(int argc, char* argv[argc]) {
+	server_options options = {
+		.nthreads = DEFAULT_POOL_THREADS,
+		.queue_depth = DEFAULT_POOL_QUEUE,
+		.use_reactor = false,
+		.access_log = NULL,
+		.nworkers = 0,
+		.pin_workers = false,
+		.argv = argv
+	};
+	int cache_mb = DEFAULT_CACHE_MB;
+	init_listener_options(&options.listen, DEFAULT_HTTP_PORT);
 
-	while (true) {
-        // accept client connection
-		int socket_fd = accept(listen_sock_fd, (struct sockaddr *)&address, &addrlen);
-		if (socket_fd < 0) {
-			perror("accept");
-			continue;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "et:q:c:m:l:w:piu:a:U:b:6nd:f:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'e':
+			options.use_reactor = true;
+			break;
+		case 't':
+			if ((sscanf(optarg, "%d", &options.nthreads) != 1) || (options.nthreads < 1)) {
+				fprintf(stderr, "Invalid thread count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			if ((sscanf(optarg, "%d", &options.queue_depth) != 1) || (options.queue_depth < 1)) {
+				fprintf(stderr, "Invalid queue depth %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			if ((sscanf(optarg, "%d", &cache_mb) != 1) || (cache_mb < 0)) {
+				fprintf(stderr, "Invalid cache size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			if (!loadMimeTypes(optarg)) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			options.access_log = optarg;
+			break;
+		case 'w':
+			if ((sscanf(optarg, "%d", &options.nworkers) != 1) || (options.nworkers < 1)) {
+				fprintf(stderr, "Invalid worker count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			options.pin_workers = true;
+			break;
+		case 'i':
+			setAutoindex(true);
+			break;
+		case 'u':
+			if (!openUploadRoot(optarg)) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			options.listen.host = optarg;
+			break;
+		case 'U':
+			options.listen.unix_path = optarg;
+			break;
+		case 'b':
+			if ((sscanf(optarg, "%d", &options.listen.backlog) != 1) || (options.listen.backlog < 1)) {
+				fprintf(stderr, "Invalid backlog %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '6':
+			options.listen.ipv6_only = true;
+			break;
+		case 'n':
+			options.listen.nodelay = true;
+			break;
+		case 'd':
+			if ((sscanf(optarg, "%d", &options.listen.defer_accept) != 1)
+					|| (options.listen.defer_accept < 1)) {
+				fprintf(stderr, "Invalid defer accept seconds %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			if ((sscanf(optarg, "%d", &options.listen.fastopen) != 1) || (options.listen.fastopen < 1)) {
+				fprintf(stderr, "Invalid fastopen queue %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
 		}
-		if (debug) {
-			fprintf(stderr, "New connection accepted  %s:%u\n",
-					inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+	}
+    if (optind == argc - 1) {
+		if ((sscanf(argv[optind], "%d", &options.listen.port) != 1) || (options.listen.port < MIN_PORT)) {
+			fprintf(stderr, "Invalid port %s\n", argv[optind]);
+			return EXIT_FAILURE;
 		}
+	} else if (optind < argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+    if (options.listen.unix_path != NULL) {
+		if (options.nworkers > 0) {
+			fprintf(stderr, "Worker processes cannot share a Unix domain socket\n");
+			return EXIT_FAILURE;
+		}
+		snprintf(options.where, sizeof options.where, "%s", options.listen.unix_path);
+	} else {
+		snprintf(options.where, sizeof options.where, "port %d", options.listen.port);
+	}
+
+    setContentCacheCapacity((size_t)cache_mb * 1024 * 1024);
 
-		// handle request
-		process_request(socket_fd);
-    }
+    // content paths are opened relative to the content directory
+    if (!openContentRoot(CONTENT_BASE)) {
+		perror(CONTENT_BASE);
+		return EXIT_FAILURE;
+	}
+
+    // a client closing early must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    // each worker process opens its own listener on the port
+    if (options.nworkers > 0) {
+		fprintf(stderr, "Tiny Http Server starting %d workers on %s\n",
+				options.nworkers, options.where);
+		return run_workers(options.nworkers, options.pin_workers, serve_worker, &options, argv);
+	}
 
-    // close listener socket
-    close(listen_sock_fd);
-    return EXIT_SUCCESS;
+    // use listener socket of the server being replaced, or
+    // get listener socket with the listener settings
+	int listen_sock_fd = inherited_listener();
+	if (listen_sock_fd < 0) {
+		listen_sock_fd = open_listener_socket(&options.listen);
+	}
+	if (listen_sock_fd < 0) {
+		perror("listen_sock_fd");
+		return EXIT_FAILURE;
+	}
 
+	return serve(listen_sock_fd, &options);
 }
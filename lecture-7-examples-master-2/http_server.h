@@ -10,11 +10,24 @@
 #ifndef HTTP_SERVER_H_
 #define HTTP_SERVER_H_
 
+#include <signal.h>
 #include <stdbool.h>
 
 /** maximum buffer size */
 #define MAXBUF 256
 
+/** seconds an idle keep-alive connection is kept open */
+#define KEEPALIVE_TIMEOUT 15
+
+/** milliseconds between checks whether an idle connection should free its worker */
+#define KEEPALIVE_YIELD_MS 200
+
+/** maximum number of requests served on one connection */
+#define KEEPALIVE_MAX_REQUESTS 100
+
+/** seconds active connections have to finish when the server stops */
+#define DRAIN_TIMEOUT 10
+
 /** web newline sequence */
 static const char *CRLF = "\r\n";
 
@@ -24,4 +37,7 @@ extern const bool debug;
 /** subdirectory of application home directory for web content */
 extern const char *CONTENT_BASE;
 
+/** signal asking the server to stop or be replaced, or 0 while running */
+extern volatile sig_atomic_t stop_signal;
+
 #endif /* HTTP_SERVER_H_ */
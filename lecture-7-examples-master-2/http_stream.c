@@ -0,0 +1,158 @@
+/*
+ * http_stream.c
+ *
+ * Response bodies generated while they are sent, with chunked
+ * transfer coding. Parts written by the producer are gathered by
+ * a custom stdio stream directly into the chunk buffer, after room
+ * left for the chunk size line, so a chunk is framed in place
+ * without copying its data.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+#define _GNU_SOURCE  // for fopencookie()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "http_stream.h"
+
+/** room before chunk data for the chunk size line */
+#define CHUNK_HEADER_ROOM 18
+
+/** room after chunk data for its CRLF and the last chunk */
+#define CHUNK_TRAILER_ROOM 7
+
+/**
+ * Gather bytes written by the producer into the chunk buffer,
+ * growing it if a part runs past the end.
+ *
+ * @param cookie the stream
+ * @param data the bytes written
+ * @param size the number of bytes
+ * @return the number of bytes gathered, or 0 on error
+ */
+static ssize_t gather(void *cookie, const char *data, size_t size) {
+	response_stream *stream = cookie;
+	size_t need = CHUNK_HEADER_ROOM + stream->data_len + size + CHUNK_TRAILER_ROOM;
+	if (need > stream->cap) {
+		size_t cap = stream->cap * 2;
+		if (cap < need) {
+			cap = need;
+		}
+		char *buf = realloc(stream->buf, cap);
+		if (buf == NULL) {
+			stream->failed = true;
+			return 0;
+		}
+		stream->buf = buf;
+		stream->cap = cap;
+	}
+	memcpy(stream->buf + CHUNK_HEADER_ROOM + stream->data_len, data, size);
+	stream->data_len += size;
+	return (ssize_t)size;
+}
+
+/**
+ * Create a streamed body. The stream takes ownership of the
+ * producer state, which is released by the release function
+ * when the stream is freed, even if it cannot be created.
+ *
+ * @param produce writes the next part of the body
+ * @param release releases the producer state, or NULL
+ * @param state the producer state
+ * @return the stream, or NULL if out of memory
+ */
+response_stream *newResponseStream(stream_producer produce, stream_release release, void *state) {
+	response_stream *stream = calloc(1, sizeof(response_stream));
+	if (stream == NULL) {
+		if (release != NULL) {
+			release(state);
+		}
+		return NULL;
+	}
+	stream->produce = produce;
+	stream->release = release;
+	stream->state = state;
+	stream->cap = CHUNK_HEADER_ROOM + STREAM_CHUNK_SIZE + CHUNK_TRAILER_ROOM;
+	stream->buf = malloc(stream->cap);
+	cookie_io_functions_t io = { .write = gather };
+	stream->out = (stream->buf != NULL) ? fopencookie(stream, "w", io) : NULL;
+	if (stream->out == NULL) {
+		freeResponseStream(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+/**
+ * Make sure a chunk of the body is ready to send, producing and
+ * framing the next chunk once the current one has been sent. The
+ * chunk to send is buf[pos] up to buf[len]; the sender advances
+ * pos by the bytes it sends.
+ *
+ * @param stream the stream
+ * @return 1 if a chunk is ready, 0 after the last chunk has
+ *   been sent, or -1 if the producer failed
+ */
+int fillResponseStream(response_stream *stream) {
+	if (stream->pos < stream->len) {
+		return 1;
+	}
+	if (stream->done) {
+		return 0;
+	}
+
+	// gather parts until the chunk is full or the body ends
+	stream->data_len = 0;
+	int status = 1;
+	while (status > 0 && stream->data_len < STREAM_CHUNK_SIZE) {
+		status = stream->produce(stream->state, stream->out);
+		if (fflush(stream->out) != 0 || stream->failed) {
+			status = -1;
+		}
+	}
+	if (status < 0) {
+		return -1;
+	}
+
+	// frame chunk around data in place; no chunk if no data
+	size_t end = CHUNK_HEADER_ROOM + stream->data_len;
+	stream->pos = CHUNK_HEADER_ROOM;
+	if (stream->data_len > 0) {
+		char line[CHUNK_HEADER_ROOM + 1];
+		int n = snprintf(line, sizeof line, "%zx\r\n", stream->data_len);
+		stream->pos -= n;
+		memcpy(stream->buf + stream->pos, line, n);
+		memcpy(stream->buf + end, "\r\n", 2);
+		end += 2;
+	}
+	if (status == 0) {
+		memcpy(stream->buf + end, "0\r\n\r\n", 5);  // last chunk, no trailer
+		end += 5;
+		stream->done = true;
+	}
+	stream->len = end;
+	return 1;
+}
+
+/**
+ * Free a streamed body and release its producer state.
+ *
+ * @param stream the stream, or NULL
+ */
+void freeResponseStream(response_stream *stream) {
+	if (stream == NULL) {
+		return;
+	}
+	if (stream->out != NULL) {
+		fclose(stream->out);
+	}
+	if (stream->release != NULL) {
+		stream->release(stream->state);
+	}
+	free(stream->buf);
+	free(stream);
+}
@@ -0,0 +1,86 @@
+/*
+ * http_stream.h
+ *
+ * Response bodies generated while they are sent, with chunked
+ * transfer coding. A producer writes the body a part at a time to
+ * a stdio stream; parts are gathered into chunks of about
+ * STREAM_CHUNK_SIZE bytes, so a body of any length is sent in
+ * bounded memory and needs no Content-Length up front.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef HTTP_STREAM_H_
+#define HTTP_STREAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/** body bytes gathered before a chunk is sent */
+#define STREAM_CHUNK_SIZE 16384
+
+/**
+ * Write the next part of a streamed body.
+ *
+ * @param state the producer state
+ * @param out the stream to write the part to
+ * @return 1 if more parts follow, 0 after the last part, -1 on error
+ */
+typedef int (*stream_producer)(void *state, FILE *out);
+
+/**
+ * Release the producer state once the body is sent or abandoned.
+ *
+ * @param state the producer state
+ */
+typedef void (*stream_release)(void *state);
+
+/** Response body generated by a producer */
+typedef struct {
+	stream_producer produce;	// writes the next part of the body
+	stream_release release;		// releases the producer state, or NULL
+	void *state;				// the producer state
+	FILE *out;					// stream that gathers parts into buf
+	char *buf;					// chunk size line, chunk data, and CRLF
+	size_t cap;					// size of buf
+	size_t data_len;			// bytes of chunk data in buf
+	size_t pos;					// offset of next byte of chunk to send
+	size_t len;					// offset of end of chunk
+	bool failed;				// chunk data could not be gathered
+	bool done;					// last chunk has been framed
+} response_stream;
+
+/**
+ * Create a streamed body. The stream takes ownership of the
+ * producer state, which is released by the release function
+ * when the stream is freed, even if it cannot be created.
+ *
+ * @param produce writes the next part of the body
+ * @param release releases the producer state, or NULL
+ * @param state the producer state
+ * @return the stream, or NULL if out of memory
+ */
+response_stream *newResponseStream(stream_producer produce, stream_release release, void *state);
+
+/**
+ * Make sure a chunk of the body is ready to send, producing and
+ * framing the next chunk once the current one has been sent. The
+ * chunk to send is buf[pos] up to buf[len]; the sender advances
+ * pos by the bytes it sends.
+ *
+ * @param stream the stream
+ * @return 1 if a chunk is ready, 0 after the last chunk has
+ *   been sent, or -1 if the producer failed
+ */
+int fillResponseStream(response_stream *stream);
+
+/**
+ * Free a streamed body and release its producer state.
+ *
+ * @param stream the stream, or NULL
+ */
+void freeResponseStream(response_stream *stream);
+
+#endif /* HTTP_STREAM_H_ */
@@ -0,0 +1,487 @@
+/*
+ * http_upload.c
+ *
+ * Storage of PUT and POST request bodies as files under an upload
+ * directory. A body is written to a temporary file in the target
+ * directory as it arrives and renamed into place once complete, so
+ * readers never see a partial file and a failed upload leaves the
+ * previous file in place. Chunked bodies are decoded by a state
+ * machine that resumes wherever the last piece of input ended.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "http_upload.h"
+#include "http_util.h"
+
+/** States of chunked body decoding */
+enum {
+	CHUNK_SIZE_START,	// before chunk size
+	CHUNK_SIZE,			// in chunk size
+	CHUNK_EXT,			// in chunk extensions
+	CHUNK_SIZE_LF,		// after CR ending chunk size line
+	CHUNK_DATA,			// in chunk data
+	CHUNK_DATA_CR,		// after chunk data
+	CHUNK_DATA_LF,		// after CR ending chunk data
+	TRAILER_START,		// at start of trailer line
+	TRAILER_LINE,		// in trailer field
+	TRAILER_END_LF		// after CR ending trailer
+};
+
+/** upload directory, or -1 if uploads are refused */
+static int upload_root = -1;
+
+/** number used to make temporary and generated file names unique */
+static atomic_uint upload_count = 0;
+
+/**
+ * Open the directory under which uploads are stored. Uploads
+ * are refused unless this is called.
+ *
+ * @param dir the upload directory
+ * @return true if the directory was opened
+ */
+bool openUploadRoot(const char dir[]) {
+	upload_root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return upload_root >= 0;
+}
+
+/**
+ * Test whether uploads are accepted.
+ *
+ * @return true if an upload directory is open
+ */
+bool isUploadEnabled(void) {
+	return upload_root >= 0;
+}
+
+/**
+ * Get the status of the response to a failed file operation.
+ *
+ * @param err the error number
+ * @return the response status
+ */
+static int errorStatus(int err) {
+	switch (err) {
+	case ENOSPC:
+	case EDQUOT:
+		return 507;  // Insufficient Storage
+	case EACCES:
+	case EPERM:
+	case EXDEV:		// path leads outside upload directory
+	case ELOOP:
+		return 403;
+	case ENOENT:
+	case ENOTDIR:
+		return 409;  // directory of file does not exist
+	default:
+		return 500;
+	}
+}
+
+/**
+ * Parse a Content-Length value.
+ *
+ * @param value the value
+ * @param length set to the length
+ * @return true if the value is a valid length
+ */
+static bool parseLength(const char value[], long long *length) {
+	if (*value < '0' || *value > '9') {
+		return false;
+	}
+	long long n = 0;
+	for ( ; *value >= '0' && *value <= '9'; value++) {
+		if (n > (LLONG_MAX - 9) / 10) {
+			return false;
+		}
+		n = n * 10 + (*value - '0');
+	}
+	*length = n;
+	return *value == '\0';
+}
+
+/**
+ * Get the length of the body of a request that does not use it.
+ * The body follows the request header on the connection, so it
+ * must be read and discarded before the next request, unless the
+ * connection is closed instead.
+ *
+ * @param requestHeaders the request headers
+ * @return the length of the body, 0 if there is none, or -1 if it
+ *   must not be read: it is chunked, its length is invalid or over
+ *   MAX_DISCARD_SIZE, or the client waits for 100 Continue to send it
+ */
+long long getDiscardLength(const http_headers *requestHeaders) {
+	const char *value = getHeader(requestHeaders, "Content-Length");
+	if (getHeader(requestHeaders, "Transfer-Encoding") != NULL) {
+		return -1;
+	}
+	if (value == NULL) {
+		return 0;
+	}
+	long long length;
+	if (!parseLength(value, &length) || length > MAX_DISCARD_SIZE) {
+		return -1;
+	}
+	const char *expect = getHeader(requestHeaders, "Expect");
+	if (length > 0 && expect != NULL && strcasecmp(expect, "100-continue") == 0) {
+		return -1;
+	}
+	return length;
+}
+
+/**
+ * Move the complete file into place.
+ *
+ * @param upload the upload
+ * @return 201 if the file was created, 204 if it was replaced,
+ *   or the status of the error response
+ */
+static int finishUpload(http_upload *upload) {
+	int status = upload->replacing ? 204 : 201;
+	int fd = upload->fd;
+	upload->fd = -1;
+	if (close(fd) < 0 || renameat(upload->dir_fd, upload->temp_name,
+								  upload->dir_fd, upload->name) < 0) {
+		status = errorStatus(errno);
+		unlinkat(upload->dir_fd, upload->temp_name, 0);
+	}
+	close(upload->dir_fd);
+	upload->dir_fd = -1;
+	return status;
+}
+
+/**
+ * Start an upload of a request body to the file named by a URI.
+ * A POST to a URI ending in "/" stores the body under a new name
+ * in that directory; otherwise the body replaces the named file.
+ * The file appears only once the whole body has been stored,
+ * so an empty body is stored here.
+ *
+ * @param upload the upload
+ * @param method the request method, "PUT" or "POST"
+ * @param uri the request URI
+ * @param requestHeaders the request headers
+ * @return 0 if started, 201 or 204 if an empty body was stored,
+ *   or the status of the error response
+ */
+int beginUpload(http_upload *upload, const char method[], const char uri[],
+				const http_headers *requestHeaders) {
+	upload->dir_fd = upload->fd = -1;
+	if (upload_root < 0) {
+		return 405;
+	}
+
+	// body is framed by chunked coding or by its length, not both
+	const char *coding = getHeader(requestHeaders, "Transfer-Encoding");
+	const char *length = getHeader(requestHeaders, "Content-Length");
+	upload->size = 0;
+	if (coding != NULL) {
+		if (length != NULL) {
+			return 400;
+		}
+		if (strcasecmp(coding, "chunked") != 0) {
+			return 501;
+		}
+		upload->chunked = true;
+		upload->state = CHUNK_SIZE_START;
+		upload->remaining = 0;
+	} else if (length != NULL) {
+		if (!parseLength(length, &upload->remaining)) {
+			return 400;
+		}
+		if (upload->remaining > MAX_UPLOAD_SIZE) {
+			return 413;
+		}
+		upload->chunked = false;
+	} else {
+		return 411;  // Length Required
+	}
+
+	char path[PATH_MAX];
+	int status = resolveUri(uri, path, sizeof path);
+	if (status != 0) {
+		return status;
+	}
+	size_t uriLen = strcspn(uri, "?#");
+	bool toDirectory = (uriLen > 0 && uri[uriLen - 1] == '/');
+	if (toDirectory) {
+		if (strcasecmp(method, "POST") != 0) {
+			return 405;
+		}
+		path[strlen(path) - strlen(DIRECTORY_INDEX)] = '\0';
+	}
+
+	// split path into directory and file name
+	char *slash = strrchr(path, '/');
+	const char *name = (slash != NULL) ? slash + 1 : path;
+	const char *dir = ".";
+	if (slash != NULL) {
+		*slash = '\0';
+		dir = path;
+	}
+	unsigned count = atomic_fetch_add(&upload_count, 1);
+	if (uriLen + sizeof upload->temp_name >= sizeof upload->location) {
+		return 414;  // too long for Location of generated name
+	}
+	if (toDirectory) {
+		snprintf(upload->name, sizeof upload->name, "upload-%lx-%d-%u",
+				 (unsigned long)time(NULL), (int)getpid(), count);
+		memcpy(upload->location, uri, uriLen);
+		strcpy(upload->location + uriLen, upload->name);
+	} else {
+		if (strlen(name) >= sizeof upload->name) {
+			return 414;
+		}
+		strcpy(upload->name, name);
+		snprintf(upload->location, sizeof upload->location, "%.*s", (int)uriLen, uri);
+	}
+
+	upload->dir_fd = openBeneath(upload_root, dir, O_RDONLY | O_DIRECTORY);
+	if (upload->dir_fd < 0) {
+		return errorStatus(errno);
+	}
+	struct stat sb;
+	upload->replacing = (fstatat(upload->dir_fd, upload->name, &sb, AT_SYMLINK_NOFOLLOW) == 0);
+	if (upload->replacing && S_ISDIR(sb.st_mode)) {
+		close(upload->dir_fd);
+		upload->dir_fd = -1;
+		return 409;
+	}
+
+	// body goes to a temporary file until complete
+	snprintf(upload->temp_name, sizeof upload->temp_name, ".upload-%d-%u", (int)getpid(), count);
+	upload->fd = openat(upload->dir_fd, upload->temp_name,
+						O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (upload->fd < 0) {
+		status = errorStatus(errno);
+		close(upload->dir_fd);
+		upload->dir_fd = -1;
+		return status;
+	}
+
+	// an empty body has no bytes to wait for
+	if (!upload->chunked && upload->remaining == 0) {
+		return finishUpload(upload);
+	}
+	return 0;
+}
+
+/**
+ * Abandon an upload in progress and remove its temporary file.
+ * Does nothing if no upload is in progress.
+ *
+ * @param upload the upload
+ */
+void abortUpload(http_upload *upload) {
+	if (upload->dir_fd < 0) {
+		return;
+	}
+	if (upload->fd >= 0) {
+		close(upload->fd);
+		upload->fd = -1;
+	}
+	unlinkat(upload->dir_fd, upload->temp_name, 0);
+	close(upload->dir_fd);
+	upload->dir_fd = -1;
+}
+
+/**
+ * Write body bytes to the temporary file.
+ *
+ * @param upload the upload
+ * @param data the body bytes
+ * @param len the number of bytes
+ * @return 0 if written, or the status of the error response
+ */
+static int storeBytes(http_upload *upload, const char data[], size_t len) {
+	while (len > 0) {
+		ssize_t n = write(upload->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return errorStatus(errno);
+		}
+		data += n;
+		len -= n;
+		upload->size += n;
+	}
+	return 0;
+}
+
+/**
+ * Decode chunked body bytes and store the chunk data.
+ *
+ * @param upload the upload
+ * @param buf the received bytes
+ * @param len the number of received bytes
+ * @param used set to the number of bytes that are part of the body
+ * @return 0 if more body bytes are needed, 1 at the end of the
+ *   body, or the status of the error response
+ */
+static int decodeChunks(http_upload *upload, const char buf[], size_t len, size_t *used) {
+	size_t i = 0;
+	while (i < len) {
+		char ch = buf[i];
+		switch (upload->state) {
+		case CHUNK_SIZE_START:
+		case CHUNK_SIZE: {
+			int digit = (ch >= '0' && ch <= '9') ? ch - '0'
+					  : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+					  : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : -1;
+			if (digit >= 0) {
+				upload->remaining = upload->remaining * 16 + digit;
+				if (upload->size + upload->remaining > MAX_UPLOAD_SIZE) {
+					return 413;
+				}
+				upload->state = CHUNK_SIZE;
+			} else if (upload->state == CHUNK_SIZE_START) {
+				return 400;
+			} else if (ch == ';' || ch == ' ' || ch == '\t') {
+				upload->state = CHUNK_EXT;
+			} else if (ch == '\r') {
+				upload->state = CHUNK_SIZE_LF;
+			} else if (ch == '\n') {
+				upload->state = (upload->remaining > 0) ? CHUNK_DATA : TRAILER_START;
+			} else {
+				return 400;
+			}
+			i++;
+			break;
+		}
+		case CHUNK_EXT:
+			if (ch == '\n') {
+				upload->state = (upload->remaining > 0) ? CHUNK_DATA : TRAILER_START;
+			}
+			i++;
+			break;
+
+		case CHUNK_SIZE_LF:
+			if (ch != '\n') {
+				return 400;
+			}
+			upload->state = (upload->remaining > 0) ? CHUNK_DATA : TRAILER_START;
+			i++;
+			break;
+
+		case CHUNK_DATA: {
+			// store as much of the chunk as has arrived at once
+			size_t n = len - i;
+			if ((long long)n > upload->remaining) {
+				n = (size_t)upload->remaining;
+			}
+			int status = storeBytes(upload, buf + i, n);
+			if (status != 0) {
+				return status;
+			}
+			upload->remaining -= n;
+			i += n;
+			if (upload->remaining == 0) {
+				upload->state = CHUNK_DATA_CR;
+			}
+			break;
+		}
+		case CHUNK_DATA_CR:
+			if (ch == '\n') {
+				upload->state = CHUNK_SIZE_START;
+			} else if (ch == '\r') {
+				upload->state = CHUNK_DATA_LF;
+			} else {
+				return 400;
+			}
+			i++;
+			break;
+
+		case CHUNK_DATA_LF:
+			if (ch != '\n') {
+				return 400;
+			}
+			upload->state = CHUNK_SIZE_START;
+			i++;
+			break;
+
+		case TRAILER_START:
+			i++;
+			if (ch == '\n') {
+				*used = i;
+				return 1;
+			}
+			upload->state = (ch == '\r') ? TRAILER_END_LF : TRAILER_LINE;
+			break;
+
+		case TRAILER_LINE:
+			if (ch == '\n') {
+				upload->state = TRAILER_START;
+			}
+			i++;
+			break;
+
+		case TRAILER_END_LF:
+			if (ch != '\n') {
+				return 400;
+			}
+			*used = i + 1;
+			return 1;
+		}
+	}
+	*used = i;
+	return 0;
+}
+
+/**
+ * Store request body bytes that have arrived. Bytes after the end
+ * of the body are not used; they belong to the next request.
+ *
+ * @param upload the upload
+ * @param buf the received bytes
+ * @param len the number of received bytes
+ * @param used set to the number of bytes that are part of the body
+ * @return 0 if more body bytes are needed, otherwise the status of
+ *   the response: 201 or 204 once the file is stored, or an error
+ */
+int receiveUpload(http_upload *upload, const char buf[], size_t len, size_t *used) {
+	int status;
+	*used = 0;
+	if (upload->chunked) {
+		status = decodeChunks(upload, buf, len, used);
+	} else {
+		size_t n = ((long long)len < upload->remaining) ? len : (size_t)upload->remaining;
+		status = storeBytes(upload, buf, n);
+		upload->remaining -= n;
+		*used = n;
+		if (status == 0 && upload->remaining == 0) {
+			status = 1;
+		}
+	}
+
+	if (status == 1) {
+		return finishUpload(upload);
+	}
+	if (status != 0) {
+		abortUpload(upload);
+	}
+	return status;
+}
+
+/**
+ * Get the number of body bytes still to come, if known, so they
+ * can be read without reading past the end of the body.
+ *
+ * @param upload the upload
+ * @return the number of bytes, or -1 if the body is chunked
+ */
+long long getUploadRemaining(const http_upload *upload) {
+	return upload->chunked ? -1 : upload->remaining;
+}
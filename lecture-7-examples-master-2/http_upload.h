@@ -0,0 +1,120 @@
+/*
+ * http_upload.h
+ *
+ * Storage of PUT and POST request bodies as files under an upload
+ * directory. The body is written to the file as it arrives, in
+ * whatever pieces the request engine reads, so no upload is ever
+ * held in memory whole. Bodies may be sent with Content-Length or
+ * with chunked transfer coding.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef HTTP_UPLOAD_H_
+#define HTTP_UPLOAD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http_headers.h"
+#include "http_server.h"
+
+/** largest request body stored */
+#define MAX_UPLOAD_SIZE (4LL * 1024 * 1024 * 1024)
+
+/** largest unused request body read to keep the connection open */
+#define MAX_DISCARD_SIZE (1024LL * 1024)
+
+/** Upload of one request body in progress */
+typedef struct {
+	int dir_fd;				// directory of the file, or -1 if no upload
+	int fd;					// temporary file receiving the body
+	char name[MAXBUF];		// file name in directory
+	char temp_name[64];		// temporary file name in directory
+	char location[MAXBUF];	// URI of the stored file
+	bool replacing;			// true if the file already exists
+	bool chunked;			// true if the body has chunked transfer coding
+	int state;				// state of chunked body decoding
+	long long remaining;	// bytes left in body or current chunk
+	long long size;			// bytes of body stored
+} http_upload;
+
+/**
+ * Open the directory under which uploads are stored. Uploads
+ * are refused unless this is called.
+ *
+ * @param dir the upload directory
+ * @return true if the directory was opened
+ */
+bool openUploadRoot(const char dir[]);
+
+/**
+ * Test whether uploads are accepted.
+ *
+ * @return true if an upload directory is open
+ */
+bool isUploadEnabled(void);
+
+/**
+ * Get the length of the body of a request that does not use it.
+ * The body follows the request header on the connection, so it
+ * must be read and discarded before the next request, unless the
+ * connection is closed instead.
+ *
+ * @param requestHeaders the request headers
+ * @return the length of the body, 0 if there is none, or -1 if it
+ *   must not be read: it is chunked, its length is invalid or over
+ *   MAX_DISCARD_SIZE, or the client waits for 100 Continue to send it
+ */
+long long getDiscardLength(const http_headers *requestHeaders);
+
+/**
+ * Start an upload of a request body to the file named by a URI.
+ * A POST to a URI ending in "/" stores the body under a new name
+ * in that directory; otherwise the body replaces the named file.
+ * The file appears only once the whole body has been stored,
+ * so an empty body is stored here.
+ *
+ * @param upload the upload
+ * @param method the request method, "PUT" or "POST"
+ * @param uri the request URI
+ * @param requestHeaders the request headers
+ * @return 0 if started, 201 or 204 if an empty body was stored,
+ *   or the status of the error response
+ */
+int beginUpload(http_upload *upload, const char method[], const char uri[],
+				const http_headers *requestHeaders);
+
+/**
+ * Store request body bytes that have arrived. Bytes after the end
+ * of the body are not used; they belong to the next request.
+ *
+ * @param upload the upload
+ * @param buf the received bytes
+ * @param len the number of received bytes
+ * @param used set to the number of bytes that are part of the body
+ * @return 0 if more body bytes are needed, otherwise the status of
+ *   the response: 201 or 204 once the file is stored, or an error
+ */
+int receiveUpload(http_upload *upload, const char buf[], size_t len, size_t *used);
+
+/**
+ * Get the number of body bytes still to come, if known, so they
+ * can be read without reading past the end of the body.
+ *
+ * @param upload the upload
+ * @return the number of bytes, or -1 if the body is chunked
+ */
+long long getUploadRemaining(const http_upload *upload);
+
+/**
+ * Abandon an upload in progress and remove its temporary file.
+ * Does nothing if no upload is in progress.
+ *
+ * @param upload the upload
+ */
+void abortUpload(http_upload *upload);
+
+#endif /* HTTP_UPLOAD_H_ */
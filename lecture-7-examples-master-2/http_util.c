@@ -6,18 +6,45 @@
  *  @since 2019-04-10
  *  @author: Philip Gust
  */
+#define _GNU_SOURCE  // for strcasestr()
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/openat2.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
+#include "http_headers.h"
 #include "http_server.h"
 #include "http_util.h"
+#include "mime_types.h"
 
 
+/** largest content offset */
+#define OFF_MAX ((off_t)((1ULL << (sizeof(off_t) * CHAR_BIT - 1)) - 1))
+
 /** The default response protocol */
 static const char* responseProtocol = "HTTP/1.1";
 
+/** directory that content paths are relative to */
+static int content_root = -1;
+
+/** true once openat2() is found to be unavailable */
+static atomic_bool no_openat2 = false;
+
 /**
  * Reads line of request from request stream and trims trailing CRLF.
  *
@@ -30,11 +57,8 @@ char* readRequestLine(FILE *istream, char buf[], int len) {
 	if (fgets(buf, len, istream) == NULL) {
 		return NULL;
 	}
-	// trim newline characters
-	char* p = strstr(buf, CRLF);
-	if (p != NULL) {
-		*p = 0;
-	}
+	// trim newline characters (CRLF, or LF from lenient clients)
+	buf[strcspn(buf, CRLF)] = 0;
 	return buf;
 }
 
@@ -45,57 +69,408 @@ char* readRequestLine(FILE *istream, char buf[], int len) {
  * @param timer the time
  * @param buf the buffer
  */
-static inline void milliTimeToRFC_1123_Date_Time(time_t timer, char buf[]) {
-	strftime(buf, 64, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&timer));
+void milliTimeToRFC_1123_Date_Time(time_t timer, char buf[]) {
+	struct tm tm;
+	strftime(buf, 64, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&timer, &tm));
+}
+
+/**
+ * Converts a RFC-1123 formatted date-time string, or the
+ * obsolete asctime() format, to a timer.
+ *
+ * @param buf the date-time string
+ * @param timer set to the time
+ * @return true if the string was parsed
+ */
+bool RFC_1123_Date_TimeToMilliTime(const char buf[], time_t *timer) {
+	struct tm tm;
+	memset(&tm, 0, sizeof tm);
+	if (strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+		memset(&tm, 0, sizeof tm);
+		if (strptime(buf, "%a %b %d %H:%M:%S %Y", &tm) == NULL) {
+			return false;
+		}
+	}
+	*timer = timegm(&tm);
+	return true;
+}
+
+/**
+ * Get entity tag for a file. The tag changes whenever
+ * the file is replaced, resized, or modified, and differs
+ * for each content coding of the file.
+ *
+ * @param sb the file status
+ * @param encoding the content coding, or NULL if none
+ * @param etag the quoted entity tag
+ */
+void getEntityTag(const struct stat *sb, const char encoding[], char etag[]) {
+	int len = sprintf(etag, "\"%lx-%lx-%lx", (unsigned long)sb->st_ino,
+					  (unsigned long)sb->st_size, (unsigned long)sb->st_mtime);
+	if (encoding != NULL) {
+		len += sprintf(etag + len, "-%s", encoding);
+	}
+	strcpy(etag + len, "\"");
+}
+
+/**
+ * Determine whether an If-None-Match list matches an entity tag.
+ * Uses weak comparison, so a W/ prefix is ignored.
+ *
+ * @param tags the comma-separated list of quoted tags, or "*"
+ * @param etag the quoted entity tag
+ * @return true if any tag in the list matches
+ */
+static bool matchesEntityTag(const char tags[], const char etag[]) {
+	size_t etag_len = strlen(etag);
+	for (const char *tag = tags; *tag != '\0'; ) {
+		tag += strspn(tag, " \t,");
+		size_t len = strcspn(tag, ",");
+		while (len > 0 && (tag[len-1] == ' ' || tag[len-1] == '\t')) {
+			len--;
+		}
+		if (len == 1 && *tag == '*') {
+			return true;
+		}
+		const char *opaque = tag;
+		if (len > 2 && strncmp(tag, "W/", 2) == 0) {
+			opaque += 2;
+		}
+		if ((size_t)(tag + len - opaque) == etag_len && strncmp(opaque, etag, etag_len) == 0) {
+			return true;
+		}
+		tag += len;
+		tag += strcspn(tag, ",");
+	}
+	return false;
+}
+
+/**
+ * Determine whether a conditional GET can be answered with
+ * 304 Not Modified. If-None-Match takes precedence over
+ * If-Modified-Since when both are present.
+ *
+ * @param requestHeaders the request headers
+ * @param etag the quoted entity tag of the content
+ * @param mtime the modification time of the content
+ * @return true if the client's copy is current
+ */
+bool isNotModified(const http_headers *requestHeaders, const char etag[], time_t mtime) {
+	const char *ifNoneMatch = getHeader(requestHeaders, "If-None-Match");
+	if (ifNoneMatch != NULL) {
+		return matchesEntityTag(ifNoneMatch, etag);
+	}
+
+	const char *ifModifiedSince = getHeader(requestHeaders, "If-Modified-Since");
+	time_t since;
+	if (ifModifiedSince != NULL && RFC_1123_Date_TimeToMilliTime(ifModifiedSince, &since)) {
+		return mtime <= since;
+	}
+	return false;
+}
+
+/**
+ * Determine whether a range request may be answered with partial
+ * content. Without If-Range it always may; with If-Range the
+ * client's entity tag must match strongly, or its date must equal
+ * the modification time of the content.
+ *
+ * @param requestHeaders the request headers
+ * @param etag the quoted entity tag of the content
+ * @param mtime the modification time of the content
+ * @return true if the requested ranges may be sent
+ */
+bool isRangeCurrent(const http_headers *requestHeaders, const char etag[], time_t mtime) {
+	const char *ifRange = getHeader(requestHeaders, "If-Range");
+	if (ifRange == NULL) {
+		return true;
+	}
+	if (*ifRange == '"' || strncmp(ifRange, "W/", 2) == 0) {
+		return strcmp(ifRange, etag) == 0;  // weak tags never match strongly
+	}
+	time_t since;
+	return RFC_1123_Date_TimeToMilliTime(ifRange, &since) && (since == mtime);
+}
+
+/**
+ * Parse a decimal content offset. An offset too large for off_t
+ * is read as OFF_MAX, which is past the end of any content.
+ *
+ * @param p the digits
+ * @param end set to the character after the digits
+ * @return the offset
+ */
+static off_t parseOffset(const char *p, char **end) {
+	errno = 0;
+	unsigned long long value = strtoull(p, end, 10);
+	if (errno == ERANGE || value > (unsigned long long)OFF_MAX) {
+		return OFF_MAX;
+	}
+	return (off_t)value;
+}
+
+/**
+ * Merge ranges that overlap or are adjacent, so the same content
+ * is not sent more than once. A merged range takes the place of
+ * the first of its ranges in request order.
+ *
+ * @param ranges the ranges
+ * @param nranges the number of ranges
+ * @return the number of ranges after merging
+ */
+static int mergeByteRanges(byte_range ranges[], int nranges) {
+	for (int i = 0; i < nranges; i++) {
+		for (int j = i + 1; j < nranges; j++) {
+			if (ranges[j].first <= ranges[i].last + 1 && ranges[i].first <= ranges[j].last + 1) {
+				// extend range i to cover range j and remove range j
+				if (ranges[j].first < ranges[i].first) {
+					ranges[i].first = ranges[j].first;
+				}
+				if (ranges[j].last > ranges[i].last) {
+					ranges[i].last = ranges[j].last;
+				}
+				memmove(&ranges[j], &ranges[j + 1], (nranges - j - 1) * sizeof ranges[0]);
+				nranges--;
+				j = i;  // recheck later ranges against the larger range
+			}
+		}
+	}
+	return nranges;
 }
 
 /**
- * Send status and fixed properties to response output stream.
+ * Parse a "bytes=" Range specification against the content size.
+ * Open-ended and suffix ranges are resolved to absolute offsets
+ * and ranges that extend past the end are truncated; ranges that
+ * start past the end are dropped. Overlapping and adjacent ranges
+ * are merged, so every range is within the content and no content
+ * is sent twice.
  *
- * @param ostream the output socket stream
+ * @param spec the Range header value
+ * @param size the size of the content
+ * @param ranges set to the satisfiable ranges in request order
+ * @param maxRanges the maximum number of ranges
+ * @return the number of satisfiable ranges, 0 if none are
+ *   satisfiable, or -1 if the specification is invalid or
+ *   has too many ranges and should be ignored
+ */
+int parseByteRanges(const char spec[], off_t size, byte_range ranges[], int maxRanges) {
+	if (strncasecmp(spec, "bytes=", 6) != 0) {
+		return -1;
+	}
+
+	int nranges = 0;
+	for (const char *p = spec + 6; ; p++) {
+		p += strspn(p, " \t");
+		char *end;
+		off_t first, last;
+		if (*p == '-') {  // suffix range: last n bytes
+			if (!isdigit((unsigned char)p[1])) {
+				return -1;
+			}
+			off_t suffix = parseOffset(p + 1, &end);
+			first = (suffix < size) ? size - suffix : 0;
+			last = (suffix == 0) ? -1 : size - 1;
+		} else if (isdigit((unsigned char)*p)) {
+			first = parseOffset(p, &end);
+			if (*end != '-') {
+				return -1;
+			}
+			p = end + 1;
+			if (isdigit((unsigned char)*p)) {
+				last = parseOffset(p, &end);
+				if (last < first) {
+					return -1;
+				}
+				if (last >= size) {
+					last = size - 1;
+				}
+			} else {  // open-ended range
+				last = size - 1;
+				end = (char *)p;
+			}
+		} else {
+			return -1;
+		}
+
+		// keep range if satisfiable
+		if (first <= last && first < size) {
+			if (nranges == maxRanges) {
+				return -1;
+			}
+			ranges[nranges].first = first;
+			ranges[nranges].last = last;
+			nranges++;
+		}
+
+		p = end + strspn(end, " \t");
+		if (*p == '\0') {
+			break;
+		}
+		if (*p != ',') {
+			return -1;
+		}
+	}
+	return mergeByteRanges(ranges, nranges);
+}
+
+/** cached RFC-1123 date strings, alternately updated by date clock */
+static char dateStrings[2][64];
+
+/** index of current date string, or -1 if date clock is not running */
+static atomic_int dateIndex = -1;
+
+/**
+ * Date clock thread function refreshes the cached date string
+ * at the start of each second.
+ *
+ * @param arg unused
+ * @return NULL (unused)
+ */
+static void *dateClock(void *arg) {
+	(void)arg;
+	while (true) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		// update the date string readers are not using, then switch
+		int next = 1 - atomic_load(&dateIndex);
+		milliTimeToRFC_1123_Date_Time(now.tv_sec, dateStrings[next]);
+		atomic_store(&dateIndex, next);
+
+		// sleep until next second begins
+		struct timespec delay = { 0, 1000000000L - now.tv_nsec };
+		nanosleep(&delay, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Start the thread that keeps the cached Date property current
+ * so responses do not format the time themselves.
+ *
+ * @return true if the date clock is running
+ */
+bool startDateClock(void) {
+	milliTimeToRFC_1123_Date_Time(time(NULL), dateStrings[0]);
+	atomic_store(&dateIndex, 0);
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, dateClock, NULL) != 0) {
+		atomic_store(&dateIndex, -1);
+		return false;
+	}
+	pthread_detach(tid);
+	return true;
+}
+
+/**
+ * Append bytes to the response header buffer. Marks the
+ * header as overflowed if there is not enough room.
+ *
+ * @param response the response header
+ * @param bytes the bytes to append
+ * @param len the number of bytes
+ */
+void addResponseBytes(response_header *response, const char bytes[], size_t len) {
+	if (response->len + len > sizeof response->buf) {
+		response->overflow = true;
+		return;
+	}
+	memcpy(response->buf + response->len, bytes, len);
+	response->len += len;
+}
+
+/**
+ * Append a string to the response header buffer.
+ *
+ * @param response the response header
+ * @param str the string
+ */
+static inline void addResponseString(response_header *response, const char str[]) {
+	addResponseBytes(response, str, strlen(str));
+}
+
+/**
+ * Begin response header with status and fixed properties.
+ *
+ * @param response the response header
  * @param status the response status
  * @param statusMsg the response message
  */
-void sendResponseStatus(FILE *ostream, int status, const char* statusMsg) {
-	fprintf(ostream, "%s %d %s%s", responseProtocol, status, statusMsg, CRLF);
-	if (debug) {
-		fprintf(stderr, "< %s %d %s\n", responseProtocol, status, statusMsg);
+void beginResponse(response_header *response, int status, const char* statusMsg) {
+	response->len = (size_t)snprintf(response->buf, sizeof response->buf,
+			"%s %d %s%sServer: Tiny Http Server%sDate: ",
+			responseProtocol, status, statusMsg, CRLF, CRLF);
+	response->status = status;
+	response->nsent = 0;
+	response->overflow = false;
+
+	// response time from date clock if running
+	int i = atomic_load(&dateIndex);
+	if (i >= 0) {
+		addResponseString(response, dateStrings[i]);
+	} else {
+		char time_str[MAXBUF];
+		milliTimeToRFC_1123_Date_Time(time(NULL), time_str);
+		addResponseString(response, time_str);
 	}
+	addResponseString(response, CRLF);
+}
 
-	// send server name
-	sendResponseProperty(ostream, "Server", "Tiny Http Server");
+/**
+ * Add property to response header.
+ *
+ * @param response the response header
+ * @param name property name
+ * @param value property value
+ */
+void addResponseProperty(response_header *response, const char name[], const char value[]) {
+	addResponseString(response, name);
+	addResponseString(response, ": ");
+	addResponseString(response, value);
+	addResponseString(response, CRLF);
+}
 
-	// send response time
-	char time_str[MAXBUF];
-	milliTimeToRFC_1123_Date_Time(time(NULL), time_str);
-	sendResponseProperty(ostream, "Date", time_str);
+/**
+ * Add pre-rendered properties to response header.
+ *
+ * @param response the response header
+ * @param properties "name: value" lines, each ending with CRLF
+ */
+void addRenderedProperties(response_header *response, const char properties[]) {
+	addResponseString(response, properties);
 }
 
 /**
- * Send property to response output stream.
+ * Add header properties and end of response properties
+ * to response header.
  *
- * @param ostream the output socket stream
- * @param propName property name
- * @param propVal property value;
+ * @param response the response header
+ * @param responseHeaders the response headers
  */
-void sendResponseProperty(FILE *ostream, char name[], char value[]) {
-	fprintf(ostream, "%s: %s%s", name, value, CRLF);
-	if (debug) {
-		fprintf(stderr, "< %s: %s\n", name, value);
+void endResponseProperties(response_header *response, const http_headers *responseHeaders) {
+	for (int i = 0; i < responseHeaders->count; i++) {
+		addResponseProperty(response, responseHeaders->header[i].name,
+							responseHeaders->header[i].value);
 	}
+	addResponseString(response, CRLF);
 }
 
 /**
- * Send end of response properties to response output stream.
+ * Print the status and properties of a response header for debugging.
  *
- * @param ostream the output socket stream
- * @param propName property name
- * @param propVal property value;
+ * @param response the response header
  */
-void endResponseProperties(FILE *ostream) {
-	fprintf(ostream, "%s", CRLF);
-	if (debug) {
-		fprintf(stderr, "< \n");
+void debugResponseHeader(const response_header *response) {
+	const char *end = response->buf + response->len;
+	for (const char *p = response->buf; p < end; ) {
+		int len = (int)strcspn(p, CRLF);
+		fprintf(stderr, "< %.*s\n", len, p);
+		if (len == 0) {
+			break;  // end of response properties
+		}
+		p += len + strlen(CRLF);
 	}
 }
 
@@ -107,22 +482,92 @@ void endResponseProperties(FILE *ostream) {
  * @param nbytes the number of bytes to send
  */
 void sendResponseBytes(FILE *contentStream, FILE *ostream, unsigned long nbytes) {
-	// copy content stream to output stream
-    for (unsigned long byte; (nbytes > 0) && !feof(contentStream); nbytes--) {
-    	byte = fgetc(contentStream);
-    	fputc(byte, ostream);
-    }
+	// copy content stream to output stream in blocks
+	char buf[COPY_BLOCK_SIZE];
+	while (nbytes > 0) {
+		size_t n = fread(buf, 1, (nbytes < sizeof buf) ? nbytes : sizeof buf, contentStream);
+		if (n == 0 || fwrite(buf, 1, n, ostream) != n) {
+			break;
+		}
+		nbytes -= n;
+	}
+}
+
+/**
+ * Copy bytes from content file to output stream by reading
+ * and writing large blocks.
+ *
+ * @param content_fd the content file descriptor
+ * @param out_fd the output socket descriptor
+ * @param offset the offset of the first content byte
+ * @param nbytes the number of bytes to send
+ * @return true if all bytes were sent
+ */
+static bool copyFileBlocks(int content_fd, int out_fd, off_t offset, unsigned long nbytes) {
+	char buf[COPY_BLOCK_SIZE];
+	while (nbytes > 0) {
+		ssize_t n = pread(content_fd, buf, (nbytes < sizeof buf) ? nbytes : sizeof buf, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		for (ssize_t sent = 0; sent < n; ) {
+			ssize_t w = write(out_fd, buf + sent, n - sent);
+			if (w < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			sent += w;
+		}
+		offset += n;
+		nbytes -= n;
+	}
+	return true;
+}
+
+/**
+ * Send bytes from content file to output socket without copying
+ * them through user space. Uses sendfile() where available,
+ * falling back to large-block read and write.
+ *
+ * @param content_fd the content file descriptor
+ * @param out_fd the output socket descriptor
+ * @param offset the offset of the first content byte
+ * @param nbytes the number of bytes to send
+ * @return true if all bytes were sent
+ */
+bool sendResponseFile(int content_fd, int out_fd, off_t offset, unsigned long nbytes) {
+#ifdef __linux__
+	while (nbytes > 0) {
+		ssize_t n = sendfile(out_fd, content_fd, &offset, nbytes);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL || errno == ENOSYS) break;  // not supported for these fds
+			return false;
+		}
+		if (n == 0) {
+			return false;  // content file shrank
+		}
+		nbytes -= n;
+	}
+#endif /* __linux__ */
+
+	return copyFileBlocks(content_fd, out_fd, offset, nbytes);
 }
 
 /**
- * Set error response and error page to the response output stream.
+ * Set error response and error page in the response header.
+ * The error page follows the header in the same buffer.
  *
- * @param ostream the output socket stream
+ * @param response the response header
  * @param status the response status
  * @param statusMsg the response message
- * @param responseHeaders the response headers
+ * @param responseHeaders the response headers, or NULL if none
  */
-void sendErrorResponse(FILE* ostream, int responseCode, const char* responseStr) {
+void setErrorResponse(response_header *response, int responseCode, const char* responseStr,
+					  http_headers *responseHeaders) {
 	char errorBody[MAXBUF];  // because of data substitution.
 	char errBodyLen[MAXBUF];
 	const char* errorPage =
@@ -133,25 +578,284 @@ void sendErrorResponse(FILE* ostream, int responseCode, const char* responseStr)
 	sprintf(errorBody, errorPage, responseCode, responseStr, responseCode, responseStr);
 	sprintf(errBodyLen, "%zu", strlen(errorBody));
 
-	// send response header
-	sendResponseStatus(ostream, responseCode, responseStr);
-	sendResponseProperty(ostream, "Content-type", "text/html");
-	sendResponseProperty(ostream, "Content-Length", errBodyLen);
-	endResponseProperties(ostream);
+	http_headers noHeaders;
+	if (responseHeaders == NULL) {
+		initHeaders(&noHeaders);
+		responseHeaders = &noHeaders;
+	}
+
+	// response header
+	beginResponse(response, responseCode, responseStr);
+	putHeader(responseHeaders, "Content-type", "text/html");
+	putHeader(responseHeaders, "Content-Length", errBodyLen);
+	endResponseProperties(response, responseHeaders);
+
+	// error body
+	addResponseString(response, errorBody);
+}
+
+/**
+ * Determine whether connection should remain open after the
+ * response. HTTP/1.1 connections persist unless the client
+ * sends "Connection: close"; HTTP/1.0 connections persist
+ * only if the client sends "Connection: keep-alive".
+ *
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @return true if connection should remain open
+ */
+bool isKeepAlive(const char version[], const http_headers *requestHeaders) {
+	const char *connection = getHeader(requestHeaders, "Connection");
+	if (strcasecmp(version, "HTTP/1.1") == 0) {
+		return (connection == NULL) || (strcasestr(connection, "close") == NULL);
+	}
+	return (connection != NULL) && (strcasestr(connection, "keep-alive") != NULL);
+}
+
+/**
+ * Get the preferred content coding that the client accepts
+ * and the server can produce.
+ *
+ * @param requestHeaders the request headers
+ * @return "gzip" or "deflate", or NULL to send content as is
+ */
+const char *getAcceptedEncoding(const http_headers *requestHeaders) {
+	const char *accept = getHeader(requestHeaders, "Accept-Encoding");
+	if (accept == NULL) {
+		return NULL;
+	}
+
+	// quality of each coding, or -1 if not listed
+	double gzip = -1, deflate = -1, any = -1;
+	for (const char *p = accept; *p != '\0'; ) {
+		p += strspn(p, " \t,");
+		size_t len = strcspn(p, ",");
+		char coding[MAXBUF];
+		snprintf(coding, sizeof coding, "%.*s", (int)len, p);
+		p += len;
+
+		double q = 1.0;
+		char *params = strchr(coding, ';');
+		if (params != NULL) {
+			*params++ = '\0';
+			const char *qvalue = strcasestr(params, "q=");
+			if (qvalue != NULL) {
+				q = strtod(qvalue + 2, NULL);
+			}
+		}
+		coding[strcspn(coding, " \t")] = '\0';
+		if (strcasecmp(coding, "gzip") == 0 || strcasecmp(coding, "x-gzip") == 0) {
+			gzip = q;
+		} else if (strcasecmp(coding, "deflate") == 0) {
+			deflate = q;
+		} else if (strcmp(coding, "*") == 0) {
+			any = q;
+		}
+	}
+	if (gzip < 0) gzip = any;
+	if (deflate < 0) deflate = any;
+
+	if (gzip > 0 && gzip >= deflate) {
+		return "gzip";
+	}
+	return (deflate > 0) ? "deflate" : NULL;
+}
+
+/**
+ * Determine whether content of a type is worth compressing.
+ *
+ * @param contentType the content type
+ * @return true if content is textual
+ */
+bool isCompressible(const char contentType[]) {
+	static const char *types[] = {
+		"application/json", "application/xml", "application/javascript",
+		"application/x-sh", "application/yaml", "application/toml", NULL
+	};
+	if (strncmp(contentType, "text/", 5) == 0) {
+		return true;
+	}
+	size_t len = strlen(contentType);
+	if (len > 5 && (strcmp(contentType + len - 5, "+json") == 0
+					|| strcmp(contentType + len - 4, "+xml") == 0)) {
+		return true;
+	}
+	for (int i = 0; types[i] != NULL; i++) {
+		if (strcmp(contentType, types[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
 
-	// send error body
-	fprintf(ostream, "%s", errorBody);
+/**
+ * Get the value of a hexadecimal digit.
+ *
+ * @param ch the digit
+ * @return the value, or -1 if not a hexadecimal digit
+ */
+static int hexValue(char ch) {
+	if (ch >= '0' && ch <= '9') return ch - '0';
+	if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	return -1;
 }
 
 /**
- * Resolves server URI to file system path.
+ * Resolves server URI to a file path relative to the content root
+ * in one pass. The scheme and authority of an absolute URI, and
+ * the query and fragment, are ignored. Each path segment is
+ * percent-decoded, and "." and ".." segments are removed so the
+ * path stays within the content root. A path that names a
+ * directory by ending in "/" resolves to its "index.html".
+ *
  * @param uri the request URI
- * @param fspath the file system path
+ * @param path the file path
+ * @param size the size of the file path buffer
+ * @return 0 if resolved, or the status of the error response:
+ *   400 for a URI that is not a path, an invalid escape, or an
+ *   escaped "/" or NUL, or 414 if the path does not fit in the buffer
  */
-void resolveUri(const char uri[], char fspath[]) {
-	strcpy(fspath, CONTENT_BASE);
-	strcat(fspath, uri);
-	return;
+int resolveUri(const char uri[], char path[], size_t size) {
+	// path of absolute URI starts after the authority
+	const char *p = uri;
+	if (strncasecmp(p, "http://", 7) == 0 || strncasecmp(p, "https://", 8) == 0) {
+		p = strchr(p, ':') + 3;
+		p += strcspn(p, "/?#");
+	} else if (*p != '/') {
+		return 400;
+	}
+
+	// path is empty or ends with "/" before each segment
+	size_t len = 0;
+	bool directory = true;
+	while (*p == '/') {
+		p++;
+		size_t segment = len;
+		for ( ; *p != '/' && *p != '?' && *p != '#' && *p != '\0'; p++) {
+			char ch = *p;
+			if (ch == '%') {
+				int hi = hexValue(p[1]);
+				int lo = (hi < 0) ? -1 : hexValue(p[2]);
+				if (lo < 0) {
+					return 400;
+				}
+				ch = (char)(hi << 4 | lo);
+				if (ch == '/' || ch == '\0') {
+					return 400;
+				}
+				p += 2;
+			}
+			if (len + 1 >= size) {
+				return 414;
+			}
+			path[len++] = ch;
+		}
+
+		size_t n = len - segment;
+		directory = true;
+		if (n == 0 || (n == 1 && path[segment] == '.')) {
+			len = segment;  // empty or "." segment
+		} else if (n == 2 && path[segment] == '.' && path[segment + 1] == '.') {
+			// ".." removes itself and the previous segment
+			len = segment;
+			if (len > 0) {
+				for (len--; len > 0 && path[len - 1] != '/'; len--) {
+					continue;
+				}
+			}
+		} else if (*p == '/') {
+			if (len + 1 >= size) {
+				return 414;
+			}
+			path[len++] = '/';
+		} else {
+			directory = false;
+		}
+	}
+
+	if (directory) {
+		if (len + sizeof DIRECTORY_INDEX > size) {
+			return 414;
+		}
+		memcpy(path + len, DIRECTORY_INDEX, sizeof DIRECTORY_INDEX);
+	} else {
+		path[len] = '\0';
+	}
+	return 0;
+}
+
+/**
+ * Open the directory that content paths are relative to.
+ * Must be called before content is opened.
+ *
+ * @param dir the content directory
+ * @return true if the directory was opened
+ */
+bool openContentRoot(const char dir[]) {
+	content_root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return content_root >= 0;
+}
+
+/**
+ * Open a file relative to a directory. Where the kernel supports
+ * it, the path is resolved with openat2() so that no symbolic link
+ * can lead outside the directory.
+ *
+ * @param dir_fd the directory
+ * @param path the file path relative to the directory
+ * @param flags the open flags
+ * @return the file descriptor, or -1 with errno set on error
+ */
+int openBeneath(int dir_fd, const char path[], int flags) {
+#if defined(__linux__) && defined(SYS_openat2)
+	if (!atomic_load_explicit(&no_openat2, memory_order_relaxed)) {
+		struct open_how how = {
+			.flags = flags | O_CLOEXEC,
+			.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+		};
+		int fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof how);
+		if (fd >= 0 || (errno != ENOSYS && errno != EPERM)) {
+			return fd;
+		}
+		// kernel before 5.6, or system call filtered
+		atomic_store_explicit(&no_openat2, true, memory_order_relaxed);
+	}
+#endif
+	return openat(dir_fd, path, flags | O_CLOEXEC);
+}
+
+/**
+ * Open a content file for reading.
+ *
+ * @param path the file path relative to the content root
+ * @return the file descriptor, or -1 with errno set on error
+ */
+int openContent(const char path[]) {
+	return openBeneath(content_root, path, O_RDONLY);
+}
+
+/**
+ * Get the status of a content file. The path is resolved the same
+ * way as openContent() resolves it, so a symbolic link that leads
+ * outside the content root has no status.
+ *
+ * @param path the file path relative to the content root
+ * @param sb set to the file status
+ * @return true if the file status was found
+ */
+bool statContent(const char path[], struct stat *sb) {
+#ifdef O_PATH
+	int fd = openBeneath(content_root, path, O_PATH);  // needs no read permission
+#else
+	int fd = openBeneath(content_root, path, O_RDONLY);
+#endif
+	if (fd < 0) {
+		return false;
+	}
+	bool found = (fstat(fd, sb) == 0);
+	close(fd);
+	return found;
 }
 
 /**
@@ -161,21 +865,6 @@ void resolveUri(const char uri[], char fspath[]) {
  * @param contentType the content type
  */
 void getContentType(char filePath[], char contentType[]) {
-	// file path suffix to content type mapping
-	static const char* contentTypes[][2] = {
-		{".html", "text/html"},
-		{".txt", "text/plain"},
-		{".css", "text/css"},
-		{".gif", "impage/gif"},
-		{".jpg", "image.jpg"},
-		{".png", "image.png"},
-		{".ico", "image/ico"},
-		{ NULL, "application/octet-stream"}  // default
-	};
-	int i;
-	for (i = 0; contentTypes[i][0] != NULL; i++) {
-		if (strcasestr(filePath, contentTypes[i][0]) != NULL) break;
-	}
-	strcpy(contentType, contentTypes[i][1]);
+	strcpy(contentType, lookupContentType(filePath));
 }
 
@@ -10,6 +10,42 @@
 #ifndef HTTP_UTIL_H_
 #define HTTP_UTIL_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "http_headers.h"
+
+/** size of blocks used to copy content */
+#define COPY_BLOCK_SIZE 65536
+
+/** maximum number of byte ranges in a range request */
+#define MAX_RANGES 16
+
+/** file served for a URI that names a directory */
+#define DIRECTORY_INDEX "index.html"
+
+/** maximum size of a response header */
+#define MAX_RESPONSE_HEADER 4096
+
+/** Response status line and properties assembled in one buffer */
+typedef struct {
+	int status;			// response status
+	unsigned long nsent;	// bytes of header and body sent
+	size_t len;			// number of bytes in buffer
+	bool overflow;		// true if properties did not fit
+	char buf[MAX_RESPONSE_HEADER];
+} response_header;
+
+/** An inclusive range of content byte offsets */
+typedef struct {
+	off_t first;
+	off_t last;
+} byte_range;
+
 /**
  * Reads line of request from request stream and trims trailing CRLF.
  *
@@ -21,32 +57,137 @@
 char* readRequestLine(FILE *istream, char buf[], int len);
 
 /**
- * Send status and fixed properties to response output stream.
+ * Converts timer to a RFC-1123 formatted date-time string
+ * of the form: Sat, 13 Apr 2019 19:03:32 GMT
+ *
+ * @param timer the time
+ * @param buf the buffer
+ */
+void milliTimeToRFC_1123_Date_Time(time_t timer, char buf[]);
+
+/**
+ * Converts a RFC-1123 formatted date-time string, or the
+ * obsolete asctime() format, to a timer.
+ *
+ * @param buf the date-time string
+ * @param timer set to the time
+ * @return true if the string was parsed
+ */
+bool RFC_1123_Date_TimeToMilliTime(const char buf[], time_t *timer);
+
+/**
+ * Get entity tag for a file. The tag changes whenever
+ * the file is replaced, resized, or modified, and differs
+ * for each content coding of the file.
  *
+ * @param sb the file status
+ * @param encoding the content coding, or NULL if none
+ * @param etag the quoted entity tag
+ */
+void getEntityTag(const struct stat *sb, const char encoding[], char etag[]);
+
+/**
+ * Determine whether a conditional GET can be answered with
+ * 304 Not Modified. If-None-Match takes precedence over
+ * If-Modified-Since when both are present.
+ *
+ * @param requestHeaders the request headers
+ * @param etag the quoted entity tag of the content
+ * @param mtime the modification time of the content
+ * @return true if the client's copy is current
+ */
+bool isNotModified(const http_headers *requestHeaders, const char etag[], time_t mtime);
+
+/**
+ * Determine whether a range request may be answered with partial
+ * content. Without If-Range it always may; with If-Range the
+ * client's entity tag must match strongly, or its date must equal
+ * the modification time of the content.
+ *
+ * @param requestHeaders the request headers
+ * @param etag the quoted entity tag of the content
+ * @param mtime the modification time of the content
+ * @return true if the requested ranges may be sent
+ */
+bool isRangeCurrent(const http_headers *requestHeaders, const char etag[], time_t mtime);
+
+/**
+ * Parse a "bytes=" Range specification against the content size.
+ * Open-ended and suffix ranges are resolved to absolute offsets
+ * and ranges that extend past the end are truncated; ranges that
+ * start past the end are dropped. Overlapping and adjacent ranges
+ * are merged, so every range is within the content and no content
+ * is sent twice.
+ *
+ * @param spec the Range header value
+ * @param size the size of the content
+ * @param ranges set to the satisfiable ranges in request order
+ * @param maxRanges the maximum number of ranges
+ * @return the number of satisfiable ranges, 0 if none are
+ *   satisfiable, or -1 if the specification is invalid or
+ *   has too many ranges and should be ignored
+ */
+int parseByteRanges(const char spec[], off_t size, byte_range ranges[], int maxRanges);
+
+/**
+ * Start the thread that keeps the cached Date property current
+ * so responses do not format the time themselves.
+ *
+ * @return true if the date clock is running
+ */
+bool startDateClock(void);
+
+/**
+ * Begin response header with status and fixed properties.
+ *
+ * @param response the response header
  * @param status the response status
  * @param statusMsg the response message
- * @param responseCharset the response charset
- * @throws IOException if error occurs
  */
-void sendResponseStatus(FILE *ostream, int status, const char* statusMsg);
+void beginResponse(response_header *response, int status, const char* statusMsg);
+
+/**
+ * Add property to response header.
+ *
+ * @param response the response header
+ * @param name property name
+ * @param value property value
+ */
+void addResponseProperty(response_header *response, const char name[], const char value[]);
 
 /**
- * Send property to response output stream.
+ * Add pre-rendered properties to response header.
  *
- * @param ostream the output socket stream
- * @param propName property name
- * @param propVal property value;
+ * @param response the response header
+ * @param properties "name: value" lines, each ending with CRLF
  */
-void sendResponseProperty(FILE *ostream, char name[], char value[]);
+void addRenderedProperties(response_header *response, const char properties[]);
 
 /**
- * Send end of response properties to response output stream.
+ * Add header properties and end of response properties
+ * to response header.
  *
- * @param ostream the output socket stream
- * @param propName property name
- * @param propVal property value;
+ * @param response the response header
+ * @param responseHeaders the response headers
  */
-void endResponseProperties(FILE *ostream);
+void endResponseProperties(response_header *response, const http_headers *responseHeaders);
+
+/**
+ * Append bytes to the response header buffer. Marks the
+ * header as overflowed if there is not enough room.
+ *
+ * @param response the response header
+ * @param bytes the bytes to append
+ * @param len the number of bytes
+ */
+void addResponseBytes(response_header *response, const char bytes[], size_t len);
+
+/**
+ * Print the status and properties of a response header for debugging.
+ *
+ * @param response the response header
+ */
+void debugResponseHeader(const response_header *response);
 
 /**
  * Copy bytes from input stream to output stream
@@ -57,21 +198,115 @@ void endResponseProperties(FILE *ostream);
 void sendResponseBytes(FILE *istream, FILE *ostream, unsigned long nbytes);
 
 /**
- * Set error response and error page to the response output stream.
+ * Send bytes from content file to output socket without copying
+ * them through user space. Uses sendfile() where available,
+ * falling back to large-block read and write.
+ *
+ * @param content_fd the content file descriptor
+ * @param out_fd the output socket descriptor
+ * @param offset the offset of the first content byte
+ * @param nbytes the number of bytes to send
+ * @return true if all bytes were sent
+ */
+bool sendResponseFile(int content_fd, int out_fd, off_t offset, unsigned long nbytes);
+
+/**
+ * Set error response and error page in the response header.
+ * The error page follows the header in the same buffer.
  *
- * @param ostream the output socket stream
+ * @param response the response header
  * @param status the response status
  * @param statusMsg the response message
- * @param responseHeaders the response headers
+ * @param responseHeaders the response headers, or NULL if none
+ */
+void setErrorResponse(response_header *response, int responseCode, const char* responseStr,
+					  http_headers *responseHeaders);
+
+/**
+ * Determine whether connection should remain open after the
+ * response. HTTP/1.1 connections persist unless the client
+ * sends "Connection: close"; HTTP/1.0 connections persist
+ * only if the client sends "Connection: keep-alive".
+ *
+ * @param version the request protocol version
+ * @param requestHeaders the request headers
+ * @return true if connection should remain open
+ */
+bool isKeepAlive(const char version[], const http_headers *requestHeaders);
+
+/**
+ * Get the preferred content coding that the client accepts
+ * and the server can produce.
+ *
+ * @param requestHeaders the request headers
+ * @return "gzip" or "deflate", or NULL to send content as is
+ */
+const char *getAcceptedEncoding(const http_headers *requestHeaders);
+
+/**
+ * Determine whether content of a type is worth compressing.
+ *
+ * @param contentType the content type
+ * @return true if content is textual
  */
-void sendErrorResponse(FILE* ostream, int responseCode, const char* responseStr);
+bool isCompressible(const char contentType[]);
 
 /**
- * Resolves server URI to file system path.
+ * Resolves server URI to a file path relative to the content root
+ * in one pass. The scheme and authority of an absolute URI, and
+ * the query and fragment, are ignored. Each path segment is
+ * percent-decoded, and "." and ".." segments are removed so the
+ * path stays within the content root. A path that names a
+ * directory by ending in "/" resolves to its "index.html".
+ *
  * @param uri the request URI
- * @param fspath the file system path
+ * @param path the file path
+ * @param size the size of the file path buffer
+ * @return 0 if resolved, or the status of the error response:
+ *   400 for a URI that is not a path, an invalid escape, or an
+ *   escaped "/" or NUL, or 414 if the path does not fit in the buffer
+ */
+int resolveUri(const char uri[], char path[], size_t size);
+
+/**
+ * Open the directory that content paths are relative to.
+ * Must be called before content is opened.
+ *
+ * @param dir the content directory
+ * @return true if the directory was opened
+ */
+bool openContentRoot(const char dir[]);
+
+/**
+ * Open a file relative to a directory. Where the kernel supports
+ * it, the path is resolved with openat2() so that no symbolic link
+ * can lead outside the directory.
+ *
+ * @param dir_fd the directory
+ * @param path the file path relative to the directory
+ * @param flags the open flags
+ * @return the file descriptor, or -1 with errno set on error
+ */
+int openBeneath(int dir_fd, const char path[], int flags);
+
+/**
+ * Open a content file for reading.
+ *
+ * @param path the file path relative to the content root
+ * @return the file descriptor, or -1 with errno set on error
+ */
+int openContent(const char path[]);
+
+/**
+ * Get the status of a content file. The path is resolved the same
+ * way as openContent() resolves it, so a symbolic link that leads
+ * outside the content root has no status.
+ *
+ * @param path the file path relative to the content root
+ * @param sb set to the file status
+ * @return true if the file status was found
  */
-void resolveUri(const char* uri, char* fspath);
+bool statContent(const char path[], struct stat *sb);
 
 /**
  * Get content type of file path.
@@ -0,0 +1,1067 @@
+/*
+ * loadgen.c
+ *
+ * HTTP load generator for measuring the Tiny Http Server. Keeps a
+ * number of connections busy, each sending its next GET request
+ * as soon as the previous response has been read, and replays a
+ * mix of URIs round robin. With -P it sends PUT requests with a
+ * body of the given size instead, to measure uploads. With -U it
+ * connects to a Unix domain socket instead of a TCP port, and with
+ * -F it opens TCP connections with Fast Open, so the listener
+ * options of the server can be compared. Connections are spread over threads
+ * that each run an epoll loop. At the end it reports requests per
+ * second, throughput, latency percentiles, response status
+ * classes, and errors.
+ *
+ * Latency is measured from the start of a request, including
+ * connecting when the connection is not kept alive, to the last
+ * byte of the response. Responses must have a Content-Length, use
+ * chunked transfer coding, or end when the server closes the
+ * connection.
+ *
+ * Build and run:
+ *   gcc -std=gnu11 -O2 -o loadgen loadgen.c -lpthread
+ *   ./loadgen -c 64 -d 10 -k 1500 /index.html /favicon.ico
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+#define _GNU_SOURCE  // for memmem() and strcasestr()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "server_stats.h"
+
+/** default number of concurrent connections */
+#define DEFAULT_CONNECTIONS 16
+
+/** default number of threads */
+#define DEFAULT_THREADS 4
+
+/** default duration of a run in seconds */
+#define DEFAULT_DURATION 10
+
+/** default seconds before a request times out */
+#define DEFAULT_TIMEOUT 10
+
+/** largest response header read */
+#define MAX_RESPONSE_HEADER 8192
+
+/** most extra request header lines */
+#define MAX_EXTRA_HEADERS 8
+
+/** most URIs in the mix */
+#define MAX_URIS 4096
+
+/** milliseconds between checks for timeouts and idle connections */
+#define SCAN_INTERVAL_MS 10
+
+/** Load generator settings from the command line */
+typedef struct {
+	const char *host;		// server host
+	const char *port;		// server port
+	const char *unix_path;	// server Unix domain socket path, or NULL for TCP
+	bool fastopen;			// send the first request with the SYN (TCP Fast Open)
+	int nconnections;		// number of concurrent connections
+	int nthreads;			// number of threads
+	int duration;			// seconds to run if max_requests is 0
+	unsigned long max_requests;	// number of requests to send, or 0 to run for duration
+	int timeout;			// seconds before a request times out
+	bool keep_alive;		// send requests on persistent connections
+	const char *headers[MAX_EXTRA_HEADERS];	// extra request header lines
+	int nheaders;			// number of extra request header lines
+	size_t upload_size;		// bytes of PUT request body, or 0 to send GET
+} load_options;
+
+/** Kinds of errors counted */
+typedef enum {
+	ERROR_CONNECT,		// could not connect
+	ERROR_WRITE,		// could not send request
+	ERROR_READ,			// could not read response
+	ERROR_CLOSED,		// connection closed before end of response
+	ERROR_RESPONSE,		// malformed response header
+	ERROR_TIMEOUT,		// no response within timeout
+	NUM_ERRORS
+} error_kind;
+
+/** names of the error kinds */
+static const char *error_names[NUM_ERRORS] = {
+	"connect", "write", "read", "closed", "malformed", "timeout"
+};
+
+/** States of a connection */
+typedef enum {
+	CONN_IDLE,			// no request in progress
+	CONN_CONNECTING,	// waiting for connect to complete
+	CONN_SENDING,		// sending request
+	CONN_READING		// reading response
+} conn_state;
+
+/** States of chunked response body decoding */
+typedef enum {
+	CHUNK_SIZE,			// in chunk size
+	CHUNK_EXT,			// in rest of chunk size line
+	CHUNK_DATA,			// in chunk data
+	CHUNK_DATA_END,		// in CRLF after chunk data
+	CHUNK_TRAILER_START,	// at start of trailer line
+	CHUNK_TRAILER,		// in trailer line
+	CHUNK_DONE			// body complete
+} chunk_state;
+
+/** A client connection and its request in progress */
+typedef struct {
+	int fd;						// socket, or -1 if not connected
+	conn_state state;			// connection state
+	struct timespec start;		// start time of request
+	const char *request;		// request being sent
+	size_t request_len;			// length of request
+	size_t sent;				// bytes of request sent
+	char header[MAX_RESPONSE_HEADER];	// response header read so far
+	size_t header_len;			// bytes in header buffer
+	bool header_done;			// true once the header has been read
+	bool until_close;			// true if body ends when the server closes
+	bool close_after;			// true if the server closes after the response
+	long long body_left;		// bytes of body still to read
+	bool chunked;				// true if body has chunked transfer coding
+	chunk_state chunk;			// state of chunked body decoding
+	long long chunk_left;		// bytes of current chunk still to read
+	unsigned long bytes;		// bytes of response read
+	int status;					// response status
+} connection;
+
+/** Measurements and connections of one thread */
+typedef struct {
+	pthread_t thread;			// the thread
+	int id;						// thread number
+	int epoll_fd;				// epoll instance of thread
+	connection *conns;			// connections of thread
+	int nconns;					// number of connections
+	unsigned long next_uri;		// next URI in the mix
+	unsigned long completed;	// responses read
+	unsigned long bytes;		// response bytes read
+	unsigned long uploaded;		// request body bytes sent
+	unsigned long status[6];	// responses by status class (status / 100)
+	unsigned long errors[NUM_ERRORS];	// errors by kind
+	unsigned long latency[HISTOGRAM_BUCKETS];	// latency histogram
+	unsigned long latency_sum;	// total latency in microseconds
+	unsigned long latency_max;	// largest latency in microseconds
+} load_thread;
+
+/** load generator settings */
+static load_options options = {
+	.host = "127.0.0.1",
+	.nconnections = DEFAULT_CONNECTIONS,
+	.nthreads = DEFAULT_THREADS,
+	.duration = DEFAULT_DURATION,
+	.max_requests = 0,
+	.timeout = DEFAULT_TIMEOUT,
+	.keep_alive = false,
+	.nheaders = 0
+};
+
+/** server address */
+static struct sockaddr_storage server_addr;
+
+/** length of server address */
+static socklen_t server_addr_len;
+
+/** pre-rendered request for each URI in the mix */
+static char *requests[MAX_URIS];
+
+/** body of PUT requests, shared by all connections */
+static char *upload_body = NULL;
+
+/** number of URIs in the mix */
+static int nrequests = 0;
+
+/** requests started, when running for a number of requests */
+static atomic_ulong issued = 0;
+
+/** time at which a timed run ends */
+static struct timespec deadline;
+
+/**
+ * Get the time from one time to another in microseconds.
+ *
+ * @param from the earlier time
+ * @param to the later time
+ * @return the microseconds between the times
+ */
+static long long elapsed_us(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/**
+ * Get histogram bucket of a latency. Uses the same log-linear
+ * buckets as the server statistics.
+ *
+ * @param us the latency in microseconds
+ * @return the bucket index
+ */
+static unsigned bucket_of(unsigned long us) {
+	if (us < (1UL << HISTOGRAM_SUB_BITS)) {
+		return (unsigned)us;
+	}
+	unsigned exp = 63 - __builtin_clzl(us);
+	if (exp > HISTOGRAM_MAX_EXP) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+	unsigned shift = exp - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS)
+		   + (unsigned)((us >> shift) & ((1UL << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/**
+ * Get the highest latency that falls in a histogram bucket.
+ *
+ * @param bucket the bucket index
+ * @return the latency in microseconds
+ */
+static unsigned long bucket_value(unsigned bucket) {
+	unsigned sub = bucket & ((1U << HISTOGRAM_SUB_BITS) - 1);
+	unsigned level = bucket >> HISTOGRAM_SUB_BITS;
+	if (level == 0) {
+		return bucket;
+	}
+	unsigned shift = level - 1;
+	unsigned long low = ((1UL << HISTOGRAM_SUB_BITS) + sub) << shift;
+	return low + (1UL << shift) - 1;
+}
+
+/**
+ * Set the events a connection waits for.
+ *
+ * @param t the thread
+ * @param c the connection
+ * @param events the epoll events
+ * @param add true to add the connection to the epoll instance
+ */
+static void watch_connection(load_thread *t, connection *c, uint32_t events, bool add) {
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	epoll_ctl(t->epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/**
+ * Close a connection.
+ *
+ * @param c the connection
+ */
+static void close_connection(connection *c) {
+	if (c->fd >= 0) {
+		close(c->fd);  // also removes it from epoll instance
+		c->fd = -1;
+	}
+	c->state = CONN_IDLE;
+}
+
+/**
+ * Count an error and close the connection. The connection
+ * starts its next request on the next scan.
+ *
+ * @param t the thread
+ * @param c the connection
+ * @param kind the kind of error
+ */
+static void fail_request(load_thread *t, connection *c, error_kind kind) {
+	t->errors[kind]++;
+	close_connection(c);
+}
+
+/**
+ * Test whether the run is over.
+ *
+ * @param now the current time
+ * @return true if no more requests should be started
+ */
+static bool is_run_over(const struct timespec *now) {
+	if (options.max_requests > 0) {
+		return atomic_load(&issued) >= options.max_requests;
+	}
+	return elapsed_us(&deadline, now) >= 0;
+}
+
+/**
+ * Send as much of the request as the socket will take. Once
+ * the request is sent, the connection waits for the response.
+ *
+ * @param t the thread
+ * @param c the connection
+ */
+static void send_request(load_thread *t, connection *c) {
+	size_t total = c->request_len + options.upload_size;
+	while (c->sent < total) {
+		// rest of request header and body together
+		struct iovec iov[2];
+		int iovcnt = 0;
+		size_t body_sent = 0;
+		if (c->sent < c->request_len) {
+			iov[iovcnt++] = (struct iovec){ (char *)c->request + c->sent, c->request_len - c->sent };
+		} else {
+			body_sent = c->sent - c->request_len;
+		}
+		if (body_sent < options.upload_size) {
+			iov[iovcnt++] = (struct iovec){ upload_body + body_sent, options.upload_size - body_sent };
+		}
+		ssize_t n = writev(c->fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;  // wait until writable
+			}
+			fail_request(t, c, ERROR_WRITE);
+			return;
+		}
+		c->sent += n;
+	}
+	c->state = CONN_READING;
+	c->header_len = 0;
+	c->header_done = false;
+	c->until_close = false;
+	c->close_after = false;
+	c->bytes = 0;
+	watch_connection(t, c, EPOLLIN, false);
+}
+
+/**
+ * Open a non-blocking connection to the server.
+ *
+ * @param t the thread
+ * @param c the connection
+ * @return true if connected or connecting
+ */
+static bool open_connection(load_thread *t, connection *c) {
+	c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) {
+		return false;
+	}
+	int one = 1;
+	if (server_addr.ss_family != AF_UNIX) {
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+#ifdef TCP_FASTOPEN_CONNECT
+	// connect() returns at once, and the request goes with the SYN
+	// if the server gave this client a Fast Open cookie before
+	if (options.fastopen) {
+		setsockopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof one);
+	}
+#endif
+	if (connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) < 0
+			&& errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return false;
+	}
+	c->state = CONN_CONNECTING;
+	watch_connection(t, c, EPOLLOUT, true);
+	return true;
+}
+
+/**
+ * Start the next request of the mix on a connection, connecting
+ * first if the connection is not open.
+ *
+ * @param t the thread
+ * @param c the connection
+ * @param now the current time
+ */
+static void start_request(load_thread *t, connection *c, const struct timespec *now) {
+	if (is_run_over(now)) {
+		close_connection(c);
+		return;
+	}
+	if (options.max_requests > 0 && atomic_fetch_add(&issued, 1) >= options.max_requests) {
+		close_connection(c);
+		return;
+	}
+
+	const char *request = requests[t->next_uri++ % nrequests];
+	c->start = *now;
+	c->request = request;
+	c->request_len = strlen(request);
+	c->sent = 0;
+	if (c->fd < 0) {
+		if (!open_connection(t, c)) {
+			t->errors[ERROR_CONNECT]++;
+			c->state = CONN_IDLE;
+		}
+		return;
+	}
+	c->state = CONN_SENDING;
+	watch_connection(t, c, EPOLLOUT, false);
+	send_request(t, c);
+}
+
+/**
+ * Record a complete response and start the next request.
+ *
+ * @param t the thread
+ * @param c the connection
+ */
+static void finish_request(load_thread *t, connection *c) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long us = (unsigned long)elapsed_us(&c->start, &now);
+	t->latency[bucket_of(us)]++;
+	t->latency_sum += us;
+	if (us > t->latency_max) {
+		t->latency_max = us;
+	}
+	t->completed++;
+	t->bytes += c->bytes;
+	t->uploaded += options.upload_size;
+	t->status[(c->status >= 100 && c->status < 600) ? c->status / 100 : 0]++;
+
+	if (c->close_after || !options.keep_alive) {
+		close_connection(c);
+	} else {
+		c->state = CONN_IDLE;
+	}
+	start_request(t, c, &now);
+}
+
+/**
+ * Get the response status and body length from a complete
+ * response header.
+ *
+ * @param c the connection
+ * @param end the length of the header, including the blank line
+ * @return true if the header is valid
+ */
+static bool parse_response_header(connection *c, size_t end) {
+	c->header[end - 1] = '\0';  // header ends with the blank line
+	if (sscanf(c->header, "HTTP/%*d.%*d %d", &c->status) != 1) {
+		return false;
+	}
+
+	const char *persist = strcasestr(c->header, "\r\nConnection:");
+	if (persist != NULL) {
+		persist += 13;
+		persist += strspn(persist, " \t");
+	}
+	c->close_after = (persist != NULL && strncasecmp(persist, "close", 5) == 0);
+
+	const char *length = strcasestr(c->header, "\r\nContent-Length:");
+	const char *coding = strcasestr(c->header, "\r\nTransfer-Encoding:");
+	c->chunked = false;
+	if (c->status < 200 || c->status == 204 || c->status == 304) {
+		c->body_left = 0;
+	} else if (coding != NULL && strcasestr(coding, "chunked") != NULL) {
+		c->chunked = true;
+		c->chunk = CHUNK_SIZE;
+		c->chunk_left = 0;
+		c->body_left = 0;
+	} else if (length != NULL) {
+		c->body_left = strtoll(length + 17, NULL, 10);
+	} else {
+		// body ends when server closes connection
+		c->until_close = true;
+		c->close_after = true;
+		c->body_left = 0;
+	}
+	c->header_done = true;
+	return true;
+}
+
+/**
+ * Decode chunked body bytes, skipping the chunk data.
+ *
+ * @param c the connection
+ * @param data the body bytes
+ * @param len the number of bytes
+ */
+static void skip_chunks(connection *c, const char data[], size_t len) {
+	for (size_t i = 0; i < len && c->chunk != CHUNK_DONE; i++) {
+		char ch = data[i];
+		switch (c->chunk) {
+		case CHUNK_SIZE:
+			if (ch >= '0' && ch <= '9') {
+				c->chunk_left = c->chunk_left * 16 + (ch - '0');
+				break;
+			}
+			if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+				c->chunk_left = c->chunk_left * 16 + ((ch | 0x20) - 'a' + 10);
+				break;
+			}
+			c->chunk = CHUNK_EXT;
+			// fall through
+		case CHUNK_EXT:
+			if (ch == '\n') {
+				c->chunk = (c->chunk_left > 0) ? CHUNK_DATA : CHUNK_TRAILER_START;
+			}
+			break;
+		case CHUNK_DATA: {
+			size_t n = len - i;
+			if ((long long)n > c->chunk_left) {
+				n = (size_t)c->chunk_left;
+			}
+			c->chunk_left -= n;
+			i += n - 1;
+			if (c->chunk_left == 0) {
+				c->chunk = CHUNK_DATA_END;
+			}
+			break;
+		}
+		case CHUNK_DATA_END:
+			if (ch == '\n') {
+				c->chunk = CHUNK_SIZE;
+			}
+			break;
+		case CHUNK_TRAILER_START:
+			if (ch == '\n') {
+				c->chunk = CHUNK_DONE;
+			} else if (ch != '\r') {
+				c->chunk = CHUNK_TRAILER;
+			}
+			break;
+		case CHUNK_TRAILER:
+			if (ch == '\n') {
+				c->chunk = CHUNK_TRAILER_START;
+			}
+			break;
+		case CHUNK_DONE:
+			break;
+		}
+	}
+}
+
+/**
+ * Read as much of the response as has arrived.
+ *
+ * @param t the thread
+ * @param c the connection
+ * @param scratch buffer for response body bytes
+ * @param size the size of the scratch buffer
+ */
+static void read_response(load_thread *t, connection *c, char scratch[], size_t size) {
+	while (true) {
+		ssize_t n;
+		if (!c->header_done) {
+			// read header into header buffer
+			size_t room = sizeof c->header - 1 - c->header_len;
+			if (room == 0) {
+				fail_request(t, c, ERROR_RESPONSE);
+				return;
+			}
+			n = read(c->fd, c->header + c->header_len, room);
+			if (n > 0) {
+				size_t from = (c->header_len > 3) ? c->header_len - 3 : 0;
+				c->header_len += n;
+				c->bytes += n;
+				char *blank = memmem(c->header + from, c->header_len - from, "\r\n\r\n", 4);
+				if (blank != NULL) {
+					size_t end = blank + 4 - c->header;
+					if (!parse_response_header(c, end)) {
+						fail_request(t, c, ERROR_RESPONSE);
+						return;
+					}
+					c->body_left -= c->header_len - end;  // body bytes read with header
+					if (c->chunked) {
+						skip_chunks(c, c->header + end, c->header_len - end);
+					}
+				}
+			}
+		} else {
+			n = read(c->fd, scratch, size);
+			if (n > 0) {
+				c->bytes += n;
+				c->body_left -= n;
+				if (c->chunked) {
+					skip_chunks(c, scratch, (size_t)n);
+				}
+			}
+		}
+
+		if (n == 0) {
+			if (c->header_done && c->until_close) {
+				finish_request(t, c);
+			} else {
+				fail_request(t, c, ERROR_CLOSED);
+			}
+			return;
+		}
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				fail_request(t, c, ERROR_READ);
+			}
+			return;
+		}
+		if (c->header_done && !c->until_close
+				&& (c->chunked ? c->chunk == CHUNK_DONE : c->body_left <= 0)) {
+			finish_request(t, c);
+			return;
+		}
+	}
+}
+
+/**
+ * Handle readiness of a connection.
+ *
+ * @param t the thread
+ * @param c the connection
+ * @param scratch buffer for response body bytes
+ * @param size the size of the scratch buffer
+ */
+static void handle_connection(load_thread *t, connection *c, char scratch[], size_t size) {
+	switch (c->state) {
+	case CONN_CONNECTING: {
+		int err = 0;
+		socklen_t len = sizeof err;
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			fail_request(t, c, ERROR_CONNECT);
+			return;
+		}
+		c->state = CONN_SENDING;
+		send_request(t, c);
+		break;
+	}
+	case CONN_SENDING:
+		send_request(t, c);
+		break;
+	case CONN_READING:
+		read_response(t, c, scratch, size);
+		break;
+	case CONN_IDLE:
+		break;
+	}
+}
+
+/**
+ * Thread function that keeps its connections busy until the
+ * run is over.
+ *
+ * @param arg the load thread
+ * @return NULL
+ */
+static void *run_connections(void *arg) {
+	load_thread *t = arg;
+	static _Thread_local char scratch[65536];
+	struct epoll_event events[64];
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t->next_uri = t->id;  // threads start at different URIs
+	for (int i = 0; i < t->nconns; i++) {
+		t->conns[i].fd = -1;
+		start_request(t, &t->conns[i], &now);
+	}
+
+	struct timespec scanned = now;
+	while (true) {
+		int n = epoll_wait(t->epoll_fd, events, 64, SCAN_INTERVAL_MS);
+		for (int i = 0; i < n; i++) {
+			handle_connection(t, events[i].data.ptr, scratch, sizeof scratch);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (options.max_requests == 0 && is_run_over(&now)) {
+			break;  // abandon requests in progress
+		}
+		if (elapsed_us(&scanned, &now) < SCAN_INTERVAL_MS * 1000) {
+			continue;
+		}
+		scanned = now;
+
+		// time out late requests, and restart connections after errors
+		int active = 0;
+		for (int i = 0; i < t->nconns; i++) {
+			connection *c = &t->conns[i];
+			if (c->state != CONN_IDLE
+					&& elapsed_us(&c->start, &now) > options.timeout * 1000000LL) {
+				fail_request(t, c, ERROR_TIMEOUT);
+			}
+			if (c->state == CONN_IDLE) {
+				start_request(t, c, &now);
+			}
+			if (c->state != CONN_IDLE) {
+				active++;
+			}
+		}
+		if (active == 0 && is_run_over(&now)) {
+			break;  // all requests sent and answered
+		}
+	}
+
+	for (int i = 0; i < t->nconns; i++) {
+		close_connection(&t->conns[i]);
+	}
+	return NULL;
+}
+
+/**
+ * Add a URI to the mix.
+ *
+ * @param uri the URI
+ * @return true if added
+ */
+static bool add_uri(const char uri[]) {
+	if (nrequests == MAX_URIS) {
+		fprintf(stderr, "Too many URIs, using first %d\n", MAX_URIS);
+		return false;
+	}
+	size_t len = strlen(uri) + strlen(options.host) + 192;
+	for (int h = 0; h < options.nheaders; h++) {
+		len += strlen(options.headers[h]) + 2;
+	}
+	char *request = malloc(len);
+	if (request == NULL) {
+		return false;
+	}
+	int n = snprintf(request, len, "%s %s HTTP/1.1\r\nHost: %s:%s\r\n",
+					 (options.upload_size > 0) ? "PUT" : "GET", uri, options.host, options.port);
+	if (options.upload_size > 0) {
+		n += snprintf(request + n, len - n, "Content-Length: %zu\r\n", options.upload_size);
+	}
+	for (int h = 0; h < options.nheaders; h++) {
+		n += snprintf(request + n, len - n, "%s\r\n", options.headers[h]);
+	}
+	snprintf(request + n, len - n, "%s\r\n", options.keep_alive ? "" : "Connection: close\r\n");
+	requests[nrequests++] = request;
+	return true;
+}
+
+/**
+ * Add the URIs in a file to the mix, one per line. Blank lines
+ * and lines starting with '#' are ignored. A URI listed more
+ * than once is requested more often.
+ *
+ * @param path the file path
+ * @return true if the file was read
+ */
+static bool add_uri_file(const char path[]) {
+	FILE *stream = fopen(path, "r");
+	if (stream == NULL) {
+		return false;
+	}
+	char line[MAX_RESPONSE_HEADER];
+	while (fgets(line, sizeof line, stream) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '\0' && line[0] != '#' && !add_uri(line)) {
+			break;
+		}
+	}
+	fclose(stream);
+	return true;
+}
+
+/**
+ * Find the smallest latency at or below which a percentage
+ * of the latencies fall.
+ *
+ * @param counts the count in each bucket
+ * @param count the total count
+ * @param percentile the percentage
+ * @param max the largest latency
+ * @return the latency in microseconds
+ */
+static unsigned long percentile_of(const unsigned long counts[], unsigned long count,
+								   double percentile, unsigned long max) {
+	unsigned long rank = (unsigned long)(percentile / 100.0 * count + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	unsigned long seen = 0;
+	unsigned b = 0;
+	while (b < HISTOGRAM_BUCKETS - 1 && seen + counts[b] < rank) {
+		seen += counts[b++];
+	}
+	unsigned long value = (count > 0) ? bucket_value(b) : 0;
+	return (value < max) ? value : max;
+}
+
+/**
+ * Add the measurements of the threads together and report them.
+ *
+ * @param threads the threads
+ * @param seconds the length of the run
+ */
+static void report(const load_thread threads[], double seconds) {
+	static unsigned long latency[HISTOGRAM_BUCKETS];
+	unsigned long completed = 0, bytes = 0, uploaded = 0, sum = 0, max = 0;
+	unsigned long status[6] = { 0 }, errors[NUM_ERRORS] = { 0 };
+	for (int i = 0; i < options.nthreads; i++) {
+		const load_thread *t = &threads[i];
+		completed += t->completed;
+		bytes += t->bytes;
+		uploaded += t->uploaded;
+		sum += t->latency_sum;
+		if (t->latency_max > max) {
+			max = t->latency_max;
+		}
+		for (int s = 0; s < 6; s++) {
+			status[s] += t->status[s];
+		}
+		for (int e = 0; e < NUM_ERRORS; e++) {
+			errors[e] += t->errors[e];
+		}
+		for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			latency[b] += t->latency[b];
+		}
+	}
+
+	printf("requests   %lu in %.2f s, %.1f req/s, %.2f MB/s\n",
+		   completed, seconds, completed / seconds, bytes / seconds / (1024 * 1024));
+	if (options.upload_size > 0) {
+		printf("uploaded   %.2f MB/s\n", uploaded / seconds / (1024 * 1024));
+	}
+	printf("latency us mean %.0f  p50 %lu  p90 %lu  p99 %lu  p999 %lu  max %lu\n",
+		   (completed > 0) ? (double)sum / completed : 0.0,
+		   percentile_of(latency, completed, 50, max), percentile_of(latency, completed, 90, max),
+		   percentile_of(latency, completed, 99, max), percentile_of(latency, completed, 99.9, max),
+		   max);
+	printf("status     2xx %lu  3xx %lu  4xx %lu  5xx %lu  other %lu\n",
+		   status[2], status[3], status[4], status[5], status[0] + status[1]);
+	unsigned long nerrors = 0;
+	printf("errors    ");
+	for (int e = 0; e < NUM_ERRORS; e++) {
+		printf(" %s %lu ", error_names[e], errors[e]);
+		nerrors += errors[e];
+	}
+	printf("\n");
+	if (nerrors > 0 || status[4] + status[5] > 0) {
+		printf("%lu errors, %lu error responses\n", nerrors, status[4] + status[5]);
+	}
+}
+
+/**
+ * Resolve the server address.
+ *
+ * @return true if resolved
+ */
+static bool resolve_server(void) {
+	if (options.unix_path != NULL) {
+		struct sockaddr_un *address = (struct sockaddr_un *)&server_addr;
+		if (strlen(options.unix_path) >= sizeof address->sun_path) {
+			fprintf(stderr, "%s: path too long\n", options.unix_path);
+			return false;
+		}
+		address->sun_family = AF_UNIX;
+		strcpy(address->sun_path, options.unix_path);
+		server_addr_len = sizeof *address;
+		return true;
+	}
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *addrs;
+	int err = getaddrinfo(options.host, options.port, &hints, &addrs);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", options.host, gai_strerror(err));
+		return false;
+	}
+	memcpy(&server_addr, addrs->ai_addr, addrs->ai_addrlen);
+	server_addr_len = addrs->ai_addrlen;
+	freeaddrinfo(addrs);
+	return true;
+}
+
+/**
+ * Print usage message.
+ *
+ * @param program the program name
+ */
+static void usage(const char *program) {
+	fprintf(stderr, "usage: %s [-c connections] [-t threads] [-d seconds | -n requests] [-k]"
+			" [-T timeout] [-h host | -U unix_path] [-F] [-H header] [-P body_size] [-f uri_file]"
+			" port [uri ...]\n", program);
+}
+
+/**
+ * Main program runs the load and reports the results.
+ *
+ * @param -c: optional number of concurrent connections (default: 16)
+ * @param -t: optional number of threads (default: 4)
+ * @param -d: optional seconds to run (default: 10)
+ * @param -n: optional number of requests to send instead of running for a time
+ * @param -k: optional keep connections alive between requests
+ * @param -T: optional seconds before a request times out (default: 10)
+ * @param -h: optional server host (default: 127.0.0.1)
+ * @param -U: optional server Unix domain socket path instead of host and port
+ * @param -F: optional open connections with TCP Fast Open
+ * @param -H: optional extra request header line, e.g. "Accept-Encoding: gzip"
+ * @param -P: optional send PUT requests with a body of this many bytes instead of GET
+ * @param -f: optional file of URIs to add to the mix, one per line
+ * @param port: the server port, only sent in the Host header with -U
+ * @param uri: optional URIs to add to the mix (default: / if no URI file)
+ */
+int main(int argc, char* argv[argc]) {
+	const char *uri_file = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:t:d:n:kT:h:U:FH:P:f:")) != -1) {
+		switch (opt) {
+		case 'c':
+			if ((sscanf(optarg, "%d", &options.nconnections) != 1) || (options.nconnections < 1)) {
+				fprintf(stderr, "Invalid connection count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			if ((sscanf(optarg, "%d", &options.nthreads) != 1) || (options.nthreads < 1)) {
+				fprintf(stderr, "Invalid thread count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if ((sscanf(optarg, "%d", &options.duration) != 1) || (options.duration < 1)) {
+				fprintf(stderr, "Invalid duration %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			if ((sscanf(optarg, "%lu", &options.max_requests) != 1) || (options.max_requests < 1)) {
+				fprintf(stderr, "Invalid request count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'k':
+			options.keep_alive = true;
+			break;
+		case 'T':
+			if ((sscanf(optarg, "%d", &options.timeout) != 1) || (options.timeout < 1)) {
+				fprintf(stderr, "Invalid timeout %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			options.host = optarg;
+			break;
+		case 'U':
+			options.unix_path = optarg;
+			break;
+		case 'F':
+			options.fastopen = true;
+			break;
+		case 'H':
+			if (options.nheaders == MAX_EXTRA_HEADERS) {
+				fprintf(stderr, "Too many headers\n");
+				return EXIT_FAILURE;
+			}
+			options.headers[options.nheaders++] = optarg;
+			break;
+		case 'P':
+			if ((sscanf(optarg, "%zu", &options.upload_size) != 1) || (options.upload_size < 1)) {
+				fprintf(stderr, "Invalid body size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			uri_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	options.port = argv[optind++];
+	if (options.nthreads > options.nconnections) {
+		options.nthreads = options.nconnections;
+	}
+
+	// one body is sent by every PUT request
+	if (options.upload_size > 0) {
+		upload_body = malloc(options.upload_size);
+		if (upload_body == NULL) {
+			perror("malloc");
+			return EXIT_FAILURE;
+		}
+		for (size_t i = 0; i < options.upload_size; i++) {
+			upload_body[i] = (char)random();
+		}
+	}
+
+	// requests are rendered once for the whole run
+	if (uri_file != NULL && !add_uri_file(uri_file)) {
+		perror(uri_file);
+		return EXIT_FAILURE;
+	}
+	for ( ; optind < argc && add_uri(argv[optind]); optind++) {
+		continue;
+	}
+	if (nrequests == 0 && !add_uri("/")) {
+		return EXIT_FAILURE;
+	}
+	if (!resolve_server()) {
+		return EXIT_FAILURE;
+	}
+
+	// many connections may need more than the default descriptor limit
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	load_thread *threads = calloc(options.nthreads, sizeof(load_thread));
+	connection *conns = calloc(options.nconnections, sizeof(connection));
+	if (threads == NULL || conns == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (options.max_requests > 0) {
+		printf("%lu requests", options.max_requests);
+	} else {
+		printf("%d s", options.duration);
+	}
+	printf(" of %d URIs on %d %s%s connections in %d threads to ", nrequests,
+		   options.nconnections, options.keep_alive ? "keep-alive" : "new",
+		   options.fastopen ? " fast open" : "", options.nthreads);
+	if (options.unix_path != NULL) {
+		printf("%s\n", options.unix_path);
+	} else {
+		printf("%s:%s\n", options.host, options.port);
+	}
+	fflush(stdout);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = start;
+	deadline.tv_sec += options.duration;
+
+	// spread connections evenly over threads
+	connection *next = conns;
+	for (int i = 0; i < options.nthreads; i++) {
+		load_thread *t = &threads[i];
+		t->id = i;
+		t->conns = next;
+		t->nconns = options.nconnections / options.nthreads + (i < options.nconnections % options.nthreads);
+		next += t->nconns;
+		t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (t->epoll_fd < 0 || pthread_create(&t->thread, NULL, run_connections, t) != 0) {
+			perror("start thread");
+			return EXIT_FAILURE;
+		}
+	}
+	for (int i = 0; i < options.nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		close(threads[i].epoll_fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	report(threads, elapsed_us(&start, &end) / 1e6);
+
+	free(threads);
+	free(conns);
+	for (int i = 0; i < nrequests; i++) {
+		free(requests[i]);
+	}
+	return EXIT_SUCCESS;
+}
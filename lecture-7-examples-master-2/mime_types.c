@@ -0,0 +1,475 @@
+/*
+ * mime_types.c
+ *
+ * Table of content types keyed by file name suffix. Lookups go
+ * through a perfect hash built with the hash-and-displace method:
+ * suffixes are grouped into buckets, and each bucket gets the
+ * displacement that moves all of its suffixes into empty slots.
+ * A lookup hashes the suffix once, reads the displacement of its
+ * bucket, and compares the one suffix found in its slot.
+ *
+ * The table is built from the built-in types on first use and
+ * rebuilt when a mime.types file is loaded at startup. It is not
+ * changed while requests are served, so lookups do not lock.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime_types.h"
+
+/** largest displacement tried before the slot table is grown */
+#define MAX_DISPLACEMENT 4096
+
+/** A suffix and its content type */
+typedef struct {
+	const char *suffix;		// lower-case suffix without '.'
+	const char *type;		// content type
+	uint64_t hash;			// hash of suffix
+} mime_type;
+
+/** built-in suffix to content type mapping */
+static const char *builtinTypes[][2] = {
+	// text
+	{"html", "text/html"}, {"htm", "text/html"}, {"shtml", "text/html"},
+	{"txt", "text/plain"}, {"text", "text/plain"}, {"log", "text/plain"},
+	{"conf", "text/plain"}, {"ini", "text/plain"}, {"md", "text/markdown"},
+	{"markdown", "text/markdown"}, {"css", "text/css"}, {"csv", "text/csv"},
+	{"tsv", "text/tab-separated-values"}, {"ics", "text/calendar"},
+	{"vcf", "text/vcard"}, {"vcard", "text/vcard"}, {"rtx", "text/richtext"},
+	{"sgml", "text/sgml"}, {"sgm", "text/sgml"}, {"vtt", "text/vtt"},
+	{"jad", "text/vnd.sun.j2me.app-descriptor"}, {"wml", "text/vnd.wap.wml"},
+	{"htc", "text/x-component"}, {"mml", "text/mathml"}, {"uri", "text/uri-list"},
+	{"c", "text/x-c"}, {"h", "text/x-c"}, {"cc", "text/x-c"}, {"cpp", "text/x-c"},
+	{"hpp", "text/x-c"}, {"java", "text/x-java-source"}, {"py", "text/x-python"},
+	{"sh", "application/x-sh"}, {"pl", "application/x-perl"},
+	{"s", "text/x-asm"}, {"asm", "text/x-asm"}, {"f", "text/x-fortran"},
+	{"p", "text/x-pascal"}, {"pas", "text/x-pascal"}, {"tex", "application/x-tex"},
+	{"latex", "application/x-latex"}, {"bib", "text/x-bibtex"},
+	{"diff", "text/x-diff"}, {"patch", "text/x-diff"}, {"yaml", "application/yaml"},
+	{"yml", "application/yaml"}, {"toml", "application/toml"},
+
+	// images
+	{"gif", "image/gif"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"},
+	{"jpe", "image/jpeg"}, {"jfif", "image/jpeg"}, {"png", "image/png"},
+	{"apng", "image/apng"}, {"ico", "image/x-icon"}, {"cur", "image/x-icon"},
+	{"bmp", "image/bmp"}, {"webp", "image/webp"}, {"avif", "image/avif"},
+	{"heic", "image/heic"}, {"heif", "image/heif"}, {"svg", "image/svg+xml"},
+	{"svgz", "image/svg+xml"}, {"tif", "image/tiff"}, {"tiff", "image/tiff"},
+	{"jp2", "image/jp2"}, {"jxl", "image/jxl"}, {"psd", "image/vnd.adobe.photoshop"},
+	{"wbmp", "image/vnd.wap.wbmp"}, {"djvu", "image/vnd.djvu"}, {"djv", "image/vnd.djvu"},
+	{"pbm", "image/x-portable-bitmap"}, {"pgm", "image/x-portable-graymap"},
+	{"ppm", "image/x-portable-pixmap"}, {"pnm", "image/x-portable-anymap"},
+	{"xbm", "image/x-xbitmap"}, {"xpm", "image/x-xpixmap"}, {"tga", "image/x-tga"},
+	{"ras", "image/x-cmu-raster"}, {"rgb", "image/x-rgb"}, {"xwd", "image/x-xwindowdump"},
+	{"jng", "image/x-jng"}, {"dds", "image/vnd.ms-dds"}, {"exr", "image/aces"},
+
+	// audio
+	{"mp3", "audio/mpeg"}, {"mpga", "audio/mpeg"}, {"m4a", "audio/mp4"},
+	{"aac", "audio/aac"}, {"oga", "audio/ogg"}, {"ogg", "audio/ogg"},
+	{"opus", "audio/ogg"}, {"spx", "audio/ogg"}, {"wav", "audio/wav"},
+	{"weba", "audio/webm"}, {"flac", "audio/flac"}, {"mid", "audio/midi"},
+	{"midi", "audio/midi"}, {"kar", "audio/midi"}, {"aif", "audio/x-aiff"},
+	{"aiff", "audio/x-aiff"}, {"aifc", "audio/x-aiff"}, {"au", "audio/basic"},
+	{"snd", "audio/basic"}, {"ra", "audio/x-realaudio"}, {"m3u", "audio/x-mpegurl"},
+	{"wma", "audio/x-ms-wma"}, {"amr", "audio/amr"}, {"caf", "audio/x-caf"},
+
+	// video
+	{"mp4", "video/mp4"}, {"m4v", "video/mp4"}, {"mpeg", "video/mpeg"},
+	{"mpg", "video/mpeg"}, {"mpe", "video/mpeg"}, {"mov", "video/quicktime"},
+	{"qt", "video/quicktime"}, {"webm", "video/webm"}, {"ogv", "video/ogg"},
+	{"avi", "video/x-msvideo"}, {"wmv", "video/x-ms-wmv"}, {"asf", "video/x-ms-asf"},
+	{"asx", "video/x-ms-asf"}, {"flv", "video/x-flv"}, {"mkv", "video/x-matroska"},
+	{"3gp", "video/3gpp"}, {"3gpp", "video/3gpp"}, {"3g2", "video/3gpp2"},
+	{"ts", "video/mp2t"}, {"m2ts", "video/mp2t"}, {"mng", "video/x-mng"},
+	{"m3u8", "application/vnd.apple.mpegurl"}, {"mpd", "application/dash+xml"},
+
+	// fonts
+	{"woff", "font/woff"}, {"woff2", "font/woff2"}, {"ttf", "font/ttf"},
+	{"otf", "font/otf"}, {"ttc", "font/collection"},
+	{"eot", "application/vnd.ms-fontobject"},
+
+	// structured data and scripts
+	{"js", "text/javascript"}, {"mjs", "text/javascript"},
+	{"json", "application/json"}, {"map", "application/json"},
+	{"jsonld", "application/ld+json"}, {"webmanifest", "application/manifest+json"},
+	{"xml", "application/xml"}, {"xsl", "application/xml"}, {"xsd", "application/xml"},
+	{"dtd", "application/xml-dtd"}, {"xslt", "application/xslt+xml"},
+	{"xhtml", "application/xhtml+xml"}, {"xht", "application/xhtml+xml"},
+	{"rss", "application/rss+xml"}, {"atom", "application/atom+xml"},
+	{"rdf", "application/rdf+xml"}, {"kml", "application/vnd.google-earth.kml+xml"},
+	{"kmz", "application/vnd.google-earth.kmz"}, {"gpx", "application/gpx+xml"},
+	{"geojson", "application/geo+json"}, {"wasm", "application/wasm"},
+	{"php", "application/x-httpd-php"}, {"rb", "application/x-ruby"},
+	{"tcl", "application/x-tcl"}, {"tk", "application/x-tcl"},
+	{"swf", "application/x-shockwave-flash"}, {"jar", "application/java-archive"},
+	{"war", "application/java-archive"}, {"ear", "application/java-archive"},
+	{"class", "application/java-vm"}, {"ser", "application/java-serialized-object"},
+	{"jnlp", "application/x-java-jnlp-file"}, {"sql", "application/sql"},
+	{"wsdl", "application/wsdl+xml"}, {"ps", "application/postscript"},
+	{"eps", "application/postscript"}, {"ai", "application/postscript"},
+	{"pdf", "application/pdf"}, {"rtf", "application/rtf"},
+	{"epub", "application/epub+zip"}, {"mobi", "application/x-mobipocket-ebook"},
+	{"sig", "application/pgp-signature"},
+	{"asc", "application/pgp-signature"}, {"pgp", "application/pgp-encrypted"},
+	{"p7s", "application/pkcs7-signature"}, {"p7m", "application/pkcs7-mime"},
+	{"p10", "application/pkcs10"}, {"p12", "application/x-pkcs12"},
+	{"pfx", "application/x-pkcs12"}, {"crt", "application/x-x509-ca-cert"},
+	{"cer", "application/pkix-cert"}, {"der", "application/x-x509-ca-cert"},
+	{"pem", "application/x-pem-file"}, {"crl", "application/pkix-crl"},
+
+	// office documents
+	{"doc", "application/msword"}, {"dot", "application/msword"},
+	{"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+	{"dotx", "application/vnd.openxmlformats-officedocument.wordprocessingml.template"},
+	{"xls", "application/vnd.ms-excel"}, {"xlt", "application/vnd.ms-excel"},
+	{"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+	{"xltx", "application/vnd.openxmlformats-officedocument.spreadsheetml.template"},
+	{"ppt", "application/vnd.ms-powerpoint"}, {"pps", "application/vnd.ms-powerpoint"},
+	{"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+	{"ppsx", "application/vnd.openxmlformats-officedocument.presentationml.slideshow"},
+	{"potx", "application/vnd.openxmlformats-officedocument.presentationml.template"},
+	{"odt", "application/vnd.oasis.opendocument.text"},
+	{"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+	{"odp", "application/vnd.oasis.opendocument.presentation"},
+	{"odg", "application/vnd.oasis.opendocument.graphics"},
+	{"odf", "application/vnd.oasis.opendocument.formula"},
+	{"pages", "application/vnd.apple.pages"}, {"numbers", "application/vnd.apple.numbers"},
+	{"key", "application/vnd.apple.keynote"}, {"vsd", "application/vnd.visio"},
+	{"mdb", "application/x-msaccess"}, {"one", "application/onenote"},
+	{"xps", "application/vnd.ms-xpsdocument"}, {"oxps", "application/oxps"},
+
+	// archives and binaries
+	{"zip", "application/zip"}, {"gz", "application/gzip"}, {"tgz", "application/gzip"},
+	{"bz2", "application/x-bzip2"}, {"xz", "application/x-xz"},
+	{"zst", "application/zstd"}, {"lz", "application/x-lzip"},
+	{"lzma", "application/x-lzma"}, {"z", "application/x-compress"},
+	{"tar", "application/x-tar"}, {"7z", "application/x-7z-compressed"},
+	{"rar", "application/vnd.rar"}, {"cab", "application/vnd.ms-cab-compressed"},
+	{"cpio", "application/x-cpio"}, {"shar", "application/x-shar"},
+	{"iso", "application/x-iso9660-image"}, {"img", "application/octet-stream"},
+	{"dmg", "application/x-apple-diskimage"}, {"pkg", "application/octet-stream"},
+	{"deb", "application/vnd.debian.binary-package"},
+	{"rpm", "application/x-rpm"}, {"apk", "application/vnd.android.package-archive"},
+	{"msi", "application/x-msdownload"}, {"exe", "application/x-msdownload"},
+	{"dll", "application/x-msdownload"}, {"bin", "application/octet-stream"},
+	{"so", "application/octet-stream"}, {"o", "application/octet-stream"},
+	{"a", "application/octet-stream"}, {"dat", "application/octet-stream"},
+	{"torrent", "application/x-bittorrent"}, {"sqlite", "application/vnd.sqlite3"},
+	{"db", "application/octet-stream"}, {"wad", "application/x-doom"},
+	{"nes", "application/x-nes-rom"}, {"bat", "application/x-msdownload"},
+	{"crx", "application/x-chrome-extension"}, {"xpi", "application/x-xpinstall"},
+	{"ipa", "application/octet-stream"}, {"appimage", "application/vnd.appimage"},
+	{"ogx", "application/ogg"}, {"hqx", "application/mac-binhex40"},
+	{"cpt", "application/mac-compactpro"}, {"sit", "application/x-stuffit"},
+	{"dvi", "application/x-dvi"}, {"gtar", "application/x-gtar"},
+	{"hdf", "application/x-hdf"}, {"nc", "application/x-netcdf"},
+	{"cdf", "application/x-netcdf"}, {"sv4cpio", "application/x-sv4cpio"},
+	{"ustar", "application/x-ustar"}, {"src", "application/x-wais-source"},
+	{"mif", "application/vnd.mif"},
+
+	// 3D models
+	{"gltf", "model/gltf+json"}, {"glb", "model/gltf-binary"},
+	{"obj", "model/obj"}, {"stl", "model/stl"}, {"wrl", "model/vrml"},
+	{"vrml", "model/vrml"}, {"x3d", "model/x3d+xml"}, {"igs", "model/iges"},
+	{"iges", "model/iges"}, {"msh", "model/mesh"}, {"mesh", "model/mesh"},
+	{"usdz", "model/vnd.usdz+zip"},
+};
+
+/** suffix to content type entries */
+static mime_type *types = NULL;
+static int ntypes = 0;
+static int maxtypes = 0;
+
+/** displacement for each bucket of suffixes */
+static uint32_t *displacements = NULL;
+static unsigned nbuckets = 0;
+
+/** index of entry in each slot, or -1 if empty; number of slots is a power of 2 */
+static int *slots = NULL;
+static unsigned nslots = 0;
+
+/** ensures built-in types are loaded once */
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Compute 64-bit FNV-1a hash of a suffix.
+ *
+ * @param suffix the lower-case suffix
+ * @return the hash
+ */
+static uint64_t hashSuffix(const char suffix[]) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const unsigned char *p = (const unsigned char *)suffix; *p != '\0'; p++) {
+		hash = (hash ^ *p) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/**
+ * Get bucket of a suffix hash.
+ *
+ * @param hash the suffix hash
+ * @param buckets the number of buckets
+ * @return the bucket index
+ */
+static inline unsigned bucketOf(uint64_t hash, unsigned buckets) {
+	return (unsigned)((hash * 0x9E3779B97F4A7C15ull) >> 32) % buckets;
+}
+
+/**
+ * Get slot of a suffix hash for a displacement. Distinct
+ * displacements give distinct slots for the same hash.
+ *
+ * @param hash the suffix hash
+ * @param displacement the displacement of its bucket
+ * @param mask the number of slots minus 1
+ * @return the slot index
+ */
+static inline unsigned slotOf(uint64_t hash, uint32_t displacement, unsigned mask) {
+	uint32_t h1 = (uint32_t)hash;
+	uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+	return (h1 + displacement * h2) & mask;
+}
+
+/**
+ * Add a suffix and content type, replacing the type of an
+ * existing suffix. Suffixes that are too long are ignored.
+ *
+ * @param suffix the suffix without '.'
+ * @param type the content type, which must remain valid
+ * @return false if there is no memory
+ */
+static bool addType(const char suffix[], const char type[]) {
+	char lower[MAX_SUFFIX];
+	size_t len = strlen(suffix);
+	if (len == 0 || len >= MAX_SUFFIX) {
+		return true;
+	}
+	for (size_t i = 0; i <= len; i++) {
+		lower[i] = tolower((unsigned char)suffix[i]);
+	}
+
+	for (int i = 0; i < ntypes; i++) {
+		if (strcmp(types[i].suffix, lower) == 0) {
+			types[i].type = type;
+			return true;
+		}
+	}
+	if (ntypes == maxtypes) {
+		int n = (maxtypes == 0) ? 256 : 2 * maxtypes;
+		mime_type *t = realloc(types, n * sizeof(mime_type));
+		if (t == NULL) {
+			return false;
+		}
+		types = t;
+		maxtypes = n;
+	}
+	char *s = strdup(lower);
+	if (s == NULL) {
+		return false;
+	}
+	types[ntypes++] = (mime_type){ s, type, hashSuffix(s) };
+	return true;
+}
+
+/**
+ * Try to find displacements that place all entries in
+ * distinct slots.
+ *
+ * @param disp the displacement for each bucket
+ * @param buckets the number of buckets
+ * @param slot the entry index for each slot
+ * @param mask the number of slots minus 1
+ * @return true if all entries were placed
+ */
+static bool placeTypes(uint32_t disp[], unsigned buckets, int slot[], unsigned mask) {
+	// group entries by bucket
+	unsigned *start = calloc(buckets + 1, sizeof(unsigned));
+	unsigned *next = malloc(buckets * sizeof(unsigned));
+	int *members = malloc(ntypes * sizeof(int));
+	bool placed = (start != NULL && next != NULL && members != NULL);
+	if (placed) {
+		for (int i = 0; i < ntypes; i++) {
+			start[bucketOf(types[i].hash, buckets) + 1]++;
+		}
+		for (unsigned b = 0; b < buckets; b++) {
+			start[b+1] += start[b];
+		}
+		memcpy(next, start, buckets * sizeof(unsigned));
+		for (int i = 0; i < ntypes; i++) {
+			members[next[bucketOf(types[i].hash, buckets)]++] = i;
+		}
+
+		// order buckets from largest to smallest by repeated passes
+		unsigned largest = 0;
+		for (unsigned b = 0; b < buckets; b++) {
+			if (start[b+1] - start[b] > largest) largest = start[b+1] - start[b];
+		}
+		for (unsigned i = 0; i <= mask; i++) {
+			slot[i] = -1;
+		}
+		for (unsigned size = largest; size > 0 && placed; size--) {
+			for (unsigned b = 0; b < buckets && placed; b++) {
+				if (start[b+1] - start[b] != size) {
+					continue;
+				}
+				// find displacement that moves bucket to empty slots
+				uint32_t d;
+				for (d = 0; d < MAX_DISPLACEMENT; d++) {
+					unsigned m;
+					for (m = start[b]; m < start[b+1]; m++) {
+						unsigned s = slotOf(types[members[m]].hash, d, mask);
+						if (slot[s] >= 0) {
+							break;
+						}
+						slot[s] = members[m];
+					}
+					if (m == start[b+1]) {
+						break;
+					}
+					while (m-- > start[b]) {  // undo partial placement
+						slot[slotOf(types[members[m]].hash, d, mask)] = -1;
+					}
+				}
+				disp[b] = d;
+				placed = (d < MAX_DISPLACEMENT);
+			}
+		}
+	}
+	free(start);
+	free(next);
+	free(members);
+	return placed;
+}
+
+/**
+ * Build the perfect hash for the current entries, growing
+ * the slot table until a placement is found.
+ *
+ * @return false if there is no memory
+ */
+static bool buildTable(void) {
+	unsigned buckets = ntypes / 4 + 1;
+	unsigned size = 1;
+	while (size < 2 * (unsigned)ntypes) {
+		size <<= 1;
+	}
+	for ( ; size != 0; size <<= 1) {
+		uint32_t *disp = malloc(buckets * sizeof(uint32_t));
+		int *slot = malloc(size * sizeof(int));
+		if (disp == NULL || slot == NULL) {
+			free(disp);
+			free(slot);
+			return false;
+		}
+		if (placeTypes(disp, buckets, slot, size - 1)) {
+			free(displacements);
+			free(slots);
+			displacements = disp;
+			nbuckets = buckets;
+			slots = slot;
+			nslots = size;
+			return true;
+		}
+		free(disp);
+		free(slot);
+	}
+	return false;
+}
+
+/**
+ * Load the built-in types and build the table.
+ */
+static void initBuiltinTypes(void) {
+	for (size_t i = 0; i < sizeof builtinTypes / sizeof builtinTypes[0]; i++) {
+		if (!addType(builtinTypes[i][0], builtinTypes[i][1])) {
+			perror("addType");
+			return;
+		}
+	}
+	if (!buildTable()) {
+		perror("buildTable");
+	}
+}
+
+/**
+ * Add the types in a mime.types file to the table. Each line
+ * holds a content type followed by its suffixes; '#' starts a
+ * comment. Types from the file replace built-in types for the
+ * same suffix. Must be called before requests are served.
+ *
+ * @param path the mime.types file
+ * @return true if the file was loaded
+ */
+bool loadMimeTypes(const char path[]) {
+	pthread_once(&builtin_once, initBuiltinTypes);
+
+	FILE *stream = fopen(path, "r");
+	if (stream == NULL) {
+		return false;
+	}
+	bool loaded = true;
+	char line[1024];
+	while (loaded && fgets(line, sizeof line, stream) != NULL) {
+		line[strcspn(line, "#\r\n")] = '\0';
+
+		char *save;
+		char *type = strtok_r(line, " \t", &save);
+		char *suffix = strtok_r(NULL, " \t", &save);
+		if (type == NULL || suffix == NULL) {
+			continue;
+		}
+		if ((type = strdup(type)) == NULL) {
+			loaded = false;
+			break;
+		}
+		for ( ; suffix != NULL && loaded; suffix = strtok_r(NULL, " \t", &save)) {
+			loaded = addType(suffix, type);
+		}
+	}
+	fclose(stream);
+
+	return loaded && buildTable();
+}
+
+/**
+ * Look up content type for a file path by its suffix.
+ *
+ * @param filePath the file path
+ * @return the content type, or DEFAULT_CONTENT_TYPE if unknown
+ */
+const char *lookupContentType(const char filePath[]) {
+	pthread_once(&builtin_once, initBuiltinTypes);
+
+	// suffix follows the last '.' of the file name, other than a leading '.'
+	const char *name = strrchr(filePath, '/');
+	name = (name != NULL) ? name + 1 : filePath;
+	const char *dot = strrchr(name, '.');
+	if (dot == NULL || dot == name || slots == NULL) {
+		return DEFAULT_CONTENT_TYPE;
+	}
+
+	// lower-case and hash the suffix together
+	char suffix[MAX_SUFFIX];
+	uint64_t hash = 14695981039346656037ull;
+	size_t len = 0;
+	for (const unsigned char *p = (const unsigned char *)dot + 1; *p != '\0'; p++) {
+		if (len == MAX_SUFFIX - 1) {
+			return DEFAULT_CONTENT_TYPE;
+		}
+		suffix[len] = tolower(*p);
+		hash = (hash ^ (unsigned char)suffix[len++]) * 1099511628211ull;
+	}
+	suffix[len] = '\0';
+
+	int i = slots[slotOf(hash, displacements[bucketOf(hash, nbuckets)], nslots - 1)];
+	return (i >= 0 && strcmp(types[i].suffix, suffix) == 0) ? types[i].type : DEFAULT_CONTENT_TYPE;
+}
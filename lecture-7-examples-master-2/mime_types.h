@@ -0,0 +1,43 @@
+/*
+ * mime_types.h
+ *
+ * Table of content types keyed by file name suffix. The table
+ * starts with built-in types, can be extended from a mime.types
+ * file at startup, and is looked up through a perfect hash so
+ * each lookup probes exactly one slot.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef MIME_TYPES_H_
+#define MIME_TYPES_H_
+
+#include <stdbool.h>
+
+/** content type of files with unknown suffix */
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+
+/** maximum length of a file name suffix */
+#define MAX_SUFFIX 16
+
+/**
+ * Add the types in a mime.types file to the table. Each line
+ * holds a content type followed by its suffixes; '#' starts a
+ * comment. Types from the file replace built-in types for the
+ * same suffix. Must be called before requests are served.
+ *
+ * @param path the mime.types file
+ * @return true if the file was loaded
+ */
+bool loadMimeTypes(const char path[]);
+
+/**
+ * Look up content type for a file path by its suffix.
+ *
+ * @param filePath the file path
+ * @return the content type, or DEFAULT_CONTENT_TYPE if unknown
+ */
+const char *lookupContentType(const char filePath[]);
+
+#endif /* MIME_TYPES_H_ */
@@ -1,16 +1,226 @@
 /*
  * network_util.c
  *
- * Functions that implement network operations.
+ * Functions that implement network operations: listener sockets
+ * on TCP ports or Unix domain socket paths, with their socket
+ * options, and accepting connections from them.
  *
  *  @since 2019-04-10
  *  @author: Philip Gust
  */
+#define _GNU_SOURCE  // for accept4()
 
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "network_util.h"
+
+/**
+ * Initialize listener settings to the defaults for a port:
+ * all IPv6 and IPv4 addresses, and the system's maximum backlog.
+ *
+ * @param options the settings
+ * @param port the port number
+ */
+void init_listener_options(listener_options *options, int port) {
+	memset(options, 0, sizeof *options);
+	options->port = port;
+	options->backlog = SOMAXCONN;
+}
+
+/**
+ * Set an integer socket option.
+ *
+ * @param sock_fd the socket
+ * @param level the protocol level
+ * @param name the option
+ * @param value the value
+ * @return true if the option was set
+ */
+static bool set_option(int sock_fd, int level, int name, int value) {
+	return setsockopt(sock_fd, level, name, &value, sizeof value) == 0;
+}
+
+/**
+ * Remove a Unix domain socket left behind by a server that has
+ * exited, which would keep a new listener from binding its path.
+ * The socket of a running server is left alone.
+ *
+ * @param address the socket address
+ */
+static void remove_stale_socket(const struct sockaddr_un *address) {
+	struct stat st;
+	if (lstat(address->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+		return;
+	}
+	int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock_fd >= 0) {
+		if (connect(sock_fd, (const struct sockaddr *)address, sizeof *address) < 0
+				&& errno == ECONNREFUSED) {
+			unlink(address->sun_path);
+		}
+		close(sock_fd);
+	}
+}
+
+/**
+ * Create a Unix domain socket bound to a path.
+ *
+ * @param options the settings
+ * @param type the socket type and flags
+ * @return the socket or -1 if unavailable
+ */
+static int bind_unix_socket(const listener_options *options, int type) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof address);
+	address.sun_family = AF_UNIX;
+	if (strlen(options->unix_path) >= sizeof address.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, options->unix_path);
+	remove_stale_socket(&address);
+
+	int sock_fd = socket(AF_UNIX, type, 0);
+	if (sock_fd < 0) {
+		return -1;
+	}
+	if (bind(sock_fd, (struct sockaddr *)&address, sizeof address) < 0) {
+		close(sock_fd);
+		return -1;
+	}
+	return sock_fd;
+}
+
+/**
+ * Create a TCP socket with the settings' options and bind it
+ * to an address.
+ *
+ * @param options the settings
+ * @param type the socket type and flags
+ * @param ai the address
+ * @return the socket or -1 if unavailable
+ */
+static int bind_tcp_address(const listener_options *options, int type, const struct addrinfo *ai) {
+	int sock_fd = socket(ai->ai_family, type, ai->ai_protocol);
+	if (sock_fd < 0) {
+		return -1;
+	}
+
+	// SO_REUSEADDR prevents the "address already in use" errors
+	// that commonly come up when testing servers.
+	bool ok = set_option(sock_fd, SOL_SOCKET, SO_REUSEADDR, 1);
+
+	// SO_REUSEPORT lets each worker process bind its own listener
+	// to the port, and the kernel balances connections among them
+	if (ok && options->reuse_port) {
+		ok = set_option(sock_fd, SOL_SOCKET, SO_REUSEPORT, 1);
+	}
+
+	// an IPv6 socket also accepts IPv4 connections unless IPv6 only
+	if (ok && ai->ai_family == AF_INET6) {
+		ok = set_option(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, options->ipv6_only);
+	}
+
+	// accepted sockets inherit TCP_NODELAY from the listener
+	if (ok && options->nodelay) {
+		ok = set_option(sock_fd, IPPROTO_TCP, TCP_NODELAY, 1);
+	}
+
+	// accept only once the client sends data, so a worker does
+	// not wait for the request of a connection that was just opened
+	if (ok && options->defer_accept > 0) {
+		ok = set_option(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->defer_accept);
+	}
+
+	// let returning clients send the request with the connection
+	if (ok && options->fastopen > 0) {
+		ok = set_option(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen);
+	}
+
+	if (!ok || bind(sock_fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		close(sock_fd);
+		return -1;
+	}
+	return sock_fd;
+}
+
+/**
+ * Create a TCP socket bound to the settings' address and port,
+ * trying IPv6 addresses first so that when no address is given
+ * the socket accepts both IPv6 and IPv4 connections.
+ *
+ * @param options the settings
+ * @param type the socket type and flags
+ * @return the socket or -1 if unavailable
+ */
+static int bind_tcp_socket(const listener_options *options, int type) {
+	char port[16];
+	snprintf(port, sizeof port, "%d", options->port);
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE | AI_NUMERICSERV
+	};
+	struct addrinfo *addrs;
+	int err = getaddrinfo(options->host, port, &hints, &addrs);
+	if (err != 0) {
+		if (err != EAI_SYSTEM) {
+			errno = EADDRNOTAVAIL;
+		}
+		return -1;
+	}
+
+	int sock_fd = -1;
+	for (int pass = 0; pass < 2 && sock_fd < 0; pass++) {
+		for (struct addrinfo *ai = addrs; ai != NULL && sock_fd < 0; ai = ai->ai_next) {
+			if ((ai->ai_family == AF_INET6) == (pass == 0)) {
+				sock_fd = bind_tcp_address(options, type, ai);
+			}
+		}
+	}
+	freeaddrinfo(addrs);
+	return sock_fd;
+}
+
+/**
+ * Open a listener socket with the settings. Unless an address
+ * is given, the socket is bound to all IPv6 addresses and also
+ * accepts IPv4 connections, or to all IPv4 addresses if IPv6 is
+ * not available.
+ *
+ * @param options the settings
+ * @return listener socket or -1 if unavailable
+ */
+int open_listener_socket(const listener_options *options) {
+	int type = SOCK_STREAM | SOCK_CLOEXEC | (options->nonblocking ? SOCK_NONBLOCK : 0);
+	int listen_sock_fd = (options->unix_path != NULL)
+			? bind_unix_socket(options, type)
+			: bind_tcp_socket(options, type);
+	if (listen_sock_fd < 0) {
+		return -1;
+	}
+
+	// set up queue for clients connections up to the backlog,
+	// which the system limits to somaxconn
+	int backlog = (options->backlog > 0) ? options->backlog : SOMAXCONN;
+	if (listen(listen_sock_fd, backlog) < 0) {
+		close(listen_sock_fd);
+		return -1;
+	}
+
+	return listen_sock_fd;
+}
 
 /**
  * Get listener socket
@@ -19,40 +229,63 @@
  * @return listener socket or -1 if unavailable
  */
 int get_listener_socket(int port) {
-    // Creating internet socket stream file descriptor
-    int listen_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_sock_fd < 0) {
-        return -1;
-    }
-
-    // SO_REUSEADDR prevents the "address already in use" errors
-    // that commonly come up when testing servers.
-    int optval = 1;
-    if (setsockopt(listen_sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval , sizeof(int)) < 0) {
-    	close(listen_sock_fd);
-    	return -1;
-    }
-
-    // host address and port
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-    memset(&address, 0, addrlen);
-    address.sin_family = AF_INET;  // address from internet
-    address.sin_port = htons(port);   // port in network byte order
-    address.sin_addr.s_addr = INADDR_ANY;  // bind to any address
-
-    // bind host address to port
-    if (bind(listen_sock_fd, (struct sockaddr *)&address, addrlen) < 0) {
-    	close(listen_sock_fd);
-		return -1;
-    }
-
-    // set up queue for clients connections up to default
-    // maximum pending socket connections (usually 128)
-    if (listen(listen_sock_fd, SOMAXCONN) < 0) {
-    	close(listen_sock_fd);
-    	return -1;
-    }
+	listener_options options;
+	init_listener_options(&options, port);
+	return open_listener_socket(&options);
+}
 
-	return listen_sock_fd;
+/**
+ * Get listener socket that shares its port with the listeners
+ * of other processes using SO_REUSEPORT.
+ *
+ * @param port the port number
+ * @return listener socket or -1 if unavailable
+ */
+int get_shared_listener_socket(int port) {
+	listener_options options;
+	init_listener_options(&options, port);
+	options.reuse_port = true;
+	return open_listener_socket(&options);
+}
+
+/**
+ * Format a peer address as text.
+ *
+ * @param address the address
+ * @param peer the buffer for the text, of PEER_ADDRESS_SIZE characters
+ */
+static void format_peer(const struct sockaddr_storage *address, char peer[]) {
+	char host[INET6_ADDRSTRLEN];
+	if (address->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)address;
+		inet_ntop(AF_INET, &in->sin_addr, host, sizeof host);
+		snprintf(peer, PEER_ADDRESS_SIZE, "%s:%u", host, ntohs(in->sin_port));
+	} else if (address->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+		inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof host);
+		snprintf(peer, PEER_ADDRESS_SIZE, "[%s]:%u", host, ntohs(in6->sin6_port));
+	} else {
+		snprintf(peer, PEER_ADDRESS_SIZE, "local");
+	}
+}
+
+/**
+ * Accept a connection with accept4(), so the socket is created
+ * close-on-exec and, if asked, non-blocking without more calls.
+ *
+ * @param listen_sock_fd the listener socket
+ * @param nonblocking true to make the connection non-blocking
+ * @param peer set to the peer address as text if not NULL;
+ *   must have room for PEER_ADDRESS_SIZE characters
+ * @return the connection socket, or -1 with errno set
+ */
+int accept_connection(int listen_sock_fd, bool nonblocking, char peer[]) {
+	struct sockaddr_storage address;
+	socklen_t addrlen = sizeof address;
+	int flags = SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0);
+	int sock_fd = accept4(listen_sock_fd, (struct sockaddr *)&address, &addrlen, flags);
+	if (sock_fd >= 0 && peer != NULL) {
+		format_peer(&address, peer);
+	}
+	return sock_fd;
 }
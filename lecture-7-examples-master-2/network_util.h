@@ -1,7 +1,10 @@
 /*
  * network_util.h
  *
- * Functions that implement network operations.
+ * Functions that implement network operations: listener sockets
+ * on TCP ports or Unix domain socket paths, with their socket
+ * options, and accepting connections from them. Shared by the
+ * HTTP server and the palindrome server.
  *
  *  @since 2019-04-10
  *  @author: Philip Gust
@@ -10,6 +13,47 @@
 #ifndef NETWORK_UTIL_H_
 #define NETWORK_UTIL_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+/** size of buffer for a peer address as text, with its port */
+#define PEER_ADDRESS_SIZE (INET6_ADDRSTRLEN + 8)
+
+/** Listener socket settings */
+typedef struct {
+	const char *host;		// address to bind, or NULL for all IPv6 and IPv4 addresses
+	int port;				// TCP port number
+	const char *unix_path;	// Unix domain socket path instead of TCP, or NULL
+	int backlog;			// maximum pending connections (default: SOMAXCONN)
+	bool reuse_port;		// share the port with other listeners (SO_REUSEPORT)
+	bool ipv6_only;			// accept only IPv6 on an IPv6 address (IPV6_V6ONLY)
+	bool nonblocking;		// accept returns at once if no connection is pending
+	bool nodelay;			// accepted sockets send small writes at once (TCP_NODELAY)
+	int defer_accept;		// seconds to wait for request data before accept, or 0
+	int fastopen;			// TCP Fast Open pending request limit, or 0 for none
+} listener_options;
+
+/**
+ * Initialize listener settings to the defaults for a port:
+ * all IPv6 and IPv4 addresses, and the system's maximum backlog.
+ *
+ * @param options the settings
+ * @param port the port number
+ */
+void init_listener_options(listener_options *options, int port);
+
+/**
+ * Open a listener socket with the settings. Unless an address
+ * is given, the socket is bound to all IPv6 addresses and also
+ * accepts IPv4 connections, or to all IPv4 addresses if IPv6 is
+ * not available.
+ *
+ * @param options the settings
+ * @return listener socket or -1 if unavailable
+ */
+int open_listener_socket(const listener_options *options);
+
 /**
  * Get listener socket
  *
@@ -18,4 +62,25 @@
  */
 int get_listener_socket(int port) ;
 
+/**
+ * Get listener socket that shares its port with the listeners
+ * of other processes using SO_REUSEPORT.
+ *
+ * @param port the port number
+ * @return listener socket or -1 if unavailable
+ */
+int get_shared_listener_socket(int port);
+
+/**
+ * Accept a connection with accept4(), so the socket is created
+ * close-on-exec and, if asked, non-blocking without more calls.
+ *
+ * @param listen_sock_fd the listener socket
+ * @param nonblocking true to make the connection non-blocking
+ * @param peer set to the peer address as text if not NULL;
+ *   must have room for PEER_ADDRESS_SIZE characters
+ * @return the connection socket, or -1 with errno set
+ */
+int accept_connection(int listen_sock_fd, bool nonblocking, char peer[]);
+
 #endif /* NETWORK_UTIL_H_ */
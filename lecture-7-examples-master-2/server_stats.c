@@ -0,0 +1,301 @@
+/*
+ * server_stats.c
+ *
+ * Live server counters and latency histograms. A thread gets its
+ * own block of counters the first time it records anything, and
+ * the block is added to a list that readers walk to total them.
+ * Only the owning thread writes a block, so counters are updated
+ * with relaxed atomic loads and stores rather than locked
+ * read-modify-write instructions.
+ *
+ * Latency histograms use log-linear buckets like HdrHistogram:
+ * each power of 2 is split into 2^HISTOGRAM_SUB_BITS buckets, so
+ * percentiles are reported within about 6% of the true value.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "content_cache.h"
+#include "server_stats.h"
+
+/** Counters updated by one thread */
+typedef struct thread_stats {
+	atomic_ulong responses[MAX_STATUS + 1];		// responses by status
+	atomic_ulong bytes;							// response bytes sent
+	atomic_long connections;					// connections opened minus closed
+	atomic_ulong latency[NUM_LATENCIES][HISTOGRAM_BUCKETS];	// latency histograms
+	atomic_ulong latency_sum[NUM_LATENCIES];	// total latency in microseconds
+	atomic_ulong latency_max[NUM_LATENCIES];	// largest latency in microseconds
+	struct thread_stats *next;					// next block in list
+} thread_stats;
+
+/** monitor for list of thread blocks */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** blocks of all threads that have recorded statistics */
+static thread_stats *all_stats = NULL;
+
+/** block of the current thread */
+static _Thread_local thread_stats *local_stats = NULL;
+
+/** names of latency histograms */
+static const char *latencyNames[NUM_LATENCIES] = { "parse", "open", "send" };
+
+/**
+ * Get block of the current thread, creating it on first use.
+ *
+ * @return the block, or NULL if out of memory
+ */
+static thread_stats *getLocalStats(void) {
+	if (local_stats == NULL) {
+		thread_stats *stats = calloc(1, sizeof(thread_stats));
+		if (stats == NULL) {
+			return NULL;
+		}
+		pthread_mutex_lock(&stats_lock);  // lock stats monitor
+			stats->next = all_stats;
+			all_stats = stats;
+		pthread_mutex_unlock(&stats_lock);  // unlock stats monitor
+		local_stats = stats;
+	}
+	return local_stats;
+}
+
+/**
+ * Add to a counter owned by the current thread.
+ *
+ * @param counter the counter
+ * @param n the amount to add
+ */
+static inline void addCounter(atomic_ulong *counter, unsigned long n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+						  memory_order_relaxed);
+}
+
+/**
+ * Get histogram bucket of a latency. Latencies below
+ * 2^HISTOGRAM_SUB_BITS have their own buckets; larger ones
+ * share a bucket with latencies of the same leading bits.
+ *
+ * @param us the latency in microseconds
+ * @return the bucket index
+ */
+static unsigned bucketOf(unsigned long us) {
+	if (us < (1UL << HISTOGRAM_SUB_BITS)) {
+		return (unsigned)us;
+	}
+	unsigned exp = 63 - __builtin_clzl(us);
+	if (exp > HISTOGRAM_MAX_EXP) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+	unsigned shift = exp - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS)
+		   + (unsigned)((us >> shift) & ((1UL << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/**
+ * Get the highest latency that falls in a histogram bucket.
+ *
+ * @param bucket the bucket index
+ * @return the latency in microseconds
+ */
+static unsigned long bucketValue(unsigned bucket) {
+	unsigned sub = bucket & ((1U << HISTOGRAM_SUB_BITS) - 1);
+	unsigned level = bucket >> HISTOGRAM_SUB_BITS;
+	if (level == 0) {
+		return bucket;
+	}
+	unsigned shift = level - 1;
+	unsigned long low = ((1UL << HISTOGRAM_SUB_BITS) + sub) << shift;
+	return low + (1UL << shift) - 1;
+}
+
+/**
+ * Start timing an operation.
+ *
+ * @param start set to the start time
+ */
+void startTimer(struct timespec *start) {
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/**
+ * Record latency of an operation in its histogram.
+ *
+ * @param kind the kind of operation
+ * @param start the start time of the operation
+ */
+void recordLatency(latency_kind kind, const struct timespec *start) {
+	thread_stats *stats = getLocalStats();
+	if (stats == NULL) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long us = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0) {
+		us = 0;
+	}
+
+	addCounter(&stats->latency[kind][bucketOf(us)], 1);
+	addCounter(&stats->latency_sum[kind], us);
+	if ((unsigned long)us > atomic_load_explicit(&stats->latency_max[kind], memory_order_relaxed)) {
+		atomic_store_explicit(&stats->latency_max[kind], us, memory_order_relaxed);
+	}
+}
+
+/**
+ * Count a response that was sent.
+ *
+ * @param status the response status
+ * @param bytes the response bytes sent
+ */
+void countResponse(int status, unsigned long bytes) {
+	thread_stats *stats = getLocalStats();
+	if (stats == NULL) {
+		return;
+	}
+	if (status >= 0 && status <= MAX_STATUS) {
+		addCounter(&stats->responses[status], 1);
+	}
+	addCounter(&stats->bytes, bytes);
+}
+
+/**
+ * Count a connection being opened or closed.
+ *
+ * @param delta 1 if opened, -1 if closed
+ */
+void countConnection(int delta) {
+	thread_stats *stats = getLocalStats();
+	if (stats != NULL) {
+		atomic_store_explicit(&stats->connections,
+			atomic_load_explicit(&stats->connections, memory_order_relaxed) + delta,
+			memory_order_relaxed);
+	}
+}
+
+/**
+ * Write a latency histogram summary as a JSON object.
+ *
+ * @param out the output stream
+ * @param counts the total count in each bucket
+ * @param sum the total latency
+ * @param max the largest latency
+ */
+static void writeHistogram(FILE *out, const unsigned long counts[], unsigned long sum,
+						   unsigned long max) {
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	static const char *names[] = { "p50", "p90", "p99", "p999" };
+
+	unsigned long count = 0;
+	for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		count += counts[b];
+	}
+	fprintf(out, "{\"count\":%lu,\"mean\":%.1f", count, (count > 0) ? (double)sum / count : 0.0);
+
+	unsigned b = 0;
+	unsigned long seen = 0;
+	for (int p = 0; p < 4; p++) {
+		// smallest bucket at or below which the percentile of values fall
+		unsigned long rank = (unsigned long)(percentiles[p] / 100.0 * count + 0.5);
+		if (rank == 0) {
+			rank = 1;
+		}
+		while (b < HISTOGRAM_BUCKETS - 1 && seen + counts[b] < rank) {
+			seen += counts[b++];
+		}
+		unsigned long value = (count > 0) ? bucketValue(b) : 0;
+		fprintf(out, ",\"%s\":%lu", names[p], (value < max) ? value : max);
+	}
+	fprintf(out, ",\"max\":%lu}", max);
+}
+
+/**
+ * Render current statistics of all threads as a JSON object.
+ *
+ * @param len set to the length of the report
+ * @return the malloc'd report, or NULL if out of memory
+ */
+char *renderServerStats(size_t *len) {
+	// totals of all thread blocks
+	static unsigned long responses[MAX_STATUS + 1];
+	static unsigned long latency[NUM_LATENCIES][HISTOGRAM_BUCKETS];
+	unsigned long latency_sum[NUM_LATENCIES] = { 0 };
+	unsigned long latency_max[NUM_LATENCIES] = { 0 };
+	unsigned long bytes = 0;
+	long connections = 0;
+
+	pthread_mutex_lock(&stats_lock);  // lock stats monitor
+		for (int s = 0; s <= MAX_STATUS; s++) {
+			responses[s] = 0;
+		}
+		for (int k = 0; k < NUM_LATENCIES; k++) {
+			for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+				latency[k][b] = 0;
+			}
+		}
+		for (thread_stats *stats = all_stats; stats != NULL; stats = stats->next) {
+			for (int s = 0; s <= MAX_STATUS; s++) {
+				responses[s] += atomic_load_explicit(&stats->responses[s], memory_order_relaxed);
+			}
+			bytes += atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+			connections += atomic_load_explicit(&stats->connections, memory_order_relaxed);
+			for (int k = 0; k < NUM_LATENCIES; k++) {
+				for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+					latency[k][b] += atomic_load_explicit(&stats->latency[k][b], memory_order_relaxed);
+				}
+				latency_sum[k] += atomic_load_explicit(&stats->latency_sum[k], memory_order_relaxed);
+				unsigned long max = atomic_load_explicit(&stats->latency_max[k], memory_order_relaxed);
+				if (max > latency_max[k]) {
+					latency_max[k] = max;
+				}
+			}
+		}
+
+		// render while totals are held by the monitor
+		char *report = NULL;
+		FILE *out = open_memstream(&report, len);
+		if (out != NULL) {
+			unsigned long total = 0;
+			for (int s = 0; s <= MAX_STATUS; s++) {
+				total += responses[s];
+			}
+			fprintf(out, "{\"connections\":{\"active\":%ld},", connections);
+			fprintf(out, "\"responses\":{\"total\":%lu", total);
+			for (int s = 0; s <= MAX_STATUS; s++) {
+				if (responses[s] > 0) {
+					fprintf(out, ",\"%d\":%lu", s, responses[s]);
+				}
+			}
+			fprintf(out, "},\"bytes_sent\":%lu,", bytes);
+
+			content_cache_stats cache;
+			getContentCacheStats(&cache);
+			unsigned long lookups = cache.hits + cache.misses;
+			fprintf(out, "\"cache\":{\"hits\":%lu,\"misses\":%lu,\"hit_rate\":%.4f,"
+					"\"evictions\":%lu,\"entries\":%lu,\"bytes\":%zu,\"capacity\":%zu},",
+					cache.hits, cache.misses, (lookups > 0) ? (double)cache.hits / lookups : 0.0,
+					cache.evictions, cache.entries, cache.bytes, cache.capacity);
+
+			fprintf(out, "\"latency_us\":{");
+			for (int k = 0; k < NUM_LATENCIES; k++) {
+				fprintf(out, "%s\"%s\":", (k > 0) ? "," : "", latencyNames[k]);
+				writeHistogram(out, latency[k], latency_sum[k], latency_max[k]);
+			}
+			fprintf(out, "}}\n");
+			if (fclose(out) != 0) {
+				free(report);
+				report = NULL;
+			}
+		}
+	pthread_mutex_unlock(&stats_lock);  // unlock stats monitor
+
+	return report;
+}
@@ -0,0 +1,79 @@
+/*
+ * server_stats.h
+ *
+ * Live server counters and latency histograms. Each thread
+ * updates its own block of counters, so recording adds no
+ * contention; the blocks are added together when read.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef SERVER_STATS_H_
+#define SERVER_STATS_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/** URI of the built-in statistics report */
+#define STATS_URI "/__stats"
+
+/** highest response status counted */
+#define MAX_STATUS 599
+
+/** number of sub-buckets per power of 2 in latency histograms, as bits */
+#define HISTOGRAM_SUB_BITS 4
+
+/** largest power of 2 of latencies tracked in microseconds */
+#define HISTOGRAM_MAX_EXP 36
+
+/** number of buckets in latency histograms */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+/** Latencies tracked with histograms */
+typedef enum {
+	LATENCY_PARSE,		// parse request header
+	LATENCY_OPEN,		// find content in cache or open content file
+	LATENCY_SEND,		// send response header and body
+	NUM_LATENCIES
+} latency_kind;
+
+/**
+ * Start timing an operation.
+ *
+ * @param start set to the start time
+ */
+void startTimer(struct timespec *start);
+
+/**
+ * Record latency of an operation in its histogram.
+ *
+ * @param kind the kind of operation
+ * @param start the start time of the operation
+ */
+void recordLatency(latency_kind kind, const struct timespec *start);
+
+/**
+ * Count a response that was sent.
+ *
+ * @param status the response status
+ * @param bytes the response bytes sent
+ */
+void countResponse(int status, unsigned long bytes);
+
+/**
+ * Count a connection being opened or closed.
+ *
+ * @param delta 1 if opened, -1 if closed
+ */
+void countConnection(int delta);
+
+/**
+ * Render current statistics of all threads as a JSON object.
+ *
+ * @param len set to the length of the report
+ * @return the malloc'd report, or NULL if out of memory
+ */
+char *renderServerStats(size_t *len);
+
+#endif /* SERVER_STATS_H_ */
@@ -0,0 +1,161 @@
+#!/usr/bin/env bash
+#
+# test_server.sh
+#
+# Request tests for the Tiny Http Server. Builds the server, then
+# sends raw requests to the thread pool and the reactor, with
+# uploads disabled and enabled, and checks the status of each
+# response. A request sent inside the body of another request must
+# never be answered, whether or not the body is read; requests
+# pipelined after a body that is read must be.
+#
+# Usage:
+#   ./test_server.sh
+#
+# Environment:
+#   PORT  server port (default: 1598)
+#
+#  @since 2019-04-10
+#  @author: Philip Gust
+
+set -euo pipefail
+trap '' PIPE
+
+PORT=${PORT:-1598}
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+SERVER_PID=
+FAILURES=0
+
+# stop the server and remove the work directory on exit
+cleanup() {
+	if [ -n "$SERVER_PID" ]; then
+		kill "$SERVER_PID" 2>/dev/null || true
+		wait "$SERVER_PID" 2>/dev/null || true
+	fi
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# build server and copy content it serves
+build() {
+	local sources
+	sources=$(cd "$SRC" && ls *.c | grep -v '^bench_\|^fuzz_\|^loadgen')
+	(cd "$SRC" && gcc -std=gnu11 -O2 -o "$WORK/http_server" $sources -lpthread -lz)
+	cp -r "$SRC/content" "$WORK/content"
+	mkdir -p "$WORK/uploads"
+}
+
+# start the server with an engine and flags, and wait until it
+# accepts connections
+start_server() {
+	local engine=$1
+	shift
+	local flags=(-t 4 "$@")
+	if [ "$engine" = reactor ]; then
+		flags=(-e "$@")
+	fi
+	(cd "$WORK" && exec ./http_server "${flags[@]}" "$PORT") 2>"$WORK/server.log" &
+	SERVER_PID=$!
+	for _ in $(seq 1 50); do
+		if (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+			return
+		fi
+		sleep 0.1
+	done
+	echo "server did not start" >&2
+	cat "$WORK/server.log" >&2
+	exit 1
+}
+
+# stop the server
+stop_server() {
+	kill "$SERVER_PID"
+	wait "$SERVER_PID" 2>/dev/null || true
+	SERVER_PID=
+}
+
+# send raw request bytes on one connection and list the status
+# of each response until the server closes it; a server that
+# closes before reading them all fails the write, not the script
+send_requests() {
+	exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+	printf '%b' "$1" >&3 2>/dev/null || true
+	timeout 5 cat <&3 2>/dev/null | grep -ao 'HTTP/1\.1 [0-9][0-9][0-9]' | cut -d ' ' -f 2 | tr '\n' ' ' || true
+	exec 3<&-
+}
+
+# send requests and compare the response statuses to those expected
+expect() {
+	local name=$1 requests=$2 expected=$3
+	local actual
+	actual=$(send_requests "$requests")
+	if [ "$actual" = "$expected " ]; then
+		echo "  ok    $name"
+	else
+		echo "  FAIL  $name: expected '$expected', got '${actual% }'"
+		FAILURES=$((FAILURES + 1))
+	fi
+}
+
+# request for the icon, which must only be answered if sent on its own
+SMUGGLED='GET /favicon.ico HTTP/1.1\r\nHost: localhost\r\n\r\n'
+SMUGGLED_LEN=$(printf '%b' "$SMUGGLED" | wc -c)
+LAST='GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n'
+
+# requests whose body is never read
+run_unread_bodies() {
+	expect "request inside a GET body is not answered" \
+		"GET /index.html HTTP/1.1\r\nHost: localhost\r\nContent-Length: $SMUGGLED_LEN\r\n\r\n$SMUGGLED$LAST" \
+		"200 200"
+	expect "request inside a body sent after 100 Continue is not answered" \
+		"GET /index.html HTTP/1.1\r\nHost: localhost\r\nExpect: 100-continue\r\nContent-Length: $SMUGGLED_LEN\r\n\r\n$SMUGGLED$LAST" \
+		"200"
+	expect "request inside a chunked body is not answered" \
+		"DELETE /index.html HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n$(printf %x "$SMUGGLED_LEN")\r\n$SMUGGLED\r\n0\r\n\r\n" \
+		"501"
+	expect "request after empty body is answered" \
+		"GET /index.html HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n$LAST" \
+		"200 200"
+}
+
+# run the tests against an engine
+run() {
+	local engine=$1
+	echo "$engine"
+
+	start_server "$engine"
+	expect "pipelined request inside a POST body is not answered" \
+		"POST /index.html HTTP/1.1\r\nHost: localhost\r\nContent-Length: $SMUGGLED_LEN\r\n\r\n$SMUGGLED$LAST" \
+		"405 200"
+	run_unread_bodies
+	stop_server
+
+	start_server "$engine" -u uploads
+	expect "pipelined request inside an uploaded POST body is stored" \
+		"POST /smuggled.txt HTTP/1.1\r\nHost: localhost\r\nContent-Length: $SMUGGLED_LEN\r\n\r\n$SMUGGLED$LAST" \
+		"201 200"
+	expect "empty PUT body is stored" \
+		"PUT /empty.txt HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" \
+		"201"
+	expect "empty PUT body replaces file" \
+		"PUT /empty.txt HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" \
+		"204"
+	expect "request after empty PUT body is answered" \
+		"PUT /empty.txt HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n$LAST" \
+		"204 200"
+	run_unread_bodies
+	stop_server
+	rm -f "$WORK/uploads/smuggled.txt" "$WORK/uploads/empty.txt"
+}
+
+build
+for engine in pool reactor; do
+	run "$engine"
+done
+if [ "$FAILURES" -gt 0 ]; then
+	echo "$FAILURES failed"
+	exit 1
+fi
+echo "all passed"
@@ -0,0 +1,214 @@
+/*
+ * thread_pool.c
+ *
+ * Fixed-size pool of worker threads that service a bounded
+ * queue of accepted client sockets. The queue is a ring
+ * buffer guarded by a monitor; workers wait on a condition
+ * until a socket is available.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "thread_pool.h"
+
+/** Thread pool state */
+struct thread_pool {
+	pthread_mutex_t lock;	// monitor for queue state
+	pthread_cond_t not_empty;	// signaled when a socket is queued
+	pthread_cond_t stopped;	// signaled when a worker exits
+	socket_handler handler;	// function to handle a socket
+	int *queue;				// ring buffer of pending sockets
+	int queue_depth;		// capacity of ring buffer
+	int head;				// index of next socket to remove
+	int count;				// number of queued sockets
+	bool running;			// false when pool is shutting down
+	int nthreads;			// number of worker threads
+	int nrunning;			// number of worker threads not yet exited
+	pthread_t *threads;		// worker threads
+};
+
+/** pool of the calling worker thread, or NULL if not a worker */
+static _Thread_local thread_pool *current_pool = NULL;
+
+/**
+ * Worker thread function removes sockets from the queue
+ * and passes them to the handler until the pool stops.
+ *
+ * @param arg the thread pool
+ * @return NULL (unused)
+ */
+static void *worker(void *arg) {
+	thread_pool *pool = arg;
+	current_pool = pool;
+
+	while (true) {
+		int sock_fd;
+		pthread_mutex_lock(&pool->lock);  // lock queue monitor
+			while (pool->count == 0 && pool->running) {
+				pthread_cond_wait(&pool->not_empty, &pool->lock);
+			}
+			if (pool->count == 0) {  // stopped and drained
+				pool->nrunning--;
+				pthread_cond_signal(&pool->stopped);  // wake drain
+				pthread_mutex_unlock(&pool->lock);
+				break;
+			}
+			sock_fd = pool->queue[pool->head];
+			pool->head = (pool->head + 1) % pool->queue_depth;
+			pool->count--;
+		pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+
+		pool->handler(sock_fd);
+	}
+	return NULL;
+}
+
+/**
+ * Create a thread pool and start its worker threads.
+ *
+ * @param nthreads the number of worker threads
+ * @param queue_depth the maximum number of pending sockets
+ * @param handler the function workers call for each socket
+ * @return the thread pool or NULL if it could not be created
+ */
+thread_pool *thread_pool_create(int nthreads, int queue_depth, socket_handler handler) {
+	if (nthreads <= 0 || queue_depth <= 0) {
+		return NULL;
+	}
+
+	thread_pool *pool = calloc(1, sizeof(thread_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->queue = calloc(queue_depth, sizeof(int));
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	if (pool->queue == NULL || pool->threads == NULL) {
+		free(pool->queue);
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->stopped, NULL);
+	pool->handler = handler;
+	pool->queue_depth = queue_depth;
+	pool->running = true;
+
+	// start worker threads
+	for (pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++) {
+		pthread_mutex_lock(&pool->lock);  // lock queue monitor
+			pool->nrunning++;
+		pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+		if (pthread_create(&pool->threads[pool->nthreads], NULL, worker, pool) != 0) {
+			perror("pthread_create");
+			pthread_mutex_lock(&pool->lock);  // lock queue monitor
+				pool->nrunning--;
+			pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+			thread_pool_destroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+/**
+ * Submit a socket to the pool without blocking.
+ *
+ * @param pool the thread pool
+ * @param sock_fd the socket descriptor
+ * @return true if queued, false if the queue is full
+ */
+bool thread_pool_submit(thread_pool *pool, int sock_fd) {
+	bool queued = false;
+	pthread_mutex_lock(&pool->lock);  // lock queue monitor
+		if (pool->running && pool->count < pool->queue_depth) {
+			int tail = (pool->head + pool->count) % pool->queue_depth;
+			pool->queue[tail] = sock_fd;
+			pool->count++;
+			queued = true;
+			pthread_cond_signal(&pool->not_empty);  // wake one worker
+		}
+	pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+	return queued;
+}
+
+/**
+ * Test whether sockets are queued for the pool of the calling
+ * worker thread, so a worker holding an idle connection can
+ * give it up to serve them.
+ *
+ * @return true if sockets are waiting, false if none are or the
+ *   caller is not a worker thread
+ */
+bool thread_pool_has_waiting(void) {
+	thread_pool *pool = current_pool;
+	if (pool == NULL) {
+		return false;
+	}
+	bool waiting;
+	pthread_mutex_lock(&pool->lock);  // lock queue monitor
+		waiting = (pool->count > 0);
+	pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+	return waiting;
+}
+
+/**
+ * Stop accepting sockets and wait until the workers have
+ * handled the queued sockets and exited, or until a timeout.
+ * The pool may be destroyed once it has drained.
+ *
+ * @param pool the thread pool
+ * @param timeout the maximum number of seconds to wait
+ * @return true if all workers exited, false on timeout
+ */
+bool thread_pool_drain(thread_pool *pool, int timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	bool drained;
+	pthread_mutex_lock(&pool->lock);  // lock queue monitor
+		pool->running = false;
+		pthread_cond_broadcast(&pool->not_empty);  // wake all workers
+		while (pool->nrunning > 0) {
+			if (pthread_cond_timedwait(&pool->stopped, &pool->lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+		drained = (pool->nrunning == 0);
+	pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+	return drained;
+}
+
+/**
+ * Stop the worker threads once the queue is empty,
+ * wait for them to finish, and free the pool.
+ *
+ * @param pool the thread pool
+ */
+void thread_pool_destroy(thread_pool *pool) {
+	pthread_mutex_lock(&pool->lock);  // lock queue monitor
+		pool->running = false;
+		pthread_cond_broadcast(&pool->not_empty);  // wake all workers
+	pthread_mutex_unlock(&pool->lock);  // unlock queue monitor
+
+	for (int i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_cond_destroy(&pool->stopped);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->queue);
+	free(pool);
+}
@@ -0,0 +1,76 @@
+/*
+ * thread_pool.h
+ *
+ * Fixed-size pool of worker threads that service a bounded
+ * queue of accepted client sockets.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <stdbool.h>
+
+/** Default number of worker threads */
+#define DEFAULT_POOL_THREADS 8
+
+/** Default depth of the pending socket queue */
+#define DEFAULT_POOL_QUEUE 64
+
+/** Function that a worker calls to handle a socket */
+typedef void (*socket_handler)(int sock_fd);
+
+/** Opaque thread pool */
+typedef struct thread_pool thread_pool;
+
+/**
+ * Create a thread pool and start its worker threads.
+ *
+ * @param nthreads the number of worker threads
+ * @param queue_depth the maximum number of pending sockets
+ * @param handler the function workers call for each socket
+ * @return the thread pool or NULL if it could not be created
+ */
+thread_pool *thread_pool_create(int nthreads, int queue_depth, socket_handler handler);
+
+/**
+ * Submit a socket to the pool without blocking.
+ *
+ * @param pool the thread pool
+ * @param sock_fd the socket descriptor
+ * @return true if queued, false if the queue is full
+ */
+bool thread_pool_submit(thread_pool *pool, int sock_fd);
+
+/**
+ * Test whether sockets are queued for the pool of the calling
+ * worker thread, so a worker holding an idle connection can
+ * give it up to serve them.
+ *
+ * @return true if sockets are waiting, false if none are or the
+ *   caller is not a worker thread
+ */
+bool thread_pool_has_waiting(void);
+
+/**
+ * Stop accepting sockets and wait until the workers have
+ * handled the queued sockets and exited, or until a timeout.
+ * The pool may be destroyed once it has drained.
+ *
+ * @param pool the thread pool
+ * @param timeout the maximum number of seconds to wait
+ * @return true if all workers exited, false on timeout
+ */
+bool thread_pool_drain(thread_pool *pool, int timeout);
+
+/**
+ * Stop the worker threads once the queue is empty,
+ * wait for them to finish, and free the pool.
+ *
+ * @param pool the thread pool
+ */
+void thread_pool_destroy(thread_pool *pool);
+
+#endif /* THREAD_POOL_H_ */
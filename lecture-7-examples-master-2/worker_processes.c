@@ -0,0 +1,412 @@
+/*
+ * worker_processes.c
+ *
+ * Supervisor that runs a server function in several forked
+ * worker processes and restarts any worker that exits. Workers
+ * share nothing after the fork; each opens its own listener, so
+ * the kernel spreads connections among them with SO_REUSEPORT.
+ *
+ * A running server is replaced by forking and exec'ing its own
+ * command line. The new program inherits the listener socket,
+ * so no connection is refused while the old server drains.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+#ifdef __linux__
+#define _GNU_SOURCE  // for sched_setaffinity()
+#include <sched.h>
+#include <sys/prctl.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/** environment passed to programs this process runs */
+extern char **environ;
+
+#include "worker_processes.h"
+
+/** signal that asked the supervisor to stop, or 0 */
+static volatile sig_atomic_t stop_signal = 0;
+
+/**
+ * Signal handler records a request to stop.
+ *
+ * @param sig the signal
+ */
+static void request_stop(int sig) {
+	stop_signal = sig;
+}
+
+/**
+ * Pin the calling process to one of the CPUs it may run on.
+ *
+ * @param worker the worker number, which selects the CPU
+ */
+static void pin_worker(int worker) {
+#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+		perror("sched_getaffinity");
+		return;
+	}
+	int ncpus = CPU_COUNT(&allowed);
+	int n = worker % ncpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			if (sched_setaffinity(0, sizeof set, &set) < 0) {
+				perror("sched_setaffinity");
+			}
+			return;
+		}
+	}
+#else
+	(void)worker;
+	fprintf(stderr, "CPU pinning is only available on Linux\n");
+#endif
+}
+
+/**
+ * Fork one worker process.
+ *
+ * @param worker the worker number
+ * @param pin_cpus true to pin the worker to its own CPU
+ * @param work the function the worker runs
+ * @param arg the argument passed to the function
+ * @return the process id of the worker, or -1 on error
+ */
+static pid_t start_worker(int worker, bool pin_cpus, worker_function work, void *arg) {
+	pid_t pid = fork();
+	if (pid != 0) {
+		return pid;
+	}
+
+	// worker stops on the signals the supervisor handles;
+	// only the supervisor replaces the server
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGTERM);  // do not outlive supervisor
+#endif
+	if (pin_cpus) {
+		pin_worker(worker);
+	}
+	exit(work(worker, arg));
+}
+
+/**
+ * Fork worker processes and restart any that exit, until the
+ * supervisor receives SIGTERM or SIGINT, which it passes on to
+ * the workers before waiting for them to exit. On SIGHUP, the
+ * supervisor first starts a replacement server from its command
+ * line, then stops its workers with SIGTERM.
+ *
+ * @param nworkers the number of worker processes
+ * @param pin_cpus true to pin each worker to its own CPU
+ * @param work the function each worker runs; its result is the worker's exit status
+ * @param arg the argument passed to the function
+ * @param argv the command line of the server, or NULL to stop on SIGHUP without replacement
+ * @return EXIT_SUCCESS after the workers stop, or EXIT_FAILURE on error
+ */
+int run_workers(int nworkers, bool pin_cpus, worker_function work, void *arg, char *const argv[]) {
+	pid_t *pids = calloc(nworkers, sizeof(pid_t));
+	time_t *started = calloc(nworkers, sizeof(time_t));
+	if (pids == NULL || started == NULL) {
+		free(pids);
+		free(started);
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = request_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	int nrunning = 0;
+	for (int i = 0; i < nworkers; i++) {
+		pids[i] = start_worker(i, pin_cpus, work, arg);
+		started[i] = time(NULL);
+		if (pids[i] < 0) {
+			perror("fork");
+		} else {
+			nrunning++;
+		}
+	}
+
+	bool stopping = false;
+	while (nrunning > 0) {
+		if (stop_signal == SIGHUP && !stopping && argv != NULL) {
+			// new workers of replacement share the port with
+			// these until they have drained
+			if (!start_replacement(argv, -1)) {
+				fprintf(stderr, "Cannot start replacement server\n");
+				stop_signal = 0;
+				continue;
+			}
+		}
+		if (stop_signal != 0 && !stopping) {
+			// pass stop request on to workers
+			int sig = (stop_signal == SIGHUP) ? SIGTERM : stop_signal;
+			for (int i = 0; i < nworkers; i++) {
+				if (pids[i] > 0) {
+					kill(pids[i], sig);
+				}
+			}
+			stopping = true;
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			perror("waitpid");
+			break;
+		}
+
+		int i;
+		for (i = 0; i < nworkers && pids[i] != pid; i++) {
+			continue;
+		}
+		if (i == nworkers) {
+			continue;  // not a worker
+		}
+		pids[i] = 0;
+		nrunning--;
+		if (stopping) {
+			continue;
+		}
+
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "Worker %d (pid %d) killed by signal %d, restarting\n",
+					i, (int)pid, WTERMSIG(status));
+		} else {
+			fprintf(stderr, "Worker %d (pid %d) exited with status %d, restarting\n",
+					i, (int)pid, WEXITSTATUS(status));
+		}
+
+		// back off if worker keeps failing on startup
+		if (time(NULL) - started[i] < WORKER_MIN_UPTIME) {
+			sleep(WORKER_MIN_UPTIME);
+			if (stop_signal != 0) {
+				continue;
+			}
+		}
+		pids[i] = start_worker(i, pin_cpus, work, arg);
+		started[i] = time(NULL);
+		if (pids[i] < 0) {
+			perror("fork");
+		} else {
+			nrunning++;
+		}
+	}
+
+	free(pids);
+	free(started);
+	return (stop_signal != 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Find the program file for a command name the way execvp()
+ * does, so it can be run with execve() after a fork.
+ *
+ * @param name the command name
+ * @param path set to the program file
+ * @param size the size of path
+ * @return true if an executable program file was found
+ */
+static bool find_program(const char name[], char path[], size_t size) {
+	if (strchr(name, '/') != NULL) {
+		return snprintf(path, size, "%s", name) < (int)size;
+	}
+	const char *dirs = getenv("PATH");
+	if (dirs == NULL) {
+		dirs = "/bin:/usr/bin";
+	}
+	while (true) {
+		size_t len = strcspn(dirs, ":");
+		int n = (len == 0) ? snprintf(path, size, "%s", name)  // empty entry is current directory
+						   : snprintf(path, size, "%.*s/%s", (int)len, dirs, name);
+		if (n < (int)size && access(path, X_OK) == 0) {
+			return true;
+		}
+		if (dirs[len] == '\0') {
+			return false;
+		}
+		dirs += len + 1;
+	}
+}
+
+/**
+ * Close descriptors from 3 up, except two that are kept. Only
+ * calls that are safe in the child of a multithreaded fork are
+ * made.
+ *
+ * @param keep1 a descriptor to keep, or -1
+ * @param keep2 another descriptor to keep, or -1
+ */
+static void close_other_files(int keep1, int keep2) {
+	int low = (keep1 < keep2) ? keep1 : keep2;
+	int high = (keep1 < keep2) ? keep2 : keep1;
+#ifdef SYS_close_range
+	unsigned first = 3;
+	int keep[] = { low, high };
+	for (int k = 0; k < 2; k++) {
+		if (keep[k] >= (int)first) {
+			if (keep[k] > (int)first) {
+				syscall(SYS_close_range, first, (unsigned)keep[k] - 1, 0);
+			}
+			first = (unsigned)keep[k] + 1;
+		}
+	}
+	if (syscall(SYS_close_range, first, ~0U, 0) == 0) {
+		return;
+	}
+	// kernel without close_range(): close one at a time
+#endif
+	long maxfd = sysconf(_SC_OPEN_MAX);
+	for (int fd = 3; fd < maxfd; fd++) {
+		if (fd != low && fd != high) {
+			close(fd);
+		}
+	}
+}
+
+/**
+ * Start a replacement server by running the server's command line
+ * again in a new process. The listener socket, if any, is passed
+ * to the new server in the LISTENER_FD_ENV environment variable
+ * so connections keep being accepted while this server drains.
+ *
+ * @param argv the command line of the server
+ * @param listen_sock_fd the listener socket, or -1 for none
+ * @return true if the replacement server program started
+ */
+bool start_replacement(char *const argv[], int listen_sock_fd) {
+	// pipe closes on exec, or carries errno if exec fails
+	int status_pipe[2];
+	if (pipe(status_pipe) < 0) {
+		perror("pipe");
+		return false;
+	}
+	fcntl(status_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	// other threads may hold locks that the child would wait on
+	// forever, so the program file and environment are prepared
+	// before the fork and the child only makes system calls
+	char program[PATH_MAX];
+	if (!find_program(argv[0], program, sizeof program)) {
+		fprintf(stderr, "%s: command not found\n", argv[0]);
+		close(status_pipe[0]);
+		close(status_pipe[1]);
+		return false;
+	}
+	size_t nenv = 0;
+	while (environ[nenv] != NULL) {
+		nenv++;
+	}
+	char **envp = malloc((nenv + 2) * sizeof(char *));
+	if (envp == NULL) {
+		perror("malloc");
+		close(status_pipe[0]);
+		close(status_pipe[1]);
+		return false;
+	}
+	char listener[sizeof LISTENER_FD_ENV + 16];
+	size_t nameLen = strlen(LISTENER_FD_ENV);
+	size_t nkept = 0;
+	for (size_t i = 0; i < nenv; i++) {
+		if (strncmp(environ[i], LISTENER_FD_ENV, nameLen) != 0 || environ[i][nameLen] != '=') {
+			envp[nkept++] = environ[i];
+		}
+	}
+	if (listen_sock_fd >= 0) {
+		snprintf(listener, sizeof listener, "%s=%d", LISTENER_FD_ENV, listen_sock_fd);
+		envp[nkept++] = listener;
+	}
+	envp[nkept] = NULL;
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		free(envp);
+		close(status_pipe[0]);
+		close(status_pipe[1]);
+		return false;
+	}
+	if (pid == 0) {
+		// close client sockets and files so they do not stay
+		// open in the new server after this one closes them
+		close_other_files(listen_sock_fd, status_pipe[1]);
+		if (listen_sock_fd >= 0) {
+			fcntl(listen_sock_fd, F_SETFD, 0);  // keep open across exec
+		}
+		setsid();  // not stopped by signals to the old server's group
+
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execve(program, argv, envp);
+
+		int err = errno;
+		ssize_t n = write(status_pipe[1], &err, sizeof err);
+		_exit((n < 0) ? 126 : 127);
+	}
+
+	// wait for exec to succeed or fail
+	free(envp);
+	close(status_pipe[1]);
+	int err;
+	ssize_t n;
+	while ((n = read(status_pipe[0], &err, sizeof err)) < 0 && errno == EINTR) {
+		continue;
+	}
+	close(status_pipe[0]);
+	if (n > 0) {
+		waitpid(pid, NULL, 0);
+		errno = err;
+		perror(argv[0]);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Get a listener socket passed on by the server that this
+ * server replaced.
+ *
+ * @return the listener socket, or -1 if none was passed on
+ */
+int inherited_listener(void) {
+	const char *value = getenv(LISTENER_FD_ENV);
+	int listen_sock_fd;
+	if (value == NULL || sscanf(value, "%d", &listen_sock_fd) != 1) {
+		return -1;
+	}
+	unsetenv(LISTENER_FD_ENV);  // not for later replacements
+
+	// old server may have left the socket non-blocking
+	int flags = fcntl(listen_sock_fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	fcntl(listen_sock_fd, F_SETFL, flags & ~O_NONBLOCK);
+	fcntl(listen_sock_fd, F_SETFD, FD_CLOEXEC);
+	return listen_sock_fd;
+}
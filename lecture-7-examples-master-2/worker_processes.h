@@ -0,0 +1,62 @@
+/*
+ * worker_processes.h
+ *
+ * Supervisor that runs a server function in several forked
+ * worker processes and restarts any worker that exits, and
+ * functions that replace a running server with a new one.
+ *
+ *  @since 2019-04-10
+ *  @author: Philip Gust
+ */
+
+#ifndef WORKER_PROCESSES_H_
+#define WORKER_PROCESSES_H_
+
+#include <stdbool.h>
+
+/** seconds a worker must run before it is restarted without delay */
+#define WORKER_MIN_UPTIME 1
+
+/** environment variable that passes the listener socket to a replacement server */
+#define LISTENER_FD_ENV "LISTENER_FD"
+
+/** Function that a worker process runs */
+typedef int (*worker_function)(int worker, void *arg);
+
+/**
+ * Fork worker processes and restart any that exit, until the
+ * supervisor receives SIGTERM or SIGINT, which it passes on to
+ * the workers before waiting for them to exit. On SIGHUP, the
+ * supervisor first starts a replacement server from its command
+ * line, then stops its workers with SIGTERM.
+ *
+ * @param nworkers the number of worker processes
+ * @param pin_cpus true to pin each worker to its own CPU
+ * @param work the function each worker runs; its result is the worker's exit status
+ * @param arg the argument passed to the function
+ * @param argv the command line of the server, or NULL to stop on SIGHUP without replacement
+ * @return EXIT_SUCCESS after the workers stop, or EXIT_FAILURE on error
+ */
+int run_workers(int nworkers, bool pin_cpus, worker_function work, void *arg, char *const argv[]);
+
+/**
+ * Start a replacement server by running the server's command line
+ * again in a new process. The listener socket, if any, is passed
+ * to the new server in the LISTENER_FD_ENV environment variable
+ * so connections keep being accepted while this server drains.
+ *
+ * @param argv the command line of the server
+ * @param listen_sock_fd the listener socket, or -1 for none
+ * @return true if the replacement server program started
+ */
+bool start_replacement(char *const argv[], int listen_sock_fd);
+
+/**
+ * Get a listener socket passed on by the server that this
+ * server replaced.
+ *
+ * @return the listener socket, or -1 if none was passed on
+ */
+int inherited_listener(void);
+
+#endif /* WORKER_PROCESSES_H_ */